@@ -166,6 +166,214 @@
 #define kIOPMAssertionProcessNameKey            CFSTR("Process Name")
 #endif
 
+/*
+ * Filtered assertion query
+ *
+ * 'whichData' selector for io_pm_assertion_copy_details(). The 'props' argument
+ * carries a serialized filter dictionary built from the keys below. powerd
+ * evaluates the filter against its own assertion records and returns only the
+ * matching assertions, projected to the requested fields.
+ *
+ * Reply is a dictionary:
+ *   kIOPMAssertionQueryFieldsKey - CFArray of field names, in column order
+ *   kIOPMAssertionQueryRowsKey   - CFArray of rows; each row is a CFArray of
+ *                                  values in the same order as the field names
+ *
+ * An unknown assertion type or a negative pid in the filter fails the query
+ * with kIOReturnBadArgument instead of being ignored.
+ */
+#ifndef kIOPMAssertionMIGCopyFiltered
+#define kIOPMAssertionMIGCopyFiltered           0x100
+#endif
+
+// Filter keys. All keys are optional; a missing key matches everything.
+#define kIOPMAssertionQueryPIDsKey              CFSTR("PIDs")           // CFArray of CFNumber pids
+#define kIOPMAssertionQueryTypesKey             CFSTR("Types")          // CFArray of assertion type strings
+#define kIOPMAssertionQueryMinAgeKey            CFSTR("MinAge")         // CFNumber, seconds
+#define kIOPMAssertionQueryNamePrefixKey        CFSTR("NamePrefix")     // CFString
+#define kIOPMAssertionQueryStateKey             CFSTR("State")          // CFNumber, one of kIOPMAssertionQueryState*
+#define kIOPMAssertionQueryFieldsKey            CFSTR("Fields")         // CFArray of kIOPMAssertionQueryField* strings
+#define kIOPMAssertionQueryRowsKey              CFSTR("Rows")
+
+enum {
+    kIOPMAssertionQueryStateActive      = 0,
+    kIOPMAssertionQueryStateInactive    = 1,
+    kIOPMAssertionQueryStateAny         = 2
+};
+
+/*
+ * Repeating power events
+ *
+ * kIOPMRepeatingPowerOnKey and kIOPMRepeatingPowerOffKey hold a single event
+ * dictionary, the first of its class, for clients that only know about one.
+ * The full lists of up to kIOPMMaxRepeatingEvents event dictionaries are
+ * under kIOPMRepeatingPowerOnListKey and kIOPMRepeatingPowerOffListKey.
+ * A request to IOPMScheduleRepeatingPowerEvent() with neither list key only
+ * replaces the first event of each class and keeps the rest.
+ */
+#define kIOPMMaxRepeatingEvents                 64
+#define kIOPMRepeatingPowerOnListKey            "RepeatingPowerOnList"
+#define kIOPMRepeatingPowerOffListKey           "RepeatingPowerOffList"
+
+// Projection fields
+#define kIOPMAssertionQueryFieldPID             CFSTR("PID")
+#define kIOPMAssertionQueryFieldID              CFSTR("AssertionId")
+#define kIOPMAssertionQueryFieldType            CFSTR("Type")
+#define kIOPMAssertionQueryFieldName            CFSTR("Name")
+#define kIOPMAssertionQueryFieldProcessName     CFSTR("ProcessName")
+#define kIOPMAssertionQueryFieldAge             CFSTR("Age")            // seconds since creation
+#define kIOPMAssertionQueryFieldTimeLeft        CFSTR("TimeLeft")       // seconds; 0 if not timed
+#define kIOPMAssertionQueryFieldActive          CFSTR("Active")         // CFBoolean
+#define kIOPMAssertionQueryFieldRetainCount     CFSTR("RetainCount")
+
+// Per-process responses to the assertion check powerd sends clients before sleep
+#define kIOPMAssertionQueryFieldCheckLatency    CFSTR("CheckLatencyMs")     // last response, ms
+#define kIOPMAssertionQueryFieldCheckLatencyMax CFSTR("CheckLatencyMaxMs")  // slowest response, ms
+#define kIOPMAssertionQueryFieldCheckTimeouts   CFSTR("CheckTimeouts")      // checks not answered in time
+
+/*
+ * Sleep/wake client acknowledgement history
+ *
+ * 'whichData' selector for io_pm_assertion_copy_details(). Reply is a CFArray
+ * with one dictionary per client name that has acknowledged or timed out on
+ * a sleep/wake notification.
+ */
+#ifndef kIOPMConnectionMIGCopyAckHistory
+#define kIOPMConnectionMIGCopyAckHistory        0x101
+#endif
+
+#define kIOPMAckHistoryNameKey                  CFSTR("Name")
+#define kIOPMAckHistorySamplesKey               CFSTR("Samples")        // acknowledged in time
+#define kIOPMAckHistoryTimeoutsKey              CFSTR("Timeouts")
+#define kIOPMAckHistoryAvgMsKey                 CFSTR("AvgMs")          // EWMA of ack latency
+#define kIOPMAckHistoryP95MsKey                 CFSTR("P95Ms")
+#define kIOPMAckHistoryBudgetKey                CFSTR("BudgetSecs")     // current ack budget
+#define kIOPMAckHistoryOffenderKey              CFSTR("Offender")       // CFBoolean
+#define kIOPMAckHistorySendFailuresKey          CFSTR("SendFailures")   // notifications not delivered
+#define kIOPMAckHistorySlowKey                  CFSTR("Slow")           // acked, but slowly
+#define kIOPMAckHistoryMaxMsKey                 CFSTR("MaxMs")          // slowest ack in time
+
+/*
+ * Sleep/wake transition phase profile
+ *
+ * 'whichData' selector for io_pm_assertion_copy_details(). Reply is a
+ * CFDictionary with the most recent capability change timelines, per-phase
+ * duration histograms, transition queue and notification delivery counters.
+ */
+#ifndef kIOPMConnectionMIGCopyTransitionProfile
+#define kIOPMConnectionMIGCopyTransitionProfile 0x102
+#endif
+
+#define kIOPMTransitionProfileTimelinesKey      CFSTR("Timelines")      // CFArray, oldest first
+#define kIOPMTransitionProfileHistogramsKey     CFSTR("Histograms")     // phase name -> CFArray of counts
+#define kIOPMTransitionProfileQueueKey          CFSTR("Queue")
+#define kIOPMTransitionProfileSendsKey          CFSTR("Sends")
+
+// Keys in each timeline
+#define kIOPMTransitionSeqKey                   CFSTR("Seq")
+#define kIOPMTransitionFromCapsKey              CFSTR("From")
+#define kIOPMTransitionToCapsKey                CFSTR("To")
+#define kIOPMTransitionAgeMsKey                 CFSTR("AgeMs")          // since the transition began
+#define kIOPMTransitionCompleteKey              CFSTR("Complete")       // CFBoolean
+#define kIOPMTransitionPhasesKey                CFSTR("Phases")         // phase name -> ms since begin
+#define kIOPMTransitionAcksKey                  CFSTR("Acks")
+#define kIOPMTransitionAckCountKey              CFSTR("AckCount")       // may exceed the Acks array
+
+// Keys in each ack of a timeline
+#define kIOPMTransitionAckNameKey               CFSTR("Name")
+#define kIOPMTransitionAckPIDKey                CFSTR("PID")
+#define kIOPMTransitionAckMsKey                 CFSTR("Ms")             // since the transition began
+#define kIOPMTransitionAckTimedOutKey           CFSTR("TimedOut")       // CFBoolean
+
+// Phase names, in order
+#define kIOPMTransitionPhaseNotify              "Notify"
+#define kIOPMTransitionPhaseClientAcks          "ClientAcks"
+#define kIOPMTransitionPhaseWakeEvents          "WakeEvents"
+#define kIOPMTransitionPhaseKernelAck           "KernelAck"
+
+// Histogram bucket i counts phase durations in [2^(i-1), 2^i) ms; bucket 0 is < 1 ms
+#define kIOPMTransitionHistBucketCnt            16
+
+// Keys in the queue dictionary
+#define kIOPMTransitionQueuedKey                CFSTR("Queued")
+#define kIOPMTransitionCoalescedKey             CFSTR("Coalesced")
+#define kIOPMTransitionDroppedKey               CFSTR("Dropped")
+#define kIOPMTransitionMaxDepthKey              CFSTR("MaxDepth")
+#define kIOPMTransitionWaitMaxMsKey             CFSTR("WaitMaxMs")
+#define kIOPMTransitionWaitTotalMsKey           CFSTR("WaitTotalMs")
+
+// Keys in the notification delivery dictionary
+#define kIOPMTransitionSentKey                  CFSTR("Sent")
+#define kIOPMTransitionDeferredKey              CFSTR("Deferred")       // found the client's queue full
+#define kIOPMTransitionSendFailedKey            CFSTR("Failed")         // never delivered
+
+/*
+ * Sleep/wake acknowledgement option
+ *
+ * CFNumber, seconds that every wake requested in the same acknowledgement may
+ * be deferred so it can share an RTC wake with other requests. Capped at an
+ * hour. Without it a wake is due at its requested date.
+ */
+#ifndef kIOPMAckWakeLeewayKey
+#define kIOPMAckWakeLeewayKey                   CFSTR("WakeLeeway")
+#endif
+
+/*
+ * Wake candidates at the last sleep
+ *
+ * 'whichData' selector for io_pm_assertion_copy_details(). Reply is a CFArray
+ * with one dictionary per wake request, or auto power off, that powerd
+ * considered when it last went to sleep, in the order they were collected.
+ */
+#ifndef kIOPMConnectionMIGCopyWakeCandidates
+#define kIOPMConnectionMIGCopyWakeCandidates    0x103
+#endif
+
+#define kIOPMWakeCandidateSourceKey             CFSTR("Source")         // e.g. "Maintenance", "UserWake"
+#define kIOPMWakeCandidatePIDKey                CFSTR("PID")
+#define kIOPMWakeCandidateClientInfoKey         CFSTR("ClientInfo")     // optional
+#define kIOPMWakeCandidateRequestedKey          CFSTR("Requested")      // CFDate
+#define kIOPMWakeCandidateDeadlineKey           CFSTR("Deadline")       // CFDate, requested time plus leeway, if any
+#define kIOPMWakeCandidateEffectiveKey          CFSTR("Effective")      // CFDate, after the minimum lead time
+#define kIOPMWakeCandidateOutcomeKey            CFSTR("Outcome")        // one of the outcomes below
+#define kIOPMWakeCandidateLostToKey             CFSTR("LostTo")         // Source of the winner, if Later or Merged
+
+// Outcomes
+#define kIOPMWakeCandidateChosen                CFSTR("Chosen")
+#define kIOPMWakeCandidateLater                 CFSTR("Later")
+#define kIOPMWakeCandidateMerged                CFSTR("Merged")         // served by the chosen wake
+#define kIOPMWakeCandidateDisabled              CFSTR("DisabledForStandby")
+#define kIOPMWakeCandidateNotPowerOff           CFSTR("NoPowerOffSupport")
+
+/*
+ * Dark wake linger policy
+ *
+ * 'whichData' selector for io_pm_assertion_copy_details(). Reply is a CFArray
+ * with one dictionary per sleep reason (dark wake linger) or wake reason
+ * (AC wake linger) that powerd has lingered for, describing the linger it
+ * would use next and the recent dark wakes it learned that from.
+ */
+#ifndef kIOPMConnectionMIGCopyLingerPolicy
+#define kIOPMConnectionMIGCopyLingerPolicy      0x104
+#endif
+
+#define kIOPMLingerKindKey                      CFSTR("Kind")           // one of the kinds below
+#define kIOPMLingerReasonKey                    CFSTR("Reason")         // Sleep or wake reason
+#define kIOPMLingerDurationKey                  CFSTR("Linger")         // Secs of the next linger
+#define kIOPMLingerDefaultKey                   CFSTR("Default")        // Configured secs
+#define kIOPMLingerLearnedKey                   CFSTR("Learned")        // CFBoolean, false while using Default
+#define kIOPMLingerCountKey                     CFSTR("Lingers")        // Lingers started for this reason
+#define kIOPMLingerSamplesKey                   CFSTR("Samples")        // Recent lingers learned from
+#define kIOPMLingerArrivedDuringKey             CFSTR("ArrivedDuring")  // Samples with activity within Linger
+#define kIOPMLingerArrivedAfterKey              CFSTR("ArrivedAfter")   // Samples with activity soon after
+#define kIOPMLingerNoArrivalKey                 CFSTR("NoArrival")      // Samples with no activity soon after
+#define kIOPMLingerAwakeKey                     CFSTR("Awake")          // Secs awake over the samples at Linger
+#define kIOPMLingerAwakeDefaultKey              CFSTR("AwakeAtDefault") // Secs awake over the samples at Default
+
+// Kinds
+#define kIOPMLingerKindDarkWake                 CFSTR("DarkWake")
+#define kIOPMLingerKindACWake                   CFSTR("ACWake")
+
 #ifndef kIOPMRootDomainWakeReasonKey
 // As defined in Kernel.framework/IOKit/pwr_mgt/RootDomain.h
 #define kIOPMRootDomainWakeReasonKey            "Wake Reason"
@@ -31,6 +31,10 @@
 
 #include <syslog.h>
 #include <notify.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <bsm/libbsm.h>
 #include "PrivateLib.h"
 #include "AutoWakeScheduler.h"
@@ -50,6 +54,38 @@ enum {
 
 #define MIN_SCHEDULE_TIME   (0.0)
 
+/*
+ * Schedule changes are appended to a journal rather than rewriting the
+ * prefs file. The prefs file is the snapshot the journal applies to, and
+ * records the generation of the journal that follows it.
+ */
+#define kAutoWakeJournalPath            "/Library/Preferences/SystemConfiguration/com.apple.AutoWake.journal"
+#define kAutoWakeJournalGenerationKey   "JournalGeneration"
+#define kAutoWakeJournalMagic           0x41574a4c      // 'AWJL'
+#define kAutoWakeJournalRecordMagic     0x41574a52      // 'AWJR'
+#define kAutoWakeJournalVersion         1
+#define kAutoWakeJournalMinRecords      256             // Compact after this many records, or twice the live events
+#define kAutoWakeJournalMaxRecordLen    (64 * 1024)
+
+enum {
+    kAutoWakeJournalAdd     = 1,
+    kAutoWakeJournalRemove  = 2
+};
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    generation;
+} autoWakeJournalHeader_t;
+
+/* Followed by 'length' bytes of the event as a binary plist */
+typedef struct {
+    uint32_t    magic;
+    uint32_t    op;
+    uint32_t    length;
+    uint32_t    checksum;       // Of op, length and the event
+} autoWakeJournalRecord_t;
+
 extern uint32_t gDebugFlags;
 
 
@@ -65,6 +101,16 @@ PowerEventBehavior          wakeorpoweronBehavior;
 
 static uint32_t     activeEventCnt = 0;
 static bool         wakePurgeAllowed = true;
+
+static CFStringRef  autoWakePrefsPath = CFSTR(kIOPMAutoWakePrefsPath);
+static const char   *autoWakeJournalPath = kAutoWakeJournalPath;
+static int          journalFD = -1;
+static uint64_t     journalGeneration = 0;
+static uint32_t     journalRecords = 0;
+#ifdef XCTEST
+static bool         xctJournalCrashAfterSnapshot = false;
+static CFAbsoluteTime   xctVirtualNow = 0.0;
+#endif
 enum {
     kBehaviorsCount = 6
 };
@@ -89,10 +135,13 @@ static bool             isEntryValidAndFuturistic(CFDictionaryRef, CFDateRef);
 static void             schedulePowerEvent(PowerEventBehavior *);
 static void             purgePastEvents(PowerEventBehavior *);
 static void             copyScheduledPowerChangeArrays(void);
+static IOReturn         compactJournal(void);
+static IOReturn         journalReset(uint64_t generation);
+static uint32_t         journalReplay(uint64_t generation, bool *needsCompaction);
+static PowerEventBehavior *behaviorForType(CFTypeRef type);
+static powerEventNode_t *findEvent(PowerEventBehavior *, CFDictionaryRef);
 static CFDictionaryRef  copyEarliestUpcoming(PowerEventBehavior *);
 static CFDateRef        _getScheduledEventDate(CFDictionaryRef);
-static CFArrayRef       copyMergedEventArray(PowerEventBehavior *, 
-                                             PowerEventBehavior *);
 static CFComparisonResult compareEvDates(CFDictionaryRef, 
                                              CFDictionaryRef, void *);
 
@@ -137,57 +186,469 @@ void restartTimerExpiredCallout(CFDictionaryRef);
  * thru IOKit.
  * So to minimize disk access we only purge when we think the disk is "up" anyway.
  */
+
+#pragma mark -
+#pragma mark Event Heap
+
+/*
+ * Current time as the scheduler and the repeating schedule see it. Tests
+ * may run both on a virtual clock.
+ */
+__private_extern__ CFAbsoluteTime
+autoWakeNow(void)
+{
+#ifdef XCTEST
+    if (xctVirtualNow != 0.0)
+        return xctVirtualNow;
+#endif
+    return CFAbsoluteTimeGetCurrent();
+}
+
+/*
+ * Each behavior keeps its events in a binary min-heap ordered by date, with
+ * ties going to the event scheduled first. The earliest event is always at
+ * nodes[0]. Entries without a valid date sort last, as in compareEvDates().
+ */
+#define kPowerEventUndated          DBL_MAX
+#define kPowerEventHeapMinCapacity  16
+
+typedef enum {
+    kPowerEventVisitDescend,    // Not a match; entries below it may be
+    kPowerEventVisitMatch,      // A match; nothing below it sorts earlier
+    kPowerEventVisitPrune       // Neither this entry nor any below it matches
+} powerEventVisit_t;
+
+typedef powerEventVisit_t (*powerEventMatcher)(powerEventNode_t *, void *);
+
+static uint64_t     powerEventSeq = 0;
+
+static CFAbsoluteTime
+powerEventDate(CFDictionaryRef event)
+{
+    CFDateRef   date;
+
+    if (!isA_CFDictionary(event))
+        return kPowerEventUndated;
+    date = isA_CFDate(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTimeKey)));
+    if (!date)
+        return kPowerEventUndated;
+
+    return CFDateGetAbsoluteTime(date);
+}
+
+static bool
+powerEventBefore(powerEventNode_t *a, powerEventNode_t *b)
+{
+    if (a->date != b->date)
+        return (a->date < b->date);
+    return (a->seq < b->seq);
+}
+
+static void
+powerEventHeapSet(powerEventHeap_t *heap, CFIndex idx, powerEventNode_t *node)
+{
+    heap->nodes[idx] = node;
+    node->heapIdx = idx;
+}
+
+static void
+powerEventHeapSiftUp(powerEventHeap_t *heap, CFIndex idx)
+{
+    powerEventNode_t    *node = heap->nodes[idx];
+    CFIndex             parent;
+
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (!powerEventBefore(node, heap->nodes[parent]))
+            break;
+        powerEventHeapSet(heap, idx, heap->nodes[parent]);
+        idx = parent;
+    }
+    powerEventHeapSet(heap, idx, node);
+}
+
+static void
+powerEventHeapSiftDown(powerEventHeap_t *heap, CFIndex idx)
+{
+    powerEventNode_t    *node = heap->nodes[idx];
+    CFIndex             child;
+
+    while ((child = 2 * idx + 1) < heap->count) {
+        if ((child + 1 < heap->count)
+            && powerEventBefore(heap->nodes[child + 1], heap->nodes[child]))
+            child++;
+        if (!powerEventBefore(heap->nodes[child], node))
+            break;
+        powerEventHeapSet(heap, idx, heap->nodes[child]);
+        idx = child;
+    }
+    powerEventHeapSet(heap, idx, node);
+}
+
+/* Rebuilds heap order in O(n) after entries were dropped in place */
+static void
+powerEventHeapify(powerEventHeap_t *heap)
+{
+    CFIndex             idx;
+
+    for (idx = heap->count / 2 - 1; idx >= 0; idx--)
+        powerEventHeapSiftDown(heap, idx);
+}
+
+/*
+ * Index callbacks. byKey holds nodes as both key and value, hashed on the
+ * date and app name, so a stack probe with just those two can look one up.
+ */
+static Boolean
+powerEventKeyEqual(const void *a, const void *b)
+{
+    const powerEventNode_t  *n1 = (const powerEventNode_t *)a;
+    const powerEventNode_t  *n2 = (const powerEventNode_t *)b;
+
+    if (n1->date != n2->date)
+        return false;
+    return ((n1->appName == n2->appName)
+            || (n1->appName && n2->appName && CFEqual(n1->appName, n2->appName)));
+}
+
+static CFHashCode
+powerEventKeyHash(const void *value)
+{
+    const powerEventNode_t  *node = (const powerEventNode_t *)value;
+    uint64_t                bits;
+
+    memcpy(&bits, &node->date, sizeof(bits));
+    return (CFHashCode)(bits ^ (bits >> 32)) ^ (node->appName ? CFHash(node->appName) : 0);
+}
+
+static const CFDictionaryKeyCallBacks powerEventKeyCallBacks = {
+    0, NULL, NULL, NULL, powerEventKeyEqual, powerEventKeyHash
+};
+
+static bool
+powerEventIndexCreate(powerEventHeap_t *heap)
+{
+    if (!heap->byKey)
+        heap->byKey = CFDictionaryCreateMutable(0, 0, &powerEventKeyCallBacks, NULL);
+
+    return (heap->byKey != NULL);
+}
+
+static void
+powerEventIndexAdd(powerEventHeap_t *heap, powerEventNode_t *node)
+{
+    powerEventNode_t    *head;
+
+    // Undated events can't be cancelled, so they have no key. Equal keys
+    // chain in insertion order behind the first.
+    if (node->date != kPowerEventUndated) {
+        head = (powerEventNode_t *)CFDictionaryGetValue(heap->byKey, node);
+        if (!head) {
+            CFDictionaryAddValue(heap->byKey, node, node);
+        } else {
+            while (head->keyNext)
+                head = head->keyNext;
+            head->keyNext = node;
+        }
+    }
+}
+
+static void
+powerEventIndexRemove(powerEventHeap_t *heap, powerEventNode_t *node)
+{
+    powerEventNode_t    *prev;
+
+    if (node->date != kPowerEventUndated) {
+        prev = (powerEventNode_t *)CFDictionaryGetValue(heap->byKey, node);
+        if (prev == node) {
+            // The dictionary keeps its original key, so re-add the successor
+            CFDictionaryRemoveValue(heap->byKey, node);
+            if (node->keyNext)
+                CFDictionaryAddValue(heap->byKey, node->keyNext, node->keyNext);
+        } else if (prev) {
+            while (prev->keyNext && (prev->keyNext != node))
+                prev = prev->keyNext;
+            prev->keyNext = node->keyNext;
+        }
+    }
+}
+
+static powerEventNode_t *
+powerEventHeapInsert(powerEventHeap_t *heap, CFDictionaryRef event)
+{
+    powerEventNode_t    *node = NULL;
+    powerEventNode_t    **nodes = NULL;
+    CFIndex             capacity;
+
+    if (heap->count == heap->capacity) {
+        capacity = heap->capacity ? 2 * heap->capacity : kPowerEventHeapMinCapacity;
+        nodes = realloc(heap->nodes, capacity * sizeof(*nodes));
+        if (!nodes) {
+            ERROR_LOG("Failed to grow power event heap to %ld entries\n", (long)capacity);
+            return NULL;
+        }
+        heap->nodes = nodes;
+        heap->capacity = capacity;
+    }
+
+    if (!powerEventIndexCreate(heap)) {
+        return NULL;
+    }
+
+    node = calloc(1, sizeof(*node));
+    if (!node) {
+        return NULL;
+    }
+    node->event = CFRetain(event);
+    node->date = powerEventDate(event);
+    node->appName = isA_CFDictionary(event) ?
+        CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey)) : NULL;
+    node->seq = powerEventSeq++;
+    powerEventIndexAdd(heap, node);
+
+    heap->nodes[heap->count] = node;
+    powerEventHeapSiftUp(heap, heap->count++);
+    heap->generation++;
+
+    return node;
+}
+
+static void
+powerEventHeapRemoveAt(powerEventHeap_t *heap, CFIndex idx)
+{
+    powerEventNode_t    *node = heap->nodes[idx];
+    powerEventNode_t    *last = heap->nodes[--heap->count];
+
+    powerEventIndexRemove(heap, node);
+
+    // Move the last entry into the hole and let it settle either way
+    if (idx < heap->count) {
+        powerEventHeapSet(heap, idx, last);
+        if ((idx > 0) && powerEventBefore(last, heap->nodes[(idx - 1) / 2]))
+            powerEventHeapSiftUp(heap, idx);
+        else
+            powerEventHeapSiftDown(heap, idx);
+    }
+    heap->generation++;
+
+    CFRelease(node->event);
+    free(node);
+}
+
+static void
+powerEventHeapRemoveAll(powerEventHeap_t *heap)
+{
+    powerEventNode_t    *node;
+
+    if (!heap->count)
+        return;
+
+    CFDictionaryRemoveAllValues(heap->byKey);
+    while (heap->count) {
+        node = heap->nodes[--heap->count];
+        CFRelease(node->event);
+        free(node);
+    }
+    heap->generation++;
+}
+
+/*
+ * Returns the earliest entry in the subtree at 'idx' accepted by 'match', or
+ * 'best' if nothing there sorts ahead of it. Children never sort ahead of
+ * their parent, so whole subtrees are skipped once a match or a pruning
+ * entry is found.
+ */
+static powerEventNode_t *
+powerEventHeapFind(powerEventHeap_t *heap, CFIndex idx,
+                   powerEventMatcher match, void *context, powerEventNode_t *best)
+{
+    powerEventNode_t    *node;
+
+    if (idx >= heap->count)
+        return best;
+
+    node = heap->nodes[idx];
+    if (best && !powerEventBefore(node, best))
+        return best;
+
+    switch ((*match)(node, context)) {
+        case kPowerEventVisitMatch:
+            return node;
+        case kPowerEventVisitPrune:
+            return best;
+        default:
+            best = powerEventHeapFind(heap, 2 * idx + 1, match, context, best);
+            return powerEventHeapFind(heap, 2 * idx + 2, match, context, best);
+    }
+}
+
+static int
+powerEventNodeCompare(const void *a, const void *b)
+{
+    powerEventNode_t    *n1 = *(powerEventNode_t * const *)a;
+    powerEventNode_t    *n2 = *(powerEventNode_t * const *)b;
+
+    if (powerEventBefore(n1, n2))
+        return -1;
+    return powerEventBefore(n2, n1) ? 1 : 0;
+}
+
+/*
+ * Appends the heap's events to 'arr' sorted by date, the order the prefs
+ * file and IOPMCopyScheduledPowerEvents() callers have always seen.
+ */
+static void
+powerEventHeapAppendSorted(powerEventHeap_t *heap, CFMutableArrayRef arr)
+{
+    powerEventNode_t    **sorted = NULL;
+    CFIndex             i;
+
+    if (!heap->count)
+        return;
+
+    sorted = malloc(heap->count * sizeof(*sorted));
+    if (!sorted)
+        return;
+    memcpy(sorted, heap->nodes, heap->count * sizeof(*sorted));
+    qsort(sorted, heap->count, sizeof(*sorted), powerEventNodeCompare);
+
+    for (i = 0; i < heap->count; i++)
+        CFArrayAppendValue(arr, sorted[i]->event);
+
+    free(sorted);
+}
+
+/* Matches the first valid event at or after *(CFAbsoluteTime *)context */
+static powerEventVisit_t
+matchFutureEvent(powerEventNode_t *node, void *context)
+{
+    CFAbsoluteTime  now = *(CFAbsoluteTime *)context;
+
+    if (node->date == kPowerEventUndated)
+        return kPowerEventVisitPrune;
+    return (node->date >= now) ? kPowerEventVisitMatch : kPowerEventVisitDescend;
+}
+
+/*
+ * Caches of the earliest event per behavior. Scheduling, sleep and the MIG
+ * queries all ask for it far more often than events come and go.
+ */
+static uint32_t     earliestCacheEpoch = 0;
+
+static void
+earliestCacheClear(powerEventCache_t *cache)
+{
+    if (cache->event)
+        CFRelease(cache->event);
+    bzero(cache, sizeof(*cache));
+}
+
+static bool
+earliestCacheHit(PowerEventBehavior *behave, powerEventCache_t *cache, CFAbsoluteTime now)
+{
+    uint32_t    sharedGeneration = behave->sharedEvents ? behave->sharedEvents->events.generation : 0;
+
+    return (cache->valid
+            && (cache->generation == behave->events.generation)
+            && (cache->sharedGeneration == sharedGeneration)
+            && (cache->epoch == earliestCacheEpoch)
+            && (now <= cache->expires));
+}
+
+static void
+earliestCacheStore(PowerEventBehavior *behave, powerEventCache_t *cache,
+                   CFDictionaryRef event, CFAbsoluteTime expires)
+{
+    earliestCacheClear(cache);
+    if (event)
+        cache->event = CFRetain(event);
+    cache->expires = event ? expires : kPowerEventUndated;
+    cache->generation = behave->events.generation;
+    cache->sharedGeneration = behave->sharedEvents ? behave->sharedEvents->events.generation : 0;
+    cache->epoch = earliestCacheEpoch;
+    cache->valid = true;
+}
+
 #pragma mark -
 #pragma mark AutoWakeScheduler
 
 /*
- * Deletes events with specific appName in the given behavior array.
- *
- * The event array pointer gets modified. 
+ * Clears currentEvent wherever 'event' is the one being timed. Only the
+ * event's own behavior, or wake and poweron for a wakeorpoweron event, can
+ * be timing it, and they hold the very same dictionary.
  */
 static void
-removeEventsByAppName(PowerEventBehavior *behave, CFStringRef appName)
+clearCurrentEvent(PowerEventBehavior *behave, CFDictionaryRef event)
 {
-    CFIndex             count, j;
-    CFDictionaryRef     cancelee = 0;
+    PowerEventBehavior  *timing[] = { behave, &wakeBehavior, &poweronBehavior };
+    int                 count = (behave == &wakeorpoweronBehavior) ? 3 : 1;
+    int                 j;
+
+    for (j = 0; j < count; j++) {
+        if (timing[j]->currentEvent == event) {
+            CFRelease(timing[j]->currentEvent);
+            timing[j]->currentEvent = NULL;
+        }
+    }
+}
 
+/*
+ * Deletes events with specific appName in the given behavior's heap.
+ * Only runs at startup, so a single pass over the heap is enough.
+ */
+static void
+removeEventsByAppName(PowerEventBehavior *behave, CFStringRef appName)
+{
+    powerEventHeap_t    *heap = &behave->events;
+    powerEventNode_t    *node = NULL;
+    CFIndex             i, kept = 0;
 
-    if ( (behave->array == NULL) || 
-            (count = CFArrayGetCount(behave->array)) == 0)
+    if ((heap->count == 0) || !appName)
         return;
-    for (j = count-1; j >= 0; j--)
+
+    // Compact the survivors in place, then restore heap order once
+    for (i = 0; i < heap->count; i++)
     {
-        cancelee = CFArrayGetValueAtIndex(behave->array, j);
-        if( CFEqual(
-            CFDictionaryGetValue(cancelee, CFSTR(kIOPMPowerEventAppNameKey)), appName
-            ))
+        node = heap->nodes[i];
+        if (!node->appName || !CFEqual(node->appName, appName))
         {
-            // This is the one to cancel
-            if (behave->currentEvent && CFEqual(cancelee, behave->currentEvent)) {
-                CFRelease(behave->currentEvent);
-                behave->currentEvent = NULL;
-            }
-
-            CFArrayRemoveValueAtIndex(behave->array, j);
-            activeEventCnt--;
+            powerEventHeapSet(heap, kept++, node);
+            continue;
         }
-    }
 
-}
+        // This is the one to cancel
+        clearCurrentEvent(behave, node->event);
+        powerEventIndexRemove(heap, node);
 
+        CFRelease(node->event);
+        free(node);
+        activeEventCnt--;
+    }
 
+    if (kept != heap->count) {
+        heap->count = kept;
+        powerEventHeapify(heap);
+        heap->generation++;
+    }
+}
 
-__private_extern__ void 
-AutoWake_prime(void) 
+/*
+ * Sets up the per-type behaviors. Called once at startup; any events or
+ * cached events a behavior holds must already have been released.
+ */
+static void
+initBehaviors(void)
 {
     PowerEventBehavior      *this_behavior;
     int                     i;
 
-    wakeRequests_log = os_log_create(PM_LOG_SYSTEM, WAKEREQUESTS_LOG);
     // clear out behavior structs for good measure
     for(i=0; i<kBehaviorsCount; i++) 
     {
         this_behavior = behaviors[i];
+        free(this_behavior->events.nodes);
+        if (this_behavior->events.byKey)
+            CFRelease(this_behavior->events.byKey);
         bzero(this_behavior, sizeof(PowerEventBehavior));
     }
 
@@ -213,7 +674,18 @@ AutoWake_prime(void)
     // from wakeorpoweron into runtime wake and poweron queues. 
     wakeBehavior.sharedEvents = 
             poweronBehavior.sharedEvents = &wakeorpoweronBehavior;
+}
+
+
+
+__private_extern__ void 
+AutoWake_prime(void) 
+{
+    PowerEventBehavior      *this_behavior;
+    int                     i;
 
+    wakeRequests_log = os_log_create(PM_LOG_SYSTEM, WAKEREQUESTS_LOG);
+    initBehaviors();
 
     // system bootup; read prefs from disk
     copyScheduledPowerChangeArrays();
@@ -282,6 +754,8 @@ __private_extern__ void AutoWakeCalendarChange(void)
     PowerEventBehavior      *this_behavior;
     int i;
     
+    earliestCacheEpoch++;
+    RepeatingAutoWake_flushOccurrences();
     for(i=0; i<kBehaviorsCount; i++)
     {
         this_behavior = behaviors[i];
@@ -293,6 +767,16 @@ __private_extern__ void AutoWakeCalendarChange(void)
     }
 }
 
+/*
+ * The repeating schedule, or the time zone its events are expressed in, has
+ * changed. Cached earliest events and repeat occurrences may be stale.
+ */
+__private_extern__ void AutoWakeRepeatingChange(void)
+{
+    earliestCacheEpoch++;
+    RepeatingAutoWake_flushOccurrences();
+}
+
 /*
  * Required behaviors at timer expiration:
  *
@@ -428,6 +912,22 @@ schedulePowerEventType(CFStringRef type)
     schedulePowerEvent(behaviors[i]);
 }
 
+/*
+ * getWakeEarliestTime - Returns the event's own time, before leeway; the
+ * wake may happen anywhere from here to getWakeScheduleTime()
+ */
+__private_extern__ CFAbsoluteTime getWakeEarliestTime(CFDictionaryRef event)
+{
+    CFDateRef           wakeup_date = NULL;
+
+    wakeup_date = isA_CFDate(CFDictionaryGetValue(event, 
+                                                  CFSTR(kIOPMPowerEventTimeKey)));
+    if (!wakeup_date)
+        return 0;
+
+    return CFDateGetAbsoluteTime(wakeup_date);
+}
+
 /*
  * getWakeScheduleTime - Returns the absolute time when this event's wake will
  * be scheduled, taking leeway into account
@@ -492,42 +992,57 @@ __private_extern__ CFDictionaryRef copyEarliestRequestAutoWakeEvent(void)
 {
     return copyEarliestEvent(&wakeBehavior);
 }
-__private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior  *behave)
+/*
+ * Finds the event in the subtree at 'idx' with the earliest schedule time at
+ * or after 'now'. Leeway only moves an event later than its date, so a
+ * subtree topped by an event dated after the best time so far can't beat it.
+ */
+static void
+findEarliestScheduled(powerEventHeap_t *heap, CFIndex idx, CFAbsoluteTime now,
+                      CFDictionaryRef *one_event, CFAbsoluteTime *one_event_ts)
 {
-    CFIndex             cnt, i;
-    CFArrayRef          arr = NULL;
+    powerEventNode_t    *node;
+    CFAbsoluteTime      wakeup_abs = 0;
+
+    if (idx >= heap->count)
+        return;
+
+    node = heap->nodes[idx];
+    if ((node->date == kPowerEventUndated)
+        || ((*one_event_ts != 0) && (node->date >= *one_event_ts)))
+        return;
+
+    DEBUG_LOG("Active wake request: %{public}@\n", node->event);
+    wakeup_abs = getWakeScheduleTime(node->event);
+    if (wakeup_abs && (wakeup_abs >= now + MIN_SCHEDULE_TIME)
+        && ((*one_event_ts == 0) || (wakeup_abs < *one_event_ts))) {
+        *one_event = node->event;
+        *one_event_ts = wakeup_abs;
+    }
+
+    findEarliestScheduled(heap, 2 * idx + 1, now, one_event, one_event_ts);
+    findEarliestScheduled(heap, 2 * idx + 2, now, one_event, one_event_ts);
+}
 
+__private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior  *behave)
+{
     CFDictionaryRef     one_event = NULL;
-    CFDictionaryRef     event = NULL;
     CFDictionaryRef     repeat_event = NULL;
-    CFAbsoluteTime      now = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime      now = autoWakeNow();
     CFAbsoluteTime      one_event_ts = 0;
     CFAbsoluteTime      wakeup_abs = 0;
     CFDictionaryRef     selected_event = NULL;
     
-    
-    // wake and poweron types get merged with wakeorpoweron array
-    if(behave->sharedEvents) {
-        arr = copyMergedEventArray(behave, behave->sharedEvents);
-    } else {
-        arr = behave->array;
+    if (earliestCacheHit(behave, &behave->scheduledCache, now + MIN_SCHEDULE_TIME)) {
+        selected_event = behave->scheduledCache.event;
+        return selected_event ? CFRetain(selected_event) : NULL;
     }
+    
+    findEarliestScheduled(&behave->events, 0, now, &one_event, &one_event_ts);
 
-
-    i = cnt = 0;
-    for ( isA_CFArray(arr) && (cnt = CFArrayGetCount(arr)); i < cnt; i++) {
-        event = CFArrayGetValueAtIndex(arr, i);
-        if (!isA_CFDictionary(event)) continue;
-
-        DEBUG_LOG("Active wake request: %{public}@\n", event);
-        wakeup_abs = getWakeScheduleTime(event);
-        if ((!wakeup_abs) || (wakeup_abs < now + MIN_SCHEDULE_TIME))
-            continue;
-
-        if ((one_event_ts == 0) || (wakeup_abs < one_event_ts)) {
-            one_event = event;
-            one_event_ts = wakeup_abs;
-        }
+    // wake and poweron types also consider wakeorpoweron events
+    if(behave->sharedEvents) {
+        findEarliestScheduled(&behave->sharedEvents->events, 0, now, &one_event, &one_event_ts);
     }
     
     repeat_event = copyNextRepeatingEvent(behave->title);
@@ -550,14 +1065,13 @@ __private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior  *behave
         selected_event = CFDictionaryCreateCopy(NULL,one_event);
         INFO_LOG("Selected RTC wake request: %{public}@\n", selected_event);
     }
+    earliestCacheStore(behave, &behave->scheduledCache, selected_event, one_event_ts);
     
     if (repeat_event)
     {
         CFRelease(repeat_event);
     }
 
-    if(arr && behave->sharedEvents) CFRelease(arr);
-
     return selected_event;
 }
 
@@ -708,7 +1222,7 @@ isEntryValidAndFuturistic(CFDictionaryRef wakeup_dict, CFDateRef date_now)
 /*
  *
  * Purge past wakeup times
- * Does not care whether its operating on wakeup or poweron array.
+ * Does not care whether its operating on wakeup or poweron events.
  * Just purges all entries with a time < now
  *
  */
@@ -722,28 +1236,24 @@ purgePastEvents(PowerEventBehavior  *behave)
     
     if( !behave 
         || !behave->title
-        || !behave->array
-        || (0 == CFArrayGetCount(behave->array)))
+        || (0 == behave->events.count))
     {
         return;
     }
     
-    date_now = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
+    date_now = CFDateCreate(0, autoWakeNow());
 
-    // Loop over the array and remove any values that are in the past.
-    // Since array is sorted by date already, we stop once we reach an event
+    // Pop events off the heap while they are in the past.
+    // The earliest event is always on top, so we stop once we reach an event
     // scheduled in the future.
-    // Do not try to optimize the CFArrayGetCount out of the while loop; this value may
-    // change during loop execution.
-    while(0 < CFArrayGetCount(behave->array))
+    while(0 < behave->events.count)
     {
-        event = CFArrayGetValueAtIndex(behave->array, 0);
+        event = behave->events.nodes[0]->event;
         if (isEntryValidAndFuturistic(event, date_now) )
                 break;
 
-        // Remove entry from the array - its time has past
-        // The rest of the array will shift down to fill index 0
-        CFArrayRemoveValueAtIndex(behave->array, 0);
+        // Remove entry from the heap - its time has past
+        powerEventHeapRemoveAt(&behave->events, 0);
         activeEventCnt--;
     }
 
@@ -762,13 +1272,18 @@ static void
 copyScheduledPowerChangeArrays(void)
 {
     CFArrayRef              tmp;
+    CFNumberRef             num;
     SCPreferencesRef        prefs;
     PowerEventBehavior      *this_behavior;
+    CFIndex                 count, j;
+    uint64_t                generation = 0;
+    bool                    needsCompaction = false;
+    uint32_t                replayed;
     int                     i;
    
     prefs = SCPreferencesCreate(0, 
                                 CFSTR("PM-configd-AutoWake"),
-                                CFSTR(kIOPMAutoWakePrefsPath));
+                                autoWakePrefsPath);
     if(!prefs) return;
 
     activeEventCnt = 0;
@@ -777,24 +1292,36 @@ copyScheduledPowerChangeArrays(void)
     {
         this_behavior = behaviors[i];
 
-        if(this_behavior->array) {
-            CFRelease(this_behavior->array);
-            this_behavior->array = NULL;
-        }
+        powerEventHeapRemoveAll(&this_behavior->events);
 
+        // Stored in date order, so each insert stays at the bottom of the heap
         tmp = isA_CFArray(SCPreferencesGetValue(prefs, this_behavior->title));
-        if(tmp && (0 < CFArrayGetCount(tmp))) {
-            this_behavior->array = CFArrayCreateMutableCopy(0, 0, tmp);
-            activeEventCnt += CFArrayGetCount(tmp);
-        } else {
-            this_behavior->array = NULL;
+        count = tmp ? CFArrayGetCount(tmp) : 0;
+        for (j = 0; j < count; j++) {
+            if (powerEventHeapInsert(&this_behavior->events, CFArrayGetValueAtIndex(tmp, j)))
+                activeEventCnt++;
         }
     }
 
-
+    num = isA_CFNumber(SCPreferencesGetValue(prefs, CFSTR(kAutoWakeJournalGenerationKey)));
+    if (num) {
+        CFNumberGetValue(num, kCFNumberSInt64Type, &generation);
+    }
 
     CFRelease(prefs);
 
+    // Apply changes made since the snapshot, then fold them into it
+    replayed = journalReplay(generation, &needsCompaction);
+    if (replayed) {
+        INFO_LOG("Replayed %u scheduled power event changes from journal\n", replayed);
+    }
+
+    journalGeneration = generation;
+    if (needsCompaction) {
+        compactJournal();
+    } else {
+        journalReset(generation);
+    }
 }
 
 /*
@@ -808,47 +1335,33 @@ copyScheduledPowerChangeArrays(void)
 static CFDictionaryRef 
 copyEarliestUpcoming(PowerEventBehavior *b)
 {
-    CFArrayRef              arr = NULL;
-    CFDateRef               now = NULL;
+    powerEventNode_t        *node = NULL;
+    CFAbsoluteTime          now;
     CFDictionaryRef         the_result = NULL;
     CFDictionaryRef         repeatEvent = NULL;
-    CFIndex                 i, count;
     CFComparisonResult      eq;
 
     if(!b) return NULL;
 
-    // wake and poweron types get merged with wakeorpoweron array
-    if(b->sharedEvents) {
+    // Find the earliest entry occurring >MIN_SCHEDULE_TIME seconds in the
+    // future. Only past entries that haven't been purged yet are looked past.
+    now = autoWakeNow() + MIN_SCHEDULE_TIME;
+    if (earliestCacheHit(b, &b->upcomingCache, now)) {
+        the_result = b->upcomingCache.event;
+        return the_result ? CFRetain(the_result) : NULL;
+    }
 
-        // musst release arr later
-        arr = copyMergedEventArray(b, b->sharedEvents);
+    node = powerEventHeapFind(&b->events, 0, matchFutureEvent, &now, NULL);
 
-    } else {
-        arr = b->array;
+    // wake and poweron types also consider wakeorpoweron events
+    if(b->sharedEvents) {
+        node = powerEventHeapFind(&b->sharedEvents->events, 0, matchFutureEvent, &now, node);
     }
 
-    // If the array is NULL, we have no work to do.
-    if (arr && (count = CFArrayGetCount(arr)) != 0) {
-
-        
-        now = CFDateCreate(0, CFAbsoluteTimeGetCurrent() + MIN_SCHEDULE_TIME);
-
-        // iterate through all past entries, stopping at one occurring  
-        // >MIN_SCHEDULE_TIME seconds in the future, or at the end of the array
-        i = 0;
-        while( (i < count)
-            && !isEntryValidAndFuturistic(CFArrayGetValueAtIndex(arr, i), now) )
-        {
-            i++;
-        }
-        CFRelease(now);
-
-        if(i < count) 
-        {
-            the_result = CFArrayGetValueAtIndex(arr, i);
-            CFRetain(the_result);
-        }
-    }
+    if (node) {
+        the_result = node->event;
+        CFRetain(the_result);
+    }
 
     // Compare against the repeat event, if there is any
     repeatEvent = copyNextRepeatingEvent(b->title);
@@ -868,15 +1381,15 @@ copyEarliestUpcoming(PowerEventBehavior *b)
             CFRelease(repeatEvent);
         }
     }
-    
-    if(arr && b->sharedEvents) CFRelease(arr);
+
+    earliestCacheStore(b, &b->upcomingCache, the_result, powerEventDate(the_result));
     
     return the_result;
 }
 
 /*
  *
- * comapareEvDates() - internal sorting helper for copyMergedEventArray()
+ * comapareEvDates() - internal helper comparing two events by date
  *
  */
  static CFComparisonResult 
@@ -899,50 +1412,6 @@ compareEvDates(
     return CFDateCompare(d1, d2, 0);
 }
 
-/*
- *
- * copyMergedEventArray
- *
- * Takes two PowerEventBehavior*, merges their CFArray array members into one 
- * mutable array, sorted by date.
- */
-static CFArrayRef       
-copyMergedEventArray(
-    PowerEventBehavior *a, 
-    PowerEventBehavior *b)
-{
-    CFMutableArrayRef       merged;
-    CFIndex                 bcount;
-    CFRange                 rng;
-
-    if(!a || !b) return NULL;
-    if(!a->array && !b->array) return NULL;
-    if(!a->array) return CFRetain(b->array);
-    if(!b->array) return CFRetain(a->array);
-
-    // merge!
-    merged = CFArrayCreateMutableCopy(0, 0, a->array);
-    
-    bcount = CFArrayGetCount(b->array);
-    rng =  CFRangeMake(0, bcount);
-    CFArrayAppendArray(merged, b->array, rng);
-
-    // sort!
-    // We sort using the same compare_dates function used in IOKitUser
-    // pwr_mgt/IOPMAutoWake.c. Arrays must be sorted identically to how
-    // they would be there.
-    bcount = CFArrayGetCount(merged);
-    rng =  CFRangeMake(0, bcount);
-    CFArraySortValues(merged, rng, (CFComparatorFunction)compareEvDates, 0);
-
-    // caller must release
-    return merged;
-}
-
-
-
-
-
 static CFDateRef
 _getScheduledEventDate(CFDictionaryRef event)
 {
@@ -959,7 +1428,7 @@ createSCSession(SCPreferencesRef *prefs, uid_t euid, int lock)
 
     if (euid == 0)
         *prefs = SCPreferencesCreate( 0, CFSTR("PM-configd-AutoWake"),
-                                 CFSTR(kIOPMAutoWakePrefsPath));
+                                 autoWakePrefsPath);
     else
     {
         ret = kIOReturnNotPrivileged;
@@ -995,109 +1464,97 @@ destroySCSession(SCPreferencesRef prefs, int unlock)
     }
 }
 
-static void
+static bool
 addEvent(PowerEventBehavior  *behave, CFDictionaryRef event)
 {
-    if (isA_CFArray(behave->array)) {
+    // First clear off any expired events
+    purgePastEvents(behave);
 
-        // First clear off any expired events
-        purgePastEvents(behave);
-
-        CFArrayAppendValue(behave->array, event);
-
-        // XXX: Manual sorting is probably better than using CFArraySortValues()
-        // Element is being added to already sorted array
-        CFArraySortValues( 
-                behave->array, CFRangeMake(0, CFArrayGetCount(behave->array)),
-                (CFComparatorFunction)compareEvDates, 0);
-    }
-    else {
-        behave->array = CFArrayCreateMutable(
-                            0, 0, &kCFTypeArrayCallBacks); 
-        CFArrayAppendValue(behave->array, event);
-    }
+    if (!powerEventHeapInsert(&behave->events, event))
+        return false;
     activeEventCnt++;
 
+    return true;
 }
 
 
+/*
+ * Stages a behavior's events into the snapshot. compactJournal() commits.
+ */
 static IOReturn
 updateToDisk(SCPreferencesRef prefs, PowerEventBehavior  *behavior, CFStringRef type)  
 {
     IOReturn ret = kIOReturnSuccess;
+    CFMutableArrayRef   sorted = NULL;
 
-    if(!SCPreferencesSetValue(prefs, type, behavior->array)) 
+    sorted = CFArrayCreateMutable(0, behavior->events.count, &kCFTypeArrayCallBacks);
+    if (!sorted)
     {
-        ret = kIOReturnError;
+        ret = kIOReturnNoMemory;
         goto exit;
     }
+    powerEventHeapAppendSorted(&behavior->events, sorted);
 
-    // Add a warning to the file
-    SCPreferencesSetValue(prefs, CFSTR("WARNING"), 
-        CFSTR("Do not edit this file by hand. It must remain in sorted-by-date order."));
-    //
-    //  commit the SCPreferences file out to disk
-    if(!SCPreferencesCommitChanges(prefs))
+    if(!SCPreferencesSetValue(prefs, type, sorted)) 
     {
         ret = kIOReturnError;
         goto exit;
     }
+
+    // Add a warning to the file
+    SCPreferencesSetValue(prefs, CFSTR("WARNING"), 
+        CFSTR("Do not edit this file by hand. It must remain in sorted-by-date order."));
 exit:
+    if (sorted) CFRelease(sorted);
     return ret;
 }
 
 
+/*
+ * Finds the scheduled event a cancel request refers to. Dates and app names
+ * must match; of several matches, the one scheduled first is returned.
+ */
+static powerEventNode_t *
+findEvent(PowerEventBehavior *behave, CFDictionaryRef event)
+{
+    powerEventNode_t    probe;
+
+    if (!behave->events.byKey || !isA_CFDictionary(event))
+        return NULL;
+
+    bzero(&probe, sizeof(probe));
+    probe.date = powerEventDate(event);
+    if (probe.date == kPowerEventUndated)
+        return NULL;
+    probe.appName = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey));
+
+    return (powerEventNode_t *)CFDictionaryGetValue(behave->events.byKey, &probe);
+}
+
 static bool
 removeEvent(PowerEventBehavior  *behave, CFDictionaryRef event)   
 {
 
-    CFIndex             count, i;
-    int                 j;
-    CFComparisonResult  eq;
-    CFDictionaryRef     cancelee = 0;
+    powerEventNode_t        *node = NULL;
+    CFDictionaryRef         cancelee = 0;
 
-    if (!behave->array || !isA_CFArray(behave->array))
+    node = findEvent(behave, event);
+    if (!node)
         return false;
 
-    count = CFArrayGetCount(behave->array);
-    for (i = 0; i < count; i++)
-    {
-        cancelee = CFArrayGetValueAtIndex(behave->array, i);
-        eq = compareEvDates(event, cancelee, 0);
-        if(kCFCompareLessThan == eq)
-        {
-            // fail, date to cancel < date at index
-            break;
-        }
-        else if(kCFCompareEqualTo == eq)
-        {
-            // We have confirmation on the dates and types being equal. Check id.
-            if( CFEqual(
-                CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey)), 
-                CFDictionaryGetValue(cancelee, CFSTR(kIOPMPowerEventAppNameKey))
-                ))
-            {
-                // This is the one to cancel.
-                // First check if cancelee is the current scheduled event
-                // If so, delete currentEvent field. Caller will take care of 
-                // re-scheduling the next event
-                for (j = 0; j < kBehaviorsCount; j++)
-                    if (behaviors[j]->currentEvent && CFEqual(cancelee, behaviors[j]->currentEvent)) {
-                        CFRelease(behaviors[j]->currentEvent);
-                        behaviors[j]->currentEvent = NULL;
-                    }
-                
-                if (CFDictionaryGetValue(cancelee, CFSTR(kIOPMPowerEventUserVisible)) == kCFBooleanTrue) {
-                    notify_post(kIOPMUserVisiblePowerEventNotification);
-                }
-                CFArrayRemoveValueAtIndex(behave->array, i);
-                activeEventCnt--;
-                return true;
-            }
-        }
+    // This is the one to cancel.
+    // First check if cancelee is the current scheduled event
+    // If so, delete currentEvent field. Caller will take care of 
+    // re-scheduling the next event
+    cancelee = node->event;
+    clearCurrentEvent(behave, cancelee);
+
+    if (CFDictionaryGetValue(cancelee, CFSTR(kIOPMPowerEventUserVisible)) == kCFBooleanTrue) {
+        notify_post(kIOPMUserVisiblePowerEventNotification);
     }
- 
-    return false;
+    powerEventHeapRemoveAt(&behave->events, node->heapIdx);
+    activeEventCnt--;
+    return true;
 }
 
 static IOReturn
@@ -1107,29 +1564,23 @@ removeAllEvents(audit_token_t token)
     CFIndex             i;
     uid_t               callerEUID;
     IOReturn ret = kIOReturnSuccess;
-    SCPreferencesRef    prefs = 0;
 
     audit_token_to_au32(token, NULL, &callerEUID, NULL, NULL, NULL, NULL, NULL, NULL);
 
-    if((ret = createSCSession(&prefs, callerEUID, 1)) != kIOReturnSuccess)
+    if (callerEUID != 0) {
+        ret = kIOReturnNotPrivileged;
         goto exit;
+    }
  
     for(i=0; i<kBehaviorsCount; i++)
     {
-        if(!behaviors[i]->array)
+        if(!behaviors[i]->events.count)
             continue;
         if(behaviors[i]->currentEvent) {
             CFRelease(behaviors[i]->currentEvent);
             behaviors[i]->currentEvent = NULL;
         }
-        CFArrayRemoveAllValues(behaviors[i]->array);
-        if((ret=updateToDisk(prefs, behaviors[i], behaviors[i]->title) != kIOReturnSuccess)) {
-            ret=kIOReturnError;
-            goto exit;
-        }
-        /* updateToDisk throws error if 'behaviours[i]->array=NULL' is passed as a parameter. */
-        /* Resetting the array to NULL post updatToDisk */
-        behaviors[i]->array=NULL;
+        powerEventHeapRemoveAll(&behaviors[i]->events);
         /* Schedule the power event */
         if (CFEqual(behaviors[i]->title, CFSTR(kIOPMAutoWakeOrPowerOn))) {
             /*
@@ -1145,13 +1596,300 @@ removeAllEvents(audit_token_t token)
 
     }
     activeEventCnt=0;
-    ret=kIOReturnSuccess;
+
+    /* Write the now empty snapshot rather than journaling every removal */
+    if (compactJournal() != kIOReturnSuccess) {
+        ret = kIOReturnError;
+    }
+exit:
+    return ret;
+
+}
+
+
+
+#pragma mark -
+#pragma mark Journal
+
+static PowerEventBehavior *
+behaviorForType(CFTypeRef type)
+{
+    int i;
+
+    if (!isA_CFString(type))
+        return NULL;
+
+    for (i = 0; i < kBehaviorsCount; i++) {
+        if (behaviors[i]->title && CFEqual(type, behaviors[i]->title))
+            return behaviors[i];
+    }
+    return NULL;
+}
+
+/* FNV-1a over the record's op and length, then the event bytes */
+static uint32_t
+journalChecksum(uint32_t op, uint32_t length, const UInt8 *bytes)
+{
+    uint32_t    hash = 2166136261u;
+    uint32_t    words[2] = { op, length };
+    const UInt8 *w = (const UInt8 *)words;
+    uint32_t    i;
+
+    for (i = 0; i < sizeof(words); i++)
+        hash = (hash ^ w[i]) * 16777619u;
+    for (i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    return hash;
+}
+
+/*
+ * Empties the journal and stamps it with the snapshot generation it now
+ * follows.
+ */
+static IOReturn
+journalReset(uint64_t generation)
+{
+    autoWakeJournalHeader_t     header = { kAutoWakeJournalMagic, kAutoWakeJournalVersion, generation };
+
+    if (journalFD < 0) {
+        journalFD = open(autoWakeJournalPath, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (journalFD < 0) {
+            ERROR_LOG("Failed to open AutoWake journal: %d\n", errno);
+            return kIOReturnError;
+        }
+    }
+
+    if ((ftruncate(journalFD, 0) != 0)
+        || (write(journalFD, &header, sizeof(header)) != sizeof(header))
+        || (fsync(journalFD) != 0))
+    {
+        ERROR_LOG("Failed to reset AutoWake journal: %d\n", errno);
+        close(journalFD);
+        journalFD = -1;
+        return kIOReturnError;
+    }
+
+    journalGeneration = generation;
+    journalRecords = 0;
+    return kIOReturnSuccess;
+}
+
+/*
+ * Folds the journal into a fresh snapshot of every behavior's events.
+ * The snapshot is committed under the next generation before the journal is
+ * emptied; if powerd dies in between, the old journal's generation no longer
+ * matches and it is ignored at startup.
+ */
+static IOReturn
+compactJournal(void)
+{
+    SCPreferencesRef    prefs = NULL;
+    CFNumberRef         num = NULL;
+    uint64_t            generation = journalGeneration + 1;
+    IOReturn            ret;
+    int                 i;
+
+    if ((ret = createSCSession(&prefs, 0, 1)) != kIOReturnSuccess)
+        goto exit;
+
+    for (i = 0; i < kBehaviorsCount; i++) {
+        if ((ret = updateToDisk(prefs, behaviors[i], behaviors[i]->title)) != kIOReturnSuccess)
+            goto exit;
+    }
+
+    num = CFNumberCreate(0, kCFNumberSInt64Type, &generation);
+    if (!num || !SCPreferencesSetValue(prefs, CFSTR(kAutoWakeJournalGenerationKey), num)
+        || !SCPreferencesCommitChanges(prefs))
+    {
+        ret = kIOReturnError;
+        goto exit;
+    }
+
+    // The snapshot now stands on its own. If the journal can't be emptied,
+    // its stale generation keeps it from being replayed and later changes
+    // are written as full snapshots.
+    journalGeneration = generation;
+#ifdef XCTEST
+    if (xctJournalCrashAfterSnapshot)
+        goto exit;
+#endif
+    journalReset(generation);
+
 exit:
+    if (num) CFRelease(num);
     destroySCSession(prefs, 1);
+    if (ret != kIOReturnSuccess) {
+        ERROR_LOG("Failed to compact AutoWake journal: 0x%x\n", ret);
+    }
     return ret;
+}
+
+/*
+ * Appends one add or remove record and syncs it. When the journal can't be
+ * written, falls back to writing a full snapshot.
+ */
+static IOReturn
+journalAppend(uint32_t op, CFDictionaryRef event)
+{
+    CFDataRef                   data = NULL;
+    UInt8                       *buf = NULL;
+    autoWakeJournalRecord_t     record;
+    CFIndex                     length;
+    off_t                       end;
+    IOReturn                    ret = kIOReturnSuccess;
+
+    if (journalFD < 0) {
+        return compactJournal();
+    }
+
+    data = CFPropertyListCreateData(0, event, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    if (!data) {
+        ret = kIOReturnBadArgument;
+        goto exit;
+    }
+    length = CFDataGetLength(data);
+    if (length > kAutoWakeJournalMaxRecordLen) {
+        ret = kIOReturnBadArgument;
+        goto exit;
+    }
 
+    record.magic = kAutoWakeJournalRecordMagic;
+    record.op = op;
+    record.length = (uint32_t)length;
+    record.checksum = journalChecksum(op, record.length, CFDataGetBytePtr(data));
+
+    // One write, so a crash leaves at most one torn record at the tail
+    buf = malloc(sizeof(record) + length);
+    if (!buf) {
+        ret = kIOReturnNoMemory;
+        goto exit;
+    }
+    memcpy(buf, &record, sizeof(record));
+    memcpy(buf + sizeof(record), CFDataGetBytePtr(data), length);
+
+    end = lseek(journalFD, 0, SEEK_END);
+    if ((write(journalFD, buf, sizeof(record) + length) != (ssize_t)(sizeof(record) + length))
+        || (fsync(journalFD) != 0))
+    {
+        ERROR_LOG("Failed to append to AutoWake journal: %d\n", errno);
+        if ((end < 0) || (ftruncate(journalFD, end) != 0)) {
+            close(journalFD);
+            journalFD = -1;
+        }
+        ret = compactJournal();
+        goto exit;
+    }
+
+    // Keep replay bounded by the number of live events
+    if (++journalRecords >= MAX(kAutoWakeJournalMinRecords, 2 * activeEventCnt)) {
+        compactJournal();
+    }
+
+exit:
+    if (buf) free(buf);
+    if (data) CFRelease(data);
+    return ret;
 }
 
+static void
+journalApply(uint32_t op, CFDictionaryRef event)
+{
+    PowerEventBehavior  *behave;
+    powerEventNode_t    *node;
+
+    behave = behaviorForType(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTypeKey)));
+    if (!behave)
+        return;
+
+    if (op == kAutoWakeJournalAdd) {
+        if (powerEventHeapInsert(&behave->events, event))
+            activeEventCnt++;
+    } else if (op == kAutoWakeJournalRemove) {
+        node = findEvent(behave, event);
+        if (node) {
+            powerEventHeapRemoveAt(&behave->events, node->heapIdx);
+            activeEventCnt--;
+        }
+    }
+}
+
+/*
+ * Applies the journal on top of the snapshot just loaded, if it follows
+ * that snapshot's generation. Stops at the first torn or corrupt record;
+ * everything before it was synced and is kept. Returns the number of
+ * records applied and whether the journal holds anything worth compacting.
+ */
+static uint32_t
+journalReplay(uint64_t generation, bool *needsCompaction)
+{
+    autoWakeJournalHeader_t     header;
+    autoWakeJournalRecord_t     record;
+    struct stat                 st;
+    UInt8                       *buf = NULL;
+    CFDataRef                   data = NULL;
+    CFDictionaryRef             event = NULL;
+    size_t                      off;
+    uint32_t                    applied = 0;
+    int                         fd;
+
+    *needsCompaction = false;
+
+    fd = open(autoWakeJournalPath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    if ((fstat(fd, &st) != 0) || (st.st_size <= (off_t)sizeof(header)))
+        goto exit;
+
+    buf = malloc(st.st_size);
+    if (!buf || (read(fd, buf, st.st_size) != st.st_size))
+        goto exit;
+
+    memcpy(&header, buf, sizeof(header));
+    if ((header.magic != kAutoWakeJournalMagic)
+        || (header.version != kAutoWakeJournalVersion)
+        || (header.generation != generation))
+    {
+        INFO_LOG("Ignoring AutoWake journal for generation %llu, snapshot is %llu\n",
+                 header.generation, generation);
+        goto exit;
+    }
+
+    *needsCompaction = true;
+    for (off = sizeof(header); off + sizeof(record) <= (size_t)st.st_size; off += sizeof(record) + record.length)
+    {
+        memcpy(&record, buf + off, sizeof(record));
+        if ((record.magic != kAutoWakeJournalRecordMagic)
+            || (record.length > kAutoWakeJournalMaxRecordLen)
+            || (off + sizeof(record) + record.length > (size_t)st.st_size)
+            || (record.checksum != journalChecksum(record.op, record.length, buf + off + sizeof(record))))
+        {
+            break;
+        }
+
+        data = CFDataCreateWithBytesNoCopy(0, buf + off + sizeof(record), record.length, kCFAllocatorNull);
+        event = data ? CFPropertyListCreateWithData(0, data, kCFPropertyListImmutable, NULL, NULL) : NULL;
+        if (isA_CFDictionary(event)) {
+            journalApply(record.op, event);
+            applied++;
+        }
+        if (event) CFRelease(event);
+        if (data) CFRelease(data);
+        event = NULL;
+        data = NULL;
+    }
+
+    if (off != (size_t)st.st_size) {
+        ERROR_LOG("Dropped %zu bytes of torn AutoWake journal after %u records\n",
+                  (size_t)st.st_size - off, applied);
+    }
+
+exit:
+    if (buf) free(buf);
+    close(fd);
+    return applied;
+}
 
 
 /* MIG entry point to schedule a power event */
@@ -1170,10 +1908,9 @@ _io_pm_schedule_power_event
     CFMutableDictionaryRef  event = NULL;
     CFDataRef               dataRef = NULL;
     CFStringRef             type = NULL;
-    SCPreferencesRef        prefs = 0;
+    PowerEventBehavior      *behave = NULL;
     uid_t                   callerEUID;
     pid_t                   callerPID;
-    int                     i;
     
     
     *return_code = kIOReturnSuccess;
@@ -1191,7 +1928,7 @@ _io_pm_schedule_power_event
 
     if(action == kIOPMCancelAllScheduledEvents) {
         
-        /* Remove all the events from in-memory array as well as Update the disk.
+        /* Remove all the events from in-memory heaps as well as Update the disk.
            Failure can occur due to failure to write to disk */
         *return_code = removeAllEvents(token);
         INFO_LOG("Removed all wake request based on request from pid %d\n", callerPID);
@@ -1241,11 +1978,8 @@ _io_pm_schedule_power_event
         goto exit;
     }
 
-    for(i=0; i<kBehaviorsCount; i++) {
-        if (CFEqual(type, behaviors[i]->title))
-            break;
-    }
-    if (i >= kBehaviorsCount) {
+    behave = behaviorForType(type);
+    if (!behave) {
         *return_code = kIOReturnBadArgument;
         goto exit;
     }
@@ -1255,17 +1989,22 @@ _io_pm_schedule_power_event
     //asl_log(0, 0, ASL_LEVEL_ERR, "Sched event type: %s by  %s\n", CFStringGetCStringPtr(type,kCFStringEncodingMacRoman ),
     //       CFStringGetCStringPtr( who, kCFStringEncodingMacRoman));
 
-    if((*return_code = createSCSession(&prefs, callerEUID, 1)) != kIOReturnSuccess)
+    if (callerEUID != 0) {
+        *return_code = kIOReturnNotPrivileged;
         goto exit;
+    }
 
     if (action == kIOPMScheduleEvent) {
 
-        /* Add event to in-memory array */
-        addEvent(behaviors[i], event);
+        /* Add event to in-memory heap */
+        if (!addEvent(behave, event)) {
+            *return_code = kIOReturnNoMemory;
+            goto exit;
+        }
         
         /* Commit changes to disk */
-        if ((*return_code = updateToDisk(prefs, behaviors[i], type)) != kIOReturnSuccess) {
-            removeEvent(behaviors[i], event);
+        if ((*return_code = journalAppend(kAutoWakeJournalAdd, event)) != kIOReturnSuccess) {
+            removeEvent(behave, event);
             goto exit;
         }
         DEBUG_LOG("Received wake request: %{public}@\n", event);
@@ -1275,15 +2014,15 @@ _io_pm_schedule_power_event
     }
     else if(action == kIOPMCancelScheduledEvent) {
 
-        /* Remove event from in-memory array */
-        if (!removeEvent(behaviors[i], event)) {
+        /* Remove event from in-memory heap */
+        if (!removeEvent(behave, event)) {
             *return_code = kIOReturnNotFound;
             goto exit;
         }
         DEBUG_LOG("Cancelled wake request: %{public}@\n", event);
 
         /* Update to disk. Ignore the failure; */
-        updateToDisk(prefs, behaviors[i], type);
+        journalAppend(kAutoWakeJournalRemove, event);
     }
 
     /* Schedule the power event */
@@ -1296,12 +2035,11 @@ _io_pm_schedule_power_event
         schedulePowerEvent(&poweronBehavior);
     }
     else {
-        schedulePowerEvent(behaviors[i]);
+        schedulePowerEvent(behave);
     }
 
 
 exit:
-    destroySCSession(prefs, 1);
     if (dataRef)
         CFRelease(dataRef);
 
@@ -1319,18 +2057,12 @@ __private_extern__ CFArrayRef copyScheduledPowerEvents(void)
     CFMutableArrayRef       powerEvents = NULL;
     PowerEventBehavior      *this_behavior;
     int                     i;
-    CFIndex                 bcount;
-    CFRange                 rng;
 
     powerEvents = CFArrayCreateMutable( 0, 0, &kCFTypeArrayCallBacks); 
+    if (!powerEvents) return NULL;
     for(i=0; i<kBehaviorsCount; i++) {
         this_behavior = behaviors[i];
-
-        if(this_behavior->array && isA_CFArray(this_behavior->array)) {
-            bcount = CFArrayGetCount(this_behavior->array);
-            rng =  CFRangeMake(0, bcount);
-            CFArrayAppendArray(powerEvents, this_behavior->array, rng);
-        }
+        powerEventHeapAppendSorted(&this_behavior->events, powerEvents);
     }
 
     return powerEvents;
@@ -1338,6 +2070,23 @@ __private_extern__ CFArrayRef copyScheduledPowerEvents(void)
 
 
 
+/* Matches events whose wake, leeway included, is at or after *(CFAbsoluteTime *)context */
+static powerEventVisit_t
+matchWakeNotBefore(powerEventNode_t *node, void *context)
+{
+    CFAbsoluteTime  lowerbound_ts = *(CFAbsoluteTime *)context;
+    CFAbsoluteTime  wakeup_abs;
+
+    if (node->date == kPowerEventUndated)
+        return kPowerEventVisitPrune;
+
+    wakeup_abs = getWakeScheduleTime(node->event);
+    if (!wakeup_abs || (wakeup_abs < lowerbound_ts))
+        return kPowerEventVisitDescend;
+
+    return kPowerEventVisitMatch;
+}
+
 /*
  * checkPendingWakeReqs -
  * Checks for upcoming Wake requests and/or wake requests in recent past based on the flags.
@@ -1356,16 +2105,16 @@ __private_extern__ bool checkPendingWakeReqs(int options)
     bool        exists = false;
     static      CFAbsoluteTime  purgePrevent_ts = 0;
     CFDateRef   wakeup_date = NULL;
-    CFIndex     cnt, i;
 
     CFDictionaryRef     event = NULL;
+    powerEventNode_t    *node = NULL;
     PowerEventBehavior  *behave = &wakeBehavior;
     IOPMAssertionID     id;
     CFAbsoluteTime      now_ts;
     CFAbsoluteTime      upperbound_ts = 0, lowerbound_ts = 0;
     CFAbsoluteTime      wakeup_abs = 0;
 
-    now_ts = CFAbsoluteTimeGetCurrent();
+    now_ts = autoWakeNow();
     if (options & PREVENT_PURGING) {
         // First purge any past events and then prevent purging
         purgePastEvents(behave);
@@ -1389,27 +2138,15 @@ __private_extern__ bool checkPendingWakeReqs(int options)
 
     if (upperbound_ts != lowerbound_ts) {
 
-        i = cnt = 0;
-        for (isA_CFArray(behave->array) && (cnt = CFArrayGetCount(behave->array)); i < cnt; i++) {
-
-            event = CFArrayGetValueAtIndex(behave->array, i);
-            if (!isA_CFDictionary(event)) continue;
-
+        // Earliest-dated request whose wake isn't before the lower bound
+        node = powerEventHeapFind(&behave->events, 0, matchWakeNotBefore, &lowerbound_ts, NULL);
+        if (node) {
+            event = node->event;
             wakeup_abs = getWakeScheduleTime(event);
-            if (!wakeup_abs) continue;
-
-
-            if (wakeup_abs < lowerbound_ts)
-                continue;
-
             wakeup_date = CFDateCreate(0, wakeup_abs);
 
-            if (wakeup_abs > upperbound_ts) {
-                break;
-            }
-            else {
+            if (wakeup_abs <= upperbound_ts) {
                 exists = true;
-                break;
             }
         }
     }
@@ -1447,3 +2184,150 @@ __private_extern__ bool checkPendingWakeReqs(int options)
 
     return exists;
 }
+
+#ifdef XCTEST
+/* Drops every in-memory event without touching the prefs file */
+void xctResetPowerEvents(void)
+{
+    int i;
+
+    if (!wakeRequests_log) {
+        wakeRequests_log = os_log_create(PM_LOG_SYSTEM, WAKEREQUESTS_LOG);
+    }
+    for (i = 0; i < kBehaviorsCount; i++) {
+        if (behaviors[i]->timer) {
+            CFRunLoopTimerInvalidate(behaviors[i]->timer);
+            CFRelease(behaviors[i]->timer);
+        }
+        if (behaviors[i]->currentEvent) {
+            CFRelease(behaviors[i]->currentEvent);
+        }
+        earliestCacheClear(&behaviors[i]->upcomingCache);
+        earliestCacheClear(&behaviors[i]->scheduledCache);
+        powerEventHeapRemoveAll(&behaviors[i]->events);
+    }
+    initBehaviors();
+    activeEventCnt = 0;
+}
+
+bool xctAddPowerEvent(CFDictionaryRef event)
+{
+    PowerEventBehavior *behave = behaviorForType(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTypeKey)));
+
+    return behave ? addEvent(behave, event) : false;
+}
+
+bool xctCancelPowerEvent(CFDictionaryRef event)
+{
+    PowerEventBehavior *behave = behaviorForType(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTypeKey)));
+
+    return behave ? removeEvent(behave, event) : false;
+}
+
+CFDictionaryRef xctCopyEarliestUpcoming(CFStringRef type)
+{
+    PowerEventBehavior *behave = behaviorForType(type);
+
+    return behave ? copyEarliestUpcoming(behave) : NULL;
+}
+
+CFIndex xctPowerEventCount(CFStringRef type)
+{
+    PowerEventBehavior *behave = behaviorForType(type);
+
+    return behave ? behave->events.count : 0;
+}
+
+CFDictionaryRef xctCopyEarliestEvent(CFStringRef type)
+{
+    PowerEventBehavior *behave = behaviorForType(type);
+
+    return behave ? copyEarliestEvent(behave) : NULL;
+}
+
+void xctPurgePastEvents(CFStringRef type)
+{
+    PowerEventBehavior *behave = behaviorForType(type);
+
+    if (behave) {
+        purgePastEvents(behave);
+    }
+}
+
+/* Runs the scheduler on a virtual clock; 0 returns it to the real one */
+void xctSetVirtualClock(CFAbsoluteTime now)
+{
+    xctVirtualNow = now;
+    AutoWakeRepeatingChange();
+}
+
+void xctRemoveEventsByAppName(CFStringRef type, CFStringRef appName)
+{
+    PowerEventBehavior *behave = behaviorForType(type);
+
+    if (behave) {
+        removeEventsByAppName(behave, appName);
+    }
+}
+
+/* Points the snapshot and journal elsewhere; NULL restores the default */
+void xctSetAutoWakeStore(CFStringRef prefsPath, const char *journalPath)
+{
+    if (journalFD >= 0) {
+        close(journalFD);
+        journalFD = -1;
+    }
+    autoWakePrefsPath = prefsPath ? prefsPath : CFSTR(kIOPMAutoWakePrefsPath);
+    autoWakeJournalPath = journalPath ? journalPath : kAutoWakeJournalPath;
+    journalGeneration = 0;
+    journalRecords = 0;
+}
+
+/* Schedules or cancels the way the MIG entry point does, minus the caller checks */
+IOReturn xctSchedulePowerEvent(CFDictionaryRef event)
+{
+    PowerEventBehavior  *behave = behaviorForType(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTypeKey)));
+    IOReturn            ret;
+
+    if (!behave || !addEvent(behave, event))
+        return kIOReturnBadArgument;
+    if ((ret = journalAppend(kAutoWakeJournalAdd, event)) != kIOReturnSuccess)
+        removeEvent(behave, event);
+    return ret;
+}
+
+IOReturn xctCancelScheduledPowerEvent(CFDictionaryRef event)
+{
+    PowerEventBehavior  *behave = behaviorForType(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTypeKey)));
+
+    if (!behave || !removeEvent(behave, event))
+        return kIOReturnNotFound;
+    return journalAppend(kAutoWakeJournalRemove, event);
+}
+
+/* Drops in-memory state and loads it back from the snapshot and journal, as at boot */
+void xctReloadPowerEvents(void)
+{
+    if (journalFD >= 0) {
+        close(journalFD);
+        journalFD = -1;
+    }
+    xctResetPowerEvents();
+    copyScheduledPowerChangeArrays();
+}
+
+IOReturn xctCompactJournal(bool crashAfterSnapshot)
+{
+    IOReturn ret;
+
+    xctJournalCrashAfterSnapshot = crashAfterSnapshot;
+    ret = compactJournal();
+    xctJournalCrashAfterSnapshot = false;
+    return ret;
+}
+
+uint32_t xctJournalRecords(void)
+{
+    return journalRecords;
+}
+#endif
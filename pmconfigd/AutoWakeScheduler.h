@@ -50,6 +50,50 @@
 
 typedef void (*powerEventCallout)(CFDictionaryRef);
 
+/*
+ * One scheduled event, held by a powerEventHeap_t. heapIdx tracks the node's
+ * slot as the heap reorders, so a node can be removed without searching.
+ */
+typedef struct powerEventNode {
+    CFDictionaryRef         event;
+    CFAbsoluteTime          date;       // kIOPMPowerEventTimeKey; DBL_MAX if missing
+    CFTypeRef               appName;    // kIOPMPowerEventAppNameKey; owned by event
+    uint64_t                seq;        // Insertion order, breaks ties between equal dates
+    CFIndex                 heapIdx;
+
+    struct powerEventNode   *keyNext;   // Later insert with the same date and app name
+} powerEventNode_t;
+
+/*
+ * Binary min-heap of events ordered by date, earliest at nodes[0].
+ * generation changes whenever an event is added or removed.
+ *
+ * byKey maps (date, app name) to the earliest inserted node with that key,
+ * which is the one a cancel removes. The type is implied by the behavior.
+ */
+typedef struct {
+    powerEventNode_t        **nodes;
+    CFIndex                 count;
+    CFIndex                 capacity;
+    uint32_t                generation;
+
+    CFMutableDictionaryRef  byKey;
+} powerEventHeap_t;
+
+/*
+ * Earliest event across a behavior's events, its sharedEvents and the
+ * repeating schedule. Good until either event set changes, the repeating
+ * schedule or clock changes, or the clock passes 'expires'.
+ */
+typedef struct {
+    CFDictionaryRef         event;              // Retained; NULL when nothing is upcoming
+    CFAbsoluteTime          expires;
+    uint32_t                generation;         // events.generation when computed
+    uint32_t                sharedGeneration;   // sharedEvents->events.generation when computed
+    uint32_t                epoch;              // Bumped on repeating schedule and clock changes
+    bool                    valid;
+} powerEventCache_t;
+
 /*
  * We use one PowerEventBehavior struct per-type of schedule power event
  * sleep/wake/power/shutdown/wakeORpower/restart.
@@ -58,9 +102,13 @@ typedef void (*powerEventCallout)(CFDictionaryRef);
 struct PowerEventBehavior {
     // These values change to reflect the state of current
     // and upcoming power events
-    CFMutableArrayRef       array;
+    powerEventHeap_t        events;
     CFDictionaryRef         currentEvent;
     CFRunLoopTimerRef       timer;
+
+    // Earliest event by date, and by wake time with leeway
+    powerEventCache_t       upcomingCache;
+    powerEventCache_t       scheduledCache;
     
     CFStringRef             title;
     
@@ -78,18 +126,39 @@ typedef struct PowerEventBehavior PowerEventBehavior;
 __private_extern__ void             AutoWake_prime(void);
 __private_extern__ void             AutoWakeCapabilitiesNotification(IOPMSystemPowerStateCapabilities old_cap, IOPMSystemPowerStateCapabilities new_cap);
 __private_extern__ void             AutoWakeCalendarChange(void);
+__private_extern__ void             AutoWakeRepeatingChange(void);
 __private_extern__ IOReturn         createSCSession(SCPreferencesRef *prefs, uid_t euid, int lock);
 __private_extern__ void             schedulePowerEventType(CFStringRef type);
 __private_extern__ void             destroySCSession(SCPreferencesRef prefs, int unlock);
 __private_extern__ CFAbsoluteTime   getWakeScheduleTime(CFDictionaryRef event);
+__private_extern__ CFAbsoluteTime   getWakeEarliestTime(CFDictionaryRef event);
 __private_extern__ CFTimeInterval   getEarliestRequestAutoWake(void);
 __private_extern__ CFDictionaryRef copyEarliestRequestAutoWakeEvent(void);
 __private_extern__ CFDictionaryRef copyEarliestShutdownRestartEvent(void);
 __private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior *behav);
+__private_extern__ CFAbsoluteTime   autoWakeNow(void);
 
 
 __private_extern__ bool             checkPendingWakeReqs(int options);
 
+#ifdef XCTEST
+__private_extern__ void             xctResetPowerEvents(void);
+__private_extern__ bool             xctAddPowerEvent(CFDictionaryRef event);
+__private_extern__ bool             xctCancelPowerEvent(CFDictionaryRef event);
+__private_extern__ CFDictionaryRef  xctCopyEarliestUpcoming(CFStringRef type);
+__private_extern__ CFIndex          xctPowerEventCount(CFStringRef type);
+__private_extern__ CFDictionaryRef  xctCopyEarliestEvent(CFStringRef type);
+__private_extern__ void             xctPurgePastEvents(CFStringRef type);
+__private_extern__ void             xctSetVirtualClock(CFAbsoluteTime now);
+__private_extern__ void             xctRemoveEventsByAppName(CFStringRef type, CFStringRef appName);
+__private_extern__ void             xctSetAutoWakeStore(CFStringRef prefsPath, const char *journalPath);
+__private_extern__ IOReturn         xctSchedulePowerEvent(CFDictionaryRef event);
+__private_extern__ IOReturn         xctCancelScheduledPowerEvent(CFDictionaryRef event);
+__private_extern__ void             xctReloadPowerEvents(void);
+__private_extern__ IOReturn         xctCompactJournal(bool crashAfterSnapshot);
+__private_extern__ uint32_t         xctJournalRecords(void);
+#endif
+
 
 
 #endif // _AutoWakeScheduler_h_
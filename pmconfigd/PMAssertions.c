@@ -102,6 +102,7 @@ STATIC IOReturn                     lookupAssertion(pid_t pid, IOPMAssertionID i
 STATIC bool                         propertiesDictRequiresRoot(CFDictionaryRef   props);
 STATIC IOReturn                     doRetain(pid_t pid, IOPMAssertionID id, int *retainCnt);
 STATIC IOReturn                     doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt);
+STATIC IOReturn                     doRenewLease(pid_t pid, IOPMAssertionID id);
 static IOReturn                     doSetProperties(pid_t pid, 
                                                     IOPMAssertionID id, 
                                                     CFDictionaryRef props,
@@ -109,6 +110,7 @@ static IOReturn                     doSetProperties(pid_t pid,
 
 STATIC CFArrayRef                   copyPIDAssertionDictionaryFlattened(int state);
 static CFArrayRef                   copyAssertionsByType(CFStringRef type);
+STATIC IOReturn                     copyFilteredAssertions(CFDictionaryRef filter, CFDictionaryRef *result);
 static CFDictionaryRef              copyAggregateValuesDictionary(void);
 
 STATIC IOReturn                     doCreate(pid_t pid, CFMutableDictionaryRef newProperties,
@@ -120,13 +122,15 @@ STATIC IOReturn                     copyAssertionForID(pid_t inPID, int inID,
 static ProcessInfo*                 processInfoCreate(pid_t p);
 static ProcessInfo*                 processInfoRetain(pid_t p);
 STATIC void                         processInfoRelease(pid_t p);
-static ProcessInfo*                 processInfoGet(pid_t p);
+STATIC ProcessInfo*                 processInfoGet(pid_t p);
 static void                         setClamshellSleepState();
 static int                          getAssertionTypeIndex(CFStringRef type);
 
 STATIC void                         handleAssertionTimeout(assertionType_t *assertType);
 static void                         resetGlobalTimer(assertionType_t *assertType, uint64_t timer);
 static IOReturn                     raiseAssertion(assertion_t *assertion);
+static void                         insertIntoTimedList(assertion_t *assertion, assertionType_t *assertType);
+static void                         updateLeaseTimeLeft(assertion_t *assertion);
 static void                         allocStatsBuf(ProcessInfo *pinfo);
 static void                         releaseStatsBufByPid(pid_t p);
 
@@ -167,9 +171,21 @@ dispatch_source_t                   gAggCleanupDispatch = NULL;  // Dispatch to
 uint64_t                            gAggCleanupFrequency = (15 * NSEC_PER_SEC);  // Once every 4 hours
 sysQualifier_t                      gSysQualifier;
 
-static CFMutableSetRef              gPendingResponses = NULL;
-static long                         gPendingAckToken = 0;
-static uint32_t                     gSleepBlockers = 0;
+/*
+ * State of the async assertion check done before system sleep. Checks are
+ * fanned out to all xpc clients at once and tracked against one deadline.
+ */
+#define kAssertionCheckTimeoutSecs          5
+typedef struct {
+    long                ackToken;       // Sleep token to acknowledge. 0 if no check is in progress
+    uint64_t            startTime;      // mach_absolute_time() at which checks were sent
+    uint32_t            blockers;       // Total assertions reported by clients so far
+    CFMutableSetRef     pending;        // ProcessInfo of processes yet to respond
+    dispatch_source_t   deadline;
+    bool                deadlineArmed;  // deadline timer is resumed
+} assertionCheck_t;
+
+static assertionCheck_t             gAssertionCheck;
 __private_extern__ void             sendSleepNotificationResponse(void *acknowledgementToken, bool allow);
 
 
@@ -366,6 +382,28 @@ exit:
 #endif
 }
 
+void asyncAssertionRenewLease(xpc_object_t remoteConnection, xpc_object_t msg)
+{
+    pid_t               callerPID = -1;
+    IOPMAssertionID     assertionId;
+    IOReturn            rc;
+
+    assertionId = (IOPMAssertionID)xpc_dictionary_get_uint64(msg, kAssertionLeaseRenewMsg);
+#ifndef XCTEST
+    callerPID = xpc_connection_get_pid(remoteConnection);
+#else
+    callerPID = XCTEST_PID;
+#endif
+
+    rc = doRenewLease(callerPID, assertionId);
+    if (rc != kIOReturnSuccess) {
+        ERROR_LOG("Failed to renew lease for assertion id 0x%x (rc:0x%x)\n", assertionId, rc);
+    }
+#if XCTEST
+    xpc_dictionary_set_uint64(msg, kMsgReturnCode, rc);
+#endif
+}
+
 void releaseConnectionAssertions(xpc_object_t remoteConnection)
 {
     pid_t deadPID = xpc_connection_get_pid(remoteConnection);
@@ -413,6 +451,21 @@ exit:
     xpc_release(msg);
 }
 
+static void completeAssertionCheck(bool allow)
+{
+    if (gAssertionCheck.deadlineArmed) {
+        dispatch_suspend(gAssertionCheck.deadline);
+        gAssertionCheck.deadlineArmed = false;
+    }
+
+    DEBUG_LOG("Assertion check complete in %llu ms. blockers: %u\n",
+              monotonicTS2Ms(mach_absolute_time() - gAssertionCheck.startTime),
+              gAssertionCheck.blockers);
+    sendSleepNotificationResponse((void *)gAssertionCheck.ackToken, allow);
+    gAssertionCheck.ackToken = 0;
+    gAssertionCheck.blockers = 0;
+}
+
 void handleAssertionCheckTimeout(const void *value, void *context)
 {
     ProcessInfo *pinfo = (ProcessInfo *)value;
@@ -420,10 +473,23 @@ void handleAssertionCheckTimeout(const void *value, void *context)
     if (!pinfo->proc_exited) {
         ERROR_LOG("Timed out waiting for assertion check response from pid %d\n",
                 pinfo->pid);
+        pinfo->checkTimeoutCnt++;
     }
     processInfoRelease(pinfo->pid);
 }
 
+static void assertionCheckDeadlineFired(void)
+{
+    if (CFSetGetCount(gAssertionCheck.pending) == 0) {
+        return;
+    }
+    CFSetApplyFunction(gAssertionCheck.pending, handleAssertionCheckTimeout, NULL);
+    CFSetRemoveAllValues(gAssertionCheck.pending);
+
+    // Clients that did not respond in time don't block sleep
+    completeAssertionCheck(gAssertionCheck.blockers ? false : true);
+}
+
 
 void sendCheckAssertionsMsg(ProcessInfo *pinfo, void(^responseHandler)(xpc_object_t))
 {
@@ -437,7 +503,7 @@ void sendCheckAssertionsMsg(ProcessInfo *pinfo, void(^responseHandler)(xpc_objec
     }
     DEBUG_LOG("Sending assertion check message to pid %d\n", pinfo->pid);
     xpc_dictionary_set_uint64(msg, kAssertionCheckMsg, 0);
-    xpc_dictionary_set_uint64(msg, kAssertionCheckTokenKey,gPendingAckToken);
+    xpc_dictionary_set_uint64(msg, kAssertionCheckTokenKey, gAssertionCheck.ackToken);
 
     xpc_connection_send_message_with_reply(pinfo->remoteConnection, msg, dispatch_get_main_queue(), responseHandler);
     xpc_release(msg);
@@ -449,37 +515,50 @@ void processAssertionCheckResp(xpc_object_t reply, pid_t pid)
 {
     long        token;
     uint32_t    blockers;
+    uint64_t    latency;
     ProcessInfo *pinfo;
 
-    token = (long)xpc_dictionary_get_uint64(reply, kAssertionCheckTokenKey);
-    blockers = (uint32_t)xpc_dictionary_get_uint64(reply, kAssertionCheckCountKey);
+    if (xpc_get_type(reply) == XPC_TYPE_DICTIONARY) {
+        token = (long)xpc_dictionary_get_uint64(reply, kAssertionCheckTokenKey);
+        blockers = (uint32_t)xpc_dictionary_get_uint64(reply, kAssertionCheckCountKey);
+    }
+    else {
+        // Connection went away. Its assertions are released with the connection,
+        // so it doesn't need to be waited on.
+        token = gAssertionCheck.ackToken;
+        blockers = 0;
+    }
 
-    if (token != gPendingAckToken) {
+    if ((gAssertionCheck.ackToken == 0) || (token != gAssertionCheck.ackToken)) {
         ERROR_LOG("Unexpected assertion check response from pid %d. token: %ld expected: %ld\n", 
-                  pid, token, gPendingAckToken);
+                  pid, token, gAssertionCheck.ackToken);
         return;
     }
 
 
     pinfo = processInfoGet(pid);
-    if (!pinfo) {
+    if (!pinfo || !CFSetContainsValue(gAssertionCheck.pending, pinfo)) {
         ERROR_LOG("Process for pid %d not found. token: %ld\n", pid, token);
         return;
     }
 
-    DEBUG_LOG("Received assertion check response from pid %d with assertion cnt %d\n", pid, blockers);
+    latency = monotonicTS2Ms(mach_absolute_time() - gAssertionCheck.startTime);
+    pinfo->checkLatencyMs = (uint32_t)latency;
+    if (pinfo->checkLatencyMs > pinfo->checkLatencyMaxMs) {
+        pinfo->checkLatencyMaxMs = pinfo->checkLatencyMs;
+    }
+    DEBUG_LOG("Received assertion check response from pid %d with assertion cnt %d in %llu ms\n",
+              pid, blockers, latency);
 
-    CFSetRemoveValue(gPendingResponses, pinfo);
+    gAssertionCheck.blockers += blockers;
+    CFSetRemoveValue(gAssertionCheck.pending, pinfo);
     processInfoRelease(pinfo->pid);
 
-    long cnt = CFSetGetCount(gPendingResponses);
+    long cnt = CFSetGetCount(gAssertionCheck.pending);
     if (cnt == 0) {
-        sendSleepNotificationResponse((void *)gPendingAckToken, gSleepBlockers ? false : true);
-        gPendingAckToken = 0;
-        gSleepBlockers = 0;
+        completeAssertionCheck(gAssertionCheck.blockers ? false : true);
     }
     else {
-        gSleepBlockers += blockers;
         DEBUG_LOG("Still waiting for assertion check response from %ld procs\n", cnt);
     }
 }
@@ -487,21 +566,33 @@ void processAssertionCheckResp(xpc_object_t reply, pid_t pid)
 
 void checkForAsyncAssertions(void *acknowledgementToken)
 {
-    static dispatch_source_t timer = 0;
     ProcessInfo **procs = NULL;
     ProcessInfo *pinfo = NULL;
 
 
-    if (gPendingResponses == NULL) {
-        gPendingResponses = CFSetCreateMutable(0, 0, NULL);
-        if (!gPendingResponses) {
+    if (gAssertionCheck.pending == NULL) {
+        gAssertionCheck.pending = CFSetCreateMutable(0, 0, NULL);
+        if (!gAssertionCheck.pending) {
             ERROR_LOG("Failed to create array for pending responses\n");
             sendSleepNotificationResponse(acknowledgementToken, true);
             goto exit;
         }
     }
 
-    if ((gPendingAckToken != 0) || (CFSetGetCount(gPendingResponses) != 0)) {
+    if (gAssertionCheck.deadline == NULL) {
+        gAssertionCheck.deadline = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+        if (!gAssertionCheck.deadline) {
+            sendSleepNotificationResponse(acknowledgementToken, true);
+            goto exit;
+        }
+        dispatch_source_set_event_handler(gAssertionCheck.deadline, ^{
+            assertionCheckDeadlineFired();
+        });
+        dispatch_source_set_timer(gAssertionCheck.deadline, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        // Timer stays suspended while no check is in progress
+    }
+
+    if ((gAssertionCheck.ackToken != 0) || (CFSetGetCount(gAssertionCheck.pending) != 0)) {
         ERROR_LOG("Call to check async assertions while previous check is not complete\n");
         sendSleepNotificationResponse(acknowledgementToken, true);
         goto exit;
@@ -514,8 +605,11 @@ void checkForAsyncAssertions(void *acknowledgementToken)
         goto exit;
     }
 
-    gPendingAckToken = (uintptr_t)acknowledgementToken;
-    gSleepBlockers = 0;
+    gAssertionCheck.ackToken = (uintptr_t)acknowledgementToken;
+    gAssertionCheck.blockers = 0;
+    gAssertionCheck.startTime = mach_absolute_time();
+
+    // Collect all clients first, so that the deadline covers every check sent
     CFDictionaryGetKeysAndValues(gProcessDict, NULL, (const void **)procs);
     for (long j = 0; (j < cnt) && (procs[j] != NULL); j++) {
         pinfo = procs[j];
@@ -524,48 +618,31 @@ void checkForAsyncAssertions(void *acknowledgementToken)
         }
 
         processInfoRetain(pinfo->pid);
-        CFSetAddValue(gPendingResponses, (const void*)pinfo);
-        sendCheckAssertionsMsg(pinfo, ^(xpc_object_t reply) { processAssertionCheckResp(reply, pinfo->pid); });
+        CFSetAddValue(gAssertionCheck.pending, (const void*)pinfo);
     }
 
-    if (CFSetGetCount(gPendingResponses) == 0) {
+    if (CFSetGetCount(gAssertionCheck.pending) == 0) {
         // There are no processes with xpc connection
         sendSleepNotificationResponse(acknowledgementToken, true);
-        gPendingAckToken = 0;
-        gSleepBlockers = 0;
+        gAssertionCheck.ackToken = 0;
+        goto exit;
     }
 
-    if (timer == 0) {
-
-        timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
-        dispatch_source_set_event_handler(timer, ^{
-            if (CFSetGetCount(gPendingResponses) == 0) {
-                return;
-            }
-            CFSetApplyFunction(gPendingResponses, handleAssertionCheckTimeout, NULL);
-            CFSetRemoveAllValues(gPendingResponses);
-
-            sendSleepNotificationResponse(acknowledgementToken, true);
-            gPendingAckToken = 0;
-            gSleepBlockers = 0;
-
-        });
-
-        dispatch_source_set_cancel_handler(timer, ^{
-            dispatch_release(timer);
-            timer = NULL;
-        });
-
+    dispatch_source_set_timer(gAssertionCheck.deadline,
+                              dispatch_time(DISPATCH_TIME_NOW, kAssertionCheckTimeoutSecs * NSEC_PER_SEC),
+                              DISPATCH_TIME_FOREVER, 0);
+    dispatch_resume(gAssertionCheck.deadline);
+    gAssertionCheck.deadlineArmed = true;
 
-        dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, 5LL * NSEC_PER_SEC),
-                DISPATCH_TIME_FOREVER, 0);
-        dispatch_resume(timer);
+    for (long j = 0; (j < cnt) && (procs[j] != NULL); j++) {
+        pinfo = procs[j];
+        if (!CFSetContainsValue(gAssertionCheck.pending, pinfo)) {
+            continue;
+        }
+        pid_t pid = pinfo->pid;
+        sendCheckAssertionsMsg(pinfo, ^(xpc_object_t reply) { processAssertionCheckResp(reply, pid); });
     }
 
-
-    dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, 5LL * NSEC_PER_SEC),
-            DISPATCH_TIME_FOREVER, 0);
-
 exit:
     if (procs) {
         free(procs);
@@ -587,13 +664,16 @@ void updateAppSleepStates(ProcessInfo *pinfo, int *disableAppSleep, int *enableA
 {
     if (!pinfo) return;
 
+    // State returned to the caller in the reply need not be notified again
     if ((disableAppSleep) && (pinfo->disableAS_pend == true)) {
         *disableAppSleep = 1;
         pinfo->disableAS_pend = false;
+        pinfo->appSleepDisabled = true;
     }
     if ((enableAppSleep) && (pinfo->enableAS_pend == true)) {
         *enableAppSleep = 1;
         pinfo->enableAS_pend = false;
+        pinfo->appSleepDisabled = false;
     }
 }
 
@@ -791,6 +871,42 @@ kern_return_t _io_pm_assertion_copy_details (
     {
         theCollection = copyRepeatPowerEvents();
     }
+    else if (kIOPMAssertionMIGCopyFiltered == whichData)
+    {
+        CFDictionaryRef  filter = NULL;
+
+        CFDataRef unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)props, propsCnt, kCFAllocatorNull);
+        if (unfolder) {
+            filter = (CFDictionaryRef)CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+            CFRelease(unfolder);
+        }
+        *return_val = copyFilteredAssertions(filter, (CFDictionaryRef *)&theCollection);
+
+        if (filter) {
+            CFRelease(filter);
+        }
+        if (kIOReturnSuccess != *return_val) {
+            *assertionsCnt = 0;
+            *assertions = 0;
+            goto exit;
+        }
+    }
+    else if (kIOPMConnectionMIGCopyAckHistory == whichData)
+    {
+        theCollection = copyClientAckHistory();
+    }
+    else if (kIOPMConnectionMIGCopyTransitionProfile == whichData)
+    {
+        theCollection = copyTransitionProfile();
+    }
+    else if (kIOPMConnectionMIGCopyWakeCandidates == whichData)
+    {
+        theCollection = copyWakeCandidates();
+    }
+    else if (kIOPMConnectionMIGCopyLingerPolicy == whichData)
+    {
+        theCollection = copyDarkWakeLingerPolicy();
+    }
     else if (kIOPMAssertionMIGCopyByType == whichData)
     {
         CFStringRef  assertionType = NULL;
@@ -2021,7 +2137,7 @@ static ProcessInfo* processInfoRetain(pid_t p)
     return NULL;
 
 }
-static ProcessInfo* processInfoGet(pid_t p)
+STATIC ProcessInfo* processInfoGet(pid_t p)
 {    
     ProcessInfo       *proc = NULL;
     proc = (ProcessInfo *)CFDictionaryGetValue(gProcessDict, (const void *)(uintptr_t)p);
@@ -2213,12 +2329,166 @@ void updateSystemQualifiers(assertion_t *assertion, assertionOps op)
     }
 }
 
+/*
+ * Proc timers
+ *
+ * Deadlines of all running proc timers are kept in a binary min-heap, with
+ * a single dispatch timer armed for the earliest one. Starting and stopping
+ * a proc timer is a heap insert/remove.
+ */
+#define kProcTimerHeapInitialCap    64
+
+static assertion_t                  **gProcTimerHeap = NULL;
+static uint32_t                     gProcTimerCnt = 0;
+static uint32_t                     gProcTimerCap = 0;
+static dispatch_source_t            gProcTimerSource = NULL;
+static uint64_t                     gProcTimerArmedAt = 0;  // Deadline the dispatch timer is set for. 0 if idle
+
+static void handleProcTimerExpiry(void);
+
+static inline void procTimerHeapSet(uint32_t idx, assertion_t *assertion)
+{
+    gProcTimerHeap[idx] = assertion;
+    assertion->procTimerIdx = idx;
+}
+
+static void procTimerHeapSiftUp(uint32_t idx)
+{
+    assertion_t *assertion = gProcTimerHeap[idx];
+
+    while (idx > 0) {
+        uint32_t parent = (idx - 1) / 2;
+        if (gProcTimerHeap[parent]->procTimerDeadline <= assertion->procTimerDeadline) {
+            break;
+        }
+        procTimerHeapSet(idx, gProcTimerHeap[parent]);
+        idx = parent;
+    }
+    procTimerHeapSet(idx, assertion);
+}
+
+static void procTimerHeapSiftDown(uint32_t idx)
+{
+    assertion_t *assertion = gProcTimerHeap[idx];
+
+    while (1) {
+        uint32_t child = 2 * idx + 1;
+        if (child >= gProcTimerCnt) {
+            break;
+        }
+        if ((child + 1 < gProcTimerCnt) &&
+            (gProcTimerHeap[child + 1]->procTimerDeadline < gProcTimerHeap[child]->procTimerDeadline)) {
+            child++;
+        }
+        if (assertion->procTimerDeadline <= gProcTimerHeap[child]->procTimerDeadline) {
+            break;
+        }
+        procTimerHeapSet(idx, gProcTimerHeap[child]);
+        idx = child;
+    }
+    procTimerHeapSet(idx, assertion);
+}
+
+static void procTimerRearm(void)
+{
+    uint64_t    deadline;
+    uint64_t    currTime;
+
+    if (!gProcTimerSource) {
+        gProcTimerSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+        if (!gProcTimerSource) {
+            ERROR_LOG("Failed to create proc timer source\n");
+            return;
+        }
+        dispatch_source_set_event_handler(gProcTimerSource, ^{ handleProcTimerExpiry(); });
+        dispatch_source_set_timer(gProcTimerSource, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        dispatch_resume(gProcTimerSource);
+    }
+
+    deadline = gProcTimerCnt ? gProcTimerHeap[0]->procTimerDeadline : 0;
+    if (deadline == gProcTimerArmedAt) {
+        return;
+    }
+
+    gProcTimerArmedAt = deadline;
+    if (deadline == 0) {
+        dispatch_source_set_timer(gProcTimerSource, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        return;
+    }
+
+    currTime = getMonotonicTime();
+    dispatch_source_set_timer(gProcTimerSource,
+                              dispatch_time(DISPATCH_TIME_NOW,
+                                            (deadline > currTime) ? (deadline - currTime) * NSEC_PER_SEC : 0),
+                              DISPATCH_TIME_FOREVER, 0);
+}
+
+static bool procTimerHeapInsert(assertion_t *assertion)
+{
+    if (gProcTimerCnt == gProcTimerCap) {
+        uint32_t newCap = gProcTimerCap ? (2 * gProcTimerCap) : kProcTimerHeapInitialCap;
+        assertion_t **newHeap = realloc(gProcTimerHeap, newCap * sizeof(assertion_t *));
+        if (!newHeap) {
+            ERROR_LOG("Failed to grow proc timer heap to %u entries\n", newCap);
+            return false;
+        }
+        gProcTimerHeap = newHeap;
+        gProcTimerCap = newCap;
+    }
+
+    procTimerHeapSet(gProcTimerCnt, assertion);
+    procTimerHeapSiftUp(gProcTimerCnt++);
+    return true;
+}
+
+static void procTimerHeapRemove(assertion_t *assertion)
+{
+    uint32_t    idx = assertion->procTimerIdx;
+    assertion_t *last;
+
+    if ((idx >= gProcTimerCnt) || (gProcTimerHeap[idx] != assertion)) {
+        return;
+    }
+
+    last = gProcTimerHeap[--gProcTimerCnt];
+    if (idx == gProcTimerCnt) {
+        return;
+    }
+
+    procTimerHeapSet(idx, last);
+    if ((idx > 0) && (gProcTimerHeap[(idx - 1) / 2]->procTimerDeadline > last->procTimerDeadline)) {
+        procTimerHeapSiftUp(idx);
+    }
+    else {
+        procTimerHeapSiftDown(idx);
+    }
+}
+
+static void handleProcTimerExpiry(void)
+{
+    uint64_t    currTime = getMonotonicTime();
+    assertion_t *assertion;
+
+    gProcTimerArmedAt = 0;
+    while (gProcTimerCnt && (gProcTimerHeap[0]->procTimerDeadline <= currTime)) {
+        assertion = gProcTimerHeap[0];
+        procTimerHeapRemove(assertion);
+        assertion->state &= ~kAssertionProcTimerActive;
+        assertion->state |= kAssertionProcTimerFired;
+
+        handleProcAssertionTimeout(assertion->pinfo->pid, assertion->assertionId);
+    }
+
+    procTimerRearm();
+}
+
 void stopProcTimer(assertion_t *assertion)
 {
 
-    if (assertion->procTimer && (assertion->state & kAssertionProcTimerActive)) {
-        dispatch_suspend(assertion->procTimer);
+    if (assertion->state & kAssertionProcTimerActive) {
+        procTimerHeapRemove(assertion);
         assertion->state &= ~kAssertionProcTimerActive;
+        procTimerRearm();
     }
 }
 
@@ -2227,7 +2497,6 @@ void startProcTimer(assertion_t *assertion)
 {
     assertionType_t     *assertType = NULL;
     ProcessInfo *pinfo = NULL;
-    dispatch_source_t disp;
 
     assertType = &gAssertionTypes[assertion->kassert];
     if (assertType->effectIdx == kNoEffect) {
@@ -2255,23 +2524,34 @@ void startProcTimer(assertion_t *assertion)
     }
 
     stopProcTimer(assertion);
-    if (assertion->procTimer == 0) {
-        // Saving the dispatch source to local variable 'disp', to make sure the value is
-        // copied into the cancel_handler block. That block gets executed after 'assertion'
-        // is released.
-        disp = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
-        dispatch_source_set_event_handler(disp, ^{ handleProcAssertionTimeout(pinfo->pid, assertion->assertionId);});
-        dispatch_source_set_cancel_handler(disp, ^{ dispatch_release(disp);});
-        assertion->procTimer = disp;
-        dispatch_source_set_timer(assertion->procTimer, dispatch_time(DISPATCH_TIME_NOW, pinfo->maxAssertLength * NSEC_PER_SEC),
-                              DISPATCH_TIME_FOREVER, 0);
+    if (assertion->state & kAssertionProcTimerFired) {
+        // Deadline is reported only once per assertion
+        return;
+    }
+    if (assertion->procTimerDeadline == 0) {
+        // Deadline is set when the timer is started for the first time. Stopping
+        // and restarting the timer keeps the original deadline.
+        assertion->procTimerDeadline = getMonotonicTime() + pinfo->maxAssertLength;
+    }
+    if (!procTimerHeapInsert(assertion)) {
+        return;
     }
-    dispatch_resume(assertion->procTimer);
     assertion->state |= kAssertionProcTimerActive;
+    procTimerRearm();
 
 }
 
 
+/*
+ * App Sleep notifications
+ *
+ * Processes whose App Sleep state may have changed are queued and flushed
+ * once per runloop turn. Only the net change since the process was last
+ * told is posted, so an assertion raised and released within the same turn
+ * produces no notification.
+ */
+static CFMutableArrayRef            gAppSleepQueue = NULL;
+
 static void disableAppSleep(ProcessInfo *pinfo)
 {
     char notify_str[128];
@@ -2280,6 +2560,7 @@ static void disableAppSleep(ProcessInfo *pinfo)
         return;
 
     pinfo->disableAS_pend = false;
+    pinfo->appSleepDisabled = true;
     snprintf(notify_str, sizeof(notify_str), "%s.%d", 
              kIOPMDisableAppSleepPrefix,pinfo->pid);
     notify_post(notify_str);
@@ -2294,11 +2575,51 @@ static void enableAppSleep(ProcessInfo *pinfo)
         return;
 
     pinfo->enableAS_pend = false;
+    pinfo->appSleepDisabled = false;
     snprintf(notify_str, sizeof(notify_str), "%s.%d", 
              kIOPMEnableAppSleepPrefix, pinfo->pid);
     notify_post(notify_str);
 }
 
+static void flushAppSleepQueue(void)
+{
+    ProcessInfo     *pinfo;
+    CFIndex         i, cnt;
+
+    cnt = CFArrayGetCount(gAppSleepQueue);
+    for (i = 0; i < cnt; i++) {
+        pinfo = (ProcessInfo *)CFArrayGetValueAtIndex(gAppSleepQueue, i);
+        pinfo->appSleepQueued = false;
+
+        disableAppSleep(pinfo);
+        enableAppSleep(pinfo);
+        processInfoRelease(pinfo->pid);
+    }
+    CFArrayRemoveAllValues(gAppSleepQueue);
+}
+
+static void queueAppSleepUpdate(ProcessInfo *pinfo)
+{
+    if (pinfo->appSleepQueued) {
+        return;
+    }
+
+    if (!gAppSleepQueue) {
+        gAppSleepQueue = CFArrayCreateMutable(0, 0, NULL);
+        if (!gAppSleepQueue) {
+            return;
+        }
+    }
+
+    processInfoRetain(pinfo->pid);
+    pinfo->appSleepQueued = true;
+    if (CFArrayGetCount(gAppSleepQueue) == 0) {
+        CFRunLoopPerformBlock(_getPMRunLoop(), kCFRunLoopDefaultMode, ^{ flushAppSleepQueue(); });
+        CFRunLoopWakeUp(_getPMRunLoop());
+    }
+    CFArrayAppendValue(gAppSleepQueue, pinfo);
+}
+
 
 void schedDisableAppSleep(assertion_t *assertion)
 {
@@ -2320,14 +2641,10 @@ void schedDisableAppSleep(assertion_t *assertion)
     agg = pinfo->aggTypes;
     pinfo->aggTypes |= ( 1 << assertion->kassert );
     if (agg == 0) {
-        processInfoRetain(pinfo->pid);
-        pinfo->disableAS_pend = true;
-        CFRunLoopPerformBlock(_getPMRunLoop(), kCFRunLoopDefaultMode, 
-                              ^{ 
-                              disableAppSleep(pinfo);
-                              processInfoRelease(pinfo->pid);
-                              });
-        CFRunLoopWakeUp(_getPMRunLoop());
+        // Cancels an enable that is yet to be sent
+        pinfo->enableAS_pend = false;
+        pinfo->disableAS_pend = !pinfo->appSleepDisabled;
+        queueAppSleepUpdate(pinfo);
     }
 }
 
@@ -2349,14 +2666,10 @@ void schedEnableAppSleep(assertion_t *assertion)
         pinfo->aggTypes &= ~( 1 << assertion->kassert );
 
         if (pinfo->aggTypes == 0) {
-            processInfoRetain(pinfo->pid);
-            pinfo->enableAS_pend = true;
-            CFRunLoopPerformBlock(_getPMRunLoop(), kCFRunLoopDefaultMode, 
-                                  ^{ 
-                                  enableAppSleep(pinfo); 
-                                  processInfoRelease(pinfo->pid);
-                                  });
-            CFRunLoopWakeUp(_getPMRunLoop());
+            // Cancels a disable that is yet to be sent
+            pinfo->disableAS_pend = false;
+            pinfo->enableAS_pend = pinfo->appSleepDisabled;
+            queueAppSleepUpdate(pinfo);
         }
     }
 }
@@ -3247,14 +3560,7 @@ static void releaseAssertionMemory(assertion_t *assertion, assertLogAction logAc
     if (assertion->causingPinfo) {
         processInfoRelease(assertion->causingPinfo->pid);
     }
-    if (assertion->procTimer) {
-        if ((assertion->state & kAssertionProcTimerActive) == 0) {
-            // If procTimer is suspended, resume it to allow its cancellation
-            assertion->state |= kAssertionProcTimerActive;
-            dispatch_resume(assertion->procTimer);
-        }
-        dispatch_source_cancel(assertion->procTimer);
-    }
+    stopProcTimer(assertion);
     memset(assertion, 0, sizeof(assertion_t));
     free(assertion);
 }
@@ -3324,7 +3630,11 @@ void handleAssertionTimeout(assertionType_t *assertType)
 
     }
 
-    if ( !timedoutCnt ) return;
+    if ( !timedoutCnt ) {
+        // Head of the list was renewed after the timer got armed
+        resetAssertionTimer(assertType);
+        return;
+    }
 
     resetAssertionTimer(assertType);
 
@@ -3404,7 +3714,6 @@ void updateAssertionTimer(assertionType_t *assertType)
 /* Inserts assertion into activeTimed list, sorted by timeout */
 static void insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
 {
-    assertion_t *a, *prev = NULL;
     CFNumberRef         timeLeftCF = NULL;
     uint64_t            currTime, timeLeft;
     CFDateRef           updateDate = NULL;
@@ -3427,6 +3736,14 @@ static void insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
         }
     }
 
+    insertIntoTimedList(assertion, assertType);
+}
+
+/* Links assertion into activeTimed list at the position given by its timeout */
+static void insertIntoTimedList(assertion_t *assertion, assertionType_t *assertType)
+{
+    assertion_t *a, *prev = NULL;
+
     if (LIST_EMPTY(&assertType->activeTimed) ) {
         LIST_INSERT_HEAD(&assertType->activeTimed, assertion, link);
     }
@@ -3442,7 +3759,6 @@ static void insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
         else
             LIST_INSERT_AFTER(prev, assertion, link);
     }
-
 }
 
 void insertTimedAssertion(assertion_t *assertion, assertionType_t *assertType, bool updateTimer)
@@ -3532,6 +3848,77 @@ STATIC IOReturn doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt)
 }
 
 
+/*
+ * Renewal of a lease assertion only moves the assertion to its new position
+ * in the activeTimed list. The type's timer is left armed for the old
+ * deadline; handleAssertionTimeout() re-arms it if nothing has expired by then.
+ * Aggregates, logging and notifications are untouched as the assertion stays
+ * active throughout.
+ */
+STATIC IOReturn doRenewLease(pid_t pid, IOPMAssertionID id)
+{
+    IOReturn            ret;
+    assertion_t         *assertion = NULL;
+    assertionType_t     *assertType;
+    uint64_t            newTimeout;
+
+    ret = lookupAssertion(pid, id, &assertion);
+    if ((kIOReturnSuccess != ret)) {
+        return ret;
+    }
+
+    if (!(assertion->state & kAssertionStateLeased)) {
+        return kIOReturnBadArgument;
+    }
+    if (!(assertion->state & kAssertionStateTimed)) {
+        // Lease has expired or the assertion was turned off. Client has to re-create it.
+        return kIOReturnNotReady;
+    }
+
+    newTimeout = getMonotonicTime() + assertion->leaseDuration;
+    if (newTimeout <= assertion->timeout) {
+        return kIOReturnSuccess;
+    }
+
+    assertType = &gAssertionTypes[assertion->kassert];
+
+    LIST_REMOVE(assertion, link);
+    assertion->timeout = newTimeout;
+    insertIntoTimedList(assertion, assertType);
+
+    return kIOReturnSuccess;
+}
+
+/*
+ * Time left on a lease assertion changes with every renewal. The property is
+ * refreshed only when the assertion is reported.
+ */
+static void updateLeaseTimeLeft(assertion_t *assertion)
+{
+    CFNumberRef     timeLeftCF = NULL;
+    uint64_t        currTime, timeLeft;
+    CFDateRef       updateDate = NULL;
+
+    if ((assertion->state & (kAssertionStateLeased|kAssertionStateTimed)) !=
+        (kAssertionStateLeased|kAssertionStateTimed)) {
+        return;
+    }
+
+    currTime = getMonotonicTime();
+    timeLeft = (assertion->timeout > currTime) ? (assertion->timeout - currTime) : 0;
+    timeLeftCF = CFNumberCreate(0, kCFNumberLongType, &timeLeft);
+    if (timeLeftCF) {
+        CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutTimeLeftKey, timeLeftCF);
+        CFRelease(timeLeftCF);
+    }
+
+    updateDate = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
+    if (updateDate) {
+        CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutUpdateTimeKey, updateDate);
+        CFRelease(updateDate);
+    }
+}
+
 __private_extern__ void applyToAllAssertionsSync(assertionType_t *assertType, 
                                                  bool applyToInactives,  void (^performOnAssertion)(assertion_t *))
 {
@@ -4573,10 +4960,32 @@ static IOReturn raiseAssertion(assertion_t *assertion)
     if (isA_CFNumber(numRef)) 
         CFNumberGetValue(numRef, kCFNumberDoubleType, &timeout);
 
+    /* Is this a lease. Lease duration overrides any timeout set by the client */
+    numRef = CFDictionaryGetValue(assertion->props, kIOPMAssertionLeaseDurationKey);
+    if (isA_CFNumber(numRef)) {
+        CFTimeInterval  lease = 0;
+
+        CFNumberGetValue(numRef, kCFNumberDoubleType, &lease);
+        if (lease >= 1) {
+            timeout = lease;
+            assertion->leaseDuration = (uint32_t)lease;
+            assertion->state |= kAssertionStateLeased;
+
+            /* Unless asked otherwise, an expired lease releases the assertion */
+            if (!CFDictionaryContainsKey(assertion->props, kIOPMAssertionTimeoutActionKey)) {
+                CFDictionarySetValue(assertion->props, kIOPMAssertionTimeoutActionKey,
+                                     kIOPMAssertionTimeoutActionRelease);
+            }
+        }
+    }
+
     if (assertType->flags & kAssertionTypeAutoTimed) {
         /* Restrict timeout to a max value of 'autoTimeout' */
         if (!timeout || (timeout > assertType->autoTimeout))
             timeout = assertType->autoTimeout;
+        if (assertion->leaseDuration > timeout) {
+            assertion->leaseDuration = (uint32_t)timeout;
+        }
     }
     if (timeout) {
         assertion->timeout = (uint64_t)timeout+assertion->createTime; // Absolute time at which assertion expires
@@ -4598,6 +5007,29 @@ exit:
 
 }
 
+/*
+ * True if 'assertion' is in effect and keeps the system out of sleep, the
+ * way work that arrives during a dark wake linger does. Display and user
+ * activity assertions, or ones not honored on this power source, don't.
+ */
+static bool assertionPreventsSystemSleep(assertion_t *assertion)
+{
+    if (assertion->state & kAssertionStateInactive)
+        return false;
+
+    switch (assertion->kassert) {
+    case kPreventSleepType:
+    case kSRPreventSleepType:
+    case kBackgroundTaskType:
+    case kPushServiceTaskType:
+    case kInteractivePushServiceType:
+    case kNetworkAccessType:
+        return (getAssertionLevel(assertion->kassert) != 0);
+    default:
+        return false;
+    }
+}
+
 
 STATIC IOReturn doCreate(
                   pid_t                   pid,
@@ -4666,6 +5098,10 @@ STATIC IOReturn doCreate(
         logAssertionEvent(kACreateLog, assertion);
     if (gAnyChange) notify_post( kIOPMAssertionsAnyChangedNotifyString );
 
+    // powerd's own assertions, the lingers included, aren't new work
+    if ((pid != getpid()) && assertionPreventsSystemSleep(assertion))
+        darkWakeLingerNoteActivity();
+
     *assertion_id = assertion->assertionId;
     if (enTrIntensity)
         *enTrIntensity = assertType->enTrQuality;
@@ -4708,6 +5144,7 @@ static void copyAssertion(assertion_t *assertion, CFMutableDictionaryRef asserti
     if (assertion->kassert < kIOPMNumAssertionTypes) {
         CFDictionarySetValue(assertion->props, kIOPMAssertionTrueTypeKey, assertion_types_arr[assertion->kassert]);
     }
+    updateLeaseTimeLeft(assertion);
 
     CFArrayAppendValue(pidAssertionsArr, assertion->props);
     CFRelease(pidCF);
@@ -4739,6 +5176,7 @@ static CFArrayRef copyAssertionsByType(CFStringRef assertionType)
                                                          kIOPMAssertionTrueTypeKey,
                                                          assertion_types_arr[assertion->kassert]);
                                 }
+                                updateLeaseTimeLeft(assertion);
                                 CFArrayAppendValue(returnArray, assertion->props);
                              });
 
@@ -4801,6 +5239,337 @@ exit:
     return returnArray;
 }
 
+/*
+ * Filtered assertion query
+ *
+ * The filter is parsed once into native fields and each assertion is matched
+ * against its assertion_t record. Only the requested fields of the matching
+ * assertions are copied out, as rows of a table.
+ */
+typedef enum {
+    kQueryFieldPID = 0,
+    kQueryFieldID,
+    kQueryFieldType,
+    kQueryFieldName,
+    kQueryFieldProcessName,
+    kQueryFieldAge,
+    kQueryFieldTimeLeft,
+    kQueryFieldActive,
+    kQueryFieldRetainCount,
+    kQueryFieldCheckLatency,
+    kQueryFieldCheckLatencyMax,
+    kQueryFieldCheckTimeouts,
+
+    kQueryFieldCount
+} queryField;
+
+typedef struct {
+    pid_t           *pids;              // Sorted; NULL matches any pid
+    CFIndex         pidCnt;
+    uint32_t        typeMask;           // Bit per kerAssertionType
+    uint64_t        minAge;             // In secs
+    CFStringRef     namePrefix;
+    int             state;              // kIOPMAssertionQueryState*
+    queryField      fields[kQueryFieldCount];
+    int             fieldCnt;
+} assertionQuery_t;
+
+static CFStringRef queryFieldName(queryField field)
+{
+    switch (field) {
+        case kQueryFieldPID:            return kIOPMAssertionQueryFieldPID;
+        case kQueryFieldID:             return kIOPMAssertionQueryFieldID;
+        case kQueryFieldType:           return kIOPMAssertionQueryFieldType;
+        case kQueryFieldName:           return kIOPMAssertionQueryFieldName;
+        case kQueryFieldProcessName:    return kIOPMAssertionQueryFieldProcessName;
+        case kQueryFieldAge:            return kIOPMAssertionQueryFieldAge;
+        case kQueryFieldTimeLeft:       return kIOPMAssertionQueryFieldTimeLeft;
+        case kQueryFieldActive:         return kIOPMAssertionQueryFieldActive;
+        case kQueryFieldRetainCount:    return kIOPMAssertionQueryFieldRetainCount;
+        case kQueryFieldCheckLatency:   return kIOPMAssertionQueryFieldCheckLatency;
+        case kQueryFieldCheckLatencyMax: return kIOPMAssertionQueryFieldCheckLatencyMax;
+        case kQueryFieldCheckTimeouts:  return kIOPMAssertionQueryFieldCheckTimeouts;
+        default:                        return NULL;
+    }
+}
+
+static int comparePids(const void *a, const void *b)
+{
+    pid_t p1 = *(const pid_t *)a;
+    pid_t p2 = *(const pid_t *)b;
+
+    return (p1 > p2) - (p1 < p2);
+}
+
+static bool parseAssertionQuery(CFDictionaryRef filter, assertionQuery_t *query)
+{
+    CFArrayRef      arr;
+    CFNumberRef     num;
+    CFStringRef     str;
+    CFIndex         i, cnt;
+    int             idx;
+    bool            seen[kQueryFieldCount] = {false};
+
+    bzero(query, sizeof(*query));
+    query->typeMask = (1 << kIOPMNumAssertionTypes) - 1;
+    query->state = kIOPMAssertionQueryStateActive;
+
+    if (!filter) {
+        goto defaultFields;
+    }
+
+    arr = CFDictionaryGetValue(filter, kIOPMAssertionQueryPIDsKey);
+    if (isA_CFArray(arr) && (cnt = CFArrayGetCount(arr)) > 0) {
+        query->pids = calloc(cnt, sizeof(pid_t));
+        if (!query->pids) {
+            return false;
+        }
+        for (i = 0; i < cnt; i++) {
+            num = CFArrayGetValueAtIndex(arr, i);
+            if (!isA_CFNumber(num)) {
+                return false;
+            }
+            CFNumberGetValue(num, kCFNumberIntType, &query->pids[query->pidCnt]);
+            if (query->pids[query->pidCnt++] < 0) {
+                return false;
+            }
+        }
+        qsort(query->pids, query->pidCnt, sizeof(pid_t), comparePids);
+    }
+
+    arr = CFDictionaryGetValue(filter, kIOPMAssertionQueryTypesKey);
+    if (isA_CFArray(arr)) {
+        query->typeMask = 0;
+        cnt = CFArrayGetCount(arr);
+        for (i = 0; i < cnt; i++) {
+            if ((idx = getAssertionTypeIndex(CFArrayGetValueAtIndex(arr, i))) < 0) {
+                return false;
+            }
+            query->typeMask |= (1 << idx);
+        }
+    }
+
+    num = CFDictionaryGetValue(filter, kIOPMAssertionQueryMinAgeKey);
+    if (isA_CFNumber(num)) {
+        CFNumberGetValue(num, kCFNumberSInt64Type, &query->minAge);
+    }
+
+    str = CFDictionaryGetValue(filter, kIOPMAssertionQueryNamePrefixKey);
+    if (isA_CFString(str) && CFStringGetLength(str)) {
+        query->namePrefix = str;
+    }
+
+    num = CFDictionaryGetValue(filter, kIOPMAssertionQueryStateKey);
+    if (isA_CFNumber(num)) {
+        CFNumberGetValue(num, kCFNumberIntType, &query->state);
+    }
+
+    arr = CFDictionaryGetValue(filter, kIOPMAssertionQueryFieldsKey);
+    if (isA_CFArray(arr)) {
+        cnt = CFArrayGetCount(arr);
+        for (i = 0; i < cnt; i++) {
+            str = CFArrayGetValueAtIndex(arr, i);
+            if (!isA_CFString(str)) continue;
+
+            for (idx = 0; idx < kQueryFieldCount; idx++) {
+                if (!seen[idx] && CFEqual(str, queryFieldName(idx))) {
+                    seen[idx] = true;
+                    query->fields[query->fieldCnt++] = idx;
+                    break;
+                }
+            }
+        }
+    }
+
+defaultFields:
+    if (query->fieldCnt == 0) {
+        query->fields[query->fieldCnt++] = kQueryFieldPID;
+        query->fields[query->fieldCnt++] = kQueryFieldID;
+        query->fields[query->fieldCnt++] = kQueryFieldType;
+        query->fields[query->fieldCnt++] = kQueryFieldName;
+        query->fields[query->fieldCnt++] = kQueryFieldAge;
+    }
+    return true;
+}
+
+static bool assertionMatchesQuery(assertion_t *assertion, assertionQuery_t *query, uint64_t currTime)
+{
+    CFStringRef     name;
+
+    if (query->pids && !bsearch(&assertion->pinfo->pid, query->pids,
+                                query->pidCnt, sizeof(pid_t), comparePids)) {
+        return false;
+    }
+
+    if (query->minAge && ((currTime - assertion->createTime) < query->minAge)) {
+        return false;
+    }
+
+    if (query->namePrefix) {
+        name = CFDictionaryGetValue(assertion->props, kIOPMAssertionNameKey);
+        if (!isA_CFString(name) || !CFStringHasPrefix(name, query->namePrefix)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static CFTypeRef copyAssertionQueryField(assertion_t *assertion, queryField field, uint64_t currTime)
+{
+    CFTypeRef   val = NULL;
+    int64_t     num;
+
+    switch (field) {
+        case kQueryFieldPID:
+            num = assertion->pinfo->pid;
+            break;
+        case kQueryFieldID:
+            num = assertion->assertionId;
+            break;
+        case kQueryFieldRetainCount:
+            num = assertion->retainCnt;
+            break;
+        case kQueryFieldCheckLatency:
+            num = assertion->pinfo->checkLatencyMs;
+            break;
+        case kQueryFieldCheckLatencyMax:
+            num = assertion->pinfo->checkLatencyMaxMs;
+            break;
+        case kQueryFieldCheckTimeouts:
+            num = assertion->pinfo->checkTimeoutCnt;
+            break;
+        case kQueryFieldAge:
+            num = currTime - assertion->createTime;
+            break;
+        case kQueryFieldTimeLeft:
+            num = ((assertion->state & kAssertionStateTimed) && (assertion->timeout > currTime)) ?
+                    (assertion->timeout - currTime) : 0;
+            break;
+        case kQueryFieldActive:
+            return CFRetain((assertion->state & kAssertionStateInactive) ? kCFBooleanFalse : kCFBooleanTrue);
+        case kQueryFieldType:
+            return CFRetain(assertion_types_arr[assertion->kassert]);
+        case kQueryFieldName:
+            val = CFDictionaryGetValue(assertion->props, kIOPMAssertionNameKey);
+            return isA_CFString(val) ? CFRetain(val) : CFRetain(CFSTR(""));
+        case kQueryFieldProcessName:
+            val = assertion->pinfo->name;
+            return val ? CFRetain(val) : CFRetain(CFSTR(""));
+        default:
+            return NULL;
+    }
+
+    return CFNumberCreate(0, kCFNumberSInt64Type, &num);
+}
+
+static void appendAssertionQueryRow(assertion_t *assertion, assertionQuery_t *query,
+                                    uint64_t currTime, CFMutableArrayRef rows)
+{
+    CFTypeRef           values[kQueryFieldCount];
+    CFArrayRef          row;
+    int                 i;
+
+    for (i = 0; i < query->fieldCnt; i++) {
+        values[i] = copyAssertionQueryField(assertion, query->fields[i], currTime);
+        if (!values[i]) {
+            values[i] = CFRetain(kCFNull);
+        }
+    }
+
+    row = CFArrayCreate(0, (const void **)values, query->fieldCnt, &kCFTypeArrayCallBacks);
+    if (row) {
+        CFArrayAppendValue(rows, row);
+        CFRelease(row);
+    }
+
+    for (i = 0; i < query->fieldCnt; i++) {
+        CFRelease(values[i]);
+    }
+}
+
+STATIC IOReturn copyFilteredAssertions(CFDictionaryRef filter, CFDictionaryRef *outResult)
+{
+    assertionQuery_t        query;
+    CFMutableArrayRef       rows = NULL;
+    CFMutableArrayRef       fieldNames = NULL;
+    CFMutableDictionaryRef  result = NULL;
+    assertionType_t         *assertType;
+    assertion_t             *assertion;
+    uint64_t                currTime = getMonotonicTime();
+    IOReturn                ret = kIOReturnSuccess;
+    int                     i;
+
+    *outResult = NULL;
+    if (filter && !isA_CFDictionary(filter)) {
+        return kIOReturnBadArgument;
+    }
+    if (!parseAssertionQuery(filter, &query)) {
+        // Unknown assertion type or bad pid. Don't fall back to matching everything
+        ret = kIOReturnBadArgument;
+        goto exit;
+    }
+
+    rows = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    fieldNames = CFArrayCreateMutable(0, query.fieldCnt, &kCFTypeArrayCallBacks);
+    result = CFDictionaryCreateMutable(0, 2, &kCFTypeDictionaryKeyCallBacks,
+                                       &kCFTypeDictionaryValueCallBacks);
+    if (!rows || !fieldNames || !result) {
+        if (result) {
+            CFRelease(result);
+            result = NULL;
+        }
+        ret = kIOReturnNoMemory;
+        goto exit;
+    }
+
+    for (i = 0; i < query.fieldCnt; i++) {
+        CFArrayAppendValue(fieldNames, queryFieldName(query.fields[i]));
+    }
+
+    for (i = 0; i < kIOPMNumAssertionTypes; i++)
+    {
+        if ((i == kEnableIdleType) || !(query.typeMask & (1 << i))) continue;
+        assertType = &gAssertionTypes[i];
+
+        if (query.state != kIOPMAssertionQueryStateInactive) {
+            LIST_FOREACH(assertion, &assertType->active, link) {
+                if (assertionMatchesQuery(assertion, &query, currTime)) {
+                    appendAssertionQueryRow(assertion, &query, currTime, rows);
+                }
+            }
+            LIST_FOREACH(assertion, &assertType->activeTimed, link) {
+                if (assertionMatchesQuery(assertion, &query, currTime)) {
+                    appendAssertionQueryRow(assertion, &query, currTime, rows);
+                }
+            }
+        }
+        if (query.state != kIOPMAssertionQueryStateActive) {
+            LIST_FOREACH(assertion, &assertType->inactive, link) {
+                if (assertionMatchesQuery(assertion, &query, currTime)) {
+                    appendAssertionQueryRow(assertion, &query, currTime, rows);
+                }
+            }
+        }
+    }
+
+    CFDictionarySetValue(result, kIOPMAssertionQueryFieldsKey, fieldNames);
+    CFDictionarySetValue(result, kIOPMAssertionQueryRowsKey, rows);
+
+exit:
+    if (query.pids) {
+        free(query.pids);
+    }
+    if (rows) {
+        CFRelease(rows);
+    }
+    if (fieldNames) {
+        CFRelease(fieldNames);
+    }
+
+    *outResult = result;
+    return ret;
+}
+
 STATIC IOReturn copyAssertionForID(
                                    pid_t inPID, int inID,
                                    CFMutableDictionaryRef  *outAssertion)
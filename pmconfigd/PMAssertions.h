@@ -95,6 +95,20 @@ do {    \
 
 #define  kDisplayTickleDelay  30        // Mininum delay(in secs) between sending tickles
 
+/*
+ * Lease assertions
+ * An assertion created with kIOPMAssertionLeaseDurationKey times out unless
+ * the client renews it within the lease duration. Renewals are sent as
+ * kAssertionLeaseRenewMsg over the async assertion xpc connection.
+ */
+#ifndef kIOPMAssertionLeaseDurationKey
+#define kIOPMAssertionLeaseDurationKey      CFSTR("LeaseDuration")
+#endif
+
+#ifndef kAssertionLeaseRenewMsg
+#define kAssertionLeaseRenewMsg             "assertionLeaseRenew"
+#endif
+
 /*
  * Lower 16 bits are used for assertionID created by powerd.
  * Upper 16 bits are used for assertionID created by the client process creating
@@ -222,6 +236,10 @@ typedef struct {
     uint32_t            maxAssertLength;    // Max assertion duration expected by this process
     uint32_t            aggAssertLength;    // Total duration assertions held since last reset
 
+    uint32_t            checkLatencyMs;     // Response latency for the last assertion check before sleep
+    uint32_t            checkLatencyMaxMs;  // Highest assertion check response latency seen
+    uint32_t            checkTimeoutCnt;    // Assertion checks not responded to before the deadline
+
     uint32_t            anychange:1;    // Interested in any assertion changes notification
     uint32_t            aggchange:1;    // Interested in assertion aggregates change notifications
     uint32_t            timeoutchange:1;    // Interested in assertion timeout notification
@@ -229,6 +247,8 @@ typedef struct {
     uint32_t            enableAS_pend:1;    // Enable AppSleep notification need to be sent
     uint32_t            proc_exited:1;      // True if PROC_EXIT notification is received
     uint32_t            aggactivity:1;      // Contributed to gActivityAggCnt. Subscribed to AssertionActivityAggregate
+    uint32_t            appSleepDisabled:1; // Process was last told that App Sleep is disabled
+    uint32_t            appSleepQueued:1;   // Queued for the App Sleep notification batch
 } ProcessInfo;
 
 typedef struct assertion {
@@ -245,6 +265,8 @@ typedef struct assertion {
 
     uint32_t        retainCnt;          // Number of retain calls
 
+    uint32_t        leaseDuration;      // Lease length in secs, for kAssertionStateLeased assertions
+
     int             enTrIntensity;      // Intensity parameter for energy tracing of the assertion
 
     ProcessInfo     *pinfo;             // Pointer to ProcessInfo structure
@@ -253,8 +275,9 @@ typedef struct assertion {
     ProcessInfo     *causingPinfo;      // Corresponding ProcessInfo struct 
 
     
-    XCT_UNSAFE_UNRETAINED dispatch_source_t   procTimer;      // Timer set based on the value provided for this process.
-    // Ths timer triggers log collection
+    uint64_t        procTimerDeadline;  // Time at which assertion exceeds the value provided for this process.
+                                        // Crossing it triggers log collection
+    uint32_t        procTimerIdx;       // Index into proc timer heap, valid with kAssertionProcTimerActive
     // System Qualifiers
     uint32_t        audioin:1;
     uint32_t        audioout:1;
@@ -276,6 +299,8 @@ typedef struct assertion {
 #define kAssertionStateAddsToProcStats      0x080
 #define kAssertionProcTimerActive           0x100
 #define kAssertionExitSilentRunningMode     0x200
+#define kAssertionStateLeased               0x400  // Assertion expires unless renewed within leaseDuration
+#define kAssertionProcTimerFired            0x800  // Proc timer deadline has already been handled
 
 /* Mods bits for assertion_t structure */
 #define kAssertionModTimer              0x1
@@ -471,6 +496,7 @@ __private_extern__ IOReturn  copyAssertionActivityAggregate(CFDictionaryRef *dat
 void asyncAssertionCreate(xpc_object_t remoteConnection, xpc_object_t msg);
 void asyncAssertionRelease(xpc_object_t remoteConnection, xpc_object_t msg);
 void asyncAssertionProperties(xpc_object_t remoteConnection, xpc_object_t msg);
+void asyncAssertionRenewLease(xpc_object_t remoteConnection, xpc_object_t msg);
 void releaseConnectionAssertions(xpc_object_t remoteConnection);
 void checkForAsyncAssertions(void *acknowledgementToken);
 
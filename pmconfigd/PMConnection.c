@@ -39,6 +39,7 @@
 #include <IOKit/pwr_mgt/IOPM.h>
 #include <libproc.h>
 #include <sys/syscall.h>
+#include <sys/param.h>
 #include <Kernel/kern/debug.h>
 #include <mach/mach_time.h>
 #include <libspindump_priv.h>
@@ -154,6 +155,34 @@ extern CFMachPortRef            pmServerMachPort;
 
 /* Bookkeeping structs */
 
+typedef struct PMResponse PMResponse;
+
+typedef enum {
+    kResponseOutcomePrompt = 0,
+    kResponseOutcomeSlow,
+    kResponseOutcomeTimedOut
+} responseOutcome_t;
+
+typedef enum {
+    kResponseTransitionNone = 0,
+    kResponseTransitionSleep,
+    kResponseTransitionDarkWake,
+    kResponseTransitionWake
+} responseTransition_t;
+
+/* responseStat_t
+ * One slow, timed out or (with kIOPMDebugLogCallbacks) prompt response.
+ * Converted to the kIOPMStats* dictionary form only when the wrangler completes.
+ */
+typedef struct {
+    uint32_t                connectionID;
+    pid_t                   pid;
+    int                     notificationType;
+    uint32_t                latencyMs;
+    uint8_t                 outcome;            // responseOutcome_t
+    uint8_t                 transition;         // responseTransition_t
+} responseStat_t;
+
 /* PMResponseWrangler
  * While we have an outstanding notification, we have one of these guys sitting around
  *  waiting to handle the incoming responses.
@@ -161,21 +190,140 @@ extern CFMachPortRef            pmServerMachPort;
  *  than one system state transition shall occur simultaneously.
  */
 typedef struct {
-    CFMutableArrayRef       awaitingResponses;
-    CFMutableArrayRef       responseStats;
-    CFRunLoopTimerRef       awaitingResponsesTimeout;
+    PMResponse              **responses;        // Indexed by (token & kResponseTokenIndexMask) - 1
+    int                     responsesCount;
+    int                     responsesCap;       // Also the capacity of responseStats
+    responseStat_t          *responseStats;
+    int                     responseStatsCount;
+    CFRunLoopTimerRef       awaitingResponsesTimeout;   // Kept across transitions; see armResponsesTimeout()
+    bool                    awaitingResponsesTimeoutArmed;
     CFAbsoluteTime          allRepliedTime;
     long                    kernelAcknowledgementID;
     int                     notificationType;
-    int                     awaitingResponsesCount;
+    int                     awaitingResponsesCount;     // Responses not yet replied
     int                     awaitResponsesTimeoutSeconds;
     int                     completedStatus;    // status after timed out or, all acked
     bool                    completed;
-    bool                    nextIsValid;
-    long                    nextKernelAcknowledgementID;
-    int                     nextInterestBits;
+    uint32_t                generation;         // Tells a wrangler from the next one to reuse its tokens
 } PMResponseWrangler;
 
+#define kAckLatencyBucketCnt        16      // log2(ms) buckets; the last one is open-ended
+#define kAckHistoryMaxClients       512
+#define kAckHistoryMinSamples       5       // Below this, a client gets the default budget
+#define kAckHistoryDecayAt          256     // Halve the histogram once it holds this many samples
+#define kAckTimeoutMinSecs          2
+#define kAckOffenderBudgetSecs      5
+
+/* clientAckHistory_t
+ * Acknowledgement latency estimator for one client name.
+ */
+typedef struct {
+    uint32_t                samples;
+    uint32_t                timeouts;
+    uint32_t                consecutiveTimeouts;
+    uint32_t                ewmaMs;
+    uint32_t                devMs;              // EWMA of |sample - ewmaMs|
+    uint32_t                histTotal;
+    uint32_t                hist[kAckLatencyBucketCnt];
+    uint32_t                sendFailures;       // Notifications that could not be delivered
+    uint32_t                slow;               // Acked, but over kAppResponseLogThresholdMS
+    uint32_t                maxMs;              // Slowest ack that didn't time out
+} clientAckHistory_t;
+
+/* pendingTransition_t
+ * A capability transition that arrived while a PMResponseWrangler was active.
+ */
+typedef struct {
+    int                     interestBits;
+    long                    kernelAcknowledgementID;
+    uint64_t                queuedAt;           // mach_absolute_time()
+} pendingTransition_t;
+
+#define kTransitionQueueMax     8
+
+/* transitionQueue_t
+ * Bounded FIFO of transitions waiting behind the active wrangler, plus stats.
+ *
+ * Coalescing rules:
+ *  - A transition carrying a kernel acknowledgement ID is never merged or
+ *    dropped. The kernel is blocked on it and clients must see it.
+ *  - A transition without an acknowledgement ID only reports a capability
+ *    change. If the tail of the queue is also such a transition, the newer
+ *    capability bits replace the tail's, since clients only need the latest state.
+ *  - On overflow, the oldest transition without an acknowledgement ID is
+ *    dropped, as every later entry supersedes its state. If all queued entries
+ *    need acknowledgement, the new transition is acknowledged to the kernel
+ *    without notifying clients.
+ */
+typedef struct {
+    pendingTransition_t     entries[kTransitionQueueMax];
+    int                     head;
+    int                     count;
+
+    int                     maxDepth;
+    uint32_t                queuedCnt;
+    uint32_t                coalescedCnt;
+    uint32_t                droppedCnt;
+    uint64_t                waitTotalMs;
+    uint64_t                waitMaxMs;
+} transitionQueue_t;
+
+/* Low bits of a message token carry the response's index in its wrangler */
+#define kResponseTokenIndexMask     0xFFFF
+/* Tokens carry index+1, so a wrangler tracks at most this many responses */
+#define kResponsesMax               kResponseTokenIndexMask
+
+/* Phases of one capability transition, in the order they normally complete */
+typedef enum {
+    kTransitionPhaseNotify = 0,         // clients notified
+    kTransitionPhaseClientAcks,         // last client acked or timed out
+    kTransitionPhaseWakeEvents,         // wake requests resolved and scheduled
+    kTransitionPhaseKernelAck,          // IOAllowPowerChange
+    kTransitionPhaseCount
+} transitionPhase_t;
+
+#define kTransitionProfileDepth     16
+#define kTransitionProfileMaxAcks   32
+
+typedef struct {
+    uint64_t                at;                 // mach_absolute_time()
+    pid_t                   pid;
+    bool                    timedout;
+    char                    name[32];
+} transitionAck_t;
+
+/* transitionTimeline_t
+ * Monotonic timestamps for one kIOMessageSystemCapabilityChange, from the
+ * callback to the kernel acknowledgement. Phases not reached stay 0.
+ */
+typedef struct {
+    uint32_t                seq;
+    uint32_t                fromCapabilities;
+    uint32_t                toCapabilities;
+    long                    kernelAcknowledgementID;
+    bool                    open;               // Not yet acknowledged to the kernel
+    uint64_t                start;
+    uint64_t                phase[kTransitionPhaseCount];
+    uint32_t                ackCnt;             // May exceed kTransitionProfileMaxAcks
+    transitionAck_t         acks[kTransitionProfileMaxAcks];
+} transitionTimeline_t;
+
+/* transitionProfile_t
+ * Ring of the last kTransitionProfileDepth timelines. A change queued behind
+ * another one keeps its own timeline open until it is acknowledged, so more
+ * than one may be open; they are told apart by kernelAcknowledgementID. Each
+ * phase's duration, measured from the phase reached before it, is added to
+ * that phase's log2(ms) histogram when a timeline closes.
+ */
+typedef struct {
+    transitionTimeline_t    ring[kTransitionProfileDepth];
+    uint32_t                total;              // Next timeline goes in ring[total % depth]
+    transitionTimeline_t    *current;           // Change being handled by the callback; may be closed
+    uint32_t                hist[kTransitionPhaseCount][kIOPMTransitionHistBucketCnt];
+} transitionProfile_t;
+
+
+#define kInterestBucketCount        (8 * sizeof(IOPMCapabilityBits))
 
 /* PMConnection - one tracker corresponds to one PMConnection
  * in an application.
@@ -186,20 +334,36 @@ typedef struct {
 typedef struct {
     mach_port_t             notifyPort;
     PMResponseWrangler      *responseHandler;
+    PMResponse              *response;          // Outstanding response in responseHandler
     CFStringRef             callerName;
     uint32_t                uniqueID;
+    CFIndex                 connectionsIdx;     // Position in gConnections
     pid_t                   callerPID;
     IOPMCapabilityBits      interestsBits;
     bool                    notifyEnable;
     int                     timeoutCnt;
     dispatch_source_t       procExit;
+    uint32_t                fanoutGen;          // Last fan-out that collected this connection
+    uint32_t                sendDeferredCnt;    // Messages waiting in gDeferredSends
+    uint32_t                sendBlockedPass;    // Last retry pass that found the queue full
+    uint32_t                sendFailCnt;
+    uint32_t                interestIdx[kInterestBucketCount];  // Position in each gInterestBuckets[bit]
 } PMConnection;
 
+/* connectionBucket_t
+ * Unordered list of connections interested in one capability bit.
+ */
+typedef struct {
+    PMConnection            **conns;
+    uint32_t                count;
+    uint32_t                capacity;
+} connectionBucket_t;
+
 
 /* PMResponse 
  * represents one outstanding notification acknowledgement
  */
-typedef struct {
+struct PMResponse {
     PMConnection            *connection;
     PMResponseWrangler      *myResponseWrangler;
     IOPMConnectionMessageToken  token;
@@ -208,6 +372,7 @@ typedef struct {
     CFAbsoluteTime          maintenanceRequested;
     CFAbsoluteTime          timerPluginRequested;
     CFAbsoluteTime          sleepServiceRequested;
+    CFTimeInterval          wakeLeeway;         // Any requested wake may be deferred this long
     CFStringRef             clientInfoString;
     CFStringRef             clientInfoStringBGTask;
     CFStringRef             clientInfoStringAppRefresh;
@@ -215,7 +380,95 @@ typedef struct {
     int                     notificationType;
     bool                    replied;
     bool                    timedout;
-} PMResponse;
+    PMResponse              *nextFree;          // Link in gResponsePool.freeResponses
+};
+
+/* responsePool_t
+ * Recycles wranglers and responses across transitions. Only one wrangler is
+ * live at a time, so a single spare is kept along with its responses[] and
+ * responseStats[] arrays and timeout timer. Released responses go on a free list that is
+ * capped at the most responses one transition has needed. Once the pool has
+ * warmed up to the usual client count, transitions take nothing from the heap.
+ */
+typedef struct {
+    PMResponseWrangler      *spareWrangler;
+    PMResponse              *freeResponses;
+    int                     freeResponsesCnt;
+    int                     highWater;
+    uint32_t                heapAllocCnt;       // Wranglers, their arrays, and responses
+} responsePool_t;
+
+/* A disarmed response timer fires this far out; see armResponsesTimeout() */
+#define kResponsesTimeoutIdleSecs   (1.0e10)
+
+/* Every source of a wake, or of auto power off, considered at sleep */
+typedef enum {
+    kWakeSourceMaintenance = 0,
+    kWakeSourceSleepService,
+    kWakeSourceTimerPlugin,
+    kWakeSourceAdaptiveWake,
+    kWakeSourceProxWakeSupport,
+    kWakeSourceTCPKATurnOff,
+    kWakeSourceUserWake,
+    kWakeSourceShutdownRestart,
+    kWakeSourceAutoPowerOff,
+    kWakeSourceCount
+} wakeSource_t;
+
+/* Why a wake candidate wasn't scheduled */
+typedef enum {
+    kWakeLostPending = 0,               // not resolved yet
+    kWakeLostNone,                      // chosen
+    kWakeLostLater,                     // another candidate comes first
+    kWakeLostMerged,                    // served by the chosen wake
+    kWakeLostDisabled,                  // dark wakes disabled for standby
+    kWakeLostNotPowerOff,               // auto power off on a platform that can't
+} wakeLoss_t;
+
+/* Dark wakes are never scheduled closer than this to sleep */
+#define kWakeCandidateMinLeadSecs   60
+
+/* Longest a client may let its wake be deferred; see kIOPMAckWakeLeewayKey */
+#define kWakeLeewayMaxSecs          (60*60)
+
+/* wakeCandidate_t
+ * A wake is due anywhere from 'requested' to 'deadline', the requested time
+ * plus any leeway. Both are held to the minimum lead for dark wakes; the held
+ * times are 'earliest' and 'effective'.
+ */
+typedef struct {
+    CFAbsoluteTime          requested;
+    CFAbsoluteTime          deadline;
+    CFAbsoluteTime          earliest;
+    CFAbsoluteTime          effective;
+    wakeSource_t            source;
+    pid_t                   pid;
+    CFStringRef             clientInfo;
+    wakeLoss_t              lost;
+    int                     seq;                // Insertion order
+} wakeCandidate_t;
+
+/* wakeCandidateQueue_t
+ * Every wake request in effect at sleep, in insertion order, and a binary
+ * min-heap over them ordered by effective time. Ties go to the source that
+ * outranks the other (user wakes over dark wakes), then to the earlier
+ * request, then to the earlier insertion. The next wake is the heap's head,
+ * at its deadline; every other candidate whose window has opened by then is
+ * merged into it. Candidates outlive the sleep that collected them so they
+ * can be dumped.
+ */
+typedef struct {
+    wakeCandidate_t         *cands;
+    int                     *heap;              // Indices into cands[]
+    int                     count;
+    int                     heapCount;
+    int                     capacity;
+    int                     chosen;             // Index into cands[], or -1
+    int                     mergedCount;        // Candidates served by the chosen wake
+    wakeType_e              wakeType;           // Highest ranked among chosen and merged
+    bool                    darkWakesDisabled;
+    CFAbsoluteTime          collected;
+} wakeCandidateQueue_t;
 
 
 /************************************************************************************/
@@ -230,37 +483,64 @@ typedef struct {
  * PMScheduleWakeEventChooseBest
  *
  * Expected to be called ONCE at each system sleep by PMConnection.c.
- * Compares maintenance, sleepservice, and autowake requests, and schedules the earliest event with the RTC.
+ * Settles the wake candidate queue and schedules its head with the RTC, unless
+ * auto power off comes first.
  */
 static IOReturn createConnectionWithID(
                     PMConnection **);
 
-static PMConnection *connectionForID(
+STATIC PMConnection *connectionForID(
                     uint32_t findMe);
 
-static CFArrayRef createArrayOfConnectionsWithInterest(
-                    int interestBitsNotify);
+static uint32_t collectConnectionsWithInterest(
+                    int interestBits,
+                    PMConnection ***found);
+
+static void setConnectionInterests(
+                    PMConnection *connection,
+                    IOPMCapabilityBits interests);
 
 static PMResponseWrangler *connectionFireNotification(
                     int notificationType,
                     long kernelAcknowledgementID);
 
-static void _sendMachMessage(
-                    mach_port_t port, 
-                    mach_msg_id_t msg_id,
+static void queueMachMessage(
+                    PMConnection *connection,
                     uint32_t payload_bits,
                     uint32_t payload_messagetoken);
 
+static void sendQueuedMachMessages(void);
+
 static void checkResponses(PMResponseWrangler *wrangler);
 
-static void PMScheduleWakeEventChooseBest(CFAbsoluteTime scheduleTime, wakeType_e type);
+static wakeCandidate_t *PMScheduleWakeEventChooseBest(wakeCandidateQueue_t *q);
 
 static void responsesTimedOut(CFRunLoopTimerRef timer, void * info);
 
 static void cleanupConnection(PMConnection *reap);
 
+static void removeConnection(PMConnection *reap);
+
 static void cleanupResponseWrangler(PMResponseWrangler *reap);
 
+static void releaseResponseWrangler(PMResponseWrangler *w);
+
+static void releaseResponse(PMResponse *r);
+
+static void disarmResponsesTimeout(PMResponseWrangler *w);
+
+static void enqueueTransition(int interestBits, long kernelAcknowledgementID);
+
+static void dequeueTransitions(void);
+
+static void transitionProfileBegin(const struct IOPMSystemCapabilityChangeParameters *capArgs);
+
+static void transitionProfileMark(transitionTimeline_t *timeline, transitionPhase_t phase);
+
+static void transitionProfileAck(PMResponse *resp);
+
+static void transitionProfileKernelAck(long kernelAcknowledgementID);
+
 static void setSystemSleepStateTracking(IOPMCapabilityBits);
 
 static void scheduleSleepServiceCapTimerEnforcer(uint32_t cap_ms);
@@ -300,14 +580,6 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler);
 
 /* CFArrayRef support structures */
 
-static Boolean _CFArrayConnectionEquality(const void *value1, const void *value2) 
-{
-    const PMConnection *v1 = (const PMConnection *)value1;
-    const PMConnection *v2 = (const PMConnection *)value2;   
-    return (v1->uniqueID == v2->uniqueID);
-}
-static CFArrayCallBacks _CFArrayConnectionCallBacks = 
-                        { 0, NULL, NULL, NULL, _CFArrayConnectionEquality };
 static CFArrayCallBacks _CFArrayVanillaCallBacks =
                         { 0, NULL, NULL, NULL, NULL };
 
@@ -319,11 +591,64 @@ static CFArrayCallBacks _CFArrayVanillaCallBacks =
 
 static CFMutableArrayRef        gConnections = NULL;
 
+/* gConnectionTable
+ * Open-addressed hash of uniqueID -> PMConnection, linear probing, kept at most
+ * half full so probes stay short. Empty slots are NULL. Entries mirror gConnections,
+ * which is kept for walks over all connections. gConnections is unordered:
+ * removeConnection() moves the last connection into the vacated position.
+ */
+static PMConnection             **gConnectionTable = NULL;
+static uint32_t                 gConnectionTableSize = 0;
+static uint32_t                 gConnectionTableCnt = 0;
+
+#define kConnectionTableMinSize     128
+
+/* gInterestBuckets
+ * One bucket per capability bit, listing the connections whose interestsBits
+ * include that bit. Notification fan-out walks only the buckets for the
+ * changing bits and collects into gFanoutBuf, which is reused across transitions.
+ */
+static connectionBucket_t       gInterestBuckets[kInterestBucketCount];
+static PMConnection             **gFanoutBuf = NULL;
+static uint32_t                 gFanoutBufCap = 0;
+static uint32_t                 gFanoutGen = 0;
+
 static uint32_t                 globalConnectionIDTally = 0;
 
 static io_connect_t             gRootDomainConnect = IO_OBJECT_NULL;
 
 static PMResponseWrangler *     gLastResponseWrangler = NULL;
+static uint32_t                 gResponseWranglerGen = 0;
+
+static transitionQueue_t        gTransitionQueue;
+
+static responsePool_t           gResponsePool;
+
+static transitionProfile_t      gTransitionProfile;
+
+/* Notification delivery counters; see sendQueuedMachMessages() */
+static struct {
+    uint64_t                sent;
+    uint64_t                deferred;
+    uint64_t                failed;
+} gSendStats;
+
+#ifdef XCTEST
+/* Connections and responses visited handling transitions; lets tests check
+ * the work per client doesn't grow with the client count. */
+static uint64_t                 gTransitionScanCnt = 0;
+#define countTransitionScan()   (gTransitionScanCnt++)
+#else
+#define countTransitionScan()
+#endif
+
+static wakeCandidateQueue_t     gWakeCandidates = { .chosen = -1 };
+
+/* gClientAckHistory
+ * callerName -> CFMutableData holding a clientAckHistory_t. Persists across
+ * transitions and feeds the per-transition acknowledgement deadline.
+ */
+static CFMutableDictionaryRef   gClientAckHistory = NULL;
 
 SleepServiceStruct              gSleepService;
 
@@ -383,7 +708,7 @@ void PMConnection_prime()
     sleepwake_log = os_log_create(PM_LOG_SYSTEM, SLEEPWAKE_LOG);
     bzero(&gSleepService, sizeof(gSleepService));
 
-    gConnections = CFArrayCreateMutable(kCFAllocatorDefault, 100, &_CFArrayConnectionCallBacks);
+    gConnections = CFArrayCreateMutable(kCFAllocatorDefault, 100, &_CFArrayVanillaCallBacks);
                                         
     // Find it
     rootDomainService = getRootDomain();
@@ -504,7 +829,7 @@ kern_return_t _io_pm_connection_create (
         newConnection->callerName = CFStringCreateWithCString(0, name, kCFStringEncodingUTF8);
     }
 
-    newConnection->interestsBits = interests;
+    setConnectionInterests(newConnection, interests);
     *connection_id = newConnection->uniqueID;
     *return_code = kIOReturnSuccess;
 
@@ -619,40 +944,60 @@ kern_return_t _io_pm_connection_release
 
 static PMResponse *_io_pm_acknowledge_event_findOutstandingResponseForToken(PMConnection *connection, int token)
 {
-    CFMutableArrayRef   responsesTrackingList = NULL;
-    long                responsesCount = 0;
-    PMResponse          *checkResponse = NULL;
+    PMResponseWrangler  *wrangler = NULL;
     PMResponse          *foundResponse = NULL;
-    long                i;
+    int                 idx;
     
     
     if (!connection
-        || !connection->responseHandler
-        || !(responsesTrackingList = connection->responseHandler->awaitingResponses)) 
+        || !(wrangler = connection->responseHandler)
+        || !wrangler->responses) 
     {
         return NULL;
     }
     
-    responsesCount = CFArrayGetCount(responsesTrackingList);
-    
-    for (i=0; i<responsesCount; i++)
-    {
-        checkResponse = (PMResponse *)CFArrayGetValueAtIndex(responsesTrackingList, i);
-        if (checkResponse && (token == checkResponse->token)) {
-            foundResponse = checkResponse;
-            break;
-        }
+    // connectionFireNotification() encodes the response's index into the token
+    idx = (token & kResponseTokenIndexMask) - 1;
+    if ((idx < 0) || (idx >= wrangler->responsesCount)) {
+        return NULL;
+    }
+
+    foundResponse = wrangler->responses[idx];
+    if (!foundResponse || (token != foundResponse->token)) {
+        return NULL;
     }
     
-    if (foundResponse && !foundResponse->connection)
+    if (!foundResponse->connection)
     {
         ERROR_LOG("Trying to acknowledge event with a NULL connection. ClientInfo %@, Replied: %d\n", foundResponse->clientInfoString, foundResponse->replied);
         return NULL;
     }
+
+    if (foundResponse->connection != connection) {
+        ERROR_LOG("Connection %d acknowledged token 0x%x owned by connection %d\n",
+                  connection->uniqueID, token, foundResponse->connection->uniqueID);
+        return NULL;
+    }
     
     return foundResponse;
 }
 
+/*
+ * Marks a response as replied and drops the wrangler's count of
+ * outstanding responses. Safe to call on an already replied response.
+ */
+static void markResponseReplied(PMResponse *resp)
+{
+    if (resp->replied) {
+        return;
+    }
+
+    resp->replied = true;
+    if (resp->myResponseWrangler && (resp->myResponseWrangler->awaitingResponsesCount > 0)) {
+        resp->myResponseWrangler->awaitingResponsesCount--;
+    }
+}
+
 /* 
  * _io_pm_connection_acknowledge_event_unpack_payload
  * Helper function to improve readability of connection_acknowledge_event
@@ -684,59 +1029,326 @@ static CFDictionaryRef _io_pm_connection_acknowledge_event_unpack_payload(
 
 static void cacheResponseStats(PMResponse *resp)
 {
-    PMResponseWrangler *respWrangler = resp->myResponseWrangler;
-    CFMutableDictionaryRef stats = NULL;
-    uint32_t   timeIntervalMS;
-    CFStringRef     respType = NULL;
+    PMResponseWrangler  *respWrangler = resp->myResponseWrangler;
+    responseStat_t      *stat = NULL;
+    uint32_t            timeIntervalMS;
+    responseOutcome_t   outcome;
 
-    if (respWrangler->responseStats == NULL)
+    if (!respWrangler->responseStats || !resp->connection
+        || (respWrangler->responseStatsCount >= respWrangler->responsesCap))
         return;
 
     timeIntervalMS = (resp->repliedWhen - resp->notifiedWhen) * 1000;
 
     if (resp->timedout) {
-        respType = CFSTR(kIOPMStatsResponseTimedOut);
+        outcome = kResponseOutcomeTimedOut;
     }
     else if (timeIntervalMS > kAppResponseLogThresholdMS) {
-        respType = CFSTR(kIOPMStatsResponseSlow);
+        outcome = kResponseOutcomeSlow;
     }
     else if (gDebugFlags & kIOPMDebugLogCallbacks) {
-        respType = CFSTR(kIOPMStatsResponsePrompt);
+        outcome = kResponseOutcomePrompt;
     }
     else return;
 
-    stats = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-    if (stats == NULL)
+    stat = &respWrangler->responseStats[respWrangler->responseStatsCount++];
+    stat->connectionID = resp->connection->uniqueID;
+    stat->pid = resp->connection->callerPID;
+    stat->notificationType = resp->notificationType;
+    stat->latencyMs = timeIntervalMS;
+    stat->outcome = outcome;
+
+    if (gPowerState & kSleepState) {
+        stat->transition = kResponseTransitionSleep;
+    }
+    else if (gPowerState & kDarkWakeState) {
+        stat->transition = kResponseTransitionDarkWake;
+    }
+    else if (gPowerState & kFullWakeState) {
+        stat->transition = kResponseTransitionWake;
+    }
+    else {
+        stat->transition = kResponseTransitionNone;
+    }
+}
+
+/*
+ * Converts the wrangler's response stats to the array of kIOPMStats*
+ * dictionaries that logASLMessageAppStats() takes.
+ */
+static CFArrayRef copyResponseStatsArray(PMResponseWrangler *wrangler)
+{
+    CFMutableArrayRef       result = NULL;
+    CFMutableDictionaryRef  stats = NULL;
+    CFNumberRef             num = NULL;
+    CFStringRef             name = NULL;
+    PMConnection            *connection = NULL;
+    responseStat_t          *stat = NULL;
+    int                     i;
+    char                    procName[64];
+
+    result = CFArrayCreateMutable(NULL, wrangler->responseStatsCount, &kCFTypeArrayCallBacks);
+    if (!result) {
+        return NULL;
+    }
+
+    for (i = 0; i < wrangler->responseStatsCount; i++)
+    {
+        stat = &wrangler->responseStats[i];
+
+        stats = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (stats == NULL)
+            break;
+
+        if (stat->outcome == kResponseOutcomeTimedOut) {
+            CFDictionarySetValue(stats, CFSTR(kIOPMStatsApplicationResponseTypeKey), CFSTR(kIOPMStatsResponseTimedOut));
+        } else if (stat->outcome == kResponseOutcomeSlow) {
+            CFDictionarySetValue(stats, CFSTR(kIOPMStatsApplicationResponseTypeKey), CFSTR(kIOPMStatsResponseSlow));
+        } else {
+            CFDictionarySetValue(stats, CFSTR(kIOPMStatsApplicationResponseTypeKey), CFSTR(kIOPMStatsResponsePrompt));
+        }
+
+        // The client may have gone away since it responded
+        name = NULL;
+        if ((connection = connectionForID(stat->connectionID)) && isA_CFString(connection->callerName)) {
+            name = CFRetain(connection->callerName);
+        } else if (proc_name(stat->pid, procName, sizeof(procName)) > 0) {
+            name = CFStringCreateWithCString(NULL, procName, kCFStringEncodingUTF8);
+        }
+        if (name) {
+            CFDictionarySetValue(stats, CFSTR(kIOPMStatsNameKey), name);
+            CFRelease(name);
+        }
+
+        num = CFNumberCreate(NULL, kCFNumberIntType, &stat->notificationType);
+        if (num) {
+            CFDictionarySetValue(stats, CFSTR(kIOPMStatsPowerCapabilityKey), num);
+            CFRelease(num);
+        }
+
+        num = CFNumberCreate(NULL, kCFNumberIntType, &stat->latencyMs);
+        if (num) {
+            CFDictionarySetValue(stats, CFSTR(kIOPMStatsTimeMSKey), num);
+            CFRelease(num);
+        }
+
+        if (stat->transition == kResponseTransitionSleep) {
+            CFDictionarySetValue(stats, CFSTR(kIOPMStatsSystemTransitionKey), CFSTR("Sleep"));
+        }
+        else if (stat->transition == kResponseTransitionDarkWake) {
+            CFDictionarySetValue(stats, CFSTR(kIOPMStatsSystemTransitionKey), CFSTR("DarkWake"));
+        }
+        else if (stat->transition == kResponseTransitionWake) {
+            CFDictionarySetValue(stats, CFSTR(kIOPMStatsSystemTransitionKey), CFSTR("Wake"));
+        }
+
+        CFArrayAppendValue(result, stats);
+        CFRelease(stats);
+    }
+
+    return result;
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+static clientAckHistory_t *ackHistoryForName(CFStringRef name, bool create)
+{
+    CFMutableDataRef    data = NULL;
+
+    if (!isA_CFString(name)) {
+        return NULL;
+    }
+
+    if (!gClientAckHistory) {
+        if (!create) {
+            return NULL;
+        }
+        gClientAckHistory = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                      &kCFTypeDictionaryValueCallBacks);
+        if (!gClientAckHistory) {
+            return NULL;
+        }
+    }
+
+    data = (CFMutableDataRef)CFDictionaryGetValue(gClientAckHistory, name);
+    if (!data && create && (CFDictionaryGetCount(gClientAckHistory) < kAckHistoryMaxClients)) {
+        data = CFDataCreateMutable(0, sizeof(clientAckHistory_t));
+        if (data) {
+            CFDataSetLength(data, sizeof(clientAckHistory_t));  // zero filled
+            CFDictionarySetValue(gClientAckHistory, name, data);
+            CFRelease(data);
+        }
+    }
+
+    return data ? (clientAckHistory_t *)CFDataGetMutableBytePtr(data) : NULL;
+}
+
+static uint32_t ackHistoryP95Ms(clientAckHistory_t *h)
+{
+    uint32_t    cumulative = 0;
+    int         i;
+
+    if (!h->histTotal) {
+        return 0;
+    }
+
+    for (i = 0; i < kAckLatencyBucketCnt - 1; i++) {
+        cumulative += h->hist[i];
+        if (cumulative * 100 >= h->histTotal * 95) {
+            break;
+        }
+    }
+
+    // Upper bound of bucket i
+    return (1U << i);
+}
+
+static bool ackHistoryIsOffender(clientAckHistory_t *h)
+{
+    return ((h->consecutiveTimeouts >= 2)
+            || ((h->timeouts >= 3) && (h->timeouts * 4 >= h->samples)));
+}
+
+/*
+ * Acknowledgement budget for one client, in seconds. Clients without enough
+ * history get the default. Prompt clients get headroom over their observed
+ * tail latency; habitual offenders get a short, fixed budget.
+ */
+static int ackBudgetSecsForHistory(clientAckHistory_t *h)
+{
+    int         defaultSecs = (int)kPMConnectionNotifyTimeoutDefault;
+    uint32_t    budgetMs;
+    int         budgetSecs;
+
+    if (!h) {
+        return defaultSecs;
+    }
+    if (ackHistoryIsOffender(h)) {
+        return MIN(defaultSecs, kAckOffenderBudgetSecs);
+    }
+    if (h->samples < kAckHistoryMinSamples) {
+        return defaultSecs;
+    }
+
+    budgetMs = MAX(2 * ackHistoryP95Ms(h), h->ewmaMs + 4 * h->devMs);
+    budgetSecs = (int)((budgetMs + 999) / 1000);
+
+    return MIN(defaultSecs, MAX(kAckTimeoutMinSecs, budgetSecs));
+}
+
+static int ackBudgetSecs(PMConnection *connection)
+{
+    return ackBudgetSecsForHistory(ackHistoryForName(connection->callerName, false));
+}
+
+/*
+ * Feeds a replied or timed out response into its client's history.
+ */
+static void recordAckHistory(PMResponse *resp)
+{
+    clientAckHistory_t  *h = NULL;
+    uint32_t            sampleMs;
+    int32_t             err;
+    int                 bucket, i;
+
+    if (!resp->connection) {
         return;
+    }
 
-    CFDictionarySetValue(stats, CFSTR(kIOPMStatsApplicationResponseTypeKey), respType);
-    CFDictionarySetValue(stats, CFSTR(kIOPMStatsNameKey), resp->connection->callerName);
+    h = ackHistoryForName(resp->connection->callerName, true);
+    if (!h) {
+        return;
+    }
 
-    CFNumberRef capsNum = CFNumberCreate(NULL, kCFNumberIntType, &resp->notificationType);
-    if (capsNum) {
-        CFDictionarySetValue(stats, CFSTR(kIOPMStatsPowerCapabilityKey), capsNum);
-        CFRelease(capsNum);
+    if (resp->timedout) {
+        h->timeouts++;
+        h->consecutiveTimeouts++;
+        resp->connection->timeoutCnt++;
+        return;
     }
 
-    CFNumberRef timeIntervalNumber = CFNumberCreate(NULL, kCFNumberIntType, &timeIntervalMS);
-    if (timeIntervalNumber) {
-        CFDictionarySetValue(stats, CFSTR(kIOPMStatsTimeMSKey), timeIntervalNumber);
-        CFRelease(timeIntervalNumber);
+    sampleMs = (uint32_t)MAX(0, (resp->repliedWhen - resp->notifiedWhen) * 1000);
+    h->consecutiveTimeouts = 0;
+    if (sampleMs > kAppResponseLogThresholdMS) {
+        h->slow++;
     }
+    h->maxMs = MAX(h->maxMs, sampleMs);
 
-    if (gPowerState & kSleepState) {
-        CFDictionarySetValue(stats, CFSTR(kIOPMStatsSystemTransitionKey), CFSTR("Sleep"));
+    if (0 == h->samples++) {
+        h->ewmaMs = sampleMs;
+        h->devMs = sampleMs / 2;
+    } else {
+        err = (int32_t)sampleMs - (int32_t)h->ewmaMs;
+        h->ewmaMs = (uint32_t)((int32_t)h->ewmaMs + err / 8);
+        h->devMs = (uint32_t)((int32_t)h->devMs + ((err < 0 ? -err : err) - (int32_t)h->devMs) / 4);
+    }
+
+    bucket = sampleMs ? MIN(kAckLatencyBucketCnt - 1, 32 - __builtin_clz(sampleMs)) : 0;
+    h->hist[bucket]++;
+    if (++h->histTotal >= kAckHistoryDecayAt) {
+        h->histTotal = 0;
+        for (i = 0; i < kAckLatencyBucketCnt; i++) {
+            h->hist[i] /= 2;
+            h->histTotal += h->hist[i];
+        }
     }
-    else if (gPowerState & kDarkWakeState) {
-        CFDictionarySetValue(stats, CFSTR(kIOPMStatsSystemTransitionKey), CFSTR("DarkWake"));
+}
+
+static void appendAckHistory(const void *key, const void *value, void *context)
+{
+    clientAckHistory_t      *h = (clientAckHistory_t *)CFDataGetBytePtr((CFDataRef)value);
+    CFMutableArrayRef       result = (CFMutableArrayRef)context;
+    CFMutableDictionaryRef  entry = NULL;
+    CFNumberRef             num = NULL;
+    int                     val;
+
+    entry = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!entry) {
+        return;
     }
-    else if (gPowerState & kFullWakeState) {
-        CFDictionarySetValue(stats, CFSTR(kIOPMStatsSystemTransitionKey), CFSTR("Wake"));
+    CFDictionarySetValue(entry, kIOPMAckHistoryNameKey, (CFStringRef)key);
+
+#define SET_ACK_HISTORY_NUM(k, v) \
+    do { \
+        val = (int)(v); \
+        if ((num = CFNumberCreate(0, kCFNumberIntType, &val))) { \
+            CFDictionarySetValue(entry, (k), num); \
+            CFRelease(num); \
+        } \
+    } while (0)
+
+    SET_ACK_HISTORY_NUM(kIOPMAckHistorySamplesKey, h->samples);
+    SET_ACK_HISTORY_NUM(kIOPMAckHistoryTimeoutsKey, h->timeouts);
+    SET_ACK_HISTORY_NUM(kIOPMAckHistoryAvgMsKey, h->ewmaMs);
+    SET_ACK_HISTORY_NUM(kIOPMAckHistoryP95MsKey, ackHistoryP95Ms(h));
+    SET_ACK_HISTORY_NUM(kIOPMAckHistoryBudgetKey, ackBudgetSecsForHistory(h));
+    SET_ACK_HISTORY_NUM(kIOPMAckHistorySendFailuresKey, h->sendFailures);
+    SET_ACK_HISTORY_NUM(kIOPMAckHistorySlowKey, h->slow);
+    SET_ACK_HISTORY_NUM(kIOPMAckHistoryMaxMsKey, h->maxMs);
+#undef SET_ACK_HISTORY_NUM
+
+    CFDictionarySetValue(entry, kIOPMAckHistoryOffenderKey,
+                         ackHistoryIsOffender(h) ? kCFBooleanTrue : kCFBooleanFalse);
+
+    CFArrayAppendValue(result, entry);
+    CFRelease(entry);
+}
+
+__private_extern__ CFArrayRef copyClientAckHistory(void)
+{
+    CFMutableArrayRef   result = NULL;
+
+    if (!gClientAckHistory) {
+        return NULL;
     }
 
-    CFArrayAppendValue(respWrangler->responseStats, stats);
+    result = CFArrayCreateMutable(0, CFDictionaryGetCount(gClientAckHistory), &kCFTypeArrayCallBacks);
+    if (result) {
+        CFDictionaryApplyFunction(gClientAckHistory, appendAckHistory, result);
+    }
 
-    CFRelease(stats);
+    return result;
 }
 
 kern_return_t _io_pm_connection_acknowledge_event
@@ -755,6 +1367,7 @@ kern_return_t _io_pm_connection_acknowledge_event
     // Check options dictionary
     CFDictionaryRef     ackOptionsDict = NULL;
     CFDateRef           requestDate = NULL;
+    CFNumberRef         leeway = NULL;
 
     if (messageToken == 0)
     {
@@ -773,9 +1386,11 @@ kern_return_t _io_pm_connection_acknowledge_event
     
     *return_code = kIOReturnSuccess;
     foundResponse->repliedWhen = CFAbsoluteTimeGetCurrent();
-    foundResponse->replied = true;
+    markResponseReplied(foundResponse);
     
     cacheResponseStats(foundResponse);
+    recordAckHistory(foundResponse);
+    transitionProfileAck(foundResponse);
     
     // Unpack the passed-in options data structure
     if ((ackOptionsDict = _io_pm_connection_acknowledge_event_unpack_payload(options_ptr, options_len)))
@@ -786,6 +1401,16 @@ kern_return_t _io_pm_connection_acknowledge_event
             CFRetain(foundResponse->clientInfoString);
         }
 
+        /* kIOPMAckWakeLeewayKey
+         *      - How long any wake requested below may be deferred so it
+         *        can share an RTC wake with other requests
+         */
+        leeway = isA_CFNumber(CFDictionaryGetValue(ackOptionsDict, kIOPMAckWakeLeewayKey));
+        if (leeway) {
+            CFNumberGetValue(leeway, kCFNumberDoubleType, &foundResponse->wakeLeeway);
+            foundResponse->wakeLeeway = MAX(0, MIN(foundResponse->wakeLeeway, kWakeLeewayMaxSecs));
+        }
+
         /*
          * mDNSResponder requests a maintenance wake for DHCP renewal.
          *  - Schedules on AC
@@ -1038,10 +1663,6 @@ static void cleanupConnection(PMConnection *reap)
 {
     PMResponseWrangler      *responseWrangler = NULL;
     PMResponse              *openResponse = NULL;
-    CFIndex                 i, allResponsesCount = 0;
-    CFIndex                 index;
-    CFRange                 connectionsRange =
-                                CFRangeMake(0, CFArrayGetCount(gConnections));
 
     if (MACH_PORT_NULL != reap->notifyPort) 
     {
@@ -1061,34 +1682,24 @@ static void cleanupConnection(PMConnection *reap)
     }
 
     responseWrangler = reap->responseHandler;
-    if (responseWrangler && responseWrangler->awaitingResponses)
+    openResponse = reap->response;
+    if (responseWrangler)
     {
-        allResponsesCount = CFArrayGetCount(responseWrangler->awaitingResponses);
-
-        for (i=0; i<allResponsesCount; i++)
-        {
-            openResponse = (PMResponse *)CFArrayGetValueAtIndex(    
-                                    responseWrangler->awaitingResponses, i);
-
-            if (openResponse && (openResponse->connection == reap)) {
-                openResponse->connection    = NULL;
-                openResponse->replied       = true;
-                openResponse->timedout      = true;
-                break;
-            }
-        }    
+        if (openResponse && (openResponse->connection == reap)) {
+            openResponse->connection    = NULL;
+            openResponse->timedout      = true;
+            markResponseReplied(openResponse);
+        }
+        reap->responseHandler = NULL;
+        reap->response = NULL;
 
         // Let the response wrangler finish handling the outstanding event
         // now that we've zeroed out any of our pending responses for this dead client.
         checkResponses(responseWrangler);
     }
        
-    // Remove our struct from gConnections
-    index = CFArrayGetFirstIndexOfValue(gConnections, connectionsRange, (void *)reap);
-
-    if (kCFNotFound != index) {
-        CFArrayRemoveValueAtIndex(gConnections, index);
-    }
+    // Remove our struct from gConnections and the ID table
+    removeConnection(reap);
     
     free(reap);
 
@@ -1100,13 +1711,8 @@ static void cleanupConnection(PMConnection *reap)
 
 static void cleanupResponseWrangler(PMResponseWrangler *reap)
 {
-    PMConnection    *one_connection;
-    CFIndex         i,  connectionsCount;
-    CFIndex         responseCount;
-
-    long nextAcknowledgementID;
-    int  nextInterestBits;
-    bool nextIsValid;
+    PMResponse      *purgeMe;
+    int             i;
 
     if (!reap) 
         return;
@@ -1114,48 +1720,32 @@ static void cleanupResponseWrangler(PMResponseWrangler *reap)
     if (!gConnections)
         return;
 
-    // Cache the next response fields.
-    nextInterestBits      = reap->nextInterestBits;
-    nextAcknowledgementID = reap->nextKernelAcknowledgementID;
-    nextIsValid           = reap->nextIsValid;
-
-    // Loop through all connections. If any connections are referring to
-    // responseWrangler in their tracking structs, zero that out.
-    connectionsCount = CFArrayGetCount(gConnections);
-    for (i=0; i<connectionsCount; i++) 
+    // Loop responses, destroy responses. Only connections holding a response
+    // refer to this wrangler; zero out their references before they point to
+    // a free'd pointer.
+    if (reap->responses)
     {
-        one_connection = (PMConnection *)CFArrayGetValueAtIndex(gConnections, i);
-        if (reap == one_connection->responseHandler) 
+        for (i=0; i<reap->responsesCount; i++) 
         {
-            // Zero out this reference before it points to a free'd pointer
-            one_connection->responseHandler = NULL;
-        }
-    }
-        
+            countTransitionScan();
+            purgeMe = reap->responses[i];
 
-    // Loop responses, destroy responses
-    if (reap->awaitingResponses)
-    {
-        responseCount = CFArrayGetCount(reap->awaitingResponses);
-        if (responseCount > 0) 
-        {
-            for (i=0; i<responseCount; i++) 
+            if (purgeMe->connection && (reap == purgeMe->connection->responseHandler))
             {
-                PMResponse  *purgeMe = (PMResponse *)CFArrayGetValueAtIndex(reap->awaitingResponses, i);
-                
-                if (purgeMe->clientInfoString)
-                    CFRelease(purgeMe->clientInfoString);
-                if (purgeMe->clientInfoStringBGTask)
-                    CFRelease(purgeMe->clientInfoStringBGTask);
-                if (purgeMe->clientInfoStringAppRefresh)
-                    CFRelease(purgeMe->clientInfoStringAppRefresh);
-                
-                free(purgeMe);
+                purgeMe->connection->responseHandler = NULL;
+                purgeMe->connection->response = NULL;
             }
+            
+            if (purgeMe->clientInfoString)
+                CFRelease(purgeMe->clientInfoString);
+            if (purgeMe->clientInfoStringBGTask)
+                CFRelease(purgeMe->clientInfoStringBGTask);
+            if (purgeMe->clientInfoStringAppRefresh)
+                CFRelease(purgeMe->clientInfoStringAppRefresh);
+            
+            releaseResponse(purgeMe);
         }
-        CFRelease(reap->awaitingResponses);
-        
-        reap->awaitingResponses = NULL;
+        reap->responsesCount = 0;
     }
 
     // Invalidate the pointer to the in-flight response wrangler.
@@ -1163,50 +1753,547 @@ static void cleanupResponseWrangler(PMResponseWrangler *reap)
         gLastResponseWrangler = NULL;
     }
 
-    free(reap);
+    releaseResponseWrangler(reap);
 
-    // Create a new response wrangler if the reaped wrangler has a queued
-    // notification stored. If new wrangler is NULL, make sure to ack any
-    // sleep message.
-    if (nextIsValid)
-    {
-        PMResponseWrangler * resp;
-        resp = connectionFireNotification(nextInterestBits, nextAcknowledgementID);
-        if (!resp)
-        {
-            if (nextAcknowledgementID)
-                IOAllowPowerChange(gRootDomainConnect, nextAcknowledgementID);
-        }
-    }
+    // Deliver transitions that queued up behind the reaped wrangler.
+    dequeueTransitions();
 }
 
 /*****************************************************************************/
 /*****************************************************************************/
 
-bool PMConnectionHandleDeadName(uint32_t connection_id)
+static void destroyResponseWrangler(PMResponseWrangler *w)
 {
-    PMConnection    *the_connection = NULL;
-    
-    the_connection = connectionForID(connection_id);
-    
-    if (the_connection) {
-        cleanupConnection(the_connection);
-        return true;
-    } else {
-        return false;
+    if (w->awaitingResponsesTimeout) {
+        CFRunLoopTimerInvalidate(w->awaitingResponsesTimeout);
+        CFRelease(w->awaitingResponsesTimeout);
     }
+    free(w->responseStats);
+    free(w->responses);
+    free(w);
 }
 
-/*****************************************************************************/
-/*****************************************************************************/
-
-static void setSystemSleepStateTracking(IOPMCapabilityBits capables)
+/*
+ * Returns a wrangler with room for 'capacity' responses, reusing the spare
+ * when there is one. Fields other than the recycled buffers are zeroed.
+ */
+static PMResponseWrangler *acquireResponseWrangler(int capacity)
 {
-    SCDynamicStoreRef   store = _getSharedPMDynamicStore();
-    CFStringRef         key = NULL;
-    CFNumberRef         capablesNum = NULL;
+    PMResponseWrangler  *w = gResponsePool.spareWrangler;
+    PMResponse          **grown = NULL;
+    responseStat_t      *grownStats = NULL;
 
-    if (!store)
+    if (w) {
+        gResponsePool.spareWrangler = NULL;
+    } else {
+        w = calloc(1, sizeof(PMResponseWrangler));
+        if (!w) {
+            return NULL;
+        }
+        gResponsePool.heapAllocCnt++;
+    }
+
+    if (w->responsesCap < capacity) {
+        grown = realloc(w->responses, capacity * sizeof(PMResponse *));
+        if (grown) {
+            w->responses = grown;
+            grownStats = realloc(w->responseStats, capacity * sizeof(responseStat_t));
+        }
+        if (!grown || !grownStats) {
+            gResponsePool.spareWrangler = w;
+            return NULL;
+        }
+        gResponsePool.heapAllocCnt += 2;
+        w->responseStats = grownStats;
+        w->responsesCap = capacity;
+    }
+
+    return w;
+}
+
+static void releaseResponseWrangler(PMResponseWrangler *w)
+{
+    PMResponse          **responses = w->responses;
+    int                 responsesCap = w->responsesCap;
+    responseStat_t      *responseStats = w->responseStats;
+    CFRunLoopTimerRef   timer = w->awaitingResponsesTimeout;
+
+    disarmResponsesTimeout(w);
+    if (gResponsePool.spareWrangler) {
+        destroyResponseWrangler(w);
+        return;
+    }
+    bzero(w, sizeof(*w));
+    w->responses = responses;
+    w->responsesCap = responsesCap;
+    w->responseStats = responseStats;
+    w->awaitingResponsesTimeout = timer;
+
+    gResponsePool.spareWrangler = w;
+}
+
+static PMResponse *acquireResponse(void)
+{
+    PMResponse  *r = gResponsePool.freeResponses;
+
+    if (r) {
+        gResponsePool.freeResponses = r->nextFree;
+        gResponsePool.freeResponsesCnt--;
+        bzero(r, sizeof(*r));
+    } else if ((r = calloc(1, sizeof(PMResponse)))) {
+        gResponsePool.heapAllocCnt++;
+    }
+
+    return r;
+}
+
+static void releaseResponse(PMResponse *r)
+{
+    if (gResponsePool.freeResponsesCnt >= gResponsePool.highWater) {
+        free(r);
+        return;
+    }
+    r->nextFree = gResponsePool.freeResponses;
+    gResponsePool.freeResponses = r;
+    gResponsePool.freeResponsesCnt++;
+}
+
+/*
+ * Starts the wrangler's response deadline. The timer is created once per
+ * wrangler and repeats at kResponsesTimeoutIdleSecs, so it survives firing
+ * and is re-armed by moving its fire date rather than by creating a new one.
+ */
+static void armResponsesTimeout(PMResponseWrangler *w)
+{
+    CFRunLoopTimerContext   responseTimerContext = { 0, (void *)w, NULL, NULL, NULL };
+
+    if (!w->awaitingResponsesTimeout) {
+        w->awaitingResponsesTimeout = CFRunLoopTimerCreate(0,
+                    CFAbsoluteTimeGetCurrent() + kResponsesTimeoutIdleSecs,
+                    kResponsesTimeoutIdleSecs, 0, 0, responsesTimedOut, &responseTimerContext);
+        if (!w->awaitingResponsesTimeout) {
+            return;
+        }
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), w->awaitingResponsesTimeout, kCFRunLoopDefaultMode);
+    }
+
+    CFRunLoopTimerSetNextFireDate(w->awaitingResponsesTimeout,
+                                  CFAbsoluteTimeGetCurrent() + w->awaitResponsesTimeoutSeconds);
+    w->awaitingResponsesTimeoutArmed = true;
+}
+
+static void disarmResponsesTimeout(PMResponseWrangler *w)
+{
+    if (w->awaitingResponsesTimeoutArmed) {
+        CFRunLoopTimerSetNextFireDate(w->awaitingResponsesTimeout,
+                                      CFAbsoluteTimeGetCurrent() + kResponsesTimeoutIdleSecs);
+        w->awaitingResponsesTimeoutArmed = false;
+    }
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+static void enqueueTransition(int interestBits, long kernelAcknowledgementID)
+{
+    transitionQueue_t       *q = &gTransitionQueue;
+    pendingTransition_t     *tail = NULL;
+    int                     i, idx, next;
+
+    q->queuedCnt++;
+
+    if (q->count > 0) {
+        tail = &q->entries[(q->head + q->count - 1) % kTransitionQueueMax];
+        if ((0 == kernelAcknowledgementID) && (0 == tail->kernelAcknowledgementID)) {
+            // Keep the tail's queue time; it has been waiting since then
+            tail->interestBits = interestBits;
+            q->coalescedCnt++;
+            return;
+        }
+    }
+
+    if (q->count == kTransitionQueueMax) {
+        for (i = 0; i < q->count; i++) {
+            idx = (q->head + i) % kTransitionQueueMax;
+            if (0 == q->entries[idx].kernelAcknowledgementID) {
+                break;
+            }
+        }
+
+        if (i == q->count) {
+            ERROR_LOG("Transition queue full; dropping transition 0x%x without notifying clients\n", interestBits);
+            q->droppedCnt++;
+            if (kernelAcknowledgementID) {
+                IOAllowPowerChange(gRootDomainConnect, kernelAcknowledgementID);
+                transitionProfileKernelAck(kernelAcknowledgementID);
+            }
+            return;
+        }
+
+        INFO_LOG("Transition queue full; dropping superseded transition 0x%x\n",
+                 q->entries[(q->head + i) % kTransitionQueueMax].interestBits);
+        for (; i < q->count - 1; i++) {
+            idx = (q->head + i) % kTransitionQueueMax;
+            next = (idx + 1) % kTransitionQueueMax;
+            q->entries[idx] = q->entries[next];
+        }
+        q->count--;
+        q->droppedCnt++;
+    }
+
+    idx = (q->head + q->count) % kTransitionQueueMax;
+    q->entries[idx].interestBits = interestBits;
+    q->entries[idx].kernelAcknowledgementID = kernelAcknowledgementID;
+    q->entries[idx].queuedAt = mach_absolute_time();
+    q->count++;
+
+    if (q->count > q->maxDepth) {
+        q->maxDepth = q->count;
+    }
+}
+
+/*
+ * Fires queued transitions in order until one of them gets a wrangler.
+ * Transitions with no interested clients are acknowledged right away.
+ */
+static void dequeueTransitions(void)
+{
+    transitionQueue_t       *q = &gTransitionQueue;
+    pendingTransition_t     next;
+    PMResponseWrangler      *resp = NULL;
+    uint64_t                waitMs;
+
+    while ((q->count > 0) && !gLastResponseWrangler)
+    {
+        next = q->entries[q->head];
+        q->head = (q->head + 1) % kTransitionQueueMax;
+        q->count--;
+
+        waitMs = monotonicTS2Ms(mach_absolute_time() - next.queuedAt);
+        q->waitTotalMs += waitMs;
+        if (waitMs > q->waitMaxMs) {
+            q->waitMaxMs = waitMs;
+        }
+        INFO_LOG("Firing queued transition 0x%x after %llu ms; %d still queued\n",
+                 next.interestBits, waitMs, q->count);
+
+        resp = connectionFireNotification(next.interestBits, next.kernelAcknowledgementID);
+        if (!resp && next.kernelAcknowledgementID) {
+            IOAllowPowerChange(gRootDomainConnect, next.kernelAcknowledgementID);
+            transitionProfileKernelAck(next.kernelAcknowledgementID);
+        }
+    }
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+static void transitionProfileEnd(transitionTimeline_t *tl)
+{
+    uint64_t                prev;
+    uint64_t                ms;
+    int                     i, bucket;
+
+    if (!tl || !tl->open) {
+        return;
+    }
+
+    prev = tl->start;
+    for (i = 0; i < kTransitionPhaseCount; i++) {
+        if (!tl->phase[i]) {
+            continue;
+        }
+        ms = monotonicTS2Ms(tl->phase[i] - prev);
+        bucket = ms ? (int)MIN(kIOPMTransitionHistBucketCnt - 1, 64 - __builtin_clzll(ms)) : 0;
+        gTransitionProfile.hist[i][bucket]++;
+        prev = tl->phase[i];
+    }
+
+    tl->open = false;
+}
+
+/* The open timeline for this kernel acknowledgement, newest first */
+static transitionTimeline_t *transitionTimelineFor(long kernelAcknowledgementID)
+{
+    transitionTimeline_t    *tl = NULL;
+    uint32_t                i;
+
+    for (i = 1; i <= MIN(gTransitionProfile.total, kTransitionProfileDepth); i++) {
+        tl = &gTransitionProfile.ring[(gTransitionProfile.total - i) % kTransitionProfileDepth];
+        if (tl->open && (tl->kernelAcknowledgementID == kernelAcknowledgementID)) {
+            return tl;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Starts a timeline for a capability change. Timelines of changes still
+ * queued behind an active one stay open. A timeline still open for the same
+ * kernel acknowledgement, or one about to be overwritten in the ring, was
+ * acknowledged elsewhere and is closed as is.
+ */
+static void transitionProfileBegin(const struct IOPMSystemCapabilityChangeParameters *capArgs)
+{
+    transitionTimeline_t    *tl = NULL;
+
+    transitionProfileEnd(transitionTimelineFor((long)capArgs->notifyRef));
+
+    tl = &gTransitionProfile.ring[gTransitionProfile.total % kTransitionProfileDepth];
+    transitionProfileEnd(tl);
+    bzero(tl, sizeof(*tl));
+    tl->seq = gTransitionProfile.total++;
+    tl->fromCapabilities = capArgs->fromCapabilities;
+    tl->toCapabilities = capArgs->toCapabilities;
+    tl->kernelAcknowledgementID = (long)capArgs->notifyRef;
+    tl->start = mach_absolute_time();
+    tl->open = true;
+
+    gTransitionProfile.current = tl;
+}
+
+/* Records the first time a phase is reached; later marks are ignored */
+static void transitionProfileMark(transitionTimeline_t *timeline, transitionPhase_t phase)
+{
+    if (timeline && timeline->open && !timeline->phase[phase]) {
+        timeline->phase[phase] = mach_absolute_time();
+    }
+}
+
+static void transitionProfileAck(PMResponse *resp)
+{
+    transitionTimeline_t    *tl = NULL;
+    transitionAck_t         *ack = NULL;
+    CFStringRef             name = NULL;
+    CFIndex                 used = 0;
+
+    if (!resp->myResponseWrangler || !resp->connection) {
+        return;
+    }
+    tl = transitionTimelineFor(resp->myResponseWrangler->kernelAcknowledgementID);
+    if (!tl) {
+        return;
+    }
+
+    if (tl->ackCnt < kTransitionProfileMaxAcks) {
+        ack = &tl->acks[tl->ackCnt];
+        ack->at = mach_absolute_time();
+        ack->pid = resp->connection->callerPID;
+        ack->timedout = resp->timedout;
+
+        // Long names are cut at a character boundary rather than dropped
+        name = resp->connection->callerName;
+        if (isA_CFString(name)) {
+            CFStringGetBytes(name, CFRangeMake(0, CFStringGetLength(name)), kCFStringEncodingUTF8,
+                             '?', false, (UInt8 *)ack->name, sizeof(ack->name) - 1, &used);
+        }
+        ack->name[used] = 0;
+    }
+    tl->ackCnt++;
+}
+
+/*
+ * Closes the timeline that IOAllowPowerChange() just acknowledged. A zero ID
+ * closes a timeline for a change that needed no acknowledgement.
+ */
+static void transitionProfileKernelAck(long kernelAcknowledgementID)
+{
+    transitionTimeline_t    *tl = transitionTimelineFor(kernelAcknowledgementID);
+
+    if (!tl) {
+        return;
+    }
+    if (kernelAcknowledgementID) {
+        transitionProfileMark(tl, kTransitionPhaseKernelAck);
+    }
+    transitionProfileEnd(tl);
+}
+
+static const char *transitionPhaseName(int phase)
+{
+    static const char *names[kTransitionPhaseCount] = {
+        kIOPMTransitionPhaseNotify,
+        kIOPMTransitionPhaseClientAcks,
+        kIOPMTransitionPhaseWakeEvents,
+        kIOPMTransitionPhaseKernelAck
+    };
+
+    return names[phase];
+}
+
+static void setDictionaryNum(CFMutableDictionaryRef dict, CFStringRef key, int64_t val)
+{
+    CFNumberRef num = CFNumberCreate(0, kCFNumberSInt64Type, &val);
+
+    if (num) {
+        CFDictionarySetValue(dict, key, num);
+        CFRelease(num);
+    }
+}
+
+static CFDictionaryRef copyTransitionTimeline(transitionTimeline_t *tl, uint64_t now)
+{
+    CFMutableDictionaryRef  entry = NULL;
+    CFMutableDictionaryRef  phases = NULL;
+    CFMutableDictionaryRef  oneAck = NULL;
+    CFMutableArrayRef       acks = NULL;
+    CFStringRef             str = NULL;
+    uint32_t                i;
+
+    entry = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    phases = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    acks = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    if (!entry || !phases || !acks) {
+        goto exit;
+    }
+
+    setDictionaryNum(entry, kIOPMTransitionSeqKey, tl->seq);
+    setDictionaryNum(entry, kIOPMTransitionFromCapsKey, tl->fromCapabilities);
+    setDictionaryNum(entry, kIOPMTransitionToCapsKey, tl->toCapabilities);
+    setDictionaryNum(entry, kIOPMTransitionAgeMsKey, monotonicTS2Ms(now - tl->start));
+    setDictionaryNum(entry, kIOPMTransitionAckCountKey, tl->ackCnt);
+    CFDictionarySetValue(entry, kIOPMTransitionCompleteKey,
+                         tl->open ? kCFBooleanFalse : kCFBooleanTrue);
+
+    for (i = 0; i < kTransitionPhaseCount; i++) {
+        if (!tl->phase[i]) {
+            continue;
+        }
+        str = CFStringCreateWithCString(0, transitionPhaseName(i), kCFStringEncodingUTF8);
+        if (str) {
+            setDictionaryNum(phases, str, monotonicTS2Ms(tl->phase[i] - tl->start));
+            CFRelease(str);
+        }
+    }
+    CFDictionarySetValue(entry, kIOPMTransitionPhasesKey, phases);
+
+    for (i = 0; i < MIN(tl->ackCnt, kTransitionProfileMaxAcks); i++) {
+        oneAck = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (!oneAck) {
+            break;
+        }
+        str = CFStringCreateWithCString(0, tl->acks[i].name, kCFStringEncodingUTF8);
+        if (str) {
+            CFDictionarySetValue(oneAck, kIOPMTransitionAckNameKey, str);
+            CFRelease(str);
+        }
+        setDictionaryNum(oneAck, kIOPMTransitionAckPIDKey, tl->acks[i].pid);
+        setDictionaryNum(oneAck, kIOPMTransitionAckMsKey, monotonicTS2Ms(tl->acks[i].at - tl->start));
+        CFDictionarySetValue(oneAck, kIOPMTransitionAckTimedOutKey,
+                             tl->acks[i].timedout ? kCFBooleanTrue : kCFBooleanFalse);
+        CFArrayAppendValue(acks, oneAck);
+        CFRelease(oneAck);
+    }
+    CFDictionarySetValue(entry, kIOPMTransitionAcksKey, acks);
+
+exit:
+    if (phases) CFRelease(phases);
+    if (acks) CFRelease(acks);
+    return entry;
+}
+
+__private_extern__ CFDictionaryRef copyTransitionProfile(void)
+{
+    transitionQueue_t       *q = &gTransitionQueue;
+    CFMutableDictionaryRef  result = NULL;
+    CFMutableDictionaryRef  histograms = NULL;
+    CFMutableDictionaryRef  queue = NULL;
+    CFMutableDictionaryRef  sends = NULL;
+    CFMutableArrayRef       timelines = NULL;
+    CFMutableArrayRef       counts = NULL;
+    CFDictionaryRef         entry = NULL;
+    CFStringRef             str = NULL;
+    CFNumberRef             num = NULL;
+    uint64_t                now = mach_absolute_time();
+    uint32_t                i, first;
+    int                     phase, bucket;
+
+    result = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    histograms = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    queue = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    sends = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    timelines = CFArrayCreateMutable(0, kTransitionProfileDepth, &kCFTypeArrayCallBacks);
+    if (!result || !histograms || !queue || !sends || !timelines) {
+        goto exit;
+    }
+
+    first = (gTransitionProfile.total > kTransitionProfileDepth) ?
+                (gTransitionProfile.total - kTransitionProfileDepth) : 0;
+    for (i = first; i < gTransitionProfile.total; i++) {
+        entry = copyTransitionTimeline(&gTransitionProfile.ring[i % kTransitionProfileDepth], now);
+        if (entry) {
+            CFArrayAppendValue(timelines, entry);
+            CFRelease(entry);
+        }
+    }
+    CFDictionarySetValue(result, kIOPMTransitionProfileTimelinesKey, timelines);
+
+    for (phase = 0; phase < kTransitionPhaseCount; phase++) {
+        counts = CFArrayCreateMutable(0, kIOPMTransitionHistBucketCnt, &kCFTypeArrayCallBacks);
+        str = CFStringCreateWithCString(0, transitionPhaseName(phase), kCFStringEncodingUTF8);
+        if (counts && str) {
+            for (bucket = 0; bucket < kIOPMTransitionHistBucketCnt; bucket++) {
+                num = CFNumberCreate(0, kCFNumberSInt32Type, &gTransitionProfile.hist[phase][bucket]);
+                if (num) {
+                    CFArrayAppendValue(counts, num);
+                    CFRelease(num);
+                }
+            }
+            CFDictionarySetValue(histograms, str, counts);
+        }
+        if (counts) CFRelease(counts);
+        if (str) CFRelease(str);
+    }
+    CFDictionarySetValue(result, kIOPMTransitionProfileHistogramsKey, histograms);
+
+    setDictionaryNum(queue, kIOPMTransitionQueuedKey, q->queuedCnt);
+    setDictionaryNum(queue, kIOPMTransitionCoalescedKey, q->coalescedCnt);
+    setDictionaryNum(queue, kIOPMTransitionDroppedKey, q->droppedCnt);
+    setDictionaryNum(queue, kIOPMTransitionMaxDepthKey, q->maxDepth);
+    setDictionaryNum(queue, kIOPMTransitionWaitMaxMsKey, (int64_t)q->waitMaxMs);
+    setDictionaryNum(queue, kIOPMTransitionWaitTotalMsKey, (int64_t)q->waitTotalMs);
+    CFDictionarySetValue(result, kIOPMTransitionProfileQueueKey, queue);
+
+    setDictionaryNum(sends, kIOPMTransitionSentKey, (int64_t)gSendStats.sent);
+    setDictionaryNum(sends, kIOPMTransitionDeferredKey, (int64_t)gSendStats.deferred);
+    setDictionaryNum(sends, kIOPMTransitionSendFailedKey, (int64_t)gSendStats.failed);
+    CFDictionarySetValue(result, kIOPMTransitionProfileSendsKey, sends);
+
+exit:
+    if (histograms) CFRelease(histograms);
+    if (queue) CFRelease(queue);
+    if (sends) CFRelease(sends);
+    if (timelines) CFRelease(timelines);
+    return result;
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+bool PMConnectionHandleDeadName(uint32_t connection_id)
+{
+    PMConnection    *the_connection = NULL;
+    
+    the_connection = connectionForID(connection_id);
+    
+    if (the_connection) {
+        cleanupConnection(the_connection);
+        return true;
+    } else {
+        return false;
+    }
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+static void setSystemSleepStateTracking(IOPMCapabilityBits capables)
+{
+    SCDynamicStoreRef   store = _getSharedPMDynamicStore();
+    CFStringRef         key = NULL;
+    CFNumberRef         capablesNum = NULL;
+
+    if (!store)
         return;
 
     key = SCDynamicStoreKeyCreate(0, CFSTR("%@%@"),
@@ -1526,6 +2613,65 @@ void xctSetPowerState(uint32_t powerState)
 {
     gPowerState = powerState;
 }
+
+void xctSetCapabilityBits(int capabilityBits)
+{
+    gCurrentCapabilityBits = capabilityBits;
+}
+
+CFIndex xctConnectionCount(void)
+{
+    return gConnections ? CFArrayGetCount(gConnections) : 0;
+}
+
+uint32_t xctCountConnectionsWithInterest(int interestBits)
+{
+    PMConnection    **found = NULL;
+
+    return collectConnectionsWithInterest(interestBits, &found);
+}
+
+bool xctFireNotification(int interestBits)
+{
+    return (NULL != connectionFireNotification(interestBits, 0));
+}
+
+uint32_t xctResponsePoolHeapAllocs(void)
+{
+    return gResponsePool.heapAllocCnt;
+}
+
+CFDictionaryRef xctUnpackAckOptions(const void *options, uint32_t len)
+{
+    return _io_pm_connection_acknowledge_event_unpack_payload((vm_offset_t)options, len);
+}
+
+void xctPowerCallBack(natural_t messageType, void *messageData)
+{
+    PMConnectionPowerCallBack(NULL, IO_OBJECT_NULL, messageType, messageData);
+}
+
+uint64_t xctTransitionScanCount(void)
+{
+    return gTransitionScanCnt;
+}
+
+uint64_t xctSentNotificationCount(void)
+{
+    return gSendStats.sent;
+}
+
+bool xctTransitionInFlight(void)
+{
+    return (NULL != gLastResponseWrangler);
+}
+
+void xctExpireResponses(void)
+{
+    if (gLastResponseWrangler) {
+        responsesTimedOut(NULL, gLastResponseWrangler);
+    }
+}
 #endif
 
 __private_extern__ bool isA_SleepState()
@@ -1999,27 +3145,273 @@ static void handleSleepPreventersMsg(natural_t msg, void *messageData)
 }
 #endif
 
-static bool dwLinger(CFStringRef sleepReason)
-{
+/*
+ * Dark wake linger policy
+ *
+ * A linger holds the system in dark wake for a while after it could have
+ * slept, betting that more work is about to arrive. Too long wastes awake
+ * time; too short and the system sleeps only to wake straight back up.
+ *
+ * For every linger we record when activity next arrived after it began: the
+ * first assertion created by another process (network clients take one
+ * before they use the network), or the next wake if the system slept first.
+ * Nothing within kLingerHorizon counts as no arrival. Samples are kept per
+ * sleep reason for the dark wake linger and per wake reason for the AC wake
+ * linger. Once a reason has kLingerMinSamples, its linger is whichever of
+ * 0 secs, the configured value and the recent arrival times up to
+ * kLingerMaxDuration would have kept the system awake the least over those
+ * samples, where an arrival after the linger costs the whole linger plus
+ * kLingerRewakeCost. A reason whose work reliably arrives just after the
+ * configured linger thus learns to wait for it rather than sleep and wake
+ * straight back up. Until then the configured value is used, and a
+ * configured value of 0 still turns lingering off.
+ */
+#define kLingerMaxReasons       16      // Per kind; the least recently used is replaced
+#define kLingerSampleCount      32
+#define kLingerMinSamples       8
+#define kLingerMaxDuration      60      // Same ceiling as setDwlInterval()
+#define kLingerHorizon          (2*kLingerMaxDuration)
+#define kLingerRewakeCost       20      // Awake secs of going to sleep and waking back up
+#define kLingerNoArrival        (-1.0f)
 
-    // Dark Wake Linger: After going from FullWake to DarkWake during a
-    // demand sleep, linger in darkwake for a certain amount of seconds
-    //
-    // Power Nap machines will linger on every FullWake --> DarkWake
-    // transition except emergency sleeps.
-    // Non-Power Nap machines will linger on every FullWake --> DarkWake
-    // transition except emergency sleeps, and clamshell close sleeps
+typedef enum {
+    kLingerDarkWake = 0,
+    kLingerACWake,
+    kLingerKindCount
+} lingerKind_t;
 
+typedef struct {
+    CFStringRef     reason;
+    float           arrival[kLingerSampleCount];    // Secs after the linger began, or kLingerNoArrival
+    int             count;
+    int             next;
+    int             configured;     // Configured secs at the last linger
+    int             linger;         // Secs chosen for the last linger
+    uint32_t        lingers;
+    uint64_t        lastUsed;
+} lingerReason_t;
 
-    bool isBTCapable = IOPMFeatureIsAvailable(CFSTR(kIOPMDarkWakeBackgroundTaskKey), NULL);
+typedef struct {
+    lingerReason_t  reasons[kLingerKindCount][kLingerMaxReasons];
+    uint64_t        useCount;
+    lingerReason_t  *pending;       // Linger still waiting for activity
+    CFAbsoluteTime  pendingStart;
+} lingerPolicy_t;
 
-    bool isEmergencySleep = IS_EMERGENCY_SLEEP(sleepReason);
-    bool isClamshellSleep = CFEqual(sleepReason, CFSTR(kIOPMClamshellSleepKey))?true:false;
+static lingerPolicy_t gLingerPolicy;
 
-    if ((getSessionUserActivity(NULL) == false) ||
-        isEmergencySleep ||
-        (kPMDarkWakeLingerDuration == 0) ) {
-        // Don't linger if:
+static void lingerRecord(lingerPolicy_t *p, CFAbsoluteTime now)
+{
+    lingerReason_t  *r = p->pending;
+    CFTimeInterval  d = now - p->pendingStart;
+
+    if (!r) {
+        return;
+    }
+    if (d < 0) {
+        d = 0;
+    }
+    r->arrival[r->next] = (d > kLingerHorizon) ? kLingerNoArrival : (float)d;
+    r->next = (r->next + 1) % kLingerSampleCount;
+    if (r->count < kLingerSampleCount) {
+        r->count++;
+    }
+    p->pending = NULL;
+}
+
+/* Secs the samples of 'r' would have kept the system awake with a 'linger' secs linger */
+static double lingerAwakeCost(const lingerReason_t *r, int linger)
+{
+    double  cost = 0;
+
+    for (int i = 0; i < r->count; i++) {
+        float d = r->arrival[i];
+
+        if (d == kLingerNoArrival) {
+            cost += linger;
+        } else if (d <= linger) {
+            cost += d;
+        } else {
+            cost += linger + kLingerRewakeCost;
+        }
+    }
+    return cost;
+}
+
+/*
+ * The cost only drops just as the linger reaches an arrival and grows with
+ * the linger in between, so 0 and the arrivals are the only candidates
+ * besides the configured value.
+ */
+static int lingerChoose(const lingerReason_t *r, int configured)
+{
+    int     best = configured;
+    double  bestCost, cost;
+
+    if (r->count < kLingerMinSamples) {
+        return configured;
+    }
+
+    bestCost = lingerAwakeCost(r, configured);
+    for (int i = -1; i < r->count; i++) {
+        int candidate = 0;
+
+        if (i >= 0) {
+            if (r->arrival[i] == kLingerNoArrival) {
+                continue;
+            }
+            // Assertion timeouts are whole secs; round up so the arrival is covered
+            candidate = (int)r->arrival[i];
+            if (candidate < r->arrival[i]) {
+                candidate++;
+            }
+            if (candidate > kLingerMaxDuration) {
+                continue;
+            }
+        }
+        cost = lingerAwakeCost(r, candidate);
+        if (cost < bestCost) {
+            bestCost = cost;
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+static lingerReason_t *lingerLookup(lingerPolicy_t *p, lingerKind_t kind, CFStringRef reason)
+{
+    lingerReason_t  *table = p->reasons[kind];
+    lingerReason_t  *r = NULL;
+
+    for (int i = 0; i < kLingerMaxReasons; i++) {
+        if (table[i].reason && CFEqual(table[i].reason, reason)) {
+            r = &table[i];
+            break;
+        }
+        if (!r || (table[i].lastUsed < r->lastUsed)) {
+            r = &table[i];
+        }
+    }
+    if (!r->reason || !CFEqual(r->reason, reason)) {
+        if (r->reason) {
+            CFRelease(r->reason);
+        }
+        bzero(r, sizeof(*r));
+        r->reason = CFStringCreateCopy(0, reason);
+    }
+    r->lastUsed = ++p->useCount;
+    return r;
+}
+
+/* Returns the secs to linger for 'reason', and starts watching for the next activity */
+static int lingerBegin(lingerKind_t kind, CFStringRef reason, int configured, CFAbsoluteTime now)
+{
+    lingerPolicy_t  *p = &gLingerPolicy;
+    lingerReason_t  *r = NULL;
+
+    lingerRecord(p, now);
+    if (!reason || !CFStringGetLength(reason)) {
+        reason = CFSTR("Unknown");
+    }
+    r = lingerLookup(p, kind, reason);
+    r->configured = configured;
+    r->linger = lingerChoose(r, configured);
+    r->lingers++;
+
+    p->pending = r;
+    p->pendingStart = now;
+
+    DEBUG_LOG("Linger %d secs for %@ (configured %d, %d samples)\n",
+              r->linger, reason, configured, r->count);
+    return r->linger;
+}
+
+__private_extern__ void darkWakeLingerNoteActivity(void)
+{
+    if (gLingerPolicy.pending) {
+        lingerRecord(&gLingerPolicy, CFAbsoluteTimeGetCurrent());
+    }
+}
+
+__private_extern__ CFArrayRef copyDarkWakeLingerPolicy(void)
+{
+    CFMutableArrayRef       result = NULL;
+    CFMutableDictionaryRef  entry = NULL;
+
+    result = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    if (!result) {
+        return NULL;
+    }
+
+    for (int kind = 0; kind < kLingerKindCount; kind++) {
+        for (int i = 0; i < kLingerMaxReasons; i++) {
+            lingerReason_t  *r = &gLingerPolicy.reasons[kind][i];
+            int             linger, during = 0, after = 0, none = 0;
+
+            if (!r->reason) {
+                continue;
+            }
+            entry = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+            if (!entry) {
+                continue;
+            }
+
+            linger = lingerChoose(r, r->configured);
+            for (int s = 0; s < r->count; s++) {
+                if (r->arrival[s] == kLingerNoArrival) {
+                    none++;
+                } else if (r->arrival[s] <= linger) {
+                    during++;
+                } else {
+                    after++;
+                }
+            }
+
+            CFDictionarySetValue(entry, kIOPMLingerKindKey,
+                                 (kLingerACWake == kind) ? kIOPMLingerKindACWake : kIOPMLingerKindDarkWake);
+            CFDictionarySetValue(entry, kIOPMLingerReasonKey, r->reason);
+            setDictionaryNum(entry, kIOPMLingerDurationKey, linger);
+            setDictionaryNum(entry, kIOPMLingerDefaultKey, r->configured);
+            CFDictionarySetValue(entry, kIOPMLingerLearnedKey,
+                                 (r->count >= kLingerMinSamples) ? kCFBooleanTrue : kCFBooleanFalse);
+            setDictionaryNum(entry, kIOPMLingerCountKey, r->lingers);
+            setDictionaryNum(entry, kIOPMLingerSamplesKey, r->count);
+            setDictionaryNum(entry, kIOPMLingerArrivedDuringKey, during);
+            setDictionaryNum(entry, kIOPMLingerArrivedAfterKey, after);
+            setDictionaryNum(entry, kIOPMLingerNoArrivalKey, none);
+            setDictionaryNum(entry, kIOPMLingerAwakeKey, (int64_t)lingerAwakeCost(r, linger));
+            setDictionaryNum(entry, kIOPMLingerAwakeDefaultKey, (int64_t)lingerAwakeCost(r, r->configured));
+
+            CFArrayAppendValue(result, entry);
+            CFRelease(entry);
+        }
+    }
+
+    return result;
+}
+
+static bool dwLinger(CFStringRef sleepReason)
+{
+    int linger = 0;
+
+    // Dark Wake Linger: After going from FullWake to DarkWake during a
+    // demand sleep, linger in darkwake for a certain amount of seconds
+    //
+    // Power Nap machines will linger on every FullWake --> DarkWake
+    // transition except emergency sleeps.
+    // Non-Power Nap machines will linger on every FullWake --> DarkWake
+    // transition except emergency sleeps, and clamshell close sleeps
+
+
+    bool isBTCapable = IOPMFeatureIsAvailable(CFSTR(kIOPMDarkWakeBackgroundTaskKey), NULL);
+
+    bool isEmergencySleep = IS_EMERGENCY_SLEEP(sleepReason);
+    bool isClamshellSleep = CFEqual(sleepReason, CFSTR(kIOPMClamshellSleepKey))?true:false;
+
+    if ((getSessionUserActivity(NULL) == false) ||
+        isEmergencySleep ||
+        (kPMDarkWakeLingerDuration == 0) ) {
+        // Don't linger if:
         //      user wasn't active in last full wake, or
         //      this is an emrgency sleep, or
         //      user has set linger duration to 0
@@ -2028,13 +3420,19 @@ static bool dwLinger(CFStringRef sleepReason)
 
     if((isBTCapable || (!isBTCapable && !isClamshellSleep)))
     {
+        linger = lingerBegin(kLingerDarkWake, sleepReason, kPMDarkWakeLingerDuration,
+                             CFAbsoluteTimeGetCurrent());
+        if (linger == 0) {
+            // Recent dark wakes for this reason say lingering costs more than it saves
+            return false;
+        }
 
         CFMutableDictionaryRef assertionDescription = NULL;
         assertionDescription = _IOPMAssertionDescriptionCreate(
                                                                kIOPMAssertInternalPreventSleep,
                                                                CFSTR("com.apple.powermanagement.darkwakelinger"),
                                                                NULL, CFSTR("Proxy assertion to linger in darkwake"),
-                                                               NULL, kPMDarkWakeLingerDuration,
+                                                               NULL, linger,
                                                                kIOPMAssertionTimeoutActionRelease);
 
         if (assertionDescription)
@@ -2160,6 +3558,8 @@ static void PMConnectionPowerCallBack(
 
     capArgs = (typeof(capArgs)) messageData;
 
+    transitionProfileBegin(capArgs);
+
     AutoWakeCapabilitiesNotification(capArgs->fromCapabilities, capArgs->toCapabilities);
     ClockSleepWakeNotification(capArgs->fromCapabilities, capArgs->toCapabilities,
                                capArgs->changeFlags);
@@ -2255,7 +3655,9 @@ static void PMConnectionPowerCallBack(
             // We have zero clients. Acknowledge immediately.            
 
             checkResponses_ScheduleWakeEvents(NULL);
+            transitionProfileMark(transitionTimelineFor((long)capArgs->notifyRef), kTransitionPhaseWakeEvents);
             IOAllowPowerChange(gRootDomainConnect, (long)capArgs->notifyRef);                
+            transitionProfileKernelAck((long)capArgs->notifyRef);
         }
 
 
@@ -2310,6 +3712,9 @@ static void PMConnectionPowerCallBack(
     {
         _updateWakeReason(&wakeReason, &wakeType);
 
+        // A wake soon after a linger ended is the activity it slept too early for
+        lingerRecord(&gLingerPolicy, CFAbsoluteTimeGetCurrent());
+
         // Update wake end timestamp
         updateCurrentWakeEnd(mach_absolute_time());
 
@@ -2482,16 +3887,21 @@ static void PMConnectionPowerCallBack(
 
         if ((kACPowered == _getPowerSource()) && (kPMDarkWakeLingerDuration != 0)
             && (IS_CAP_GAIN(capArgs, kIOPMSystemCapabilityCPU))) {
-            CFMutableDictionaryRef assertionDescription = NULL;
-            assertionDescription = _IOPMAssertionDescriptionCreate(
-                            kIOPMAssertInternalPreventSleep,
-                            CFSTR("com.apple.powermanagement.acwakelinger"),
-                            NULL, CFSTR("Proxy assertion to linger on darkwake with ac"),
-                            NULL, kPMACWakeLingerDuration,
-                            kIOPMAssertionTimeoutActionRelease);
-
-            InternalCreateAssertion(assertionDescription, NULL);
-            CFRelease(assertionDescription);
+            int linger = lingerBegin(kLingerACWake, wakeReason, kPMACWakeLingerDuration,
+                                     CFAbsoluteTimeGetCurrent());
+
+            if (linger != 0) {
+                CFMutableDictionaryRef assertionDescription = NULL;
+                assertionDescription = _IOPMAssertionDescriptionCreate(
+                                kIOPMAssertInternalPreventSleep,
+                                CFSTR("com.apple.powermanagement.acwakelinger"),
+                                NULL, CFSTR("Proxy assertion to linger on darkwake with ac"),
+                                NULL, linger,
+                                kIOPMAssertionTimeoutActionRelease);
+
+                InternalCreateAssertion(assertionDescription, NULL);
+                CFRelease(assertionDescription);
+            }
         }
 
 
@@ -2505,6 +3915,7 @@ static void PMConnectionPowerCallBack(
 
         if (capArgs->notifyRef)
             IOAllowPowerChange(gRootDomainConnect, (long)capArgs->notifyRef);     
+        transitionProfileKernelAck((long)capArgs->notifyRef);
                    
         SystemLoadSystemPowerStateHasChanged( );
 
@@ -2545,6 +3956,7 @@ static void PMConnectionPowerCallBack(
 
     if (capArgs->notifyRef)
         IOAllowPowerChange(gRootDomainConnect, capArgs->notifyRef);
+    transitionProfileKernelAck((long)capArgs->notifyRef);
 
 }
 
@@ -2562,7 +3974,7 @@ static PMResponseWrangler *connectionFireNotification(
     long kernelAcknowledgementID)
 {
     int                     affectedBits = 0;
-    CFArrayRef              interested = NULL;
+    PMConnection            **interested = NULL;
     PMConnection            *connection = NULL;
     int                     interestedCount = 0;
     uint32_t                messageToken = 0;
@@ -2570,17 +3982,16 @@ static PMResponseWrangler *connectionFireNotification(
     
     PMResponseWrangler      *responseWrangler = NULL;
     PMResponse              *awaitThis = NULL;
+    int                     untracked = 0;
 
     /*
-     * If a response wrangler is active, store the new notification on the
-     * active wrangler. Then wait for its completion before firing the new
-     * notification. Only the last notification is stored.
+     * If a response wrangler is active, queue the new notification and fire
+     * it once the active wrangler completes. See transitionQueue_t for the
+     * coalescing rules.
      */
     if (gLastResponseWrangler)
     {
-        gLastResponseWrangler->nextIsValid = true;
-        gLastResponseWrangler->nextInterestBits = interestBitsNotify;
-        gLastResponseWrangler->nextKernelAcknowledgementID = kernelAcknowledgementID;
+        enqueueTransition(interestBitsNotify, kernelAcknowledgementID);
         return gLastResponseWrangler;
     }
 
@@ -2596,107 +4007,104 @@ static PMResponseWrangler *connectionFireNotification(
 
     gCurrentCapabilityBits = interestBitsNotify;
 
-    interested = createArrayOfConnectionsWithInterest(affectedBits);
-    if (!interested) {
-        goto exit;
-    }
-    interestedCount = (int)CFArrayGetCount(interested);
+    interestedCount = (int)collectConnectionsWithInterest(affectedBits, &interested);
     if (0 == interestedCount) {
         goto exit;
     }
 
-    /* Allocate the response wrangler
+    /* Get a response wrangler from the pool
      *
-     * This object will be allocated & valid for the duration of 
+     * This object will be valid for the duration of 
      *   sending out notifications & awaiting responses.
+     *
+     * We will track each notification we're sending out with an individual response.
+     * Record that response in the "active response array" so we can group them
+     * all later when they acknowledge, or fail to acknowledge.
      */
-    responseWrangler = calloc(1, sizeof(PMResponseWrangler));
+    responseWrangler = acquireResponseWrangler(MIN(interestedCount, kResponsesMax));
     if (!responseWrangler) {
         goto exit;
     }
     responseWrangler->notificationType = interestBitsNotify;
-    responseWrangler->awaitResponsesTimeoutSeconds = (int)kPMConnectionNotifyTimeoutDefault;
     responseWrangler->kernelAcknowledgementID = kernelAcknowledgementID;
+    responseWrangler->generation = ++gResponseWranglerGen;
 
-    
-    /*
-     * We will track each notification we're sending out with an individual response.
-     * Record that response in the "active response array" so we can group them
-     * all later when they acknowledge, or fail to acknowledge.
-     */
-    responseWrangler->awaitingResponses = 
-                    CFArrayCreateMutable(kCFAllocatorDefault, interestedCount, &_CFArrayVanillaCallBacks);
-    responseWrangler->awaitingResponsesCount = interestedCount;
-
-    responseWrangler->responseStats =
-                    CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
     for (calloutCount=0; calloutCount<interestedCount; calloutCount++) 
     {
-        connection = (PMConnection *)CFArrayGetValueAtIndex(interested, calloutCount);
+        countTransitionScan();
+        connection = interested[calloutCount];
     
         if ((MACH_PORT_NULL == connection->notifyPort) ||
             (false == connection->notifyEnable)) {
             continue;
         }
-        
-        /* We generate a messagetoken here, which the notifiee must pass 
-         * back into us when the client acknowledges. 
-         * We note the token in the PMResponse struct.
-         *
-         * callCount is incremented by 1 to make sure messageToken is  not NULL
-         */
-        messageToken = (interestBitsNotify << 16)
-                            | (calloutCount+1);
-
-        // Mark this connection with the responseWrangler that's awaiting its responses
-        connection->responseHandler = responseWrangler;
 
-        _sendMachMessage(connection->notifyPort, 
-                            0,
-                            interestBitsNotify, 
-                            messageToken);
+        if (responseWrangler->responsesCount >= kResponsesMax) {
+            // No token index left to track a response with; notify without awaiting one
+            if (!untracked++) {
+                ERROR_LOG("Not awaiting responses beyond %d clients for notification 0x%x\n",
+                          kResponsesMax, interestBitsNotify);
+            }
+            queueMachMessage(connection, interestBitsNotify, 0);
+            continue;
+        }
 
         /* 
          * Track the response!
          */
-        awaitThis = calloc(1, sizeof(PMResponse));
+        awaitThis = acquireResponse();
         if (!awaitThis) {
-            goto exit;
+            break;
         }
 
+        /* We generate a messagetoken here, which the notifiee must pass 
+         * back into us when the client acknowledges. 
+         * We note the token in the PMResponse struct.
+         *
+         * The low bits carry the response's index in responses[], incremented
+         * by 1 to make sure messageToken is not NULL
+         */
+        messageToken = (interestBitsNotify << 16)
+                            | ((responseWrangler->responsesCount+1) & kResponseTokenIndexMask);
+
         awaitThis->token = messageToken;
         awaitThis->connection = connection;
         awaitThis->notificationType = interestBitsNotify;
         awaitThis->myResponseWrangler = responseWrangler;
         awaitThis->notifiedWhen = CFAbsoluteTimeGetCurrent();
 
-        CFArrayAppendValue(responseWrangler->awaitingResponses, awaitThis);
+        responseWrangler->responses[responseWrangler->responsesCount++] = awaitThis;
+        responseWrangler->awaitingResponsesCount++;
+
+        // The deadline covers the slowest budget among the clients actually notified
+        responseWrangler->awaitResponsesTimeoutSeconds = MAX(responseWrangler->awaitResponsesTimeoutSeconds,
+                                                             ackBudgetSecs(connection));
+
+        // Mark this connection with the responseWrangler that's awaiting its responses
+        connection->responseHandler = responseWrangler;
+        connection->response = awaitThis;
+
+        queueMachMessage(connection, interestBitsNotify, messageToken);
 
         if (gDebugFlags & kIOPMDebugLogCallbacks)
            logASLPMConnectionNotify(awaitThis->connection->callerName, interestBitsNotify );
          
     }
 
-    // TODO: Set off a timer to fire in xx30xx seconds 
-    CFRunLoopTimerContext   responseTimerContext = 
-        { 0, (void *)responseWrangler, NULL, NULL, NULL };
-    responseWrangler->awaitingResponsesTimeout = 
-            CFRunLoopTimerCreate(0, 
-                    CFAbsoluteTimeGetCurrent() + responseWrangler->awaitResponsesTimeoutSeconds, 
-                    0.0, 0, 0, responsesTimedOut, &responseTimerContext);
+    sendQueuedMachMessages();
 
-    if (responseWrangler->awaitingResponsesTimeout)
-    {
-        CFRunLoopAddTimer(CFRunLoopGetCurrent(), 
-                            responseWrangler->awaitingResponsesTimeout, 
-                            kCFRunLoopDefaultMode);
-                            
-        CFRelease(responseWrangler->awaitingResponsesTimeout);
+    if (0 == responseWrangler->awaitResponsesTimeoutSeconds) {
+        responseWrangler->awaitResponsesTimeoutSeconds = (int)kPMConnectionNotifyTimeoutDefault;
     }
+    INFO_LOG("Awaiting %d responses for up to %d secs\n",
+             responseWrangler->responsesCount, responseWrangler->awaitResponsesTimeoutSeconds);
+
+    gResponsePool.highWater = MAX(gResponsePool.highWater, responseWrangler->responsesCount);
+
+    armResponsesTimeout(responseWrangler);
 
 exit:
-    if (interested) 
-        CFRelease(interested);
+    transitionProfileMark(transitionTimelineFor(kernelAcknowledgementID), kTransitionPhaseNotify);
 
     // Record the active wrangler in a global, then clear when reaped.
     if (responseWrangler)
@@ -2709,30 +4117,26 @@ exit:
 static void sendNoRespNotification( int interestBitsNotify )
 {
 
-    CFIndex                 i, count = 0;
+    uint32_t                i, count = 0;
     // Set messageToken to 0, to indicate that we are not interested in response
     uint32_t                messageToken = 0;
+    PMConnection            **interested = NULL;
     PMConnection            *connection = NULL;
 
     INFO_LOG("sendNoRespNotification: 0x%x\n", interestBitsNotify);
-    count = CFArrayGetCount(gConnections);
+    count = collectConnectionsWithInterest(interestBitsNotify, &interested);
 
     for (i=0; i<count; i++)
     {
-        connection = (PMConnection *)CFArrayGetValueAtIndex(gConnections, i);
-
-        if ((connection->interestsBits & interestBitsNotify) == 0) 
-           continue;
+        countTransitionScan();
+        connection = interested[i];
 
         if ((MACH_PORT_NULL == connection->notifyPort) ||
             (false == connection->notifyEnable)) {
             continue;
         }
 
-        _sendMachMessage(connection->notifyPort, 
-                            0,
-                            interestBitsNotify, 
-                            messageToken);
+        queueMachMessage(connection, interestBitsNotify, messageToken);
 
 
         if (gDebugFlags & kIOPMDebugLogCallbacks)
@@ -2740,40 +4144,38 @@ static void sendNoRespNotification( int interestBitsNotify )
          
     }
 
+    sendQueuedMachMessages();
 
+    transitionProfileMark(gTransitionProfile.current, kTransitionPhaseNotify);
 }
 
 static void sendNoRespNotificationToInterestedClients( int interestBitsNotify )
 {
 
-    CFIndex                 i, count = 0;
+    uint32_t                i, count = 0;
     // Set messageToken to 0, to indicate that we are not interested in response
     uint32_t                messageToken = 0;
+    PMConnection            **interested = NULL;
     PMConnection            *connection = NULL;
     int                     affectedBits = 0;
 
 
     INFO_LOG("sendNoRespNotificationToInterestedClients: 0x%x\n", interestBitsNotify);
-    count = CFArrayGetCount(gConnections);
 
     affectedBits = interestBitsNotify ^ gCurrentCapabilityBits;
     gCurrentCapabilityBits = interestBitsNotify;
+    count = collectConnectionsWithInterest(affectedBits, &interested);
     for (i=0; i<count; i++)
     {
-        connection = (PMConnection *)CFArrayGetValueAtIndex(gConnections, i);
-
-        if ((connection->interestsBits & affectedBits) == 0) 
-           continue;
+        countTransitionScan();
+        connection = interested[i];
 
         if ((MACH_PORT_NULL == connection->notifyPort) ||
             (false == connection->notifyEnable)) {
             continue;
         }
 
-        _sendMachMessage(connection->notifyPort, 
-                            0,
-                            interestBitsNotify, 
-                            messageToken);
+        queueMachMessage(connection, interestBitsNotify, messageToken);
 
 
         if (gDebugFlags & kIOPMDebugLogCallbacks)
@@ -2781,7 +4183,9 @@ static void sendNoRespNotificationToInterestedClients( int interestBitsNotify )
          
     }
 
+    sendQueuedMachMessages();
 
+    transitionProfileMark(gTransitionProfile.current, kTransitionPhaseNotify);
 }
 /*****************************************************************************/
 /*****************************************************************************/
@@ -2797,31 +4201,33 @@ static void responsesTimedOut(CFRunLoopTimerRef timer, void * info)
 
     pidbuf[0] = 0;
 
-    if (!responseWrangler)
+    if (!responseWrangler || !responseWrangler->awaitingResponsesTimeoutArmed)
         return;
 
-    // Mark the timer as NULL since it's just fired and autoreleased.
-    responseWrangler->awaitingResponsesTimeout = NULL;
+    // The timer stays with the wrangler; it is only disarmed.
+    responseWrangler->awaitingResponsesTimeoutArmed = false;
 
     // Iterate list of awaiting responses, and tattle on anyone who hasn't 
     // acknowledged yet.
     // Artificially mark them as "replied", with their reason being "timed out"
-    responsesCount = CFArrayGetCount(responseWrangler->awaitingResponses);
+    responsesCount = responseWrangler->responsesCount;
     for (i=0; i<responsesCount; i++)
     {
-        one_response = (PMResponse *)CFArrayGetValueAtIndex(
-                                        responseWrangler->awaitingResponses, i);
+        countTransitionScan();
+        one_response = responseWrangler->responses[i];
         if (!one_response)
             continue;
         if (one_response->replied)
             continue;
 
         // Caught a tardy reply
-        one_response->replied = true;
+        markResponseReplied(one_response);
         one_response->timedout = true;
         one_response->repliedWhen = CFAbsoluteTimeGetCurrent();
         
         cacheResponseStats(one_response);
+        recordAckHistory(one_response);
+        transitionProfileAck(one_response);
 
         if (isA_CFString(one_response->connection->callerName) && 
                 CFStringGetCString(one_response->connection->callerName, appName, sizeof(appName), kCFStringEncodingUTF8))
@@ -2845,341 +4251,938 @@ typedef struct {
     uint32_t            payload[kMsgPayloadCount];
 } IOPMMessageStructure;
  
-static void _sendMachMessage(
-    mach_port_t         port, 
-    mach_msg_id_t       msg_id,
-    uint32_t            payload_bits,
-    uint32_t            payload_messagetoken)
+/* Don't wait for queue space; a full queue is retried from gDeferredSends */
+#define kSendTimeoutNone            0
+#define kSendRetryIntervalMs        50
+#define kSendRetryMaxAttempts       20      // Gives a full queue about a second to drain
+#define kDeferredSendMax            1024
+
+/* outgoingMessage_t
+ * One prepared notification in the fan-out batch.
+ */
+typedef struct {
+    IOPMMessageStructure    msg;
+    PMConnection            *connection;
+} outgoingMessage_t;
+
+/* deferredSend_t
+ * A notification whose destination queue was full. Holds the connection ID
+ * rather than a pointer, as the connection may go away before a retry.
+ */
+typedef struct {
+    uint32_t                connectionID;
+    uint32_t                payloadBits;
+    uint32_t                messageToken;
+    uint32_t                wranglerGen;        // Wrangler awaiting the reply, if messageToken is set
+    int                     attempts;
+} deferredSend_t;
+
+/* gOutgoing
+ * Fan-out batch, reused across transitions. Notifications are prepared here
+ * and sent together once every response has been set up.
+ */
+static outgoingMessage_t        *gOutgoing = NULL;
+static uint32_t                 gOutgoingCnt = 0;
+static uint32_t                 gOutgoingCap = 0;
+
+/* gDeferredSends
+ * FIFO of notifications to full queues. A connection with deferred messages
+ * has all later messages deferred behind them, so clients see them in order.
+ */
+static deferredSend_t           *gDeferredSends = NULL;
+static uint32_t                 gDeferredSendCnt = 0;
+static uint32_t                 gDeferredSendCap = 0;
+static dispatch_source_t        gDeferredSendTimer = NULL;
+static bool                     gDeferredSendArmed = false;
+static uint32_t                 gSendPass = 0;
+
+static void retryDeferredSends(void);
+
+static void prepareMachMessage(
+    IOPMMessageStructure    *msg,
+    mach_port_t             port,
+    uint32_t                payload_bits,
+    uint32_t                payload_messagetoken)
 {
-    kern_return_t        status;
-    IOPMMessageStructure msg;
-    
-    bzero(&msg, sizeof(msg));
-    
-    msg.header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
-    msg.header.msgh_size = sizeof(msg);
-    msg.header.msgh_remote_port = port;
-    msg.header.msgh_local_port = MACH_PORT_NULL;
-    msg.header.msgh_id = msg_id;
-    
-    msg.body.msgh_descriptor_count = 0;
-    
-    msg.payload[0] = payload_bits;
-    msg.payload[1] = payload_messagetoken;
+    bzero(msg, sizeof(*msg));
+
+    msg->header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+    msg->header.msgh_size = sizeof(*msg);
+    msg->header.msgh_remote_port = port;
+    msg->header.msgh_local_port = MACH_PORT_NULL;
+    msg->header.msgh_id = 0;
+
+    msg->body.msgh_descriptor_count = 0;
+
+    msg->payload[0] = payload_bits;
+    msg->payload[1] = payload_messagetoken;
+}
 
-    status = mach_msg(&msg.header,                  /* msg */
+static kern_return_t trySendMachMessage(IOPMMessageStructure *msg)
+{
+    kern_return_t   status;
+
+    status = mach_msg(&msg->header,                 /* msg */
               MACH_SEND_MSG | MACH_SEND_TIMEOUT,    /* options */
-              msg.header.msgh_size,                 /* send_size */
+              msg->header.msgh_size,                /* send_size */
               0,                                    /* rcv_size */
               MACH_PORT_NULL,                       /* rcv_name */
-              MACH_MSG_TIMEOUT_NONE,                /* timeout */
+              kSendTimeoutNone,                     /* timeout */
               MACH_PORT_NULL);                      /* notify */
 
     if (status == MACH_SEND_TIMED_OUT) {
-        mach_msg_destroy(&msg.header);
-    }
-    
-    if (status != MACH_MSG_SUCCESS)
-    {
-        // Pray for the lost message.
+        mach_msg_destroy(&msg->header);
     }
 
-    return;
+    return status;
 }
 
-static aslmsg describeWakeRequest(
-    aslmsg                  m,
-    pid_t                   pid,
-    char                    *describeType,
-    CFAbsoluteTime          requestedTime,
-    CFStringRef             clientInfoString)
+static bool isSendQueueFull(kern_return_t status)
 {
-    static int cnt = 0;
-    char    key[50];
-    char    value[512];
-
-    if (m == NULL) {
-        m = new_msg_pmset_log();
-        asl_set(m, kPMASLDomainKey, kPMASLDomainClientWakeRequests);
-        cnt = 0;
-    }
-
-    key[0] = value[0] = 0;
-    proc_name(pid, value, sizeof(value));
-    snprintf(key, sizeof(key), "%s%d", KPMASLWakeReqAppNamePrefix, cnt);
-    asl_set(m, key, value);
+    return ((MACH_SEND_TIMED_OUT == status) || (MACH_SEND_NO_BUFFER == status));
+}
 
-    snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqTypePrefix, cnt);
-    asl_set(m, key, describeType);
+static void recordSendFailure(PMConnection *connection, uint32_t payload_bits, kern_return_t status)
+{
+    clientAckHistory_t  *h = NULL;
 
-    snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqTimeDeltaPrefix, cnt);
-    snprintf(value, sizeof(value), "%.0f", requestedTime - CFAbsoluteTimeGetCurrent());
-    asl_set(m, key, value);
+    connection->sendFailCnt++;
+    gSendStats.failed++;
 
-    if (isA_CFString(clientInfoString) && 
-        (CFStringGetCString(clientInfoString, value, sizeof(value), kCFStringEncodingUTF8))) {
-        snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqClientInfoPrefix, cnt);
-        asl_set(m, key, value);
+    if ((h = ackHistoryForName(connection->callerName, true))) {
+        h->sendFailures++;
     }
-    cnt++;
 
-    return m;
+    ERROR_LOG("Failed to deliver notification 0x%x to %@(%d): 0x%x\n",
+              payload_bits, connection->callerName, connection->callerPID, status);
 }
 
-#pragma mark -
-#pragma mark CheckResponses
-
-static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
+static void armDeferredSendTimer(void)
 {
-    CFIndex                 i = 0;
-    CFIndex                 responsesCount          = 0;
-    bool                    complete                = true;
-    PMResponse              *oneResponse            = NULL;
-    aslmsg                  m = NULL;
-    int                     chosenReq = -1;
-    CFAbsoluteTime          userWake = 0.0; 
-    CFAbsoluteTime          earliestWake = kCFAbsoluteTimeIntervalSince1904; // Invalid value
-    wakeType_e              type = kChooseWakeTypeCount; // Invalid value
-    CFBooleanRef            scheduleEvent = kCFBooleanFalse;
-    bool                    userWakeReq = false, ssWakeReq = false, disableWakeReq = false;
-    int                     reqCnt = 0;
-
-    
-    if (wrangler) {
-        responsesCount = CFArrayGetCount(wrangler->awaitingResponses);
+    if (gDeferredSendArmed) {
+        return;
     }
-    
-    for (i=0; i<responsesCount; i++)
-    {
-        oneResponse = (PMResponse *)CFArrayGetValueAtIndex(wrangler->awaitingResponses, i);
-        
-        if (!oneResponse->replied) {
-            complete = false;
-            break;
-        }
-        
-        if (BIT_IS_SET(wrangler->notificationType, kIOPMSystemCapabilityCPU)) {
-            // Don't need to look at wake requests if system is not going to sleep
-            continue;
-        }
 
-        if (oneResponse->connection == NULL) {
-            // Requesting process has died. Ignore its request
-            continue;
+    if (!gDeferredSendTimer) {
+        gDeferredSendTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+        if (!gDeferredSendTimer) {
+            return;
         }
+        dispatch_source_set_event_handler(gDeferredSendTimer, ^{
+            gDeferredSendArmed = false;
+            retryDeferredSends();
+        });
+        dispatch_resume(gDeferredSendTimer);
+    }
 
-        if (VALID_DATE(oneResponse->maintenanceRequested)) 
+    dispatch_source_set_timer(gDeferredSendTimer,
+                              dispatch_time(DISPATCH_TIME_NOW, kSendRetryIntervalMs * NSEC_PER_MSEC),
+                              DISPATCH_TIME_FOREVER, kSendRetryIntervalMs * NSEC_PER_MSEC / 10);
+    gDeferredSendArmed = true;
+}
+
+static void deferMachMessage(
+    PMConnection            *connection,
+    uint32_t                payload_bits,
+    uint32_t                payload_messagetoken)
+{
+    deferredSend_t  *grown = NULL;
+    uint32_t        newCap;
+
+    if (gDeferredSendCnt == gDeferredSendCap) {
+        newCap = gDeferredSendCap ? (2 * gDeferredSendCap) : 32;
+        if ((newCap > kDeferredSendMax)
+            || !(grown = realloc(gDeferredSends, newCap * sizeof(deferredSend_t))))
         {
-            m = describeWakeRequest(m, oneResponse->connection->callerPID,
-                                    "Maintenance",
-                                    oneResponse->maintenanceRequested,
-                                    oneResponse->clientInfoString);
-            if (oneResponse->maintenanceRequested < earliestWake)
-            {
-                earliestWake = oneResponse->maintenanceRequested;
-                type = kChooseMaintenance;
-                chosenReq = reqCnt;
-            }
-            reqCnt++;
+            recordSendFailure(connection, payload_bits, MACH_SEND_NO_BUFFER);
+            return;
         }
+        gDeferredSends = grown;
+        gDeferredSendCap = newCap;
+    }
 
-        if (VALID_DATE(oneResponse->sleepServiceRequested)) 
-        {
-            if (isA_CFString(oneResponse->clientInfoStringAppRefresh)) {
-                m = describeWakeRequest(m, oneResponse->connection->callerPID,
-                                        "SleepService",
-                                        oneResponse->sleepServiceRequested,
-                                        oneResponse->clientInfoStringAppRefresh);
-            } else {
-                m = describeWakeRequest(m, oneResponse->connection->callerPID,
-                                        "SleepService",
-                                        oneResponse->sleepServiceRequested,
-                                        oneResponse->clientInfoString);
-            }
+    gDeferredSends[gDeferredSendCnt].connectionID = connection->uniqueID;
+    gDeferredSends[gDeferredSendCnt].payloadBits = payload_bits;
+    gDeferredSends[gDeferredSendCnt].messageToken = payload_messagetoken;
+    // Only the active wrangler's notifications carry a token
+    gDeferredSends[gDeferredSendCnt].wranglerGen = payload_messagetoken ? gResponseWranglerGen : 0;
+    gDeferredSends[gDeferredSendCnt].attempts = 0;
+    gDeferredSendCnt++;
 
-            if (oneResponse->sleepServiceRequested < earliestWake)
-            {
-                earliestWake = oneResponse->sleepServiceRequested;
-                type = kChooseSleepServiceWake;
-                chosenReq = reqCnt;
-            }
-            ssWakeReq = true;
-            reqCnt++;
-        }
+    connection->sendDeferredCnt++;
+    gSendStats.deferred++;
 
-        if (VALID_DATE(oneResponse->timerPluginRequested))
-        {
-            if (isA_CFString(oneResponse->clientInfoStringBGTask)) {
-                m = describeWakeRequest(m, oneResponse->connection->callerPID,
-                                        "TimerPlugin",
-                                        oneResponse->timerPluginRequested,
-                                        oneResponse->clientInfoStringBGTask);
-            } else {
-                m = describeWakeRequest(m, oneResponse->connection->callerPID,
-                                        "TimerPlugin",
-                                        oneResponse->timerPluginRequested,
-                                        oneResponse->clientInfoString);
-            }
+    armDeferredSendTimer();
+}
 
-            if (oneResponse->timerPluginRequested < earliestWake)
-            {
-                earliestWake = oneResponse->timerPluginRequested;
-                type = kChooseTimerPlugin;
-                chosenReq = reqCnt;
-            }
-            reqCnt++;
-        }
+/*
+ * Sends one prepared notification, unless earlier ones to the same client are
+ * still deferred, in which case it is deferred behind them.
+ */
+static void sendOrDeferMachMessage(PMConnection *connection, IOPMMessageStructure *msg)
+{
+    kern_return_t   status;
+
+    if (connection->sendDeferredCnt) {
+        // Stay behind the messages already waiting for this client
+        deferMachMessage(connection, msg->payload[0], msg->payload[1]);
+        return;
     }
-    
-    if ( !complete || (wrangler && BIT_IS_SET(wrangler->notificationType, kIOPMSystemCapabilityCPU)))
+
+    status = trySendMachMessage(msg);
+    if (MACH_MSG_SUCCESS == status) {
+        gSendStats.sent++;
+    } else if (isSendQueueFull(status)) {
+        deferMachMessage(connection, msg->payload[0], msg->payload[1]);
+    } else {
+        recordSendFailure(connection, msg->payload[0], status);
+    }
+}
+
+/*
+ * Adds a notification to the fan-out batch. Nothing is sent until
+ * sendQueuedMachMessages().
+ */
+static void queueMachMessage(
+    PMConnection            *connection,
+    uint32_t                payload_bits,
+    uint32_t                payload_messagetoken)
+{
+    outgoingMessage_t   *grown = NULL;
+    uint32_t            newCap;
+    IOPMMessageStructure msg;
+
+    if (gOutgoingCnt == gOutgoingCap) {
+        newCap = gOutgoingCap ? (2 * gOutgoingCap) : 64;
+        grown = realloc(gOutgoing, newCap * sizeof(outgoingMessage_t));
+        if (!grown) {
+            // Can't batch it; send it on its own
+            prepareMachMessage(&msg, connection->notifyPort, payload_bits, payload_messagetoken);
+            sendOrDeferMachMessage(connection, &msg);
+            return;
+        }
+        gOutgoing = grown;
+        gOutgoingCap = newCap;
+    }
+
+    prepareMachMessage(&gOutgoing[gOutgoingCnt].msg, connection->notifyPort,
+                       payload_bits, payload_messagetoken);
+    gOutgoing[gOutgoingCnt].connection = connection;
+    gOutgoingCnt++;
+}
+
+/*
+ * Sends the fan-out batch. No send waits for queue space, so this is bounded
+ * by the number of clients no matter how slowly they drain their queues.
+ */
+static void sendQueuedMachMessages(void)
+{
+    uint32_t            i;
+
+    for (i = 0; i < gOutgoingCnt; i++)
     {
-        // Either some clients haven't responded yet, or
-        // system is not going to sleep. So, no need to schedule wake yet
-        goto exit;
+        sendOrDeferMachMessage(gOutgoing[i].connection, &gOutgoing[i].msg);
     }
 
-    CFAbsoluteTime standbyWakeTime = 0, proxSupportWakeTime = 0;
-    if ((standbyWakeTime = getWakeFromStandbyTime())) {
-        if (standbyWakeTime < ts_nextPowerNap) {
-            standbyWakeTime = ts_nextPowerNap;
+    gOutgoingCnt = 0;
+}
+
+/*
+ * Retries deferred notifications in order. Once a client's queue is found
+ * full, its later messages wait for the next pass.
+ */
+static void retryDeferredSends(void)
+{
+    deferredSend_t          *d = NULL;
+    PMConnection            *connection = NULL;
+    IOPMMessageStructure    msg;
+    kern_return_t           status;
+    uint32_t                i, kept = 0;
+
+    gSendPass++;
+
+    for (i = 0; i < gDeferredSendCnt; i++)
+    {
+        d = &gDeferredSends[i];
+
+        connection = connectionForID(d->connectionID);
+        if (!connection || (MACH_PORT_NULL == connection->notifyPort)) {
+            // Client went away; nothing to deliver to
+            continue;
         }
 
-        INFO_LOG("Adaptive standby wake request after %f secs\n", standbyWakeTime - CFAbsoluteTimeGetCurrent());
-        m = describeWakeRequest(m, getpid(), "AdaptiveWake", standbyWakeTime, NULL);
-        if (standbyWakeTime < earliestWake) {
-            earliestWake = standbyWakeTime;
-            type = kChooseSleepServiceWake;
-            chosenReq = reqCnt;
+        if (d->messageToken
+            && (!gLastResponseWrangler || (gLastResponseWrangler->generation != d->wranglerGen)))
+        {
+            // The transition it was for is over. A later wrangler may hand out the
+            // same token, so a late ack would be credited to the wrong transition.
+            DEBUG_LOG("Dropping deferred notification 0x%x to %@(%d) for a completed transition\n",
+                      d->payloadBits, connection->callerName, connection->callerPID);
+            connection->sendDeferredCnt--;
+            continue;
+        }
+
+        if (connection->sendBlockedPass == gSendPass) {
+            gDeferredSends[kept++] = *d;
+            continue;
+        }
+
+        prepareMachMessage(&msg, connection->notifyPort, d->payloadBits, d->messageToken);
+        status = trySendMachMessage(&msg);
+
+        if (isSendQueueFull(status) && (++d->attempts < kSendRetryMaxAttempts)) {
+            connection->sendBlockedPass = gSendPass;
+            gDeferredSends[kept++] = *d;
+            continue;
+        }
+
+        connection->sendDeferredCnt--;
+        if (MACH_MSG_SUCCESS == status) {
+            gSendStats.sent++;
+        } else {
+            recordSendFailure(connection, d->payloadBits, status);
         }
-        reqCnt++;
     }
-    if ((proxSupportWakeTime = getNextWakeForProximitySupport())) {
-        if (proxSupportWakeTime < ts_nextPowerNap) {
-            proxSupportWakeTime = ts_nextPowerNap;
+
+    gDeferredSendCnt = kept;
+
+    if (gDeferredSendCnt) {
+        INFO_LOG("%d notifications still waiting for full client queues\n", gDeferredSendCnt);
+        armDeferredSendTimer();
+    }
+}
+
+#ifdef XCTEST
+void xctSendNoRespNotification(int interestBits)
+{
+    sendNoRespNotification(interestBits);
+}
+
+uint32_t xctDeferredSendCount(void)
+{
+    return gDeferredSendCnt;
+}
+
+void xctRetryDeferredSends(void)
+{
+    retryDeferredSends();
+}
+
+void xctResetLingerPolicy(void)
+{
+    for (int kind = 0; kind < kLingerKindCount; kind++) {
+        for (int i = 0; i < kLingerMaxReasons; i++) {
+            if (gLingerPolicy.reasons[kind][i].reason) {
+                CFRelease(gLingerPolicy.reasons[kind][i].reason);
+            }
         }
+    }
+    bzero(&gLingerPolicy, sizeof(gLingerPolicy));
+}
 
-        INFO_LOG("Prox support wake request after %f secs\n", proxSupportWakeTime - CFAbsoluteTimeGetCurrent());
-        m = describeWakeRequest(m, getpid(), "ProxWakeSupport", proxSupportWakeTime, NULL);
-        if (proxSupportWakeTime < earliestWake) {
-            earliestWake = proxSupportWakeTime;
-            type = kChooseSleepServiceWake;
-            chosenReq = reqCnt;
+int xctLingerBegin(bool acWake, CFStringRef reason, int configured, CFAbsoluteTime now)
+{
+    return lingerBegin(acWake ? kLingerACWake : kLingerDarkWake, reason, configured, now);
+}
+
+/* Activity or a wake at 'now', whichever ends the pending linger's wait */
+void xctLingerNoteActivity(CFAbsoluteTime now)
+{
+    lingerRecord(&gLingerPolicy, now);
+}
+
+/* The linger 'reason' would get now, without starting one */
+int xctLingerChoose(bool acWake, CFStringRef reason, int configured)
+{
+    lingerKind_t    kind = acWake ? kLingerACWake : kLingerDarkWake;
+
+    for (int i = 0; i < kLingerMaxReasons; i++) {
+        lingerReason_t *r = &gLingerPolicy.reasons[kind][i];
+
+        if (r->reason && CFEqual(r->reason, reason)) {
+            return lingerChoose(r, configured);
         }
-        reqCnt++;
     }
+    return configured;
+}
+#endif
+
+static aslmsg describeWakeRequest(
+    aslmsg                  m,
+    pid_t                   pid,
+    const char              *describeType,
+    CFAbsoluteTime          requestedTime,
+    CFStringRef             clientInfoString)
+{
+    static int cnt = 0;
+    char    key[50];
+    char    value[512];
+
+    if (m == NULL) {
+        m = new_msg_pmset_log();
+        asl_set(m, kPMASLDomainKey, kPMASLDomainClientWakeRequests);
+        cnt = 0;
+    }
+
+    key[0] = value[0] = 0;
+    proc_name(pid, value, sizeof(value));
+    snprintf(key, sizeof(key), "%s%d", KPMASLWakeReqAppNamePrefix, cnt);
+    asl_set(m, key, value);
+
+    snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqTypePrefix, cnt);
+    asl_set(m, key, describeType);
+
+    snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqTimeDeltaPrefix, cnt);
+    snprintf(value, sizeof(value), "%.0f", requestedTime - CFAbsoluteTimeGetCurrent());
+    asl_set(m, key, value);
+
+    if (isA_CFString(clientInfoString) && 
+        (CFStringGetCString(clientInfoString, value, sizeof(value), kCFStringEncodingUTF8))) {
+        snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqClientInfoPrefix, cnt);
+        asl_set(m, key, value);
+    }
+    cnt++;
 
+    return m;
+}
+#pragma mark -
+#pragma mark WakeCandidates
 
+/*
+ * Precedence of the wake types when candidates share a wake: a full wake
+ * serves everything, and a sleep service wake also serves maintenance.
+ */
+static int wakeTypeRank(wakeType_e type)
+{
+    switch (type) {
+        case kChooseFullWake:           return 3;
+        case kChooseSleepServiceWake:   return 2;
+        case kChooseMaintenance:
+        case kChooseTimerPlugin:        return 1;
+        default:                        return 0;
+    }
+}
 
+static const struct {
+    const char              *name;
+    wakeType_e              type;
+    int                     rank;               // Wins ties against lower ranks
+    bool                    darkWake;           // Held to kWakeCandidateMinLeadSecs
+    bool                    standbyDisables;    // Dropped when standby destroys the FV key
+} wakeSourceInfo[kWakeSourceCount] = {
+    [kWakeSourceMaintenance]        = { "Maintenance",      kChooseMaintenance,      1, true,  true  },
+    [kWakeSourceSleepService]       = { "SleepService",     kChooseSleepServiceWake, 1, true,  true  },
+    [kWakeSourceTimerPlugin]        = { "TimerPlugin",      kChooseTimerPlugin,      1, true,  true  },
+    [kWakeSourceAdaptiveWake]       = { "AdaptiveWake",     kChooseSleepServiceWake, 1, true,  true  },
+    [kWakeSourceProxWakeSupport]    = { "ProxWakeSupport",  kChooseSleepServiceWake, 1, true,  true  },
+    [kWakeSourceTCPKATurnOff]       = { "TCPKATurnOff",     kChooseMaintenance,      2, true,  true  },
+    [kWakeSourceUserWake]           = { "UserWake",         kChooseFullWake,         3, false, false },
+    [kWakeSourceShutdownRestart]    = { "Shutdown/Restart", kChooseFullWake,         4, false, true  },
+    [kWakeSourceAutoPowerOff]       = { "AutoPowerOff",     kChooseWakeTypeCount,    0, false, false },
+};
 
-    if (earliestWake < (CFAbsoluteTimeGetCurrent()+60)) {
-        // Make sure that wake request is at least 1 min from now
-        earliestWake = (CFAbsoluteTimeGetCurrent()+60);
+static bool wakeCandidateBefore(const wakeCandidate_t *a, const wakeCandidate_t *b)
+{
+    if (a->effective != b->effective) {
+        return (a->effective < b->effective);
+    }
+    if (wakeSourceInfo[a->source].rank != wakeSourceInfo[b->source].rank) {
+        return (wakeSourceInfo[a->source].rank > wakeSourceInfo[b->source].rank);
     }
+    if (a->deadline != b->deadline) {
+        return (a->deadline < b->deadline);
+    }
+    return (a->seq < b->seq);
+}
 
-#if TCPKEEPALIVE
-    CFAbsoluteTime ts_tcpka_turnoff = getTcpkaTurnOffTime();
-    if (VALID_DATE(ts_tcpka_turnoff)) {
-        m = describeWakeRequest(m, getpid(), "TCPKATurnOff", ts_tcpka_turnoff, NULL);
-        if (ts_tcpka_turnoff <= earliestWake) {
-            earliestWake = ts_tcpka_turnoff;
-            type = kChooseMaintenance;
-            chosenReq = reqCnt;
-            if (earliestWake < (CFAbsoluteTimeGetCurrent()+60)) {
-                // Make sure that wake request is at least 1 min from now
-                earliestWake = (CFAbsoluteTimeGetCurrent()+60);
+static void wakeCandidatesSiftUp(wakeCandidateQueue_t *q, int pos)
+{
+    int idx = q->heap[pos];
+    int parent;
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (!wakeCandidateBefore(&q->cands[idx], &q->cands[q->heap[parent]])) {
+            break;
+        }
+        q->heap[pos] = q->heap[parent];
+        pos = parent;
+    }
+    q->heap[pos] = idx;
+}
+
+static void wakeCandidatesSiftDown(wakeCandidateQueue_t *q, int pos)
+{
+    int idx = q->heap[pos];
+    int child;
+
+    while ((child = 2 * pos + 1) < q->heapCount) {
+        if ((child + 1 < q->heapCount) &&
+            wakeCandidateBefore(&q->cands[q->heap[child + 1]], &q->cands[q->heap[child]])) {
+            child++;
+        }
+        if (!wakeCandidateBefore(&q->cands[q->heap[child]], &q->cands[idx])) {
+            break;
+        }
+        q->heap[pos] = q->heap[child];
+        pos = child;
+    }
+    q->heap[pos] = idx;
+}
+
+/* Forgets the previous sleep's candidates; storage is kept for the next */
+static void wakeCandidatesReset(wakeCandidateQueue_t *q, bool darkWakesDisabled)
+{
+    for (int i = 0; i < q->count; i++) {
+        if (q->cands[i].clientInfo) {
+            CFRelease(q->cands[i].clientInfo);
+        }
+    }
+    q->count = 0;
+    q->heapCount = 0;
+    q->chosen = -1;
+    q->mergedCount = 0;
+    q->wakeType = kChooseWakeTypeCount;
+    q->darkWakesDisabled = darkWakesDisabled;
+    q->collected = CFAbsoluteTimeGetCurrent();
+}
+
+static void wakeCandidatesAdd(
+    wakeCandidateQueue_t    *q,
+    wakeSource_t            source,
+    CFAbsoluteTime          requested,
+    CFAbsoluteTime          deadline,
+    pid_t                   pid,
+    CFStringRef             clientInfo)
+{
+    wakeCandidate_t         *c = NULL;
+    CFAbsoluteTime          minLead = q->collected + kWakeCandidateMinLeadSecs;
+
+    if (q->count == q->capacity) {
+        int             newCap = q->capacity ? (2 * q->capacity) : 16;
+        wakeCandidate_t *cands = realloc(q->cands, newCap * sizeof(wakeCandidate_t));
+        int             *heap = realloc(q->heap, newCap * sizeof(int));
+
+        if (cands) q->cands = cands;
+        if (heap) q->heap = heap;
+        if (!cands || !heap) {
+            ERROR_LOG("Dropping %s wake request: out of memory\n", wakeSourceInfo[source].name);
+            return;
+        }
+        q->capacity = newCap;
+    }
+
+    c = &q->cands[q->count];
+    c->source = source;
+    c->requested = MIN(requested, deadline);
+    c->deadline = deadline;
+    c->earliest = c->requested;
+    c->effective = deadline;
+    if (source == kWakeSourceAutoPowerOff) {
+        c->effective = deadline - kAutoPowerOffSleepAhead;
+        c->earliest = c->effective;
+    } else if (wakeSourceInfo[source].darkWake) {
+        c->earliest = MAX(c->earliest, minLead);
+        c->effective = MAX(c->effective, minLead);
+    }
+    c->pid = pid;
+    c->clientInfo = isA_CFString(clientInfo) ? CFRetain(clientInfo) : NULL;
+    c->seq = q->count++;
+    c->lost = kWakeLostPending;
+
+    if (q->darkWakesDisabled && wakeSourceInfo[source].standbyDisables) {
+        c->lost = kWakeLostDisabled;
+        return;
+    }
+    q->heap[q->heapCount++] = c->seq;
+    wakeCandidatesSiftUp(q, q->heapCount - 1);
+}
+
+static wakeCandidate_t *wakeCandidatesPeek(wakeCandidateQueue_t *q)
+{
+    return q->heapCount ? &q->cands[q->heap[0]] : NULL;
+}
+
+static void wakeCandidatesPop(wakeCandidateQueue_t *q)
+{
+    if (!q->heapCount) {
+        return;
+    }
+    q->heap[0] = q->heap[--q->heapCount];
+    if (q->heapCount) {
+        wakeCandidatesSiftDown(q, 0);
+    }
+}
+
+/*
+ * Settles every candidate. Auto power off at the head of the queue wins only
+ * where the platform can power off; elsewhere it is dropped and the next
+ * candidate decides. The head wakes at its deadline, the latest time that
+ * still satisfies it, and takes along every candidate already due by then;
+ * the wake type is the one of them with the highest wakeTypeRank(), so a
+ * merged user wake still gets a full wake and a merged sleep service request
+ * still gets a sleep service wake. Returns the earliest RTC wake, which may
+ * still have lost to auto power off; q->chosen says which candidate won.
+ */
+static wakeCandidate_t *wakeCandidatesResolve(wakeCandidateQueue_t *q)
+{
+    wakeCandidate_t         *head = wakeCandidatesPeek(q);
+    wakeCandidate_t         *apo = NULL;
+    uint32_t                sleepType = kIOPMSleepTypeInvalid;
+    int                     topRank = 0;
+
+    if (head && (kWakeSourceAutoPowerOff == head->source)) {
+        wakeCandidatesPop(q);
+        getPlatformSleepType(&sleepType, NULL);
+        if (kIOPMSleepTypePowerOff == sleepType) {
+            apo = head;
+        } else {
+            head->lost = kWakeLostNotPowerOff;
+        }
+        head = wakeCandidatesPeek(q);
+    }
+
+    q->chosen = apo ? apo->seq : (head ? head->seq : -1);
+    q->mergedCount = 0;
+    q->wakeType = kChooseWakeTypeCount;
+    if (head && !apo) {
+        q->wakeType = wakeSourceInfo[head->source].type;
+        topRank = wakeTypeRank(q->wakeType);
+    }
+
+    for (int i = 0; i < q->count; i++) {
+        wakeCandidate_t *c = &q->cands[i];
+
+        if (kWakeLostPending != c->lost) {
+            continue;
+        }
+        if (i == q->chosen) {
+            c->lost = kWakeLostNone;
+        } else if (head && !apo && (kWakeSourceAutoPowerOff != c->source) &&
+                   (c->earliest <= head->effective))
+        {
+            c->lost = kWakeLostMerged;
+            q->mergedCount++;
+            if (wakeTypeRank(wakeSourceInfo[c->source].type) > topRank) {
+                q->wakeType = wakeSourceInfo[c->source].type;
+                topRank = wakeTypeRank(q->wakeType);
             }
+        } else {
+            c->lost = kWakeLostLater;
         }
-        reqCnt++;
+    }
+    return head;
+}
+
+static CFStringRef wakeLossString(wakeLoss_t lost)
+{
+    switch (lost) {
+        case kWakeLostNone:         return kIOPMWakeCandidateChosen;
+        case kWakeLostDisabled:     return kIOPMWakeCandidateDisabled;
+        case kWakeLostNotPowerOff:  return kIOPMWakeCandidateNotPowerOff;
+        case kWakeLostMerged:       return kIOPMWakeCandidateMerged;
+        default:                    return kIOPMWakeCandidateLater;
+    }
+}
+
+__private_extern__ CFArrayRef copyWakeCandidates(void)
+{
+    wakeCandidateQueue_t    *q = &gWakeCandidates;
+    CFMutableArrayRef       result = NULL;
+    CFMutableDictionaryRef  entry = NULL;
+    CFStringRef             str = NULL;
+    CFDateRef               date = NULL;
+
+    result = CFArrayCreateMutable(0, q->count, &kCFTypeArrayCallBacks);
+    if (!result) {
+        return NULL;
+    }
+
+    for (int i = 0; i < q->count; i++) {
+        wakeCandidate_t *c = &q->cands[i];
+
+        entry = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (!entry) {
+            continue;
+        }
+
+        if ((str = CFStringCreateWithCString(0, wakeSourceInfo[c->source].name, kCFStringEncodingUTF8))) {
+            CFDictionarySetValue(entry, kIOPMWakeCandidateSourceKey, str);
+            CFRelease(str);
+        }
+        setDictionaryNum(entry, kIOPMWakeCandidatePIDKey, c->pid);
+        if (c->clientInfo) {
+            CFDictionarySetValue(entry, kIOPMWakeCandidateClientInfoKey, c->clientInfo);
+        }
+        if ((date = CFDateCreate(0, c->requested))) {
+            CFDictionarySetValue(entry, kIOPMWakeCandidateRequestedKey, date);
+            CFRelease(date);
+        }
+        if ((c->requested < c->deadline) && (date = CFDateCreate(0, c->deadline))) {
+            CFDictionarySetValue(entry, kIOPMWakeCandidateDeadlineKey, date);
+            CFRelease(date);
+        }
+        if ((date = CFDateCreate(0, c->effective))) {
+            CFDictionarySetValue(entry, kIOPMWakeCandidateEffectiveKey, date);
+            CFRelease(date);
+        }
+        CFDictionarySetValue(entry, kIOPMWakeCandidateOutcomeKey, wakeLossString(c->lost));
+        if (((kWakeLostLater == c->lost) || (kWakeLostMerged == c->lost)) && (q->chosen >= 0) &&
+            (str = CFStringCreateWithCString(0, wakeSourceInfo[q->cands[q->chosen].source].name,
+                                             kCFStringEncodingUTF8)))
+        {
+            CFDictionarySetValue(entry, kIOPMWakeCandidateLostToKey, str);
+            CFRelease(str);
+        }
+
+        CFArrayAppendValue(result, entry);
+        CFRelease(entry);
+    }
+
+    return result;
+}
+
+#ifdef XCTEST
+int xctCoalesceWakeCandidates(
+    const char              **sources,
+    const CFAbsoluteTime    *requested,
+    const CFAbsoluteTime    *deadline,
+    int                     count,
+    CFAbsoluteTime          now,
+    bool                    darkWakesDisabled,
+    CFAbsoluteTime          *wakeAt,
+    bool                    *served)
+{
+    wakeCandidateQueue_t    q = { .chosen = -1 };
+    wakeCandidate_t         *head = NULL;
+    int                     chosen;
+
+    wakeCandidatesReset(&q, darkWakesDisabled);
+    q.collected = now;
+    for (int i = 0; i < count; i++) {
+        for (int s = 0; s < kWakeSourceCount; s++) {
+            if (!strcmp(sources[i], wakeSourceInfo[s].name)) {
+                wakeCandidatesAdd(&q, (wakeSource_t)s, requested[i], deadline[i], getpid(), NULL);
+                break;
+            }
+        }
+    }
+    head = wakeCandidatesResolve(&q);
+    chosen = q.chosen;
+    if (wakeAt) {
+        *wakeAt = head ? head->effective : 0;
+    }
+    for (int i = 0; served && (i < q.count); i++) {
+        served[i] = (kWakeLostNone == q.cands[i].lost) || (kWakeLostMerged == q.cands[i].lost);
+    }
+
+    wakeCandidatesReset(&q, false);
+    free(q.cands);
+    free(q.heap);
+    return chosen;
+}
+
+int xctChooseWakeCandidate(const char **sources, const CFAbsoluteTime *requested, int count, bool darkWakesDisabled)
+{
+    return xctCoalesceWakeCandidates(sources, requested, requested, count,
+                                     CFAbsoluteTimeGetCurrent(), darkWakesDisabled, NULL, NULL);
+}
 
+const char *xctChooseWakeType(const char **sources, const CFAbsoluteTime *requested, int count)
+{
+    wakeCandidateQueue_t    q = { .chosen = -1 };
+    wakeType_e              type;
+
+    wakeCandidatesReset(&q, false);
+    q.collected = CFAbsoluteTimeGetCurrent();
+    for (int i = 0; i < count; i++) {
+        for (int s = 0; s < kWakeSourceCount; s++) {
+            if (!strcmp(sources[i], wakeSourceInfo[s].name)) {
+                wakeCandidatesAdd(&q, (wakeSource_t)s, requested[i], requested[i], getpid(), NULL);
+                break;
+            }
+        }
     }
+    wakeCandidatesResolve(&q);
+    type = q.wakeType;
+
+    wakeCandidatesReset(&q, false);
+    free(q.cands);
+    free(q.heap);
+
+    switch (type) {
+        case kChooseFullWake:           return "FullWake";
+        case kChooseMaintenance:        return "Maintenance";
+        case kChooseSleepServiceWake:   return "SleepService";
+        case kChooseTimerPlugin:        return "TimerPlugin";
+        default:                        return NULL;
+    }
+}
 #endif
 
+/* "appName,appPID" of a scheduled power event, or NULL */
+static CFStringRef copyPowerEventAppInfo(CFDictionaryRef event)
+{
+    CFStringRef appName = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey));
+    CFNumberRef appPID = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppPIDKey));
+
+    if (isA_CFString(appName) && isA_CFNumber(appPID)) {
+        return CFStringCreateWithFormat(NULL, NULL, CFSTR("%@,%@"), appName, appPID);
+    }
+    return NULL;
+}
 
-    // Disable all dark wake requests if system is going to standby and kIOPMDestroyFVKeyOnStandbyKey
-    // is set. This is done by resetting earliestWake to kCFAbsoluteTimeIntervalSince1904
+#pragma mark -
+#pragma mark CheckResponses
 
+static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
+{
+    CFIndex                 i = 0;
+    CFIndex                 responsesCount          = 0;
+    bool                    complete                = true;
+    PMResponse              *oneResponse            = NULL;
+    wakeCandidateQueue_t    *q                      = &gWakeCandidates;
+    wakeCandidate_t         *rtcWake                = NULL;
+    CFDictionaryRef         event                   = NULL;
+    CFStringRef             appInfo                 = NULL;
+    aslmsg                  m = NULL;
+    int                     chosenReq = -1;
+    CFAbsoluteTime          userWake = 0.0; 
+    CFBooleanRef            scheduleEvent = kCFBooleanFalse;
+    bool                    userWakeReq = false, ssWakeReq = false, disableWakeReq = false;
+    int                     reqCnt = 0;
+
+    
+    if (wrangler) {
+        responsesCount = wrangler->responsesCount;
+    }
+    
+    for (i=0; i<responsesCount; i++)
+    {
+        countTransitionScan();
+        if (!wrangler->responses[i]->replied) {
+            complete = false;
+            break;
+        }
+    }
+    
+    if ( !complete || (wrangler && BIT_IS_SET(wrangler->notificationType, kIOPMSystemCapabilityCPU)))
+    {
+        // Either some clients haven't responded yet, or
+        // system is not going to sleep. So, no need to schedule wake yet
+        return complete;
+    }
+
+    // Disable all dark wake requests if system is going to standby and kIOPMDestroyFVKeyOnStandbyKey
+    // is set. They are still collected, so the dump shows what was dropped.
     bool destroyFVKey = GetSystemPowerSettingBool(CFSTR(kIOPMDestroyFVKeyOnStandbyKey));
     if (getDeltaToStandby() == 0 && destroyFVKey) {
         INFO_LOG("Entering standby and kIOPMDestroyFVKeyOnStandbyKey is set. Disabling dark wakes");
         disableWakeReq = true;
-        earliestWake = kCFAbsoluteTimeIntervalSince1904;
-        ssWakeReq = false;
-        chosenReq = -1;
     }
+    wakeCandidatesReset(q, disableWakeReq);
 
-    /* Check for user wake requests in the end to give highest priority, in case of conflict */
-    CFDictionaryRef event = copyEarliestRequestAutoWakeEvent();
+    for (i=0; i<responsesCount; i++)
+    {
+        countTransitionScan();
+        oneResponse = wrangler->responses[i];
+
+        if (oneResponse->connection == NULL) {
+            // Requesting process has died. Ignore its request
+            continue;
+        }
+
+        if (VALID_DATE(oneResponse->maintenanceRequested)) 
+        {
+            wakeCandidatesAdd(q, kWakeSourceMaintenance, oneResponse->maintenanceRequested,
+                              oneResponse->maintenanceRequested + oneResponse->wakeLeeway,
+                              oneResponse->connection->callerPID,
+                              oneResponse->clientInfoString);
+        }
+
+        if (VALID_DATE(oneResponse->sleepServiceRequested)) 
+        {
+            wakeCandidatesAdd(q, kWakeSourceSleepService, oneResponse->sleepServiceRequested,
+                              oneResponse->sleepServiceRequested + oneResponse->wakeLeeway,
+                              oneResponse->connection->callerPID,
+                              isA_CFString(oneResponse->clientInfoStringAppRefresh) ?
+                                oneResponse->clientInfoStringAppRefresh : oneResponse->clientInfoString);
+            ssWakeReq = !disableWakeReq;
+        }
+
+        if (VALID_DATE(oneResponse->timerPluginRequested))
+        {
+            wakeCandidatesAdd(q, kWakeSourceTimerPlugin, oneResponse->timerPluginRequested,
+                              oneResponse->timerPluginRequested + oneResponse->wakeLeeway,
+                              oneResponse->connection->callerPID,
+                              isA_CFString(oneResponse->clientInfoStringBGTask) ?
+                                oneResponse->clientInfoStringBGTask : oneResponse->clientInfoString);
+        }
+    }
+
+    CFAbsoluteTime standbyWakeTime = 0, proxSupportWakeTime = 0;
+    if ((standbyWakeTime = getWakeFromStandbyTime())) {
+        if (standbyWakeTime < ts_nextPowerNap) {
+            standbyWakeTime = ts_nextPowerNap;
+        }
+
+        INFO_LOG("Adaptive standby wake request after %f secs\n", standbyWakeTime - CFAbsoluteTimeGetCurrent());
+        wakeCandidatesAdd(q, kWakeSourceAdaptiveWake, standbyWakeTime, standbyWakeTime, getpid(), NULL);
+    }
+    if ((proxSupportWakeTime = getNextWakeForProximitySupport())) {
+        if (proxSupportWakeTime < ts_nextPowerNap) {
+            proxSupportWakeTime = ts_nextPowerNap;
+        }
+
+        INFO_LOG("Prox support wake request after %f secs\n", proxSupportWakeTime - CFAbsoluteTimeGetCurrent());
+        wakeCandidatesAdd(q, kWakeSourceProxWakeSupport, proxSupportWakeTime, proxSupportWakeTime, getpid(), NULL);
+    }
+
+#if TCPKEEPALIVE
+    CFAbsoluteTime ts_tcpka_turnoff = getTcpkaTurnOffTime();
+    if (VALID_DATE(ts_tcpka_turnoff)) {
+        wakeCandidatesAdd(q, kWakeSourceTCPKATurnOff, ts_tcpka_turnoff, ts_tcpka_turnoff, getpid(), NULL);
+    }
+#endif
+
+    /* User wake requests outrank the others, in case of conflict */
+    event = copyEarliestRequestAutoWakeEvent();
     if (event)
     {
         userWake = getWakeScheduleTime(event);
     
         if (VALID_DATE(userWake)) {
-            CFStringRef appName;
-            CFNumberRef appPID;
-            CFMutableStringRef appInfo=NULL;
-            appName = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey));
-            appPID = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppPIDKey));
-            if (isA_CFString(appName) && isA_CFNumber(appPID))
-            {
-                appInfo = CFStringCreateMutable(NULL, MAXPATHLEN);
-                CFStringAppendFormat(appInfo, NULL, CFSTR("%@,%@"),appName, appPID);
-            }
-            m = describeWakeRequest(m, getpid(), "UserWake", userWake, appInfo);
-            
-            if (userWake <= earliestWake) {
-                earliestWake = userWake;
-                type = kChooseFullWake;
-                chosenReq = reqCnt;
-            }
-            if (appInfo)
-            {
+            appInfo = copyPowerEventAppInfo(event);
+            wakeCandidatesAdd(q, kWakeSourceUserWake, getWakeEarliestTime(event), userWake, getpid(), appInfo);
+            if (appInfo) {
                 CFRelease(appInfo);
             }
             userWakeReq = true;
-            reqCnt++;
         }
         CFRelease(event);
     }
     
     /* check if there is any shutdown or restart request */
     event = copyEarliestShutdownRestartEvent();
-    if (event && !disableWakeReq)
+    if (event)
     {
         //wake up a minute before shutdown
         userWake = getWakeScheduleTime(event);
         
         if (VALID_DATE(userWake)) {
-            //schedule a wake 1 minute before shutdown/restart event
-            userWake = userWake - 60;
-            CFStringRef appName;
-            CFNumberRef appPID;
-            CFMutableStringRef appInfo=NULL;
-            appName = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey));
-            appPID = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppPIDKey));
-            if (isA_CFString(appName) && isA_CFNumber(appPID))
-            {
-                appInfo = CFStringCreateMutable(NULL, MAXPATHLEN);
-                CFStringAppendFormat(appInfo, NULL, CFSTR("%@,%@"),appName, appPID);
-            }
-            
-            if (userWake <= earliestWake) {
-                earliestWake = userWake;
-                type = kChooseFullWake;
-                chosenReq = reqCnt;
-                m = describeWakeRequest(m, getpid(), "Shutdown/Restart", userWake, appInfo);
-            }
-            if (appInfo)
-            {
+            appInfo = copyPowerEventAppInfo(event);
+            wakeCandidatesAdd(q, kWakeSourceShutdownRestart, getWakeEarliestTime(event) - 60, userWake - 60, getpid(), appInfo);
+            if (appInfo) {
                 CFRelease(appInfo);
             }
-            userWakeReq = true;
-            reqCnt++;
+            userWakeReq |= !disableWakeReq;
         }
         CFRelease(event);
     }
 
-
     if (ts_apo != 0) {
+        wakeCandidatesAdd(q, kWakeSourceAutoPowerOff, ts_apo, ts_apo, getpid(), NULL);
+
         // Report existence of user wake request or SS request to IOPPF(thru rootDomain)
         // This is used in figuring out if Auto Power Off should be scheduled
         if (userWakeReq || ssWakeReq) {
@@ -3188,50 +5191,69 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
         _setRootDomainProperty(CFSTR(kIOPMUserWakeAlarmScheduledKey), scheduleEvent);
     }
 
+    rtcWake = PMScheduleWakeEventChooseBest(q);
+
+    for (i = 0; i < q->count; i++) {
+        wakeCandidate_t *c = &q->cands[i];
+
+        if (kWakeSourceAutoPowerOff == c->source) {
+            continue;
+        }
+        m = describeWakeRequest(m, c->pid, wakeSourceInfo[c->source].name, c->requested, c->clientInfo);
+        if (c == rtcWake) {
+            chosenReq = reqCnt;
+        }
+        reqCnt++;
+    }
+
     if (m != NULL) {
         char chosenStr[5];
         snprintf(chosenStr, sizeof(chosenStr), "%d", chosenReq);
         asl_set(m, kPMASLWakeReqChosenIdx, chosenStr);
         asl_send(NULL, m);
-    }
-
-    PMScheduleWakeEventChooseBest(earliestWake, type);
-
-exit:
-
-    if (m != NULL) {
         asl_release(m);
     }
+
     return complete;
 }
 
 static void checkResponses(PMResponseWrangler *wrangler)
 {
 
+    // Every ack, timeout and client death decrements the count; nothing to
+    // do until it drains.
+    if (wrangler && (wrangler->awaitingResponsesCount > 0)) {
+        return;
+    }
+    transitionProfileMark(transitionTimelineFor(wrangler->kernelAcknowledgementID),
+                          kTransitionPhaseClientAcks);
 
     if (!checkResponses_ScheduleWakeEvents(wrangler)) {
         // Not all clients acknowledged.
         return;
     }
+    transitionProfileMark(transitionTimelineFor(wrangler->kernelAcknowledgementID),
+                          kTransitionPhaseWakeEvents);
 
 #if !TARGET_OS_WATCH
-    if (wrangler->responseStats) {
-        logASLMessageAppStats(wrangler->responseStats, kPMASLDomainPMClientStats);
-        CFRelease(wrangler->responseStats);
-        wrangler->responseStats = NULL;
+    if (wrangler->responseStatsCount) {
+        CFArrayRef responseStats = copyResponseStatsArray(wrangler);
+        if (responseStats) {
+            logASLMessageAppStats(responseStats, kPMASLDomainPMClientStats);
+            CFRelease(responseStats);
+        }
+        wrangler->responseStatsCount = 0;
     }
 #endif
 
     // Completion: all clients have acknowledged.
-    if (wrangler->awaitingResponsesTimeout) {
-        CFRunLoopTimerInvalidate(wrangler->awaitingResponsesTimeout);
-        wrangler->awaitingResponsesTimeout = NULL;
-    }
+    disarmResponsesTimeout(wrangler);
     
     // Handle PowerManagement acknowledgements
     if (wrangler->kernelAcknowledgementID) 
     {
         IOAllowPowerChange(gRootDomainConnect, wrangler->kernelAcknowledgementID);
+        transitionProfileKernelAck(wrangler->kernelAcknowledgementID);
     }
     
     cleanupResponseWrangler(wrangler);
@@ -3240,35 +5262,20 @@ static void checkResponses(PMResponseWrangler *wrangler)
 }
             
             
-static void PMScheduleWakeEventChooseBest(CFAbsoluteTime scheduleTime, wakeType_e type)
+static wakeCandidate_t *PMScheduleWakeEventChooseBest(wakeCandidateQueue_t *q)
 {
     CFStringRef     scheduleWakeType                    = NULL;
     CFNumberRef     diff_secs = NULL;
     uint64_t        secs_to_apo = ULONG_MAX;
     CFAbsoluteTime  cur_time = 0.0;
-    uint32_t        sleepType = kIOPMSleepTypeInvalid;
-    bool            skip_scheduling = false;
-    CFBooleanRef    scheduleEvent = kCFBooleanFalse;
-    
-
-    if (!VALID_DATE(scheduleTime))
-    {
-        // Set a huge number for following comaprisions with power off timer
-        scheduleTime = kCFAbsoluteTimeIntervalSince1904;
-    }
+    wakeCandidate_t *best = NULL;
+    wakeType_e      type = kChooseWakeTypeCount;
 
+    best = wakeCandidatesResolve(q);
 
     // Always set the Auto Power off timer
     if ( ts_apo != 0 ) 
     {
-        if (ts_apo < scheduleTime+kAutoPowerOffSleepAhead) {
-
-           getPlatformSleepType( &sleepType, NULL );
-           if ((scheduleEvent == kCFBooleanFalse) && (sleepType == kIOPMSleepTypePowerOff))
-               skip_scheduling = true;
-
-        }
-
         cur_time = CFAbsoluteTimeGetCurrent();
         if (cur_time >= ts_apo)
             secs_to_apo = 0;
@@ -3281,27 +5288,31 @@ static void PMScheduleWakeEventChooseBest(CFAbsoluteTime scheduleTime, wakeType_
            CFRelease(diff_secs);
         }
  
-       if ( skip_scheduling ) {
+       if ((q->chosen >= 0) && (q->cands[q->chosen].source == kWakeSourceAutoPowerOff)) {
              // Auto Power off timer is the earliest one and system is capable of
              // entering ErpLot6. Don't schedule any other wakes.
              if (gDebugFlags & kIOPMDebugLogCallbacks)
                 asl_log(0,0,ASL_LEVEL_ERR, 
                      "Not scheduling other wakes to allow AutoPower off. APO timer:%lld\n", 
                      secs_to_apo);
-             return;
+             return best;
        }
        if (gDebugFlags & kIOPMDebugLogCallbacks)
-             asl_log(0,0,ASL_LEVEL_ERR, "sleepType:%d APO timer:%lld secs\n", 
-                     sleepType, secs_to_apo);
+             asl_log(0,0,ASL_LEVEL_ERR, "APO timer:%lld secs\n", secs_to_apo);
     }
 
-    if ( scheduleTime == kCFAbsoluteTimeIntervalSince1904)
+    if (!best)
     {
        // Nothing to schedule. bail..
-       return;
+       return NULL;
     }
 
-    // INVARIANT: At least one of the WakeTimes we're evaluating has a valid date
+    type = q->wakeType;
+    if (q->mergedCount) {
+        INFO_LOG("%s wake in %.0f secs also serves %d other wake requests\n",
+                 wakeSourceInfo[best->source].name, best->effective - CFAbsoluteTimeGetCurrent(),
+                 q->mergedCount);
+    }
     if ((kChooseMaintenance == type) || (kChooseTimerPlugin == type))
     {
         scheduleWakeType = CFSTR(kIOPMMaintenanceScheduleImmediate);
@@ -3313,11 +5324,11 @@ static void PMScheduleWakeEventChooseBest(CFAbsoluteTime scheduleTime, wakeType_
         scheduleWakeType = CFSTR(kIOPMSleepServiceScheduleImmediate);
     }
 
-    if (VALID_DATE(scheduleTime) && scheduleWakeType)
+    if (scheduleWakeType)
     {
         CFDateRef theChosenDate = NULL;
 
-        if ((theChosenDate = CFDateCreate(0, scheduleTime)))
+        if ((theChosenDate = CFDateCreate(0, best->effective)))
         {
             /* Tell the RTC when PM wants to be woken up */
             IOPMSchedulePowerEvent(theChosenDate, NULL, scheduleWakeType);            
@@ -3326,48 +5337,252 @@ static void PMScheduleWakeEventChooseBest(CFAbsoluteTime scheduleTime, wakeType_
         }
     }
 
-    return ;
+    return best;
 }
             
             
 /*****************************************************************************/
 /*****************************************************************************/
 
-static CFArrayRef createArrayOfConnectionsWithInterest(
-    int interestBits)
+static bool interestBucketAdd(int bit, PMConnection *connection)
 {
-    CFMutableArrayRef       arrayFoundInterests = NULL;
-    PMConnection            *lookee;
-    CFIndex                 connectionsCount;
-    CFIndex                 i;
-    
-    
+    connectionBucket_t  *bucket = &gInterestBuckets[bit];
+    PMConnection        **grown = NULL;
+    uint32_t            newCapacity;
+
+    if (bucket->count == bucket->capacity) {
+        newCapacity = bucket->capacity ? 2 * bucket->capacity : 16;
+        grown = (PMConnection **)realloc(bucket->conns, newCapacity * sizeof(PMConnection *));
+        if (!grown) {
+            return false;
+        }
+        bucket->conns = grown;
+        bucket->capacity = newCapacity;
+    }
+
+    connection->interestIdx[bit] = bucket->count;
+    bucket->conns[bucket->count++] = connection;
+    return true;
+}
+
+static void interestBucketRemove(int bit, PMConnection *connection)
+{
+    connectionBucket_t  *bucket = &gInterestBuckets[bit];
+    uint32_t            idx = connection->interestIdx[bit];
+
+    if ((idx >= bucket->count) || (bucket->conns[idx] != connection)) {
+        return;
+    }
+
+    bucket->conns[idx] = bucket->conns[--bucket->count];
+    bucket->conns[idx]->interestIdx[bit] = idx;
+}
+
+/*
+ * Moves the connection between gInterestBuckets to match 'interests'.
+ * Every change to a connection's interestsBits must go through here.
+ */
+static void setConnectionInterests(PMConnection *connection, IOPMCapabilityBits interests)
+{
+    IOPMCapabilityBits  removed = connection->interestsBits & ~interests;
+    IOPMCapabilityBits  added = interests & ~connection->interestsBits;
+    int                 bit;
+
+    while (removed) {
+        bit = __builtin_ctz(removed);
+        removed &= removed - 1;
+        interestBucketRemove(bit, connection);
+        connection->interestsBits &= ~(1U << bit);
+    }
+
+    while (added) {
+        bit = __builtin_ctz(added);
+        added &= added - 1;
+        if (!interestBucketAdd(bit, connection)) {
+            ERROR_LOG("Failed to track interest bit %d for connection %d\n", bit, connection->uniqueID);
+            continue;
+        }
+        connection->interestsBits |= (1U << bit);
+    }
+}
+
+/*
+ * Collects every connection interested in any of 'interestBits' into the
+ * shared fan-out buffer and returns the count. The buffer is only valid until
+ * the next call.
+ */
+static uint32_t collectConnectionsWithInterest(
+    int interestBits,
+    PMConnection ***found)
+{
+    uint32_t                needed = (uint32_t)CFArrayGetCount(gConnections);
+    uint32_t                bits = (uint32_t)interestBits;
+    uint32_t                count = 0;
+    uint32_t                i;
+    connectionBucket_t      *bucket = NULL;
+    PMConnection            **grown = NULL;
+    int                     bit;
+
+    *found = gFanoutBuf;
     if (0 == interestBits)
-        return NULL;
+        return 0;
 
-    // *********        
-    
-    arrayFoundInterests = CFArrayCreateMutable(kCFAllocatorDefault, 0, &_CFArrayConnectionCallBacks);
+    if (needed > gFanoutBufCap) {
+        grown = (PMConnection **)realloc(gFanoutBuf, needed * sizeof(PMConnection *));
+        if (!grown) {
+            ERROR_LOG("Failed to grow notification fan-out buffer to %u\n", needed);
+            return 0;
+        }
+        gFanoutBuf = grown;
+        gFanoutBufCap = needed;
+        *found = gFanoutBuf;
+    }
 
-    connectionsCount = CFArrayGetCount(gConnections);
+    // A connection interested in several changing bits sits in several buckets;
+    // the generation stamp collects it only once.
+    if (++gFanoutGen == 0) {
+        gFanoutGen = 1;
+    }
 
-    for (i=0; i<connectionsCount; i++)
-    {
-        lookee = (PMConnection *)CFArrayGetValueAtIndex(gConnections, i);
+    while (bits) {
+        bit = __builtin_ctz(bits);
+        bits &= bits - 1;
+        bucket = &gInterestBuckets[bit];
 
-        // Matching interest in this connection
-        if (interestBits & lookee->interestsBits) {
-            CFArrayAppendValue(arrayFoundInterests, lookee);
+        for (i = 0; i < bucket->count; i++) {
+            countTransitionScan();
+            if (bucket->conns[i]->fanoutGen == gFanoutGen) {
+                continue;
+            }
+            bucket->conns[i]->fanoutGen = gFanoutGen;
+            gFanoutBuf[count++] = bucket->conns[i];
         }
     }
-    
-    return arrayFoundInterests;
-    
+
+    return count;
 }
 
 /*****************************************************************************/
 /*****************************************************************************/
 
+/*
+ * Connection IDs are handed out sequentially, so masking off the low bits
+ * spreads live connections evenly across the table without further mixing.
+ */
+static inline uint32_t connectionTableSlot(uint32_t connection_id)
+{
+    return connection_id & (gConnectionTableSize - 1);
+}
+
+static bool connectionTableResize(uint32_t newSize)
+{
+    PMConnection    **oldTable = gConnectionTable;
+    uint32_t        oldSize = gConnectionTableSize;
+    uint32_t        i, slot;
+
+    gConnectionTable = (PMConnection **)calloc(newSize, sizeof(PMConnection *));
+    if (!gConnectionTable) {
+        gConnectionTable = oldTable;
+        return false;
+    }
+    gConnectionTableSize = newSize;
+
+    for (i = 0; i < oldSize; i++) {
+        if (!oldTable[i]) {
+            continue;
+        }
+        slot = connectionTableSlot(oldTable[i]->uniqueID);
+        while (gConnectionTable[slot]) {
+            slot = (slot + 1) & (newSize - 1);
+        }
+        gConnectionTable[slot] = oldTable[i];
+    }
+
+    free(oldTable);
+    return true;
+}
+
+static bool connectionTableInsert(PMConnection *connection)
+{
+    uint32_t        slot;
+
+    if (2 * (gConnectionTableCnt + 1) > gConnectionTableSize) {
+        if (!connectionTableResize(gConnectionTableSize ? 2 * gConnectionTableSize : kConnectionTableMinSize)) {
+            return false;
+        }
+    }
+
+    slot = connectionTableSlot(connection->uniqueID);
+    while (gConnectionTable[slot]) {
+        slot = (slot + 1) & (gConnectionTableSize - 1);
+    }
+    gConnectionTable[slot] = connection;
+    gConnectionTableCnt++;
+
+    return true;
+}
+
+static void connectionTableRemove(uint32_t connection_id)
+{
+    uint32_t        mask = gConnectionTableSize - 1;
+    uint32_t        hole, slot, home;
+
+    if (!gConnectionTable) {
+        return;
+    }
+
+    hole = connectionTableSlot(connection_id);
+    while (gConnectionTable[hole] && (gConnectionTable[hole]->uniqueID != connection_id)) {
+        hole = (hole + 1) & mask;
+    }
+    if (!gConnectionTable[hole]) {
+        return;
+    }
+    gConnectionTable[hole] = NULL;
+    gConnectionTableCnt--;
+
+    // Backward-shift the rest of the probe run so lookups never need tombstones.
+    // An entry may move into the hole only if its home slot does not lie
+    // cyclically in (hole, slot].
+    slot = (hole + 1) & mask;
+    while (gConnectionTable[slot]) {
+        home = connectionTableSlot(gConnectionTable[slot]->uniqueID);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            gConnectionTable[hole] = gConnectionTable[slot];
+            gConnectionTable[slot] = NULL;
+            hole = slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+/*
+ * Drops a connection from gConnections and the ID table. gConnections is
+ * unordered; the last entry is swapped into the vacated position.
+ */
+static void removeConnection(PMConnection *reap)
+{
+    CFIndex         lastIdx = CFArrayGetCount(gConnections) - 1;
+    PMConnection    *moved = NULL;
+
+    connectionTableRemove(reap->uniqueID);
+    setConnectionInterests(reap, 0);
+
+    if ((reap->connectionsIdx > lastIdx)
+        || (CFArrayGetValueAtIndex(gConnections, reap->connectionsIdx) != reap))
+    {
+        ERROR_LOG("Connection %d is not at its tracked index %ld\n", reap->uniqueID, reap->connectionsIdx);
+        return;
+    }
+
+    if (reap->connectionsIdx != lastIdx) {
+        moved = (PMConnection *)CFArrayGetValueAtIndex(gConnections, lastIdx);
+        CFArraySetValueAtIndex(gConnections, reap->connectionsIdx, moved);
+        moved->connectionsIdx = reap->connectionsIdx;
+    }
+    CFArrayRemoveValueAtIndex(gConnections, lastIdx);
+}
+
 static IOReturn createConnectionWithID(PMConnection **out)
 {
     static bool     hasLoggedTooManyConnections = false;
@@ -3388,7 +5603,14 @@ static IOReturn createConnectionWithID(PMConnection **out)
     
     ((PMConnection *)*out)->uniqueID = kConnectionOffset + globalConnectionIDTally++;
 
+    if (!connectionTableInsert(*out)) {
+        free(*out);
+        *out = NULL;
+        return kIOReturnNoMemory;
+    }
+
     // Add new connection to the global tracking array
+    (*out)->connectionsIdx = CFArrayGetCount(gConnections);
     CFArrayAppendValue(gConnections, *out);
     
     return kIOReturnSuccess;
@@ -3397,24 +5619,23 @@ static IOReturn createConnectionWithID(PMConnection **out)
 /*****************************************************************************/
 /*****************************************************************************/
 
-static PMConnection *connectionForID(uint32_t findMe)
+STATIC PMConnection *connectionForID(uint32_t findMe)
 {
-    CFIndex     where = 0;
-    CFRange     theRange = CFRangeMake(0, CFArrayGetCount(gConnections));
-    PMConnection     dummy;
-    
-    // Our gConnections CFArray equality callback only checks the "uniqueID" field
-    // of the passed in PMConnection type. Searching for the value "dummy"
-    // will return the first instance with connection ID "findMe".
-
-    dummy.uniqueID = findMe;
-    where = CFArrayGetFirstIndexOfValue(gConnections, theRange, &dummy);
+    uint32_t    slot;
 
-    if (kCFNotFound == where) {
+    if (!gConnectionTable) {
         return NULL;
-    } else {
-        return (PMConnection *)CFArrayGetValueAtIndex(gConnections, where);
     }
+
+    slot = connectionTableSlot(findMe);
+    while (gConnectionTable[slot]) {
+        if (gConnectionTable[slot]->uniqueID == findMe) {
+            return gConnectionTable[slot];
+        }
+        slot = (slot + 1) & (gConnectionTableSize - 1);
+    }
+
+    return NULL;
 }
 
 // Unclamps machine from SilentRunning if the machine is currently clamped.
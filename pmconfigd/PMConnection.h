@@ -88,9 +88,42 @@ __private_extern__ int getCurrentSleepServiceCapTimeout();
 /** Sets whether processes should get modified vm behavior for darkwake. */
 __private_extern__ void setVMDarkwakeMode(bool darkwakeMode);
 __private_extern__ void cancelDarkWakeCapabilitiesTimer();
+/** Per-client sleep/wake acknowledgement history; see kIOPMConnectionMIGCopyAckHistory. */
+__private_extern__ CFArrayRef copyClientAckHistory(void);
+/** Recent sleep/wake transition timelines and phase histograms; see kIOPMConnectionMIGCopyTransitionProfile. */
+__private_extern__ CFDictionaryRef copyTransitionProfile(void);
+/** Wake candidates considered at the last sleep; see kIOPMConnectionMIGCopyWakeCandidates. */
+__private_extern__ CFArrayRef copyWakeCandidates(void);
+/** Learned dark wake linger durations and statistics; see kIOPMConnectionMIGCopyLingerPolicy. */
+__private_extern__ CFArrayRef copyDarkWakeLingerPolicy(void);
+/** Tells the linger policy that new work arrived, e.g. another process created an assertion. */
+__private_extern__ void darkWakeLingerNoteActivity(void);
 
 #ifdef XCTEST
 __private_extern__ void xctSetPowerState(uint32_t powerState);
+__private_extern__ void xctSetCapabilityBits(int capabilityBits);
+__private_extern__ CFIndex xctConnectionCount(void);
+__private_extern__ uint32_t xctCountConnectionsWithInterest(int interestBits);
+__private_extern__ bool xctFireNotification(int interestBits);
+__private_extern__ uint32_t xctResponsePoolHeapAllocs(void);
+__private_extern__ CFDictionaryRef xctUnpackAckOptions(const void *options, uint32_t len);
+__private_extern__ void xctPowerCallBack(natural_t messageType, void *messageData);
+__private_extern__ bool xctTransitionInFlight(void);
+__private_extern__ uint64_t xctTransitionScanCount(void);
+__private_extern__ uint64_t xctSentNotificationCount(void);
+__private_extern__ void xctExpireResponses(void);
+__private_extern__ int xctChooseWakeCandidate(const char **sources, const CFAbsoluteTime *requested, int count, bool darkWakesDisabled);
+__private_extern__ const char *xctChooseWakeType(const char **sources, const CFAbsoluteTime *requested, int count);
+__private_extern__ int xctCoalesceWakeCandidates(const char **sources, const CFAbsoluteTime *requested,
+                                                 const CFAbsoluteTime *deadline, int count, CFAbsoluteTime now,
+                                                 bool darkWakesDisabled, CFAbsoluteTime *wakeAt, bool *served);
+__private_extern__ void xctSendNoRespNotification(int interestBits);
+__private_extern__ uint32_t xctDeferredSendCount(void);
+__private_extern__ void xctRetryDeferredSends(void);
+__private_extern__ void xctResetLingerPolicy(void);
+__private_extern__ int xctLingerBegin(bool acWake, CFStringRef reason, int configured, CFAbsoluteTime now);
+__private_extern__ void xctLingerNoteActivity(CFAbsoluteTime now);
+__private_extern__ int xctLingerChoose(bool acWake, CFStringRef reason, int configured);
 #endif
 #endif
 
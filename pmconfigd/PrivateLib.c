@@ -3136,6 +3136,19 @@ __private_extern__ uint64_t monotonicTS2Secs(uint64_t tsc)
     return ( (tsc * timebaseInfo.numer) / (timebaseInfo.denom * NSEC_PER_SEC));
 
 }
+
+/* Converts a mach_absolute_time() interval to milliseconds */
+__private_extern__ uint64_t monotonicTS2Ms(uint64_t tsc)
+{
+    static mach_timebase_info_data_t    timebaseInfo;
+
+    if (timebaseInfo.denom == 0) {
+        mach_timebase_info(&timebaseInfo);
+    }
+
+    return ( (tsc * timebaseInfo.numer) / (timebaseInfo.denom * NSEC_PER_MSEC));
+}
+
 /* Returns monotonic continuous time in secs */
 __private_extern__ uint64_t getMonotonicContinuousTime( )
 {
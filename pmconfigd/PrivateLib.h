@@ -499,6 +499,7 @@ __private_extern__ IOReturn getNvramArgStr(char *key, char *buf, size_t bufSize)
 __private_extern__ uint64_t             getMonotonicContinuousTime( );
 __private_extern__ uint64_t             getMonotonicTime( );
 __private_extern__ uint64_t             monotonicTS2Secs(uint64_t tsc);
+__private_extern__ uint64_t             monotonicTS2Ms(uint64_t tsc);
 __private_extern__ void                 incrementSleepCnt();
 __private_extern__ const char *sleepType2String(int sleepType);
 __private_extern__ int getLastSleepType();
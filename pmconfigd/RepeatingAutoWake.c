@@ -58,9 +58,61 @@ enum {
 
 */
 
-static CFDictionaryRef  repeatingPowerOff = 0;
-static CFDictionaryRef  repeatingPowerOn = 0;
+/*
+ * Repeating power on (wake, poweron, wakeorpoweron) and power off (sleep,
+ * shutdown, restart) events. Each is an array of repeating event
+ * dictionaries, or NULL if there are none.
+ */
+static CFArrayRef       repeatingPowerOff = 0;
+static CFArrayRef       repeatingPowerOn = 0;
+
+/*
+ * Upcoming occurrences of a repeating event type, each already carrying its
+ * date and app name. They're built when the schedule, time zone or calendar
+ * changes, or once all of them have passed, so that copyNextRepeatingEvent()
+ * neither calls into CFCalendar nor allocates on every query.
+ */
+#define kRepeatOccurrenceCount      8
+
+typedef struct {
+    CFDictionaryRef     events[kRepeatOccurrenceCount];
+    CFAbsoluteTime      dates[kRepeatOccurrenceCount];
+    int                 count;
+    int                 next;       // First occurrence that hasn't passed
+    bool                valid;
+} repeatOccurrences_t;
+
+/*
+ * Every repeating event, compiled into one table per event type of
+ * (minute of the week, event) entries sorted by time. The week starts on
+ * Monday at midnight, as the days mask does. WakeOrPowerOn events are
+ * entered under both wake and poweron, which is how they're queried.
+ */
+#define kMinutesPerDay              (24 * 60)
+
+typedef struct {
+    int                 weekMinute;
+    int                 order;      // Position in the schedule; the first of equal times wins
+    CFDictionaryRef     event;      // Owned by repeatingPowerOn or repeatingPowerOff
+} repeatSlot_t;
+
+typedef struct {
+    repeatSlot_t        *slots;
+    int                 count;
+    int                 capacity;
+    repeatOccurrences_t occurrences;
+} repeatTable_t;
+
+enum {
+    kRepeatTableSleep = 0,
+    kRepeatTableShutdown,
+    kRepeatTableRestart,
+    kRepeatTableWake,
+    kRepeatTablePowerOn,
+    kRepeatTableCount
+};
 
+static repeatTable_t    repeatTables[kRepeatTableCount];
 
 
 static bool 
@@ -68,6 +120,7 @@ is_valid_repeating_dictionary(CFDictionaryRef   event)
 {
     CFNumberRef         tmp_num;
     CFStringRef         tmp_str;
+    int                 minutes;
 
     if(NULL == event) return true;
 
@@ -75,6 +128,8 @@ is_valid_repeating_dictionary(CFDictionaryRef   event)
     
     tmp_num = (CFNumberRef)CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTimeKey));
     if(!isA_CFNumber(tmp_num)) return false;
+    if(!CFNumberGetValue(tmp_num, kCFNumberIntType, &minutes)
+        || (minutes < 0) || (minutes >= kMinutesPerDay)) return false;
 
     tmp_num = (CFNumberRef)CFDictionaryGetValue(event, CFSTR(kIOPMDaysOfWeekKey));
     if(!isA_CFNumber(tmp_num)) return false;
@@ -95,6 +150,102 @@ is_valid_repeating_dictionary(CFDictionaryRef   event)
     return true;
 }
 
+/*
+ * A repeating power on or off list is either a single repeating event
+ * dictionary or an array of up to kIOPMMaxRepeatingEvents of them.
+ */
+static bool
+is_valid_repeating_events(CFTypeRef events)
+{
+    CFIndex     i, count;
+
+    if (!isA_CFArray(events))
+        return is_valid_repeating_dictionary(events);
+
+    count = CFArrayGetCount(events);
+    if (count > kIOPMMaxRepeatingEvents)
+        return false;
+
+    for (i = 0; i < count; i++) {
+        if (!isA_CFDictionary(CFArrayGetValueAtIndex(events, i))
+            || !is_valid_repeating_dictionary(CFArrayGetValueAtIndex(events, i)))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Returns the repeating events stored under 'key', or NULL. Anything other
+ * than a dictionary or an array means there are none.
+ */
+static CFTypeRef
+getRepeatingEvents(CFDictionaryRef dict, CFStringRef key)
+{
+    CFTypeRef   events = CFDictionaryGetValue(dict, key);
+
+    if (!isA_CFDictionary(events) && !isA_CFArray(events))
+        return NULL;
+    return events;
+}
+
+/*
+ * Returns a new array holding 'events', or NULL if there are none.
+ */
+static CFArrayRef
+createRepeatingEventArray(CFTypeRef events)
+{
+    if (isA_CFDictionary(events))
+        return CFArrayCreate(0, &events, 1, &kCFTypeArrayCallBacks);
+
+    if (isA_CFArray(events) && CFArrayGetCount(events))
+        return CFArrayCreateCopy(0, events);
+
+    return NULL;
+}
+
+/*
+ * Returns a new array of 'events' with its first event replaced by 'first',
+ * or dropped if 'first' is NULL. This is how a request from a client that
+ * only knows about one event of each class is applied.
+ */
+static CFArrayRef
+createWithFirstRepeatingEvent(CFArrayRef events, CFDictionaryRef first)
+{
+    CFMutableArrayRef   result;
+
+    if (events)
+        result = CFArrayCreateMutableCopy(0, 0, events);
+    else
+        result = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    if (!result)
+        return NULL;
+
+    if (CFArrayGetCount(result))
+        CFArrayRemoveValueAtIndex(result, 0);
+    if (first)
+        CFArrayInsertValueAtIndex(result, 0, first);
+
+    if (!CFArrayGetCount(result)) {
+        CFRelease(result);
+        return NULL;
+    }
+    return result;
+}
+
+/*
+ * Stores 'events' the way they're kept on disk and handed to clients: the
+ * first under 'key', where clients that only know about one look for it,
+ * and all of them under 'listKey'.
+ */
+static void
+setRepeatingEventsValues(CFMutableDictionaryRef dict, CFStringRef key, CFStringRef listKey, CFArrayRef events)
+{
+    if (!events)
+        return;
+    CFDictionarySetValue(dict, key, CFArrayGetValueAtIndex(events, 0));
+    CFDictionarySetValue(dict, listKey, events);
+}
+
 static int
 getRepeatingDictionaryMinutes(CFDictionaryRef event)
 {
@@ -135,72 +286,194 @@ getRepeatingDictionaryType(CFDictionaryRef event)
     return return_string;
 }
 
-// returns false if event occurs at 8PM and now it's 10PM
-// returns true if event occurs at 8PM, now it's 9AM
+static CFStringRef
+repeatTableType(int idx)
+{
+    switch (idx) {
+        case kRepeatTableSleep:     return CFSTR(kIOPMAutoSleep);
+        case kRepeatTableShutdown:  return CFSTR(kIOPMAutoShutdown);
+        case kRepeatTableRestart:   return CFSTR(kIOPMAutoRestart);
+        case kRepeatTableWake:      return CFSTR(kIOPMAutoWake);
+        case kRepeatTablePowerOn:   return CFSTR(kIOPMAutoPowerOn);
+    }
+    return CFSTR("");
+}
+
+/*
+ * Returns the table a query for 'type' is served from, or -1. WakeOrPowerOn
+ * has no table of its own; those events are returned to wake and poweron.
+ */
+static int
+repeatTableIndex(CFStringRef type)
+{
+    int i;
+
+    for (i = 0; i < kRepeatTableCount; i++) {
+        if (CFEqual(type, repeatTableType(i)))
+            return i;
+    }
+    return -1;
+}
+
+static void
+flushOccurrences(repeatOccurrences_t *occ)
+{
+    int i;
+
+    for (i = 0; i < occ->count; i++) {
+        CFRelease(occ->events[i]);
+    }
+    bzero(occ, sizeof(*occ));
+}
+
 static bool
-upcomingToday(CFDictionaryRef event, int today_cf)
+addRepeatSlot(repeatTable_t *table, int weekMinute, int order, CFDictionaryRef event)
 {
-    static const int        kAllowScheduleWindowSeconds = 5;
-    uint32_t                secondsToday;
-    int                     secondsScheduled;
-	int						days_mask;
-    if(!event) return false;
-    
-    // Determine if the scheduled event falls on today's day of week
-    days_mask = getRepeatingDictionaryDayMask(event);
-    if(!(days_mask & (1 << (today_cf-1)))) return false;
-    
-    // get gregorian date for right now
-    int hour, minute;
-    CFCalendarDecomposeAbsoluteTime(_gregorian(), CFAbsoluteTimeGetCurrent(), "Hm", &hour, &minute);
-    
-    secondsToday = 60 * (hour*60 + minute);
-    secondsScheduled = 60 * getRepeatingDictionaryMinutes(event);
-
-    // Initially, we required a 2 minute safety window before scheduling the next
-    // power event. Now, we throw caution to the wind and try a 5 second window.
-    // Lost events will simply be lost events.
-    if(secondsScheduled >= (secondsToday + kAllowScheduleWindowSeconds))
-        return true;
-    else 
-        return false;
+    repeatSlot_t    *slots;
+    int             capacity;
+
+    if (table->count == table->capacity) {
+        capacity = table->capacity ? 2 * table->capacity : 8;
+        slots = realloc(table->slots, capacity * sizeof(*slots));
+        if (!slots) {
+            return false;
+        }
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+
+    table->slots[table->count].weekMinute = weekMinute;
+    table->slots[table->count].order = order;
+    table->slots[table->count].event = event;
+    table->count++;
+    return true;
 }
 
-// daysUntil
-// returns 0 if the event is upcoming today
-// otherwise returns days until next repeating event, in range 1-7
 static int
-daysUntil(CFDictionaryRef event, int today_cf_day_of_week)
+repeatSlotCompare(const void *a, const void *b)
 {
-    int days_mask = getRepeatingDictionaryDayMask(event);
-    int check = today_cf_day_of_week % 7;
+    const repeatSlot_t  *s1 = (const repeatSlot_t *)a;
+    const repeatSlot_t  *s2 = (const repeatSlot_t *)b;
 
-    if(0 == days_mask) return -1;
+    if (s1->weekMinute != s2->weekMinute)
+        return (s1->weekMinute < s2->weekMinute) ? -1 : 1;
+    return (s1->order < s2->order) ? -1 : (s1->order > s2->order);
+}
 
-    if(upcomingToday(event, today_cf_day_of_week)) return 0;
+/*
+ * Rebuilds the per-type tables from repeatingPowerOn and repeatingPowerOff.
+ * Returns a bit per table that now has entries.
+ */
+static uint32_t
+compileRepeatTables(void)
+{
+    CFArrayRef          lists[] = { repeatingPowerOn, repeatingPowerOff };
+    CFDictionaryRef     event;
+    CFStringRef         type;
+    repeatTable_t       *table;
+    int                 tables[2];
+    int                 ntables, days_mask, minutes, order = 0;
+    int                 i, j, k, day, kept;
+    CFIndex             idx;
+    uint32_t            nonEmpty = 0;
+
+    for (i = 0; i < kRepeatTableCount; i++) {
+        flushOccurrences(&repeatTables[i].occurrences);
+        repeatTables[i].count = 0;
+    }
+
+    for (i = 0; i < 2; i++) {
+        for (idx = 0; lists[i] && (idx < CFArrayGetCount(lists[i])); idx++)
+        {
+            event = CFArrayGetValueAtIndex(lists[i], idx);
+            type = getRepeatingDictionaryType(event);
+            if (CFEqual(type, CFSTR(kIOPMAutoWakeOrPowerOn))) {
+                tables[0] = kRepeatTableWake;
+                tables[1] = kRepeatTablePowerOn;
+                ntables = 2;
+            } else if ((tables[0] = repeatTableIndex(type)) >= 0) {
+                ntables = 1;
+            } else {
+                continue;
+            }
+
+            days_mask = getRepeatingDictionaryDayMask(event);
+            minutes = getRepeatingDictionaryMinutes(event);
+            for (day = 0; day < 7; day++)
+            {
+                if (!(days_mask & (1 << day)))
+                    continue;
+                for (j = 0; j < ntables; j++) {
+                    if (!addRepeatSlot(&repeatTables[tables[j]], day * kMinutesPerDay + minutes, order, event)) {
+                        ERROR_LOG("Failed to compile repeating %{public}@ events\n", type);
+                    }
+                }
+            }
+            order++;
+        }
+    }
 
-    // Note: CF days start counting at 1, the bit mask starts counting at 0.
-    // Therefore, since we're tossing the CF day of week into a variable (check)
-    // that we're checking the bitmask with, "check" effectively refers
-    // to tomorrow, whlie today_cf_day_of_week refers to today.
-    while(!(days_mask & (1<<check)))
+    for (i = 0; i < kRepeatTableCount; i++)
     {
-        check = (check + 1) % 7;
+        table = &repeatTables[i];
+        if (!table->count)
+            continue;
+
+        // Keep only the first event of any that repeat at the same time
+        qsort(table->slots, table->count, sizeof(*table->slots), repeatSlotCompare);
+        for (k = 1, kept = 1; k < table->count; k++) {
+            if (table->slots[k].weekMinute != table->slots[kept - 1].weekMinute)
+                table->slots[kept++] = table->slots[k];
+        }
+        table->count = kept;
+        nonEmpty |= (1 << i);
     }
-    check -= today_cf_day_of_week;
-	check++;	// adjust for CF day of week (1-7) vs. bitmask day of week (0-6)
-    
-    //  If the target day is next week, but earlier in the week than today, 
-	//  check will be negative.  Mod of negative is bogus, so we add an extra
-	//  7 days to make all work.
 
-    check += 7;
-    check %= 7;
-    if(check == 0) check = 7;
+    return nonEmpty;
+}
 
-    return check;
+/*
+ * Reschedules every event type with a bit set in 'tables', in case
+ * the repeating events changed which of its events comes first.
+ */
+static void
+scheduleRepeatTables(uint32_t tables)
+{
+    int i;
+
+    for (i = 0; i < kRepeatTableCount; i++) {
+        if (tables & (1 << i))
+            schedulePowerEventType(repeatTableType(i));
+    }
 }
 
+/*
+ * Replaces the repeating events, taking ownership of 'off' and 'on'.
+ * Returns a bit per table that had or now has entries.
+ */
+static uint32_t
+setRepeatingEvents(CFArrayRef off, CFArrayRef on)
+{
+    uint32_t    tables = 0;
+    int         i;
+
+    for (i = 0; i < kRepeatTableCount; i++) {
+        if (repeatTables[i].count)
+            tables |= (1 << i);
+    }
+
+    if (repeatingPowerOff)
+        CFRelease(repeatingPowerOff);
+    if (repeatingPowerOn)
+        CFRelease(repeatingPowerOn);
+    repeatingPowerOff = off;
+    repeatingPowerOn = on;
+
+    tables |= compileRepeatTables();
+    AutoWakeRepeatingChange();
+
+    return tables;
+}
 
 /* 
  * Copy Events from on-disk file. We should be doing this only
@@ -210,39 +483,41 @@ static void
 copyScheduledRepeatPowerEvents(void)
 {
     SCPreferencesRef        prefs;
-    CFDictionaryRef         tmp;
+    CFTypeRef               off, on;
    
     prefs = SCPreferencesCreate(0, 
                                CFSTR("PM-configd-AutoWake"),
                                 CFSTR(kIOPMAutoWakePrefsPath));
     if(!prefs) return;
 
-    if (repeatingPowerOff) CFRelease(repeatingPowerOff);
-    if (repeatingPowerOn) CFRelease(repeatingPowerOn);
+    // Prefer the full lists; files written before them only have the single events
+    off = SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOffListKey));
+    if (!off)
+        off = SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOffKey));
+    if (!is_valid_repeating_events(off))
+        off = NULL;
 
-    tmp = (CFDictionaryRef)SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOffKey));
-    if (tmp && isA_CFDictionary(tmp))
-        repeatingPowerOff = CFDictionaryCreateMutableCopy(0,0,tmp);
+    on = SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOnListKey));
+    if (!on)
+        on = SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOnKey));
+    if (!is_valid_repeating_events(on))
+        on = NULL;
 
-    tmp = (CFDictionaryRef)SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOnKey));
-    if (tmp && isA_CFDictionary(tmp))
-        repeatingPowerOn = CFDictionaryCreateMutableCopy(0,0,tmp);
+    setRepeatingEvents(createRepeatingEventArray(off), createRepeatingEventArray(on));
 
     CFRelease(prefs);
 }
 
 /*
- * Returns a copy of repeat event after changing the repeat date
- * into next event date.
- *
- * Caller is responsible for releasing the copy after use.
+ * Fills the table's occurrences with its next kRepeatOccurrenceCount
+ * entries after 'now'. An occurrence in the current minute has passed.
  */
-__private_extern__ CFDictionaryRef
-copyNextRepeatingEvent(CFStringRef type)
+static void
+buildOccurrences(repeatTable_t *table, CFAbsoluteTime now)
 {
-    CFDictionaryRef         repeatDict = NULL;
-    CFStringRef             repeatDictType = NULL;
-    CFMutableDictionaryRef  repeatDictCopy = NULL;
+    repeatOccurrences_t     *occ = &table->occurrences;
+    repeatSlot_t            *slot = NULL;
+    CFMutableDictionaryRef  event = NULL;
     CFAbsoluteTime          ev_time = 0.0;
     CFAbsoluteTime          adjustedForDays = 0.0;
     CFDateRef               ev_date = NULL;
@@ -251,10 +526,92 @@ copyNextRepeatingEvent(CFStringRef type)
     int                     month = 0;
     int                     day = 0;
     int                     day_of_week = 0;
-    int                     myhour = 0;
-    int                     myminute = 0;
-    int                     mysecond = 0;
-    int                     days_until_event = 0;
+    int                     hour = 0;
+    int                     minute = 0;
+    int                     today, now_minute, days;
+    int                     lo, hi, mid, i;
+
+    flushOccurrences(occ);
+    occ->valid = true;
+
+    if (!table->count)
+        return;
+
+    // CFCalendarDecomposeAbsoluteTime starts week with Sunday as "1".
+    // The table's week starts with Monday as day 0.
+    CFCalendarDecomposeAbsoluteTime(_gregorian(), now, "EHm", &day_of_week, &hour, &minute);
+    today = (day_of_week + 5) % 7;
+    now_minute = today * kMinutesPerDay + hour * 60 + minute;
+
+    // First entry after the current minute
+    lo = 0;
+    hi = table->count;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (table->slots[mid].weekMinute <= now_minute)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // Entries a DST change skips over are dropped, so allow a few spares
+    for (i = 0; (i < 2 * kRepeatOccurrenceCount) && (occ->count < kRepeatOccurrenceCount); i++)
+    {
+        slot = &table->slots[(lo + i) % table->count];
+        days = 7 * ((lo + i) / table->count) + slot->weekMinute / kMinutesPerDay - today;
+        minutes_scheduled = slot->weekMinute % kMinutesPerDay;
+
+        adjustedForDays = now;
+        CFCalendarAddComponents(_gregorian(), &adjustedForDays, 0, "d", days);
+        CFCalendarDecomposeAbsoluteTime(_gregorian(), adjustedForDays, "yMd", &year, &month, &day);
+        CFCalendarComposeAbsoluteTime(_gregorian(), &ev_time, "yMdHms", year, month, day,
+                                      minutes_scheduled / 60, minutes_scheduled % 60, 0);
+        if ((ev_time <= now) || (occ->count && (ev_time <= occ->dates[occ->count - 1])))
+            continue;
+
+        event = CFDictionaryCreateMutableCopy(0, 0, slot->event);
+        ev_date = CFDateCreate(0, ev_time);
+        if (!event || !ev_date) {
+            if (event) CFRelease(event);
+            if (ev_date) CFRelease(ev_date);
+            break;
+        }
+        CFDictionarySetValue(event, CFSTR(kIOPMPowerEventTimeKey), ev_date);
+        CFDictionarySetValue(event, CFSTR(kIOPMPowerEventAppNameKey), CFSTR(kIOPMRepeatingAppName));
+        CFRelease(ev_date);
+
+        occ->events[occ->count] = event;
+        occ->dates[occ->count] = ev_time;
+        occ->count++;
+    }
+}
+
+/*
+ * The schedule, time zone or calendar has changed. Occurrences are rebuilt
+ * on the next query.
+ */
+__private_extern__ void
+RepeatingAutoWake_flushOccurrences(void)
+{
+    int i;
+
+    for (i = 0; i < kRepeatTableCount; i++) {
+        flushOccurrences(&repeatTables[i].occurrences);
+    }
+}
+
+/*
+ * Returns the next occurrence of any repeating event of this type, dated.
+ *
+ * Caller is responsible for releasing the copy after use.
+ */
+__private_extern__ CFDictionaryRef
+copyNextRepeatingEvent(CFStringRef type)
+{
+    repeatTable_t           *table = NULL;
+    repeatOccurrences_t     *occ = NULL;
+    CFAbsoluteTime          now = 0.0;
+    int                     idx;
 
     /*
      * 'WakeOrPowerOn' repeat events are returned when caller asks
@@ -262,62 +619,29 @@ copyNextRepeatingEvent(CFStringRef type)
      * Don't bother to return anything if caller is looking specifically for
      * WakeOrPowerOn type repeat events.
      */
-    if( CFEqual(type, CFSTR(kIOPMAutoSleep))
-        || CFEqual(type, CFSTR(kIOPMAutoShutdown))
-        || CFEqual(type, CFSTR(kIOPMAutoRestart)) )
-    {
-        repeatDict = repeatingPowerOff;
-    }
-    else if (
-        CFEqual(type, CFSTR(kIOPMAutoPowerOn)) ||
-        CFEqual(type, CFSTR(kIOPMAutoWake)) )
-    {
-        repeatDict = repeatingPowerOn;
-    }
-    else
+    idx = repeatTableIndex(type);
+    if (idx < 0)
         return NULL;
+    table = &repeatTables[idx];
+    occ = &table->occurrences;
 
-    repeatDictType = getRepeatingDictionaryType(repeatDict);
-    if (CFEqual(type, repeatDictType) ||
-            ( (CFEqual(repeatDictType, CFSTR(kIOPMAutoWakeOrPowerOn))) &&
-              (CFEqual(type, CFSTR(kIOPMAutoPowerOn)) || CFEqual(type, CFSTR(kIOPMAutoWake)))
-            )
-       )
-    {
-        repeatDictCopy = CFDictionaryCreateMutableCopy(0,0,repeatDict);
-        if (!repeatDictCopy)
-            return NULL;
-
-        CFCalendarDecomposeAbsoluteTime(_gregorian(), CFAbsoluteTimeGetCurrent(), "E", &day_of_week);
-
-        // CFCalendarDecomposeAbsoluteTime starts week with Sunday as "1".
-        // IOPMScheduleRepeatingPowerEvent() is defined to start week with Monday as "1".
-        // Reduce day_of_week by 1 to match with week used by IOPMScheduleRepeatingPowerEvent.
-        
-        day_of_week = (day_of_week == 1) ? 7 : --day_of_week;
-        days_until_event = daysUntil(repeatDict, day_of_week);
-
-        adjustedForDays = CFAbsoluteTimeGetCurrent();
-        CFCalendarAddComponents(_gregorian(), &adjustedForDays, 0, "d", days_until_event);
-        CFCalendarDecomposeAbsoluteTime(_gregorian(), adjustedForDays, "yMd", &year, &month, &day);
-
-        minutes_scheduled = getRepeatingDictionaryMinutes(repeatDict);
-
-        myhour = minutes_scheduled/60;
-        myminute = minutes_scheduled%60;
-        mysecond = 0;
+    if (!table->count)
+        return NULL;
 
-        CFCalendarComposeAbsoluteTime(_gregorian(), &ev_time, "yMdHms", year, month, day, myhour, myminute, mysecond);
-        
-        ev_date = CFDateCreate(0, ev_time);
-        if (ev_date) {
-            CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventTimeKey), ev_date);
-            CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventAppNameKey), CFSTR(kIOPMRepeatingAppName));
-            CFRelease(ev_date);
-        }
+    now = autoWakeNow();
+    if (!occ->valid) {
+        buildOccurrences(table, now);
+    }
+    while ((occ->next < occ->count) && (occ->dates[occ->next] <= now)) {
+        occ->next++;
+    }
+    if (occ->next && (occ->next == occ->count)) {
+        buildOccurrences(table, now);
     }
+    if (occ->next >= occ->count)
+        return NULL;
 
-    return repeatDictCopy;
+    return CFRetain(occ->events[occ->next]);
 }
 
 
@@ -334,23 +658,31 @@ updateRepeatEventsOnDisk(SCPreferencesRef prefs)
     IOReturn ret = kIOReturnSuccess;
 
     if (repeatingPowerOn) {
-        if(!SCPreferencesSetValue(prefs, CFSTR(kIOPMRepeatingPowerOnKey), repeatingPowerOn)) 
+        if(!SCPreferencesSetValue(prefs, CFSTR(kIOPMRepeatingPowerOnKey), CFArrayGetValueAtIndex(repeatingPowerOn, 0))
+            || !SCPreferencesSetValue(prefs, CFSTR(kIOPMRepeatingPowerOnListKey), repeatingPowerOn))
         {
             ret = kIOReturnError;
             goto exit;
         }
     }
-    else SCPreferencesRemoveValue(prefs, CFSTR(kIOPMRepeatingPowerOnKey));
+    else {
+        SCPreferencesRemoveValue(prefs, CFSTR(kIOPMRepeatingPowerOnKey));
+        SCPreferencesRemoveValue(prefs, CFSTR(kIOPMRepeatingPowerOnListKey));
+    }
 
 
     if (repeatingPowerOff) {
-        if(!SCPreferencesSetValue(prefs, CFSTR(kIOPMRepeatingPowerOffKey), repeatingPowerOff)) 
+        if(!SCPreferencesSetValue(prefs, CFSTR(kIOPMRepeatingPowerOffKey), CFArrayGetValueAtIndex(repeatingPowerOff, 0))
+            || !SCPreferencesSetValue(prefs, CFSTR(kIOPMRepeatingPowerOffListKey), repeatingPowerOff))
         {
             ret = kIOReturnError;
             goto exit;
         }
     }
-    else SCPreferencesRemoveValue(prefs, CFSTR(kIOPMRepeatingPowerOffKey));
+    else {
+        SCPreferencesRemoveValue(prefs, CFSTR(kIOPMRepeatingPowerOffKey));
+        SCPreferencesRemoveValue(prefs, CFSTR(kIOPMRepeatingPowerOffListKey));
+    }
 
     if(!SCPreferencesCommitChanges(prefs))
     {
@@ -362,6 +694,47 @@ exit:
     return ret;
 }
 
+/*
+ * Works out the repeating events a schedule request asks for. A request
+ * with either list key replaces every event, and a class left out of it is
+ * deleted. A request with neither only replaces the first event of each
+ * class, so that a client that only knows about one can save back what it
+ * read without dropping the others.
+ */
+static IOReturn
+copyRequestedRepeatingEvents(CFDictionaryRef request, CFArrayRef *off, CFArrayRef *on)
+{
+    CFTypeRef           offEvents = NULL;
+    CFTypeRef           onEvents = NULL;
+
+    *off = *on = NULL;
+
+    offEvents = getRepeatingEvents(request, CFSTR(kIOPMRepeatingPowerOffListKey));
+    onEvents = getRepeatingEvents(request, CFSTR(kIOPMRepeatingPowerOnListKey));
+    if (offEvents || onEvents)
+    {
+        if( !is_valid_repeating_events(offEvents)
+         || !is_valid_repeating_events(onEvents) )
+        {
+            return kIOReturnBadArgument;
+        }
+        *off = createRepeatingEventArray(offEvents);
+        *on = createRepeatingEventArray(onEvents);
+        return kIOReturnSuccess;
+    }
+
+    offEvents = CFDictionaryGetValue(request, CFSTR(kIOPMRepeatingPowerOffKey));
+    onEvents = CFDictionaryGetValue(request, CFSTR(kIOPMRepeatingPowerOnKey));
+    if( !is_valid_repeating_dictionary(offEvents)
+     || !is_valid_repeating_dictionary(onEvents) )
+    {
+        return kIOReturnBadArgument;
+    }
+    *off = createWithFirstRepeatingEvent(repeatingPowerOff, offEvents);
+    *on = createWithFirstRepeatingEvent(repeatingPowerOn, onEvents);
+    return kIOReturnSuccess;
+}
+
 kern_return_t
 _io_pm_schedule_repeat_event
 (
@@ -374,15 +747,12 @@ _io_pm_schedule_repeat_event
 )
 {
     CFDictionaryRef     events = NULL;
-    CFDictionaryRef     offEvents = NULL;
-    CFDictionaryRef     onEvents = NULL;
+    CFArrayRef          off = NULL;
+    CFArrayRef          on = NULL;
     CFDataRef           dataRef = NULL;
     uid_t               callerEUID;
     SCPreferencesRef    prefs = 0;
-    CFStringRef         prevOffType = NULL;
-    CFStringRef         prevOnType = NULL;
-    CFStringRef         newOffType = NULL;
-    CFStringRef         newOnType = NULL;
+    uint32_t            tables = 0;
 
 
     *return_code = kIOReturnSuccess;
@@ -394,21 +764,7 @@ _io_pm_schedule_repeat_event
         events = (CFDictionaryRef)CFPropertyListCreateWithData(0, dataRef, 0, NULL, NULL); 
     }
 
-    if (!events) {
-        *return_code = kIOReturnBadArgument;
-        goto exit;
-    }
-    offEvents = isA_CFDictionary(CFDictionaryGetValue(
-                                events, 
-                                CFSTR(kIOPMRepeatingPowerOffKey)));
-    onEvents = isA_CFDictionary(CFDictionaryGetValue(
-                                events, 
-                                CFSTR(kIOPMRepeatingPowerOnKey)));
-
-    if( !is_valid_repeating_dictionary(offEvents) 
-     || !is_valid_repeating_dictionary(onEvents) )
-    {
-        syslog(LOG_INFO, "PMCFGD: Invalid formatted repeating power event dictionary\n");
+    if (!isA_CFDictionary(events)) {
         *return_code = kIOReturnBadArgument;
         goto exit;
     }
@@ -416,58 +772,25 @@ _io_pm_schedule_repeat_event
     if((*return_code = createSCSession(&prefs, callerEUID, 1)) != kIOReturnSuccess)
         goto exit;
 
-
-    /* Need to take a retain on these strings as these dictionaries get released below */
-    prevOffType =  getRepeatingDictionaryType(repeatingPowerOff); CFRetain(prevOffType);
-    prevOnType = getRepeatingDictionaryType(repeatingPowerOn); CFRetain(prevOnType);
-
-    /*
-     * Remove both off & on events first. If off or on event is not set thru this request,
-     * then it is assumed that user is requesting to delete it.
-     */
-    if (repeatingPowerOff && isA_CFDictionary(repeatingPowerOff))
-        CFRelease(repeatingPowerOff); 
-    if (repeatingPowerOn && isA_CFDictionary(repeatingPowerOn))
-        CFRelease(repeatingPowerOn); 
-
-    repeatingPowerOff = repeatingPowerOn = NULL;
-
-
-    if (offEvents) {
-        repeatingPowerOff = CFDictionaryCreateMutableCopy(0,0,offEvents);
-    }
-    if (onEvents) {
-        repeatingPowerOn = CFDictionaryCreateMutableCopy(0,0,onEvents);
+    if((*return_code = copyRequestedRepeatingEvents(events, &off, &on)) != kIOReturnSuccess)
+    {
+        syslog(LOG_INFO, "PMCFGD: Invalid formatted repeating power event dictionary\n");
+        goto exit;
     }
 
+    tables = setRepeatingEvents(off, on);
 
     if ((*return_code = updateRepeatEventsOnDisk(prefs)) != kIOReturnSuccess)
         goto exit;
 
-    newOffType = getRepeatingDictionaryType(repeatingPowerOff);
-    newOnType = getRepeatingDictionaryType(repeatingPowerOn);
-
-
     /* 
      * Re-schedule the modified event types in case these new events are earlier
      * than previously scheduled ones
      */
-    schedulePowerEventType(prevOffType);
-    schedulePowerEventType(prevOnType);
-
-    if (!CFEqual(prevOffType, newOffType))
-        schedulePowerEventType(newOffType);
-
-    if (!CFEqual(prevOnType, newOnType))
-        schedulePowerEventType(newOnType);
+    scheduleRepeatTables(tables);
 
 
 exit:
-    if (prevOffType)
-        CFRelease(prevOffType);
-    if (prevOnType)
-        CFRelease(prevOnType);
-
     if (dataRef)
         CFRelease(dataRef);
     if (events)
@@ -491,8 +814,7 @@ _io_pm_cancel_repeat_events
 
     SCPreferencesRef    prefs = 0;
     uid_t               callerEUID;
-    CFStringRef         offType = NULL;
-    CFStringRef         onType = NULL;
+    uint32_t            tables = 0;
 
     *return_code = kIOReturnSuccess;
 
@@ -501,30 +823,15 @@ _io_pm_cancel_repeat_events
     if((*return_code = createSCSession(&prefs, callerEUID, 1)) != kIOReturnSuccess)
         goto exit;
 
-
-    /* Need to take a retain on these strings as these dictionaries get release below */
-    offType = getRepeatingDictionaryType(repeatingPowerOff); CFRetain(offType);
-    onType = getRepeatingDictionaryType(repeatingPowerOn); CFRetain(onType);
-
-    if (repeatingPowerOff && isA_CFDictionary(repeatingPowerOff))
-        CFRelease(repeatingPowerOff); 
-    if (repeatingPowerOn && isA_CFDictionary(repeatingPowerOn))
-        CFRelease(repeatingPowerOn); 
-
-    repeatingPowerOff = repeatingPowerOn = NULL;
+    tables = setRepeatingEvents(NULL, NULL);
 
     if ((*return_code = updateRepeatEventsOnDisk(prefs)) != kIOReturnSuccess)
         goto exit;
 
-    schedulePowerEventType(offType);
-    schedulePowerEventType(onType);
+    scheduleRepeatTables(tables);
 
 exit:
 
-    if (offType)
-        CFRelease(offType);
-    if (onType)
-        CFRelease(onType);
     destroySCSession(prefs, 1);
 
     return KERN_SUCCESS;
@@ -538,11 +845,33 @@ __private_extern__ CFDictionaryRef copyRepeatPowerEvents( )
     return_dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 2, 
             &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks); 
 
-    if (repeatingPowerOn && isA_CFDictionary(repeatingPowerOn))
-        CFDictionaryAddValue(return_dict, CFSTR(kIOPMRepeatingPowerOnKey), repeatingPowerOn);     
+    if (!return_dict)
+        return NULL;
 
-    if (repeatingPowerOff && isA_CFDictionary(repeatingPowerOff))
-        CFDictionaryAddValue(return_dict, CFSTR(kIOPMRepeatingPowerOffKey), repeatingPowerOff);     
+    setRepeatingEventsValues(return_dict, CFSTR(kIOPMRepeatingPowerOnKey),
+                             CFSTR(kIOPMRepeatingPowerOnListKey), repeatingPowerOn);
+    setRepeatingEventsValues(return_dict, CFSTR(kIOPMRepeatingPowerOffKey),
+                             CFSTR(kIOPMRepeatingPowerOffListKey), repeatingPowerOff);
 
     return return_dict;
 }
+
+#ifdef XCTEST
+/* Replaces the repeating schedule in memory only */
+void xctSetRepeatingPowerEvents(CFTypeRef onEvents, CFTypeRef offEvents)
+{
+    setRepeatingEvents(createRepeatingEventArray(offEvents), createRepeatingEventArray(onEvents));
+}
+
+/* Applies a schedule request the way the MIG entry point does, in memory only */
+IOReturn xctScheduleRepeatingPowerEvents(CFDictionaryRef request)
+{
+    CFArrayRef  off = NULL;
+    CFArrayRef  on = NULL;
+    IOReturn    ret;
+
+    if ((ret = copyRequestedRepeatingEvents(request, &off, &on)) == kIOReturnSuccess)
+        setRepeatingEvents(off, on);
+    return ret;
+}
+#endif
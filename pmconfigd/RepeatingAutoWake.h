@@ -26,7 +26,15 @@
 #include "PrivateLib.h"
 
 __private_extern__ CFDictionaryRef copyNextRepeatingEvent(CFStringRef type);
+__private_extern__ CFDictionaryRef copyRepeatPowerEvents(void);
 
 __private_extern__ void RepeatingAutoWake_prime(void);
 
+__private_extern__ void RepeatingAutoWake_flushOccurrences(void);
+
+#ifdef XCTEST
+__private_extern__ void xctSetRepeatingPowerEvents(CFTypeRef onEvents, CFTypeRef offEvents);
+__private_extern__ IOReturn xctScheduleRepeatingPowerEvents(CFDictionaryRef request);
+#endif
+
 #endif // _RepeatingAutoWake_h_
@@ -570,6 +570,7 @@ timeZoneChangedCallBack(
     if( CFEqual(notificationName, gTZNotificationNameString) )
     {
         broadcastGMTOffset();
+        AutoWakeRepeatingChange();
     }
 }
 
@@ -852,6 +853,9 @@ static void incoming_XPC_connection(xpc_connection_t peer)
                      else if ((inEvent = xpc_dictionary_get_value(event, kAssertionPropertiesMsg))) {
                         asyncAssertionProperties(peer, event);
                      }
+                     else if ((inEvent = xpc_dictionary_get_value(event, kAssertionLeaseRenewMsg))) {
+                        asyncAssertionRenewLease(peer, event);
+                     }
                      else if ((inEvent = xpc_dictionary_get_value(event, kPSAdapterDetails))) {
                          sendAdapterDetails(peer, event);
                      }
@@ -0,0 +1,183 @@
+//
+//  test_assertionQuery.m
+//  PowerManagement
+//
+//  Exercises the filtered assertion query (kIOPMAssertionMIGCopyFiltered)
+//  that backs 'pmset -g assertions --pid/--type/--fields'.
+//
+
+#import <XCTest/XCTest.h>
+#include <unistd.h>
+#include "PrivateLib.h"
+#include "PMAssertions.h"
+
+#define kQueryTestNamePrefix    CFSTR("test_assertionQuery")
+
+// Not static when built with XCTEST
+IOReturn doCreate(pid_t pid, CFMutableDictionaryRef newProperties,
+                  IOPMAssertionID *assertion_id, ProcessInfo **pinfo,
+                  int *enTrIntensity);
+IOReturn doRelease(pid_t pid, IOPMAssertionID id, int *retainCnt);
+IOReturn copyFilteredAssertions(CFDictionaryRef filter, CFDictionaryRef *result);
+ProcessInfo* processInfoGet(pid_t p);
+
+@interface test_assertionQuery : XCTestCase
+
+@end
+
+@implementation test_assertionQuery
+{
+    IOPMAssertionID idleID;
+    IOPMAssertionID displayID;
+}
+
++ (void)setUp
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        PMAssertions_prime();
+    });
+}
+
+- (IOPMAssertionID)createAssertion:(CFStringRef)type pid:(pid_t)pid name:(CFStringRef)name
+{
+    CFMutableDictionaryRef  props;
+    IOPMAssertionID         assertionID = kIOPMNullAssertionID;
+
+    props = _IOPMAssertionDescriptionCreate(type, name, NULL, NULL, NULL, 0, NULL);
+    XCTAssert(props != NULL);
+    XCTAssertEqual(doCreate(pid, props, &assertionID, NULL, NULL), kIOReturnSuccess);
+    CFRelease(props);
+
+    return assertionID;
+}
+
+- (void)setUp
+{
+    [super setUp];
+
+    // Two live pids so both assertions get a real ProcessInfo
+    idleID = [self createAssertion:kIOPMAssertionTypePreventUserIdleSystemSleep
+                               pid:getpid() name:CFSTR("test_assertionQuery.idle")];
+    displayID = [self createAssertion:kIOPMAssertionTypePreventUserIdleDisplaySleep
+                                  pid:getppid() name:CFSTR("test_assertionQuery.display")];
+}
+
+- (void)tearDown
+{
+    doRelease(getpid(), idleID, NULL);
+    doRelease(getppid(), displayID, NULL);
+
+    [super tearDown];
+}
+
+/*
+ * Runs the query restricted to this test's assertions and returns the
+ * names of the matching rows, or nil if powerd rejected the filter.
+ */
+- (NSArray *)namesMatchingPids:(NSArray *)pids types:(NSArray *)types result:(IOReturn *)ret
+{
+    NSMutableDictionary     *filter = [NSMutableDictionary dictionary];
+    NSMutableArray          *names = [NSMutableArray array];
+    CFDictionaryRef         result = NULL;
+    NSArray                 *fields;
+
+    filter[(__bridge NSString *)kIOPMAssertionQueryNamePrefixKey] = (__bridge NSString *)kQueryTestNamePrefix;
+    filter[(__bridge NSString *)kIOPMAssertionQueryFieldsKey] = @[(__bridge NSString *)kIOPMAssertionQueryFieldName];
+    if (pids) {
+        filter[(__bridge NSString *)kIOPMAssertionQueryPIDsKey] = pids;
+    }
+    if (types) {
+        filter[(__bridge NSString *)kIOPMAssertionQueryTypesKey] = types;
+    }
+
+    *ret = copyFilteredAssertions((__bridge CFDictionaryRef)filter, &result);
+    if (!result) {
+        return nil;
+    }
+
+    fields = ((__bridge NSDictionary *)result)[(__bridge NSString *)kIOPMAssertionQueryFieldsKey];
+    XCTAssertEqualObjects(fields, @[(__bridge NSString *)kIOPMAssertionQueryFieldName]);
+    for (NSArray *row in ((__bridge NSDictionary *)result)[(__bridge NSString *)kIOPMAssertionQueryRowsKey]) {
+        [names addObject:row[0]];
+    }
+    CFRelease(result);
+
+    return names;
+}
+
+- (void)testFilterByPid
+{
+    IOReturn    ret;
+    NSArray     *names;
+
+    names = [self namesMatchingPids:@[@(getpid())] types:nil result:&ret];
+    XCTAssertEqual(ret, kIOReturnSuccess);
+    XCTAssertEqualObjects(names, @[@"test_assertionQuery.idle"]);
+
+    names = [self namesMatchingPids:@[@(getppid())] types:nil result:&ret];
+    XCTAssertEqual(ret, kIOReturnSuccess);
+    XCTAssertEqualObjects(names, @[@"test_assertionQuery.display"]);
+}
+
+- (void)testFilterByType
+{
+    IOReturn    ret;
+    NSArray     *names;
+
+    names = [self namesMatchingPids:nil
+                              types:@[(__bridge NSString *)kIOPMAssertionTypePreventUserIdleDisplaySleep]
+                             result:&ret];
+    XCTAssertEqual(ret, kIOReturnSuccess);
+    XCTAssertEqualObjects(names, @[@"test_assertionQuery.display"]);
+}
+
+- (void)testFilterWithNoMatch
+{
+    IOReturn    ret;
+    NSArray     *names;
+
+    // Right pid, wrong type
+    names = [self namesMatchingPids:@[@(getpid())]
+                              types:@[(__bridge NSString *)kIOPMAssertionTypePreventUserIdleDisplaySleep]
+                             result:&ret];
+    XCTAssertEqual(ret, kIOReturnSuccess);
+    XCTAssertEqualObjects(names, @[]);
+}
+
+- (void)testCheckLatencyFields
+{
+    ProcessInfo             *pinfo = processInfoGet(getpid());
+    CFDictionaryRef         result = NULL;
+    NSDictionary            *filter;
+    NSArray                 *rows;
+
+    XCTAssert(pinfo != NULL);
+    pinfo->checkLatencyMs = 12;
+    pinfo->checkLatencyMaxMs = 40;
+    pinfo->checkTimeoutCnt = 2;
+
+    filter = @{ (__bridge NSString *)kIOPMAssertionQueryNamePrefixKey : @"test_assertionQuery.idle",
+                (__bridge NSString *)kIOPMAssertionQueryFieldsKey : @[ (__bridge NSString *)kIOPMAssertionQueryFieldCheckLatency,
+                                                                       (__bridge NSString *)kIOPMAssertionQueryFieldCheckLatencyMax,
+                                                                       (__bridge NSString *)kIOPMAssertionQueryFieldCheckTimeouts ] };
+    XCTAssertEqual(copyFilteredAssertions((__bridge CFDictionaryRef)filter, &result), kIOReturnSuccess);
+    rows = ((__bridge NSDictionary *)result)[(__bridge NSString *)kIOPMAssertionQueryRowsKey];
+    XCTAssertEqualObjects(rows, (@[ @[@12, @40, @2] ]));
+    CFRelease(result);
+
+    pinfo->checkLatencyMs = pinfo->checkLatencyMaxMs = pinfo->checkTimeoutCnt = 0;
+}
+
+- (void)testFilterRejectsBadArguments
+{
+    IOReturn    ret;
+
+    XCTAssertNil([self namesMatchingPids:nil types:@[@"NoSuchAssertionType"] result:&ret]);
+    XCTAssertEqual(ret, kIOReturnBadArgument);
+
+    XCTAssertNil([self namesMatchingPids:@[@(-1)] types:nil result:&ret]);
+    XCTAssertEqual(ret, kIOReturnBadArgument);
+}
+
+@end
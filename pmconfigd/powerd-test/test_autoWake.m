@@ -0,0 +1,655 @@
+//
+//  test_autoWake.m
+//  PowerManagement
+//
+//  Exercises the per-type event heaps in AutoWakeScheduler.c, and schedules
+//  and cancels events at the scale of a fleet-management tool programming
+//  wake schedules to check that neither grows worse than O(log n) per event.
+//  Also restarts from the snapshot and journal after simulated crashes, and
+//  checks that repeating events are served from precomputed occurrences.
+//
+
+#import <XCTest/XCTest.h>
+#include <mach/mach_time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "PrivateLib.h"
+#include "AutoWakeScheduler.h"
+#include "RepeatingAutoWake.h"
+
+#define kAutoWakeBenchEvents        100000
+#define kAutoWakeBaseEvents         10000
+#define kAutoWakeFirstEventSecs     (24*60*60)
+#define kAutoWakeJournalBenchOps    10000
+#define kAutoWakeJournalBaseOps     1000
+
+static double autoWakeElapsedMs(uint64_t start)
+{
+    static mach_timebase_info_data_t tb;
+
+    if (!tb.denom) {
+        mach_timebase_info(&tb);
+    }
+    return (double)(mach_absolute_time() - start) * tb.numer / tb.denom / NSEC_PER_MSEC;
+}
+
+static CFDictionaryRef createEvent(CFStringRef type, CFAbsoluteTime when, CFStringRef appName)
+{
+    CFMutableDictionaryRef  event;
+    CFDateRef               date;
+
+    event = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    date = CFDateCreate(0, when);
+    CFDictionarySetValue(event, CFSTR(kIOPMPowerEventTypeKey), type);
+    CFDictionarySetValue(event, CFSTR(kIOPMPowerEventTimeKey), date);
+    CFDictionarySetValue(event, CFSTR(kIOPMPowerEventAppNameKey), appName);
+    CFRelease(date);
+
+    return event;
+}
+
+static CFDictionaryRef createRepeatingEvent(CFStringRef type, int minutes, int daysMask)
+{
+    CFMutableDictionaryRef  event;
+    CFNumberRef             num;
+
+    event = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionarySetValue(event, CFSTR(kIOPMPowerEventTypeKey), type);
+    num = CFNumberCreate(0, kCFNumberIntType, &minutes);
+    CFDictionarySetValue(event, CFSTR(kIOPMPowerEventTimeKey), num);
+    CFRelease(num);
+    num = CFNumberCreate(0, kCFNumberIntType, &daysMask);
+    CFDictionarySetValue(event, CFSTR(kIOPMDaysOfWeekKey), num);
+    CFRelease(num);
+
+    return event;
+}
+
+static CFAbsoluteTime eventTime(CFDictionaryRef event)
+{
+    return CFDateGetAbsoluteTime(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTimeKey)));
+}
+
+@interface test_autoWake : XCTestCase
+
+@end
+
+@implementation test_autoWake
+{
+    NSString    *_storeDir;
+}
+
+- (void)setUp
+{
+    xctResetPowerEvents();
+}
+
+- (void)tearDown
+{
+    if (_storeDir) {
+        xctSetAutoWakeStore(NULL, NULL);
+        [[NSFileManager defaultManager] removeItemAtPath:_storeDir error:nil];
+        _storeDir = nil;
+    }
+    xctResetPowerEvents();
+}
+
+/* Moves the snapshot and journal into a scratch directory and loads from it */
+- (void)useScratchStore
+{
+    _storeDir = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+    XCTAssertTrue([[NSFileManager defaultManager] createDirectoryAtPath:_storeDir
+                                            withIntermediateDirectories:YES attributes:nil error:nil]);
+    xctSetAutoWakeStore((__bridge CFStringRef)[_storeDir stringByAppendingPathComponent:@"AutoWake.xml"],
+                        [self journalPath]);
+    xctReloadPowerEvents();
+}
+
+- (const char *)journalPath
+{
+    return [[_storeDir stringByAppendingPathComponent:@"AutoWake.journal"] fileSystemRepresentation];
+}
+
+/*
+ * Creates 'count' wake events a second apart from 'start' and shuffles
+ * them so inserts land all over the heap.
+ */
+- (CFDictionaryRef *)createEvents:(int)count start:(CFAbsoluteTime)start
+{
+    CFDictionaryRef *events = calloc(count, sizeof(CFDictionaryRef));
+
+    for (int i = 0; i < count; i++) {
+        events[i] = createEvent(CFSTR(kIOPMAutoWake), start + i, CFSTR("test_autoWake"));
+    }
+    srandom(count);
+    for (int i = count - 1; i > 0; i--) {
+        int             j = (int)(random() % (i + 1));
+        CFDictionaryRef tmp = events[i];
+
+        events[i] = events[j];
+        events[j] = tmp;
+    }
+    return events;
+}
+
+- (void)releaseEvents:(CFDictionaryRef *)events count:(int)count
+{
+    for (int i = 0; i < count; i++) {
+        CFRelease(events[i]);
+    }
+    free(events);
+}
+
+- (void)testEarliestStaysOnTop
+{
+    const int       count = 1000;
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef *events = [self createEvents:count start:start];
+    CFDictionaryRef earliest;
+
+    for (int i = 0; i < count; i++) {
+        XCTAssertTrue(xctAddPowerEvent(events[i]));
+    }
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), count);
+
+    // Cancel from the front; the next second's event must surface every time
+    for (int i = 0; i < count; i++) {
+        CFDictionaryRef cancel = createEvent(CFSTR(kIOPMAutoWake), start + i, CFSTR("test_autoWake"));
+
+        earliest = xctCopyEarliestUpcoming(CFSTR(kIOPMAutoWake));
+        XCTAssert(earliest != NULL);
+        XCTAssertEqualWithAccuracy(eventTime(earliest), start + i, 0.001);
+        CFRelease(earliest);
+
+        XCTAssertTrue(xctCancelPowerEvent(cancel));
+        XCTAssertFalse(xctCancelPowerEvent(cancel));
+        CFRelease(cancel);
+    }
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 0);
+    XCTAssert(xctCopyEarliestUpcoming(CFSTR(kIOPMAutoWake)) == NULL);
+
+    [self releaseEvents:events count:count];
+}
+
+- (void)testCancelMatchesAppName
+{
+    CFAbsoluteTime  when = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef first = createEvent(CFSTR(kIOPMAutoWake), when, CFSTR("first"));
+    CFDictionaryRef second = createEvent(CFSTR(kIOPMAutoWake), when, CFSTR("second"));
+    CFDictionaryRef other = createEvent(CFSTR(kIOPMAutoWake), when, CFSTR("other"));
+    CFDictionaryRef earliest;
+
+    XCTAssertTrue(xctAddPowerEvent(first));
+    XCTAssertTrue(xctAddPowerEvent(second));
+
+    XCTAssertFalse(xctCancelPowerEvent(other));
+    XCTAssertTrue(xctCancelPowerEvent(first));
+
+    earliest = xctCopyEarliestUpcoming(CFSTR(kIOPMAutoWake));
+    XCTAssert(earliest != NULL);
+    XCTAssertTrue(CFEqual(CFDictionaryGetValue(earliest, CFSTR(kIOPMPowerEventAppNameKey)), CFSTR("second")));
+    CFRelease(earliest);
+
+    CFRelease(first);
+    CFRelease(second);
+    CFRelease(other);
+}
+
+- (void)testDuplicateEventsCancelOneAtATime
+{
+    CFAbsoluteTime  when = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef event = createEvent(CFSTR(kIOPMAutoWake), when, CFSTR("test_autoWake"));
+    CFDictionaryRef later = createEvent(CFSTR(kIOPMAutoWake), when + 1, CFSTR("test_autoWake"));
+
+    XCTAssertTrue(xctAddPowerEvent(event));
+    XCTAssertTrue(xctAddPowerEvent(later));
+    XCTAssertTrue(xctAddPowerEvent(event));
+    XCTAssertTrue(xctAddPowerEvent(event));
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 4);
+
+    // Each cancel takes back one of the identical requests
+    XCTAssertTrue(xctCancelPowerEvent(event));
+    XCTAssertTrue(xctCancelPowerEvent(event));
+    XCTAssertTrue(xctCancelPowerEvent(event));
+    XCTAssertFalse(xctCancelPowerEvent(event));
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 1);
+
+    XCTAssertTrue(xctCancelPowerEvent(later));
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 0);
+
+    CFRelease(event);
+    CFRelease(later);
+}
+
+- (void)testRemoveEventsByAppNameLeavesOthers
+{
+    const int       count = 100;
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef event, earliest;
+
+    for (int i = 0; i < count; i++) {
+        event = createEvent(CFSTR(kIOPMAutoWake), start + i, (i % 2) ? CFSTR("odd") : CFSTR("even"));
+        XCTAssertTrue(xctAddPowerEvent(event));
+        CFRelease(event);
+    }
+
+    xctRemoveEventsByAppName(CFSTR(kIOPMAutoWake), CFSTR("even"));
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), count / 2);
+
+    earliest = xctCopyEarliestUpcoming(CFSTR(kIOPMAutoWake));
+    XCTAssert(earliest != NULL);
+    XCTAssertEqualWithAccuracy(eventTime(earliest), start + 1, 0.001);
+    CFRelease(earliest);
+
+    // The remaining events can still be cancelled by date and app name
+    event = createEvent(CFSTR(kIOPMAutoWake), start + 1, CFSTR("odd"));
+    XCTAssertTrue(xctCancelPowerEvent(event));
+    CFRelease(event);
+    event = createEvent(CFSTR(kIOPMAutoWake), start + 2, CFSTR("even"));
+    XCTAssertFalse(xctCancelPowerEvent(event));
+    CFRelease(event);
+
+    xctRemoveEventsByAppName(CFSTR(kIOPMAutoWake), CFSTR("odd"));
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 0);
+}
+
+- (void)testMergedViewTracksSharedEvents
+{
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef wake = createEvent(CFSTR(kIOPMAutoWake), start + 100, CFSTR("test_autoWake"));
+    CFDictionaryRef either = createEvent(CFSTR(kIOPMAutoWakeOrPowerOn), start + 50, CFSTR("test_autoWake"));
+    CFDictionaryRef first, again;
+
+    XCTAssertTrue(xctAddPowerEvent(wake));
+    first = xctCopyEarliestUpcoming(CFSTR(kIOPMAutoWake));
+    again = xctCopyEarliestUpcoming(CFSTR(kIOPMAutoWake));
+    XCTAssertEqualWithAccuracy(eventTime(first), start + 100, 0.001);
+    // Nothing changed, so the cached event comes back
+    XCTAssert(first == again);
+    CFRelease(first);
+    CFRelease(again);
+
+    // A wakeorpoweron event is earliest for both wake and poweron
+    XCTAssertTrue(xctAddPowerEvent(either));
+    first = xctCopyEarliestUpcoming(CFSTR(kIOPMAutoWake));
+    XCTAssertEqualWithAccuracy(eventTime(first), start + 50, 0.001);
+    CFRelease(first);
+    first = xctCopyEarliestUpcoming(CFSTR(kIOPMAutoPowerOn));
+    XCTAssertEqualWithAccuracy(eventTime(first), start + 50, 0.001);
+    CFRelease(first);
+
+    XCTAssertTrue(xctCancelPowerEvent(either));
+    first = xctCopyEarliestUpcoming(CFSTR(kIOPMAutoWake));
+    XCTAssertEqualWithAccuracy(eventTime(first), start + 100, 0.001);
+    CFRelease(first);
+    XCTAssert(xctCopyEarliestUpcoming(CFSTR(kIOPMAutoPowerOn)) == NULL);
+
+    CFRelease(wake);
+    CFRelease(either);
+}
+
+- (void)testRepeatingOccurrencesAreReused
+{
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+    int             hour, minute;
+    CFDictionaryRef daily, weekdays, first, again;
+
+    // Daily, at the top of the next hour
+    CFCalendarDecomposeAbsoluteTime(_gregorian(), now, "H", &hour);
+    daily = createRepeatingEvent(CFSTR(kIOPMAutoWake), ((hour + 1) % 24) * 60, 0x7f);
+    xctSetRepeatingPowerEvents(daily, NULL);
+
+    first = copyNextRepeatingEvent(CFSTR(kIOPMAutoWake));
+    again = copyNextRepeatingEvent(CFSTR(kIOPMAutoWake));
+    XCTAssert(first != NULL);
+    // Served from the precomputed occurrences, not rebuilt
+    XCTAssert(first == again);
+    XCTAssertGreaterThan(eventTime(first), now);
+    XCTAssertLessThanOrEqual(eventTime(first), now + 60 * 60);
+    CFCalendarDecomposeAbsoluteTime(_gregorian(), eventTime(first), "m", &minute);
+    XCTAssertEqual(minute, 0);
+    XCTAssertTrue(CFEqual(CFDictionaryGetValue(first, CFSTR(kIOPMPowerEventAppNameKey)), CFSTR(kIOPMRepeatingAppName)));
+    CFRelease(again);
+
+    // Not a poweroff type, and poweron only follows a WakeOrPowerOn rule
+    XCTAssert(copyNextRepeatingEvent(CFSTR(kIOPMAutoSleep)) == NULL);
+    XCTAssert(copyNextRepeatingEvent(CFSTR(kIOPMAutoPowerOn)) == NULL);
+
+    // A schedule change drops the old occurrences
+    weekdays = createRepeatingEvent(CFSTR(kIOPMAutoWakeOrPowerOn), ((hour + 2) % 24) * 60, 0x1f);
+    xctSetRepeatingPowerEvents(weekdays, NULL);
+    again = copyNextRepeatingEvent(CFSTR(kIOPMAutoPowerOn));
+    XCTAssert(again != NULL);
+    XCTAssert(again != first);
+    XCTAssertGreaterThan(eventTime(again), eventTime(first));
+    CFRelease(again);
+
+    xctSetRepeatingPowerEvents(NULL, NULL);
+    XCTAssert(copyNextRepeatingEvent(CFSTR(kIOPMAutoWake)) == NULL);
+
+    CFRelease(first);
+    CFRelease(daily);
+    CFRelease(weekdays);
+}
+
+- (void)testRepeatingOccurrencesFollowVirtualClock
+{
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent() + 30 * 24 * 60 * 60;
+    int             hour;
+    CFDictionaryRef daily, next;
+
+    // Daily, at the top of the hour after the virtual time
+    xctSetVirtualClock(now);
+    CFCalendarDecomposeAbsoluteTime(_gregorian(), now, "H", &hour);
+    daily = createRepeatingEvent(CFSTR(kIOPMAutoWake), ((hour + 1) % 24) * 60, 0x7f);
+    xctSetRepeatingPowerEvents(daily, NULL);
+
+    next = copyNextRepeatingEvent(CFSTR(kIOPMAutoWake));
+    XCTAssert(next != NULL);
+    XCTAssertGreaterThan(eventTime(next), now);
+    XCTAssertLessThanOrEqual(eventTime(next), now + 60 * 60);
+    CFRelease(next);
+
+    // Back on the real clock, the next occurrence is a month earlier
+    xctSetVirtualClock(0);
+    next = copyNextRepeatingEvent(CFSTR(kIOPMAutoWake));
+    XCTAssert(next != NULL);
+    XCTAssertLessThanOrEqual(eventTime(next), CFAbsoluteTimeGetCurrent() + 24 * 60 * 60);
+    CFRelease(next);
+
+    xctSetRepeatingPowerEvents(NULL, NULL);
+    CFRelease(daily);
+}
+
+- (void)testRepeatingRulesShareOneTable
+{
+    const int           count = 60;
+    CFAbsoluteTime      now = CFAbsoluteTimeGetCurrent();
+    CFMutableArrayRef   rules = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    CFDictionaryRef     rule, next;
+    int                 hour, minute;
+
+    // Daily rules five minutes apart, listed latest first; the one three
+    // minutes out comes next whatever order they were given in
+    CFCalendarDecomposeAbsoluteTime(_gregorian(), now, "Hm", &hour, &minute);
+    for (int i = count - 1; i >= 0; i--) {
+        rule = createRepeatingEvent(CFSTR(kIOPMAutoWake), (hour * 60 + minute + 3 + 5 * i) % (24 * 60), 0x7f);
+        CFArrayAppendValue(rules, rule);
+        CFRelease(rule);
+    }
+    xctSetRepeatingPowerEvents(rules, NULL);
+
+    next = copyNextRepeatingEvent(CFSTR(kIOPMAutoWake));
+    XCTAssert(next != NULL);
+    XCTAssertGreaterThan(eventTime(next), now + 2 * 60);
+    XCTAssertLessThanOrEqual(eventTime(next), now + 3 * 60);
+    CFRelease(next);
+    XCTAssert(copyNextRepeatingEvent(CFSTR(kIOPMAutoPowerOn)) == NULL);
+
+    // A WakeOrPowerOn rule a minute out comes first for both wake and poweron
+    rule = createRepeatingEvent(CFSTR(kIOPMAutoWakeOrPowerOn), (hour * 60 + minute + 1) % (24 * 60), 0x7f);
+    CFArrayAppendValue(rules, rule);
+    CFRelease(rule);
+    xctSetRepeatingPowerEvents(rules, NULL);
+
+    next = copyNextRepeatingEvent(CFSTR(kIOPMAutoWake));
+    XCTAssertLessThanOrEqual(eventTime(next), now + 60);
+    XCTAssertTrue(CFEqual(CFDictionaryGetValue(next, CFSTR(kIOPMPowerEventTypeKey)), CFSTR(kIOPMAutoWakeOrPowerOn)));
+    CFRelease(next);
+    next = copyNextRepeatingEvent(CFSTR(kIOPMAutoPowerOn));
+    XCTAssertLessThanOrEqual(eventTime(next), now + 60);
+    CFRelease(next);
+
+    xctSetRepeatingPowerEvents(NULL, NULL);
+    CFRelease(rules);
+}
+
+- (void)testSingleEventRequestKeepsOtherRules
+{
+    CFMutableArrayRef       rules = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    CFMutableDictionaryRef  request;
+    CFDictionaryRef         first, second, replacement, sleep, current;
+    CFArrayRef              list;
+
+    first = createRepeatingEvent(CFSTR(kIOPMAutoWake), 7 * 60, 0x1f);
+    second = createRepeatingEvent(CFSTR(kIOPMAutoWake), 10 * 60, 0x60);
+    replacement = createRepeatingEvent(CFSTR(kIOPMAutoWake), 8 * 60, 0x1f);
+    sleep = createRepeatingEvent(CFSTR(kIOPMAutoSleep), 23 * 60, 0x7f);
+    CFArrayAppendValue(rules, first);
+    CFArrayAppendValue(rules, second);
+    xctSetRepeatingPowerEvents(rules, NULL);
+
+    // Clients that only know about one event per class still get a dictionary
+    current = copyRepeatPowerEvents();
+    XCTAssertTrue(CFEqual(CFDictionaryGetValue(current, CFSTR(kIOPMRepeatingPowerOnKey)), first));
+    list = CFDictionaryGetValue(current, CFSTR(kIOPMRepeatingPowerOnListKey));
+    XCTAssertEqual(CFArrayGetCount(list), 2);
+    XCTAssert(CFDictionaryGetValue(current, CFSTR(kIOPMRepeatingPowerOffKey)) == NULL);
+    CFRelease(current);
+
+    // Saving back a single pair replaces only the first event of each class
+    request = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionarySetValue(request, CFSTR(kIOPMRepeatingPowerOnKey), replacement);
+    CFDictionarySetValue(request, CFSTR(kIOPMRepeatingPowerOffKey), sleep);
+    XCTAssertEqual(xctScheduleRepeatingPowerEvents(request), kIOReturnSuccess);
+
+    current = copyRepeatPowerEvents();
+    list = CFDictionaryGetValue(current, CFSTR(kIOPMRepeatingPowerOnListKey));
+    XCTAssertEqual(CFArrayGetCount(list), 2);
+    XCTAssertTrue(CFEqual(CFArrayGetValueAtIndex(list, 0), replacement));
+    XCTAssertTrue(CFEqual(CFArrayGetValueAtIndex(list, 1), second));
+    XCTAssertTrue(CFEqual(CFDictionaryGetValue(current, CFSTR(kIOPMRepeatingPowerOffKey)), sleep));
+    CFRelease(current);
+
+    // A list replaces the whole class, and a class left out is deleted
+    CFDictionaryRemoveAllValues(request);
+    CFDictionarySetValue(request, CFSTR(kIOPMRepeatingPowerOnListKey), rules);
+    XCTAssertEqual(xctScheduleRepeatingPowerEvents(request), kIOReturnSuccess);
+
+    current = copyRepeatPowerEvents();
+    XCTAssertTrue(CFEqual(CFDictionaryGetValue(current, CFSTR(kIOPMRepeatingPowerOnListKey)), rules));
+    XCTAssert(CFDictionaryGetValue(current, CFSTR(kIOPMRepeatingPowerOffKey)) == NULL);
+    CFRelease(current);
+
+    // Only a dictionary is accepted under the single event keys
+    CFDictionaryRemoveAllValues(request);
+    CFDictionarySetValue(request, CFSTR(kIOPMRepeatingPowerOnKey), rules);
+    XCTAssertEqual(xctScheduleRepeatingPowerEvents(request), kIOReturnBadArgument);
+
+    xctSetRepeatingPowerEvents(NULL, NULL);
+    CFRelease(request);
+    CFRelease(sleep);
+    CFRelease(replacement);
+    CFRelease(second);
+    CFRelease(first);
+    CFRelease(rules);
+}
+
+- (void)testJournalReplaysAfterRestart
+{
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef *events;
+
+    [self useScratchStore];
+    events = [self createEvents:10 start:start];
+    for (int i = 0; i < 10; i++) {
+        XCTAssertEqual(xctSchedulePowerEvent(events[i]), kIOReturnSuccess);
+    }
+    for (int i = 0; i < 3; i++) {
+        XCTAssertEqual(xctCancelScheduledPowerEvent(events[i]), kIOReturnSuccess);
+    }
+    XCTAssertEqual(xctJournalRecords(), 13);
+
+    // Restart: the snapshot is empty, everything comes from the journal
+    xctReloadPowerEvents();
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 7);
+    XCTAssertEqual(xctJournalRecords(), 0);
+
+    // And the journal was folded into the snapshot
+    xctReloadPowerEvents();
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 7);
+
+    [self releaseEvents:events count:10];
+}
+
+- (void)testTornJournalTailIsDropped
+{
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef *events;
+    struct stat     st;
+
+    [self useScratchStore];
+    events = [self createEvents:5 start:start];
+    for (int i = 0; i < 5; i++) {
+        XCTAssertEqual(xctSchedulePowerEvent(events[i]), kIOReturnSuccess);
+    }
+
+    // Crash partway through writing the last record
+    XCTAssertEqual(stat([self journalPath], &st), 0);
+    XCTAssertEqual(truncate([self journalPath], st.st_size - 3), 0);
+
+    xctReloadPowerEvents();
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 4);
+
+    // Scheduling carries on from the recovered state
+    XCTAssertEqual(xctSchedulePowerEvent(events[4]), kIOReturnSuccess);
+    xctReloadPowerEvents();
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 5);
+
+    [self releaseEvents:events count:5];
+}
+
+- (void)testCrashDuringCompactionDoesNotReplayTwice
+{
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef *events;
+
+    [self useScratchStore];
+    events = [self createEvents:5 start:start];
+    for (int i = 0; i < 5; i++) {
+        XCTAssertEqual(xctSchedulePowerEvent(events[i]), kIOReturnSuccess);
+    }
+
+    // The snapshot is committed but the journal still holds the same adds
+    XCTAssertEqual(xctCompactJournal(true), kIOReturnSuccess);
+
+    xctReloadPowerEvents();
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 5);
+
+    [self releaseEvents:events count:5];
+}
+
+/*
+ * Schedules then cancels 'count' events through the journal. Returns the
+ * average cost of one operation in microseconds.
+ */
+- (double)journaledScheduleAndCancel:(int)count
+{
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef *events = [self createEvents:count start:start];
+    CFDictionaryRef *cancels = calloc(count, sizeof(CFDictionaryRef));
+    double          scheduleMs, cancelMs;
+    uint64_t        t0;
+    int             failed = 0;
+
+    for (int i = 0; i < count; i++) {
+        cancels[i] = createEvent(CFSTR(kIOPMAutoWake), start + i, CFSTR("test_autoWake"));
+    }
+
+    t0 = mach_absolute_time();
+    for (int i = 0; i < count; i++) {
+        failed += (xctSchedulePowerEvent(events[i]) != kIOReturnSuccess);
+    }
+    scheduleMs = autoWakeElapsedMs(t0);
+
+    t0 = mach_absolute_time();
+    for (int i = 0; i < count; i++) {
+        failed += (xctCancelScheduledPowerEvent(cancels[i]) != kIOReturnSuccess);
+    }
+    cancelMs = autoWakeElapsedMs(t0);
+    XCTAssertEqual(failed, 0);
+
+    NSLog(@"%6d journaled events: schedule %9.2f ms, cancel %9.2f ms, %6.2f us/op, %u records pending",
+          count, scheduleMs, cancelMs, (scheduleMs + cancelMs) * 1000.0 / (2 * count), xctJournalRecords());
+
+    xctReloadPowerEvents();
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 0);
+
+    [self releaseEvents:cancels count:count];
+    [self releaseEvents:events count:count];
+
+    return (scheduleMs + cancelMs) * 1000.0 / (2 * count);
+}
+
+/*
+ * Reports how the per-op cost of journaled schedule and cancel grows with
+ * the number of events stored. Only logged, for the same reason as
+ * testScheduleCancelScaling.
+ */
+- (void)testJournaledScheduleCancelScaling
+{
+    double  baseUs, benchUs;
+
+    [self useScratchStore];
+    baseUs = [self journaledScheduleAndCancel:kAutoWakeJournalBaseOps];
+    benchUs = [self journaledScheduleAndCancel:kAutoWakeJournalBenchOps];
+
+    // Rewriting the whole store on every change would grow the per-op cost
+    // with the number of events scheduled
+    NSLog(@"Per-op journaled cost at %d ops is %.2fx the cost at %d",
+          kAutoWakeJournalBenchOps, benchUs / baseUs, kAutoWakeJournalBaseOps);
+}
+
+/*
+ * Schedules 'count' events in random order, then cancels them from
+ * anywhere in the heap, the way a fleet tool edits a schedule. Returns
+ * the average cost of one schedule plus one cancel in microseconds.
+ */
+- (double)scheduleAndCancel:(int)count
+{
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent() + kAutoWakeFirstEventSecs;
+    CFDictionaryRef *events = [self createEvents:count start:start];
+    CFDictionaryRef *cancels = [self createEvents:count start:start];
+    double          scheduleMs, cancelMs;
+    uint64_t        t0;
+
+    t0 = mach_absolute_time();
+    for (int i = 0; i < count; i++) {
+        xctAddPowerEvent(events[i]);
+    }
+    scheduleMs = autoWakeElapsedMs(t0);
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), count);
+
+    t0 = mach_absolute_time();
+    for (int i = 0; i < count; i++) {
+        xctCancelPowerEvent(cancels[i]);
+    }
+    cancelMs = autoWakeElapsedMs(t0);
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 0);
+
+    NSLog(@"%6d events: schedule %9.2f ms, cancel %9.2f ms, %6.2f us/event",
+          count, scheduleMs, cancelMs, (scheduleMs + cancelMs) * 1000.0 / count);
+
+    [self releaseEvents:cancels count:count];
+    [self releaseEvents:events count:count];
+
+    return (scheduleMs + cancelMs) * 1000.0 / count;
+}
+
+/*
+ * Reports how the per-event cost of scheduling and cancelling grows with the
+ * number of events. Wall-clock time varies too much on a loaded host to
+ * assert on, so the ratio is only logged.
+ */
+- (void)testScheduleCancelScaling
+{
+    double  baseUs = [self scheduleAndCancel:kAutoWakeBaseEvents];
+    double  benchUs = [self scheduleAndCancel:kAutoWakeBenchEvents];
+
+    // Re-sorting on every insert, or searching the heap for every cancel,
+    // would grow the per-event cost linearly with the number of events
+    NSLog(@"Per-event cost at %d events is %.2fx the cost at %d",
+          kAutoWakeBenchEvents, benchUs / baseUs, kAutoWakeBaseEvents);
+}
+
+@end
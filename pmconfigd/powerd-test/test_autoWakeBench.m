@@ -0,0 +1,182 @@
+//
+//  test_autoWakeBench.m
+//  PowerManagement
+//
+//  Scale benchmark for AutoWakeScheduler.c. Fills the wake queue with 10 to
+//  100k events on a virtual clock and reports the per-call latency of each
+//  scheduler operation, and the memory held per event, at every size.
+//  The scheduler is called directly, so nothing reaches the prefs file.
+//  It only reports, and takes a while, so it runs only when
+//  POWERD_RUN_BENCHMARKS is set in the test environment.
+//
+
+#import <XCTest/XCTest.h>
+#include <mach/mach_time.h>
+#include <malloc/malloc.h>
+#include "PrivateLib.h"
+#include "AutoWakeScheduler.h"
+
+#define kBenchFirstEventSecs    (24*60*60)
+#define kBenchEventSpacingSecs  60
+#define kBenchCallsPerOp        1000
+#define kBenchEnableEnv         "POWERD_RUN_BENCHMARKS"
+
+static const int kBenchSizes[] = { 10, 100, 1000, 10000, 100000 };
+
+static uint64_t benchElapsedNs(uint64_t start)
+{
+    static mach_timebase_info_data_t tb;
+
+    if (!tb.denom) {
+        mach_timebase_info(&tb);
+    }
+    return (mach_absolute_time() - start) * tb.numer / tb.denom;
+}
+
+static size_t benchBytesInUse(void)
+{
+    malloc_statistics_t stats;
+
+    malloc_zone_statistics(NULL, &stats);
+    return stats.size_in_use;
+}
+
+static CFDictionaryRef createBenchEvent(CFAbsoluteTime when)
+{
+    CFMutableDictionaryRef  event;
+    CFDateRef               date;
+
+    event = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    date = CFDateCreate(0, when);
+    CFDictionarySetValue(event, CFSTR(kIOPMPowerEventTypeKey), CFSTR(kIOPMAutoWake));
+    CFDictionarySetValue(event, CFSTR(kIOPMPowerEventTimeKey), date);
+    CFDictionarySetValue(event, CFSTR(kIOPMPowerEventAppNameKey), CFSTR("test_autoWakeBench"));
+    CFRelease(date);
+
+    return event;
+}
+
+@interface test_autoWakeBench : XCTestCase
+
+@end
+
+@implementation test_autoWakeBench
+
+- (void)setUp
+{
+    xctResetPowerEvents();
+}
+
+- (void)tearDown
+{
+    xctSetVirtualClock(0);
+    xctResetPowerEvents();
+}
+
+/*
+ * Schedules 'count' wake events a minute apart in random order, then times
+ * kBenchCallsPerOp calls of each operation against the full queue, and
+ * finally drains the queue by moving the clock past every event.
+ */
+- (void)runBenchmark:(int)count
+{
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime  first = start + kBenchFirstEventSecs;
+    CFDictionaryRef *events = calloc(count, sizeof(CFDictionaryRef));
+    CFDictionaryRef earliest;
+    size_t          bytesBefore, bytesAfter;
+    uint64_t        t0, addNs, copyNs, scheduleNs, removeNs, purgeNs;
+    int             calls = MIN(count, kBenchCallsPerOp);
+
+    xctResetPowerEvents();
+    xctSetVirtualClock(start);
+
+    for (int i = 0; i < count; i++) {
+        events[i] = createBenchEvent(first + (CFAbsoluteTime)i * kBenchEventSpacingSecs);
+    }
+    srandom(count);
+    for (int i = count - 1; i > 0; i--) {
+        int             j = (int)(random() % (i + 1));
+        CFDictionaryRef tmp = events[i];
+
+        events[i] = events[j];
+        events[j] = tmp;
+    }
+
+    // addEvent
+    bytesBefore = benchBytesInUse();
+    t0 = mach_absolute_time();
+    for (int i = 0; i < count; i++) {
+        xctAddPowerEvent(events[i]);
+    }
+    addNs = benchElapsedNs(t0);
+    bytesAfter = benchBytesInUse();
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), count);
+
+    // copyEarliestEvent, recomputed each call rather than served from its cache
+    t0 = mach_absolute_time();
+    for (int i = 0; i < kBenchCallsPerOp; i++) {
+        AutoWakeRepeatingChange();
+        earliest = xctCopyEarliestEvent(CFSTR(kIOPMAutoWake));
+        if (earliest) {
+            CFRelease(earliest);
+        }
+    }
+    copyNs = benchElapsedNs(t0);
+
+    // schedulePowerEventType, which re-arms the wake timer
+    t0 = mach_absolute_time();
+    for (int i = 0; i < kBenchCallsPerOp; i++) {
+        schedulePowerEventType(CFSTR(kIOPMAutoWake));
+    }
+    scheduleNs = benchElapsedNs(t0);
+
+    // removeEvent, from anywhere in the queue
+    t0 = mach_absolute_time();
+    for (int i = 0; i < calls; i++) {
+        xctCancelPowerEvent(events[i]);
+    }
+    removeNs = benchElapsedNs(t0);
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), count - calls);
+
+    // purgePastEvents, as the clock passes every remaining event
+    t0 = mach_absolute_time();
+    for (int i = 0; i < count; i++) {
+        xctSetVirtualClock(first + (CFAbsoluteTime)i * kBenchEventSpacingSecs + 1);
+        xctPurgePastEvents(CFSTR(kIOPMAutoWake));
+    }
+    purgeNs = benchElapsedNs(t0);
+    XCTAssertEqual(xctPowerEventCount(CFSTR(kIOPMAutoWake)), 0);
+
+    NSLog(@"%6d events: add %8.2f us, copyEarliest %8.2f us, schedule %8.2f us, "
+          "remove %8.2f us, purge %8.2f us, %6.0f bytes/event",
+          count,
+          addNs / 1000.0 / count,
+          copyNs / 1000.0 / kBenchCallsPerOp,
+          scheduleNs / 1000.0 / kBenchCallsPerOp,
+          removeNs / 1000.0 / calls,
+          purgeNs / 1000.0 / count,
+          (bytesAfter > bytesBefore) ? (double)(bytesAfter - bytesBefore) / count : 0.0);
+
+    xctSetVirtualClock(0);
+    xctResetPowerEvents();
+
+    for (int i = 0; i < count; i++) {
+        CFRelease(events[i]);
+    }
+    free(events);
+}
+
+- (void)testSchedulerScale
+{
+    if (!getenv(kBenchEnableEnv)) {
+        NSLog(@"Skipping the scheduler benchmark; set %s to run it", kBenchEnableEnv);
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(kBenchSizes) / sizeof(kBenchSizes[0]); i++) {
+        [self runBenchmark:kBenchSizes[i]];
+    }
+}
+
+@end
@@ -0,0 +1,488 @@
+//
+//  test_pmConnection.m
+//  PowerManagement
+//
+//  PMConnection registry tests and scale benchmarks.
+//
+
+#import <XCTest/XCTest.h>
+#include <pthread.h>
+#include "PrivateLib.h"
+#include "PMConnection.h"
+#include "powermanagementServer.h"
+
+#define kBenchConnectionCount   5000
+#define kPoolConnectionCount    8
+
+/*
+ * When set, libmalloc hands every allocation in every zone to malloc_logger
+ * (this is how MallocStackLogging sees them). The transition tests count
+ * the allocations made on their own thread while the daemon handles a
+ * notification or an ack.
+ */
+typedef void (malloc_logger_t)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3,
+                               uintptr_t result, uint32_t num_hot_frames_to_skip);
+extern malloc_logger_t *malloc_logger;
+
+#define kMallocLogTypeAllocate  2       // MALLOC_LOG_TYPE_ALLOCATE
+
+static malloc_logger_t      *gPrevMallocLogger;
+static pthread_t            gCountingThread;
+static volatile uint32_t    gCountedAllocs;
+
+static void countingMallocLogger(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3,
+                                 uintptr_t result, uint32_t num_hot_frames_to_skip)
+{
+    if ((type & kMallocLogTypeAllocate) && gCountingThread
+        && pthread_equal(pthread_self(), gCountingThread)) {
+        gCountedAllocs++;
+    }
+    if (gPrevMallocLogger) {
+        gPrevMallocLogger(type, arg1, arg2, arg3, result, num_hot_frames_to_skip + 1);
+    }
+}
+
+static void installAllocationCounter(void)
+{
+    gPrevMallocLogger = malloc_logger;
+    gCountedAllocs = 0;
+    malloc_logger = countingMallocLogger;
+}
+
+static void removeAllocationCounter(void)
+{
+    gCountingThread = NULL;
+    malloc_logger = gPrevMallocLogger;
+}
+
+static inline void countAllocations(bool on)
+{
+    gCountingThread = on ? pthread_self() : NULL;
+}
+
+@interface test_pmConnection : XCTestCase
+
+@end
+
+@implementation test_pmConnection
+
++ (void)setUp
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        PMConnection_prime();
+    });
+}
+
+- (void)createConnections:(uint32_t *)ids count:(int)count interests:(int)interests
+{
+    audit_token_t token = {};
+    int rc;
+
+    for (int i = 0; i < count; i++) {
+        rc = kIOReturnError;
+        _io_pm_connection_create(MACH_PORT_NULL, token, "test_pmConnection",
+                                 interests, &ids[i], &rc);
+        XCTAssertEqual(rc, kIOReturnSuccess);
+    }
+}
+
+- (void)createConnections:(uint32_t *)ids count:(int)count
+{
+    [self createConnections:ids count:count interests:kIOPMSystemPowerStateCapabilityCPU];
+}
+
+- (void)releaseConnections:(uint32_t *)ids count:(int)count
+{
+    int rc;
+
+    for (int i = 0; i < count; i++) {
+        _io_pm_connection_release(MACH_PORT_NULL, ids[i], &rc);
+    }
+}
+
+- (void)testRegistryLookupAfterRelease
+{
+    uint32_t    ids[kBenchConnectionCount];
+    CFIndex     baseCount = xctConnectionCount();
+    int         rc;
+
+    [self createConnections:ids count:kBenchConnectionCount];
+    XCTAssertEqual(xctConnectionCount(), baseCount + kBenchConnectionCount);
+
+    // Release every third connection; the rest must still resolve
+    for (int i = 0; i < kBenchConnectionCount; i += 3) {
+        _io_pm_connection_release(MACH_PORT_NULL, ids[i], &rc);
+        XCTAssertEqual(rc, kIOReturnSuccess);
+        _io_pm_connection_release(MACH_PORT_NULL, ids[i], &rc);
+        XCTAssertEqual(rc, kIOReturnNotFound);
+    }
+
+    for (int i = 0; i < kBenchConnectionCount; i++) {
+        if ((i % 3) == 0) {
+            continue;
+        }
+        _io_pm_connection_release(MACH_PORT_NULL, ids[i], &rc);
+        XCTAssertEqual(rc, kIOReturnSuccess, @"connection %u lost", ids[i]);
+    }
+
+    XCTAssertEqual(xctConnectionCount(), baseCount);
+}
+
+- (void)testRegistryLookupPerformance
+{
+    uint32_t    ids[kBenchConnectionCount];
+
+    [self createConnections:ids count:kBenchConnectionCount];
+
+    // Each ack resolves the connection by ID before looking for the token
+    [self measureBlock:^{
+        int rc;
+        for (int pass = 0; pass < 20; pass++) {
+            for (int i = 0; i < kBenchConnectionCount; i++) {
+                _io_pm_connection_acknowledge_event(MACH_PORT_NULL, ids[i], 1, 0, 0, &rc);
+            }
+        }
+    }];
+
+    [self releaseConnections:ids count:kBenchConnectionCount];
+}
+
+- (void)testInterestFanout
+{
+    uint32_t    cpuIds[kBenchConnectionCount / 2];
+    uint32_t    bothIds[kBenchConnectionCount / 2];
+    uint32_t    baseCpu = xctCountConnectionsWithInterest(kIOPMSystemPowerStateCapabilityCPU);
+    uint32_t    baseVideo = xctCountConnectionsWithInterest(kIOPMSystemPowerStateCapabilityVideo);
+    uint32_t    baseAny = xctCountConnectionsWithInterest(kIOPMSystemPowerStateCapabilityCPU
+                                                          | kIOPMSystemPowerStateCapabilityVideo);
+
+    [self createConnections:cpuIds count:kBenchConnectionCount / 2];
+    [self createConnections:bothIds count:kBenchConnectionCount / 2
+                  interests:kIOPMSystemPowerStateCapabilityCPU | kIOPMSystemPowerStateCapabilityVideo];
+
+    XCTAssertEqual(xctCountConnectionsWithInterest(kIOPMSystemPowerStateCapabilityVideo),
+                   baseVideo + kBenchConnectionCount / 2);
+    // Connections in both buckets are collected once
+    XCTAssertEqual(xctCountConnectionsWithInterest(kIOPMSystemPowerStateCapabilityCPU
+                                                   | kIOPMSystemPowerStateCapabilityVideo),
+                   baseAny + kBenchConnectionCount);
+
+    [self measureBlock:^{
+        for (int pass = 0; pass < 100; pass++) {
+            xctCountConnectionsWithInterest(kIOPMSystemPowerStateCapabilityVideo);
+        }
+    }];
+
+    [self releaseConnections:bothIds count:kBenchConnectionCount / 2];
+    XCTAssertEqual(xctCountConnectionsWithInterest(kIOPMSystemPowerStateCapabilityVideo), baseVideo);
+    XCTAssertEqual(xctCountConnectionsWithInterest(kIOPMSystemPowerStateCapabilityCPU),
+                   baseCpu + kBenchConnectionCount / 2);
+
+    [self releaseConnections:cpuIds count:kBenchConnectionCount / 2];
+}
+
+- (void)testFullQueueDeferredInOrder
+{
+    mach_port_t         port = MACH_PORT_NULL;
+    mach_port_limits_t  limits = { .mpl_qlimit = 1 };
+    audit_token_t       token = {};
+    uint32_t            cid = 0;
+    uint32_t            deferredBase = xctDeferredSendCount();
+    int                 sent[3] = { kIOPMCapabilityCPU,
+                                    kIOPMCapabilityCPU | kIOPMCapabilityDisk,
+                                    kIOPMCapabilityCPU | kIOPMCapabilityNetwork };
+    int                 rc;
+    struct {
+        mach_msg_header_t   header;
+        mach_msg_body_t     body;
+        uint32_t            payload[2];
+        mach_msg_trailer_t  trailer;
+    } rcv;
+
+    XCTAssertEqual(mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port), KERN_SUCCESS);
+    XCTAssertEqual(mach_port_insert_right(mach_task_self(), port, port, MACH_MSG_TYPE_MAKE_SEND), KERN_SUCCESS);
+    XCTAssertEqual(mach_port_set_attributes(mach_task_self(), port, MACH_PORT_LIMITS_INFO,
+                                            (mach_port_info_t)&limits, MACH_PORT_LIMITS_INFO_COUNT), KERN_SUCCESS);
+
+    [self createConnections:&cid count:1];
+    _io_pm_connection_schedule_notification(MACH_PORT_NULL, token, cid, port, 0, &rc);
+    XCTAssertEqual(rc, kIOReturnSuccess);
+
+    // The queue holds one message; the rest wait without blocking the sender
+    for (int i = 0; i < 3; i++) {
+        xctSendNoRespNotification(sent[i]);
+    }
+    XCTAssertEqual(xctDeferredSendCount(), deferredBase + 2);
+
+    for (int i = 0; i < 3; i++) {
+        if (i > 0) {
+            xctRetryDeferredSends();
+        }
+        bzero(&rcv, sizeof(rcv));
+        XCTAssertEqual(mach_msg(&rcv.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(rcv),
+                                port, 0, MACH_PORT_NULL), MACH_MSG_SUCCESS);
+        XCTAssertEqual((int)rcv.payload[0], sent[i]);
+    }
+    XCTAssertEqual(xctDeferredSendCount(), deferredBase);
+
+    [self releaseConnections:&cid count:1];
+    mach_port_mod_refs(mach_task_self(), port, MACH_PORT_RIGHT_RECEIVE, -1);
+}
+
+- (void)testDeferredNotificationDroppedAfterTransition
+{
+    const int           fullWake = kIOPMCapabilityCPU | kIOPMCapabilityDisk | kIOPMCapabilityNetwork
+                                    | kIOPMCapabilityAudio | kIOPMCapabilityVideo;
+    const int           darkWake = kIOPMCapabilityCPU | kIOPMCapabilityDisk | kIOPMCapabilityNetwork;
+    mach_port_t         port = MACH_PORT_NULL;
+    mach_port_limits_t  limits = { .mpl_qlimit = 1 };
+    audit_token_t       token = {};
+    uint32_t            cid = 0;
+    uint32_t            deferredBase = xctDeferredSendCount();
+    int                 rc;
+    struct {
+        mach_msg_header_t   header;
+        mach_msg_body_t     body;
+        uint32_t            payload[2];
+        mach_msg_trailer_t  trailer;
+    } rcv;
+
+    XCTAssertFalse(xctTransitionInFlight());
+    XCTAssertEqual(mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port), KERN_SUCCESS);
+    XCTAssertEqual(mach_port_insert_right(mach_task_self(), port, port, MACH_MSG_TYPE_MAKE_SEND), KERN_SUCCESS);
+    XCTAssertEqual(mach_port_set_attributes(mach_task_self(), port, MACH_PORT_LIMITS_INFO,
+                                            (mach_port_info_t)&limits, MACH_PORT_LIMITS_INFO_COUNT), KERN_SUCCESS);
+
+    [self createConnections:&cid count:1 interests:kIOPMSystemPowerStateCapabilityVideo];
+    _io_pm_connection_schedule_notification(MACH_PORT_NULL, token, cid, port, 0, &rc);
+    XCTAssertEqual(rc, kIOReturnSuccess);
+
+    // Fill the queue, so the transition's notification has to wait. Going from
+    // dark to full wake changes the video capability the client asked about.
+    xctSendNoRespNotification(fullWake);
+    xctSetCapabilityBits(darkWake);
+    XCTAssertTrue(xctFireNotification(fullWake));
+    XCTAssertTrue(xctTransitionInFlight());
+    XCTAssertEqual(xctDeferredSendCount(), deferredBase + 1);
+
+    // Once its transition is over, the notification is dropped rather than delivered
+    xctExpireResponses();
+    XCTAssertFalse(xctTransitionInFlight());
+    bzero(&rcv, sizeof(rcv));
+    XCTAssertEqual(mach_msg(&rcv.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(rcv),
+                            port, 0, MACH_PORT_NULL), MACH_MSG_SUCCESS);
+    XCTAssertEqual(rcv.payload[1], 0u);
+
+    xctRetryDeferredSends();
+    XCTAssertEqual(xctDeferredSendCount(), deferredBase);
+    XCTAssertEqual(mach_msg(&rcv.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(rcv),
+                            port, 0, MACH_PORT_NULL), MACH_RCV_TIMED_OUT);
+
+    [self releaseConnections:&cid count:1];
+    mach_port_mod_refs(mach_task_self(), port, MACH_PORT_RIGHT_RECEIVE, -1);
+}
+
+/*
+ * Copies ack options into memory the ack handler can vm_deallocate, as MIG
+ * would have delivered them.
+ */
+static vm_offset_t copyAckOptions(NSData *options)
+{
+    vm_address_t    buf = 0;
+
+    if (!options.length
+        || (KERN_SUCCESS != vm_allocate(mach_task_self(), &buf, options.length, VM_FLAGS_ANYWHERE))) {
+        return 0;
+    }
+    memcpy((void *)buf, options.bytes, options.length);
+    return (vm_offset_t)buf;
+}
+
+/*
+ * Fires a transition and acknowledges it from every client, counting only
+ * what the daemon allocates while handling the notification and the acks.
+ */
+- (void)runAcknowledgedTransition:(int)bits ids:(uint32_t *)ids ports:(mach_port_t *)ports
+                            count:(int)count options:(NSData *)options
+{
+    vm_offset_t     optionsBuf;
+    bool            fired;
+    int             rc;
+    struct {
+        mach_msg_header_t   header;
+        mach_msg_body_t     body;
+        uint32_t            payload[2];
+        mach_msg_trailer_t  trailer;
+    } rcv;
+
+    countAllocations(true);
+    fired = xctFireNotification(bits);
+    countAllocations(false);
+    XCTAssertTrue(fired);
+
+    for (int i = 0; i < count; i++) {
+        bzero(&rcv, sizeof(rcv));
+        XCTAssertEqual(mach_msg(&rcv.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(rcv),
+                                ports[i], 0, MACH_PORT_NULL), MACH_MSG_SUCCESS);
+        optionsBuf = copyAckOptions(options);
+
+        rc = kIOReturnError;
+        countAllocations(true);
+        _io_pm_connection_acknowledge_event(MACH_PORT_NULL, ids[i], rcv.payload[1],
+                                            optionsBuf, optionsBuf ? (mach_msg_type_number_t)options.length : 0, &rc);
+        countAllocations(false);
+        XCTAssertEqual(rc, kIOReturnSuccess);
+    }
+}
+
+- (void)runAcknowledgedTransition:(int)bits ids:(uint32_t *)ids ports:(mach_port_t *)ports count:(int)count
+{
+    [self runAcknowledgedTransition:bits ids:ids ports:ports count:count options:nil];
+}
+
+/*
+ * Once warm, a transition whose clients ack promptly allocates nothing:
+ * not from the response pool, and not transiently (CF objects on the ack
+ * path, response stats, client info) either. Acks that carry options
+ * allocate exactly what unpacking the options costs, and nothing more.
+ */
+- (void)testSteadyStateTransitionsDontAllocate
+{
+    const int           count = kPoolConnectionCount;
+    const int           fullWake = kIOPMCapabilityCPU | kIOPMCapabilityDisk | kIOPMCapabilityNetwork
+                                    | kIOPMCapabilityAudio | kIOPMCapabilityVideo;
+    const int           darkWake = kIOPMCapabilityCPU | kIOPMCapabilityDisk | kIOPMCapabilityNetwork;
+    uint32_t            ids[kPoolConnectionCount];
+    mach_port_t         ports[kPoolConnectionCount];
+    audit_token_t       token = {};
+    uint32_t            warmAllocs;
+    uint32_t            unpackAllocs;
+    NSData              *options;
+    CFDictionaryRef     unpacked;
+    int                 rc;
+
+    options = [NSPropertyListSerialization dataWithPropertyList:@{ (__bridge NSString *)kIOPMAckClientInfoKey :
+                                                                      @"test_pmConnection.clientInfo" }
+                                                         format:NSPropertyListBinaryFormat_v1_0
+                                                        options:0 error:NULL];
+    XCTAssertNotNil(options);
+
+    [self createConnections:ids count:count interests:kIOPMSystemPowerStateCapabilityVideo];
+    for (int i = 0; i < count; i++) {
+        XCTAssertEqual(mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &ports[i]), KERN_SUCCESS);
+        XCTAssertEqual(mach_port_insert_right(mach_task_self(), ports[i], ports[i], MACH_MSG_TYPE_MAKE_SEND), KERN_SUCCESS);
+        _io_pm_connection_schedule_notification(MACH_PORT_NULL, token, ids[i], ports[i], 0, &rc);
+        XCTAssertEqual(rc, kIOReturnSuccess);
+    }
+
+    // The first round sizes the pool and the per-client history
+    xctSetCapabilityBits(fullWake);
+    [self runAcknowledgedTransition:darkWake ids:ids ports:ports count:count options:options];
+    [self runAcknowledgedTransition:fullWake ids:ids ports:ports count:count options:options];
+    warmAllocs = xctResponsePoolHeapAllocs();
+
+    installAllocationCounter();
+    for (int pass = 0; pass < 50; pass++) {
+        [self runAcknowledgedTransition:darkWake ids:ids ports:ports count:count];
+        [self runAcknowledgedTransition:fullWake ids:ids ports:ports count:count];
+    }
+    XCTAssertEqual(gCountedAllocs, 0u, @"allocations across 100 transitions");
+
+    // Unpacking the options on their own, as the ack handler does
+    gCountedAllocs = 0;
+    countAllocations(true);
+    unpacked = xctUnpackAckOptions(options.bytes, (uint32_t)options.length);
+    countAllocations(false);
+    unpackAllocs = gCountedAllocs;
+    XCTAssert(unpacked != NULL);
+    if (unpacked) {
+        CFRelease(unpacked);
+    }
+    XCTAssertGreaterThan(unpackAllocs, 0u);
+
+    gCountedAllocs = 0;
+    [self runAcknowledgedTransition:darkWake ids:ids ports:ports count:count options:options];
+    [self runAcknowledgedTransition:fullWake ids:ids ports:ports count:count options:options];
+    XCTAssertEqual(gCountedAllocs, 2 * count * unpackAllocs, @"allocations beyond unpacking ack options");
+    removeAllocationCounter();
+
+    XCTAssertEqual(xctResponsePoolHeapAllocs(), warmAllocs);
+
+    [self releaseConnections:ids count:count];
+    for (int i = 0; i < count; i++) {
+        mach_port_mod_refs(mach_task_self(), ports[i], MACH_PORT_RIGHT_RECEIVE, -1);
+    }
+}
+
+- (void)testWakeCandidateOrdering
+{
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+
+    // Equal times and rank: the earlier insertion wins
+    const char      *tie[] = { "Maintenance", "SleepService", "Maintenance" };
+    CFAbsoluteTime  tieAt[] = { now + 7200, now + 3600, now + 3600 };
+    XCTAssertEqual(xctChooseWakeCandidate(tie, tieAt, 3, false), 1);
+
+    // Dark wakes held to the minimum lead collide; TCP keepalive outranks them
+    const char      *lead[] = { "Maintenance", "SleepService", "TCPKATurnOff" };
+    CFAbsoluteTime  leadAt[] = { now + 10, now + 30, now + 50 };
+    XCTAssertEqual(xctChooseWakeCandidate(lead, leadAt, 3, false), 2);
+
+    // User wakes win ties with dark wakes
+    const char      *user[] = { "SleepService", "UserWake" };
+    CFAbsoluteTime  userAt[] = { now + 3600, now + 3600 };
+    XCTAssertEqual(xctChooseWakeCandidate(user, userAt, 2, false), 1);
+
+    // Standby with the FV key destroyed drops dark wakes and shutdown wakes only
+    const char      *standby[] = { "Maintenance", "UserWake", "Shutdown/Restart" };
+    CFAbsoluteTime  standbyAt[] = { now + 600, now + 7200, now + 3600 };
+    XCTAssertEqual(xctChooseWakeCandidate(standby, standbyAt, 3, true), 1);
+    XCTAssertEqual(xctChooseWakeCandidate(standby, standbyAt, 1, true), -1);
+}
+
+- (void)testMergedWakeKeepsHighestWakeType
+{
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+
+    // A sleep service request merged into a maintenance head still gets a sleep service wake
+    const char      *ss[] = { "Maintenance", "SleepService" };
+    CFAbsoluteTime  ssAt[] = { now + 3600, now + 3600 };
+    XCTAssertEqual(xctChooseWakeCandidate(ss, ssAt, 2, false), 0);
+    XCTAssertEqualObjects(@(xctChooseWakeType(ss, ssAt, 2)), @"SleepService");
+
+    // And a merged user wake still gets a full wake
+    const char      *user[] = { "SleepService", "Maintenance", "UserWake" };
+    CFAbsoluteTime  userAt[] = { now + 3600, now + 3600, now + 3600 };
+    XCTAssertEqualObjects(@(xctChooseWakeType(user, userAt, 3)), @"FullWake");
+
+    const char      *mntc[] = { "Maintenance", "TimerPlugin" };
+    CFAbsoluteTime  mntcAt[] = { now + 3600, now + 3600 };
+    XCTAssertEqualObjects(@(xctChooseWakeType(mntc, mntcAt, 2)), @"Maintenance");
+}
+
+- (void)testWakeCandidateHeapGrows
+{
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+    const char      *sources[100];
+    CFAbsoluteTime  at[100];
+
+    // Latest first, so every insertion becomes the new head
+    for (int i = 0; i < 100; i++) {
+        sources[i] = (i % 2) ? "SleepService" : "Maintenance";
+        at[i] = now + 86400 - (i * 60);
+    }
+    XCTAssertEqual(xctChooseWakeCandidate(sources, at, 100, false), 99);
+}
+
+- (void)testRegistryChurnPerformance
+{
+    [self measureBlock:^{
+        uint32_t ids[kBenchConnectionCount];
+
+        [self createConnections:ids count:kBenchConnectionCount];
+        [self releaseConnections:ids count:kBenchConnectionCount];
+    }];
+}
+
+@end
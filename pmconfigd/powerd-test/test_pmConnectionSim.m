@@ -0,0 +1,685 @@
+//
+//  test_pmConnectionSim.m
+//  PowerManagement
+//
+//  Synthetic-client sleep/wake simulator for PMConnection. Registers
+//  thousands of clients with scripted acknowledgement behaviour, drives
+//  PMConnectionPowerCallBack() through sleep and wake, and reports what
+//  each transition costs as the client count grows. Also replays a day of
+//  periodic wake requests through wake selection to count RTC wakes, and
+//  a checked-in dark wake trace through the linger policy to total awake time.
+//
+
+#import <XCTest/XCTest.h>
+#include <mach/mach_time.h>
+#include "PrivateLib.h"
+#include "PMConnection.h"
+#include "powermanagementServer.h"
+
+#define kSimDelayedAckMs        5
+#define kSimWakeRequestSecs     3600
+#define kSimDarkWakeSecs        30
+#define kSimDaySecs             (24*60*60)
+#define kSimDarkLingerSecs      15      // kPMDarkWakeLingerDuration
+#define kSimACLingerSecs        45      // kPMACWakeLingerDuration
+#define kSimLingerMaxSecs       60      // kLingerMaxDuration
+#define kSimRewakeSecs          20      // Awake secs of sleeping and waking straight back up
+#define kSimLingerSpacingSecs   (20*60)
+
+typedef enum {
+    kSimAckPrompt = 0,
+    kSimAckDelayed,
+    kSimAckNever,
+    kSimAckMaintenance,
+    kSimAckSleepService,
+    kSimBehaviorCount
+} SimBehavior;
+
+typedef struct {
+    uint32_t        cid;
+    mach_port_t     port;
+    SimBehavior     behavior;
+} SimClient;
+
+typedef struct {
+    double          fanoutMs;       // In the capability change callback
+    double          ackMs;          // In acknowledgement handlers
+    double          totalMs;        // Callback until the transition is no longer in flight
+    int             acks;
+} SimCost;
+
+/* A client that asks for a wake every 'period', starting 'phase' into the day */
+typedef struct {
+    const char      *source;
+    CFTimeInterval  period;
+    CFTimeInterval  phase;
+    CFTimeInterval  leeway;
+} SimWakeClient;
+
+static const SimWakeClient kSimDayClients[] = {
+    { "Maintenance",    15*60,      2*60,       5*60 },
+    { "Maintenance",    20*60,      7*60,       5*60 },
+    { "Maintenance",    30*60,      11*60,      10*60 },
+    { "Maintenance",    60*60,      23*60,      15*60 },
+    { "SleepService",   10*60,      4*60,       2*60 },
+    { "SleepService",   30*60,      17*60,      5*60 },
+    { "SleepService",   45*60,      29*60,      10*60 },
+    { "TimerPlugin",    90*60,      41*60,      20*60 },
+    { "UserWake",       12*60*60,   7*60*60,    0 },
+};
+
+/*
+ * The dark wake trace replayed through the linger policy, in order: one
+ * dictionary per linger with the reason it lingered for, whether it was an
+ * AC wake linger, and how many secs after it began the next activity
+ * arrived, or -1 if none did within two minutes.
+ */
+#define kSimLingerTraceResource @"darkWakeLingerTrace"
+#define kSimLingerACWakeKey     @"ACWake"
+#define kSimLingerReasonKey     @"Reason"
+#define kSimLingerArrivalKey    @"Arrival"
+
+static double simElapsedMs(uint64_t start)
+{
+    static mach_timebase_info_data_t tb;
+
+    if (!tb.denom) {
+        mach_timebase_info(&tb);
+    }
+    return (double)(mach_absolute_time() - start) * tb.numer / tb.denom / NSEC_PER_MSEC;
+}
+
+@interface test_pmConnectionSim : XCTestCase
+
+@end
+
+@implementation test_pmConnectionSim
+{
+    SimClient   *_clients;
+    int         _clientCount;
+    long        _notifyRef;
+}
+
++ (void)setUp
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        PMConnection_prime();
+    });
+}
+
+/*
+ * Registers 'count' clients. mix[] gives the share of each SimBehavior in
+ * percent; clients are assigned round robin so every size gets the same mix.
+ */
+- (void)registerClients:(int)count mix:(const int *)mix
+{
+    audit_token_t   token = {};
+    int             rc;
+    int             slots[100];
+    int             slotCnt = 0;
+
+    for (int b = 0; b < kSimBehaviorCount; b++) {
+        for (int i = 0; i < mix[b]; i++) {
+            slots[slotCnt++] = b;
+        }
+    }
+    XCTAssertEqual(slotCnt, 100);
+
+    _clients = calloc(count, sizeof(SimClient));
+    _clientCount = count;
+
+    for (int i = 0; i < count; i++) {
+        SimClient *c = &_clients[i];
+
+        c->behavior = (SimBehavior)slots[i % slotCnt];
+        _io_pm_connection_create(MACH_PORT_NULL, token, "test_pmConnectionSim",
+                                 kIOPMSystemPowerStateCapabilityCPU, &c->cid, &rc);
+        XCTAssertEqual(rc, kIOReturnSuccess);
+
+        XCTAssertEqual(mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &c->port), KERN_SUCCESS);
+        XCTAssertEqual(mach_port_insert_right(mach_task_self(), c->port, c->port, MACH_MSG_TYPE_MAKE_SEND), KERN_SUCCESS);
+        _io_pm_connection_schedule_notification(MACH_PORT_NULL, token, c->cid, c->port, 0, &rc);
+        XCTAssertEqual(rc, kIOReturnSuccess);
+    }
+}
+
+- (void)releaseClients
+{
+    int rc;
+
+    for (int i = 0; i < _clientCount; i++) {
+        _io_pm_connection_release(MACH_PORT_NULL, _clients[i].cid, &rc);
+        mach_port_mod_refs(mach_task_self(), _clients[i].port, MACH_PORT_RIGHT_RECEIVE, -1);
+    }
+    free(_clients);
+    _clients = NULL;
+    _clientCount = 0;
+}
+
+/* Ack options the way IOPMConnectionAcknowledgeEventWithOptions() packs them */
+- (void)ackOptions:(SimBehavior)behavior buf:(vm_offset_t *)buf len:(mach_msg_type_number_t *)len
+{
+    CFMutableDictionaryRef  options = NULL;
+    CFDateRef               date = NULL;
+    CFDataRef               data = NULL;
+
+    *buf = 0;
+    *len = 0;
+    if ((behavior != kSimAckMaintenance) && (behavior != kSimAckSleepService)) {
+        return;
+    }
+
+    options = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    date = CFDateCreate(0, CFAbsoluteTimeGetCurrent() + kSimWakeRequestSecs);
+    if (behavior == kSimAckMaintenance) {
+        CFDictionarySetValue(options, kIOPMAckWakeDate, date);
+    } else {
+        CFDictionarySetValue(options, kIOPMAckAppRefreshWakeDate, date);
+        CFDictionarySetValue(options, kIOPMAckClientInfoAppRefreshKey, CFSTR("test_pmConnectionSim"));
+    }
+    data = CFPropertyListCreateData(0, options, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+
+    // The handler vm_deallocate()s the options, as MIG would
+    if (data && (KERN_SUCCESS == vm_allocate(mach_task_self(), buf, CFDataGetLength(data), VM_FLAGS_ANYWHERE))) {
+        memcpy((void *)*buf, CFDataGetBytePtr(data), CFDataGetLength(data));
+        *len = (mach_msg_type_number_t)CFDataGetLength(data);
+    }
+
+    if (data) CFRelease(data);
+    CFRelease(date);
+    CFRelease(options);
+}
+
+- (void)acknowledge:(SimClient *)c token:(uint32_t)token cost:(SimCost *)cost
+{
+    vm_offset_t             buf;
+    mach_msg_type_number_t  len;
+    uint64_t                start;
+    int                     rc;
+
+    [self ackOptions:c->behavior buf:&buf len:&len];
+
+    start = mach_absolute_time();
+    _io_pm_connection_acknowledge_event(MACH_PORT_NULL, c->cid, token, buf, len, &rc);
+    cost->ackMs += simElapsedMs(start);
+    cost->acks++;
+
+    XCTAssertEqual(rc, kIOReturnSuccess);
+}
+
+/*
+ * Delivers one capability change and plays every client's part until the
+ * transition completes. Clients that never ack are expired as the response
+ * timer would.
+ */
+- (SimCost)runTransitionFrom:(IOPMCapabilityBits)from to:(IOPMCapabilityBits)to flags:(uint32_t)flags
+{
+    struct IOPMSystemCapabilityChangeParameters capArgs = {};
+    SimCost     cost = {};
+    uint64_t    start;
+    uint32_t    *delayed = NULL;
+    int         delayedCnt = 0;
+    struct {
+        mach_msg_header_t   header;
+        mach_msg_body_t     body;
+        uint32_t            payload[2];
+        mach_msg_trailer_t  trailer;
+    } rcv;
+
+    capArgs.notifyRef = ++_notifyRef;
+    capArgs.changeFlags = flags;
+    capArgs.fromCapabilities = from;
+    capArgs.toCapabilities = to;
+
+    delayed = calloc(_clientCount, sizeof(uint32_t));
+
+    start = mach_absolute_time();
+    xctPowerCallBack(kIOMessageSystemCapabilityChange, &capArgs);
+    cost.fanoutMs = simElapsedMs(start);
+
+    for (int i = 0; i < _clientCount; i++) {
+        SimClient *c = &_clients[i];
+
+        while (1) {
+            bzero(&rcv, sizeof(rcv));
+            if (MACH_MSG_SUCCESS != mach_msg(&rcv.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(rcv),
+                                             c->port, 0, MACH_PORT_NULL)) {
+                break;
+            }
+            if (0 == rcv.payload[1]) {
+                // No response expected
+                continue;
+            }
+
+            if (c->behavior == kSimAckDelayed) {
+                delayed[i] = rcv.payload[1];
+                delayedCnt++;
+            } else if (c->behavior != kSimAckNever) {
+                [self acknowledge:c token:rcv.payload[1] cost:&cost];
+            }
+        }
+    }
+
+    if (delayedCnt) {
+        usleep(kSimDelayedAckMs * USEC_PER_SEC / MSEC_PER_SEC);
+        for (int i = 0; i < _clientCount; i++) {
+            if (delayed[i]) {
+                [self acknowledge:&_clients[i] token:delayed[i] cost:&cost];
+            }
+        }
+    }
+
+    if (xctTransitionInFlight()) {
+        xctExpireResponses();
+    }
+    XCTAssertFalse(xctTransitionInFlight());
+    cost.totalMs = simElapsedMs(start);
+
+    free(delayed);
+    return cost;
+}
+
+/* One sleep and wake cycle; returns the summed cost */
+- (SimCost)runSleepWakeCycle
+{
+    const IOPMCapabilityBits full = kIOPMSystemCapabilityCPU | kIOPMSystemCapabilityGraphics
+                                    | kIOPMSystemCapabilityAudio | kIOPMSystemCapabilityNetwork;
+    SimCost     steps[3];
+    SimCost     total = {};
+
+    steps[0] = [self runTransitionFrom:full to:0 flags:kIOPMSystemCapabilityWillChange];
+    steps[1] = [self runTransitionFrom:0 to:full flags:kIOPMSystemCapabilityWillChange];
+    steps[2] = [self runTransitionFrom:0 to:full flags:kIOPMSystemCapabilityDidChange];
+
+    for (int i = 0; i < 3; i++) {
+        total.fanoutMs += steps[i].fanoutMs;
+        total.ackMs += steps[i].ackMs;
+        total.totalMs += steps[i].totalMs;
+        total.acks += steps[i].acks;
+    }
+    return total;
+}
+
+/*
+ * Checks that the work per client in a sleep/wake cycle doesn't grow with
+ * the client count. Wall-clock time varies too much on a loaded host to
+ * assert on, so the test counts notifications sent and connections and
+ * responses scanned, and only logs the time.
+ */
+- (void)testSleepLatencyScaling
+{
+    const int   sizes[] = { 250, 1000, 4000 };
+    const int   sizeCnt = sizeof(sizes) / sizeof(sizes[0]);
+    // prompt, delayed, never, maintenance, sleep service
+    const int   mix[kSimBehaviorCount] = { 70, 10, 5, 10, 5 };
+    double      perClientUs[sizeCnt];
+    double      sentPerClient[sizeCnt];
+    double      scansPerClient[sizeCnt];
+
+    for (int s = 0; s < sizeCnt; s++) {
+        SimCost     cost;
+        uint64_t    sent, scans;
+
+        [self registerClients:sizes[s] mix:mix];
+
+        // Warm up pools and per-client history before measuring
+        [self runSleepWakeCycle];
+        sent = xctSentNotificationCount();
+        scans = xctTransitionScanCount();
+        cost = [self runSleepWakeCycle];
+        sentPerClient[s] = (double)(xctSentNotificationCount() - sent) / sizes[s];
+        scansPerClient[s] = (double)(xctTransitionScanCount() - scans) / sizes[s];
+
+        perClientUs[s] = (cost.fanoutMs + cost.ackMs) * 1000.0 / sizes[s];
+        NSLog(@"%5d clients: fan-out %8.2f ms, %5d acks %8.2f ms, transitions %9.2f ms, %6.2f us/client, "
+              "%.2f sends/client, %.2f scans/client",
+              sizes[s], cost.fanoutMs, cost.acks, cost.ackMs, cost.totalMs, perClientUs[s],
+              sentPerClient[s], scansPerClient[s]);
+
+        [self releaseClients];
+    }
+
+    XCTAssertGreaterThan(sentPerClient[0], 0.0);
+
+    // Quadratic fan-out or ack handling would grow the per-client work with
+    // the client count; the behaviour mix only rounds differently per size.
+    for (int s = 1; s < sizeCnt; s++) {
+        XCTAssertEqual(sentPerClient[s], sentPerClient[0]);
+        XCTAssertLessThanOrEqual(scansPerClient[s], scansPerClient[0] * 1.05,
+                                 @"%d clients scan %.2f entries each, %d clients %.2f",
+                                 sizes[s], scansPerClient[s], sizes[0], scansPerClient[0]);
+    }
+}
+
+/*
+ * Sleeps, wakes for the next chosen wake, stays up kSimDarkWakeSecs and
+ * sleeps again until a day has passed. Every request the wake served comes
+ * due again a period later. Returns the number of RTC wakes.
+ */
+- (int)replayDayWithLeeway:(bool)useLeeway merged:(int *)merged
+{
+    const int       count = sizeof(kSimDayClients) / sizeof(kSimDayClients[0]);
+    const char      *sources[count];
+    CFAbsoluteTime  due[count];
+    CFAbsoluteTime  requested[count];
+    CFAbsoluteTime  deadline[count];
+    bool            served[count];
+    CFAbsoluteTime  start = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime  now = start;
+    CFAbsoluteTime  wakeAt = 0;
+    int             chosen;
+    int             wakes = 0;
+
+    for (int i = 0; i < count; i++) {
+        sources[i] = kSimDayClients[i].source;
+        due[i] = start + kSimDayClients[i].phase;
+    }
+    *merged = 0;
+
+    while (1) {
+        for (int i = 0; i < count; i++) {
+            requested[i] = due[i];
+            deadline[i] = due[i] + (useLeeway ? kSimDayClients[i].leeway : 0);
+        }
+        chosen = xctCoalesceWakeCandidates(sources, requested, deadline, count, now, false, &wakeAt, served);
+        if ((chosen < 0) || (wakeAt > start + kSimDaySecs)) {
+            break;
+        }
+
+        wakes++;
+        for (int i = 0; i < count; i++) {
+            if (!served[i]) {
+                continue;
+            }
+            if (i != chosen) {
+                (*merged)++;
+            }
+            while (due[i] <= wakeAt) {
+                due[i] += kSimDayClients[i].period;
+            }
+        }
+        now = wakeAt + kSimDarkWakeSecs;
+    }
+
+    return wakes;
+}
+
+- (void)testDayReplayCoalescesWakes
+{
+    int before, after;
+    int mergedBefore, mergedAfter;
+
+    before = [self replayDayWithLeeway:false merged:&mergedBefore];
+    after = [self replayDayWithLeeway:true merged:&mergedAfter];
+
+    NSLog(@"Day replay: %d wakes without leeway (%d requests shared a wake), %d with leeway (%d shared)",
+          before, mergedBefore, after, mergedAfter);
+    XCTAssertLessThan(after, before);
+    XCTAssertGreaterThan(mergedAfter, mergedBefore);
+}
+
+- (NSArray *)lingerTrace
+{
+    NSURL       *url = [[NSBundle bundleForClass:[self class]] URLForResource:kSimLingerTraceResource
+                                                                withExtension:@"plist"];
+    NSArray     *trace = url ? [NSArray arrayWithContentsOfURL:url] : nil;
+
+    XCTAssertNotNil(trace, @"%@.plist missing from the test bundle", kSimLingerTraceResource);
+    return trace;
+}
+
+/*
+ * Teaches the linger policy the first half of the trace, then scores the
+ * second half, which it never saw, with both the fixed and the learned
+ * lingers. Activity that arrives during a linger ends the wait; activity
+ * after it costs the linger plus kSimRewakeSecs of sleeping and waking
+ * back up. Returns the number of distinct reasons.
+ */
+- (NSUInteger)replayLingerTraceFixed:(double *)fixed learned:(double *)learned
+{
+    NSArray         *trace = [self lingerTrace];
+    NSMutableSet    *reasons = [NSMutableSet set];
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+    const NSUInteger half = trace.count / 2;
+
+    xctResetLingerPolicy();
+
+    for (NSUInteger i = 0; i < half; i++) {
+        NSDictionary    *linger = trace[i];
+        bool            acWake = [linger[kSimLingerACWakeKey] boolValue];
+        double          arrival = [linger[kSimLingerArrivalKey] doubleValue];
+
+        xctLingerBegin(acWake, (__bridge CFStringRef)linger[kSimLingerReasonKey],
+                       acWake ? kSimACLingerSecs : kSimDarkLingerSecs, now);
+        if (arrival >= 0) {
+            xctLingerNoteActivity(now + arrival);
+        }
+        [reasons addObject:linger[kSimLingerReasonKey]];
+        now += kSimLingerSpacingSecs;
+    }
+    // Nothing arrives after the last one
+    xctLingerNoteActivity(now);
+
+    *fixed = *learned = 0;
+    for (NSUInteger i = half; i < trace.count; i++) {
+        NSDictionary    *linger = trace[i];
+        bool            acWake = [linger[kSimLingerACWakeKey] boolValue];
+        double          arrival = [linger[kSimLingerArrivalKey] doubleValue];
+        int             configured = acWake ? kSimACLingerSecs : kSimDarkLingerSecs;
+        int             lingers[2] = { configured,
+                                       xctLingerChoose(acWake, (__bridge CFStringRef)linger[kSimLingerReasonKey], configured) };
+        double          *awake[2] = { fixed, learned };
+
+        for (int j = 0; j < 2; j++) {
+            if (arrival < 0) {
+                *awake[j] += lingers[j];
+            } else if (arrival <= lingers[j]) {
+                *awake[j] += arrival;
+            } else {
+                *awake[j] += lingers[j] + kSimRewakeSecs;
+            }
+        }
+    }
+
+    return reasons.count;
+}
+
+- (void)testLearnedLingerBeatsFixedLinger
+{
+    double      fixed, learned;
+    NSUInteger  reasonCnt;
+    CFArrayRef  policy = NULL;
+
+    reasonCnt = [self replayLingerTraceFixed:&fixed learned:&learned];
+
+    NSLog(@"Linger replay of held-out dark wakes: %.1f secs awake with fixed lingers, %.1f with learned lingers",
+          fixed, learned);
+    XCTAssertLessThan(learned, fixed);
+
+    policy = copyDarkWakeLingerPolicy();
+    XCTAssertEqual(CFArrayGetCount(policy), (CFIndex)reasonCnt);
+    for (CFIndex i = 0; i < CFArrayGetCount(policy); i++) {
+        CFDictionaryRef entry = CFArrayGetValueAtIndex(policy, i);
+        CFStringRef     reason = CFDictionaryGetValue(entry, kIOPMLingerReasonKey);
+        int             linger = 0, awake = 0, awakeAtDefault = 0;
+
+        CFNumberGetValue(CFDictionaryGetValue(entry, kIOPMLingerDurationKey), kCFNumberIntType, &linger);
+        CFNumberGetValue(CFDictionaryGetValue(entry, kIOPMLingerAwakeKey), kCFNumberIntType, &awake);
+        CFNumberGetValue(CFDictionaryGetValue(entry, kIOPMLingerAwakeDefaultKey), kCFNumberIntType, &awakeAtDefault);
+
+        XCTAssertEqual(CFDictionaryGetValue(entry, kIOPMLingerLearnedKey), kCFBooleanTrue);
+        XCTAssertLessThanOrEqual(awake, awakeAtDefault);
+        XCTAssertLessThanOrEqual(linger, kSimLingerMaxSecs);
+        if (CFEqual(reason, CFSTR("Idle Sleep"))) {
+            // Work after idle sleep usually shows up a few secs after the
+            // default linger; waiting for it beats sleeping and rewaking
+            XCTAssertGreaterThan(linger, kSimDarkLingerSecs);
+        } else if (CFEqual(reason, CFSTR("RTC (Maintenance)"))) {
+            XCTAssertLessThan(linger, kSimACLingerSecs);
+        } else {
+            XCTAssertLessThan(linger, kSimDarkLingerSecs);
+        }
+    }
+    CFRelease(policy);
+
+    xctResetLingerPolicy();
+}
+
+- (void)testLearnedLingerWaitsForLateWork
+{
+    // Whole secs, so the arrivals are recorded exactly
+    CFAbsoluteTime  now = floor(CFAbsoluteTimeGetCurrent());
+    int             linger;
+
+    xctResetLingerPolicy();
+
+    // Work always arrives 3 secs after the configured linger ends
+    for (int i = 0; i < 16; i++) {
+        xctLingerBegin(false, CFSTR("Idle Sleep"), kSimDarkLingerSecs, now);
+        xctLingerNoteActivity(now + kSimDarkLingerSecs + 3);
+        now += kSimLingerSpacingSecs;
+    }
+    linger = xctLingerChoose(false, CFSTR("Idle Sleep"), kSimDarkLingerSecs);
+    XCTAssertEqual(linger, kSimDarkLingerSecs + 3);
+
+    xctResetLingerPolicy();
+}
+
+- (void)testLearnedLingerNeverExceedsMaximum
+{
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+
+    xctResetLingerPolicy();
+
+    // Work arrives just past the longest linger allowed, whatever is configured
+    for (int i = 0; i < 16; i++) {
+        XCTAssertLessThanOrEqual(xctLingerBegin(false, CFSTR("Idle Sleep"), kSimDarkLingerSecs, now),
+                                 kSimLingerMaxSecs);
+        xctLingerNoteActivity(now + kSimLingerMaxSecs + 5);
+        now += kSimLingerSpacingSecs;
+    }
+    XCTAssertLessThanOrEqual(xctLingerChoose(false, CFSTR("Idle Sleep"), kSimDarkLingerSecs), kSimLingerMaxSecs);
+
+    xctResetLingerPolicy();
+}
+
+- (void)testLingerUsesDefaultUntilLearned
+{
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+    int             linger = 0;
+
+    xctResetLingerPolicy();
+
+    // Nothing ever arrives, so the learned linger is none at all
+    for (int i = 0; i < 16; i++) {
+        linger = xctLingerBegin(false, CFSTR("Idle Sleep"), kSimDarkLingerSecs, now);
+        if (i < 8) {
+            XCTAssertEqual(linger, kSimDarkLingerSecs);
+        }
+        now += kSimLingerSpacingSecs;
+    }
+    XCTAssertEqual(linger, 0);
+
+    // Other reasons learn separately
+    XCTAssertEqual(xctLingerBegin(false, CFSTR("Software Sleep"), kSimDarkLingerSecs, now), kSimDarkLingerSecs);
+
+    xctResetLingerPolicy();
+}
+
+- (void)testNeverAckingClientsDontStallTransitions
+{
+    const int   mix[kSimBehaviorCount] = { 50, 0, 50, 0, 0 };
+    SimCost     cost;
+
+    [self registerClients:200 mix:mix];
+
+    cost = [self runSleepWakeCycle];
+    XCTAssertEqual(cost.acks, 100);
+    XCTAssertFalse(xctTransitionInFlight());
+
+    [self releaseClients];
+}
+
+/* Token of the next message to the client that wants a response, or 0 */
+- (uint32_t)receiveToken:(SimClient *)c
+{
+    struct {
+        mach_msg_header_t   header;
+        mach_msg_body_t     body;
+        uint32_t            payload[2];
+        mach_msg_trailer_t  trailer;
+    } rcv;
+
+    while (1) {
+        bzero(&rcv, sizeof(rcv));
+        if (MACH_MSG_SUCCESS != mach_msg(&rcv.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(rcv),
+                                         c->port, 0, MACH_PORT_NULL)) {
+            return 0;
+        }
+        if (rcv.payload[1]) {
+            return rcv.payload[1];
+        }
+    }
+}
+
+/*
+ * A capability change that arrives while another one still awaits responses
+ * is queued. Each keeps its own timeline: the first one's acks land on it,
+ * and the queued one's timeline stays open until it is fired and acked.
+ */
+- (void)testQueuedTransitionKeepsItsTimeline
+{
+    const IOPMCapabilityBits full = kIOPMSystemCapabilityCPU | kIOPMSystemCapabilityGraphics
+                                    | kIOPMSystemCapabilityAudio | kIOPMSystemCapabilityNetwork;
+    const int   mix[kSimBehaviorCount] = { 100, 0, 0, 0, 0 };
+    struct IOPMSystemCapabilityChangeParameters capArgs = {};
+    CFDictionaryRef     profile = NULL;
+    CFArrayRef          timelines = NULL;
+    CFIndex             count;
+    SimCost             cost = {};
+    uint32_t            token;
+
+    [self registerClients:1 mix:mix];
+
+    capArgs.changeFlags = kIOPMSystemCapabilityWillChange;
+    capArgs.fromCapabilities = full;
+    capArgs.toCapabilities = 0;
+
+    capArgs.notifyRef = ++_notifyRef;
+    xctPowerCallBack(kIOMessageSystemCapabilityChange, &capArgs);
+    token = [self receiveToken:&_clients[0]];
+    XCTAssertNotEqual(token, 0u);
+
+    capArgs.notifyRef = ++_notifyRef;
+    xctPowerCallBack(kIOMessageSystemCapabilityChange, &capArgs);
+    XCTAssertEqual([self receiveToken:&_clients[0]], 0u, @"second change should wait in the queue");
+
+    // Acking the first change fires the queued one
+    [self acknowledge:&_clients[0] token:token cost:&cost];
+    token = [self receiveToken:&_clients[0]];
+    XCTAssertNotEqual(token, 0u);
+    [self acknowledge:&_clients[0] token:token cost:&cost];
+    XCTAssertFalse(xctTransitionInFlight());
+
+    profile = copyTransitionProfile();
+    timelines = profile ? CFDictionaryGetValue(profile, kIOPMTransitionProfileTimelinesKey) : NULL;
+    count = timelines ? CFArrayGetCount(timelines) : 0;
+    XCTAssertGreaterThanOrEqual(count, 2);
+    for (CFIndex i = MAX(count - 2, 0); i < count; i++) {
+        NSDictionary *tl = (__bridge NSDictionary *)CFArrayGetValueAtIndex(timelines, i);
+
+        XCTAssertEqualObjects(tl[(__bridge NSString *)kIOPMTransitionCompleteKey], @YES);
+        XCTAssertEqualObjects(tl[(__bridge NSString *)kIOPMTransitionAckCountKey], @1);
+        XCTAssertNotNil(tl[(__bridge NSString *)kIOPMTransitionPhasesKey][@kIOPMTransitionPhaseKernelAck]);
+    }
+    if (profile) {
+        CFRelease(profile);
+    }
+
+    [self runTransitionFrom:0 to:full flags:kIOPMSystemCapabilityWillChange];
+    [self runTransitionFrom:0 to:full flags:kIOPMSystemCapabilityDidChange];
+    [self releaseClients];
+}
+
+@end
@@ -126,6 +126,8 @@
 #define ARG_REPEAT          "repeat"
 #define ARG_CANCEL          "cancel"
 #define ARG_CANCEL_ALL      "cancelall"
+#define ARG_ADD             "add"
+#define ARG_REMOVE          "remove"
 #define ARG_RELATIVE        "relative"
 //#define ARG_SLEEP         "sleep"
 #define ARG_SHUTDOWN        "shutdown"
@@ -184,6 +186,9 @@
 #define ARG_RDSTATS         "stats"
 #define ARG_SYSSTATE        "systemstate"
 #define ARG_SLEEPBLOCKERS   "sleepblockers"
+#define ARG_TRANSITIONPROFILE "transitionprofile"
+#define ARG_WAKECANDIDATES  "wakecandidates"
+#define ARG_LINGER          "linger"
 #define ARG_FBA             "fba"
 
 // special
@@ -381,6 +386,11 @@ static void show_system_power_settings(void);
 static void show_supported_pm_features(void);
 static void show_custom_pm_settings(void);
 static void show_live_pm_settings(void);
+static void show_slow_pm_clients(void);
+static void show_transition_profile(char **argv);
+static void show_wake_candidates(void);
+static void show_darkwake_linger(void);
+static void replaceDoubleQuote(char *str);
 static void show_ups_settings(void);
 
 static void show_scheduled_events(void);
@@ -388,6 +398,7 @@ static void show_active_assertions(uint32_t which);
 static void show_power_sources(int which);
 static bool prevent_idle_sleep(void);
 static void show_assertions(char **argv, const char *);
+static bool show_assertions_filtered(char **argv);
 static void log_assertions(void);
 static void show_systemload(void);
 static void log_systemload(void);
@@ -470,7 +481,7 @@ static void print_days_to_buf(int d, char *buf, int buflen);
 static void print_repeating_report(CFDictionaryRef repeat);
 static void print_scheduled_report(CFArrayRef events);
 
-static CFDictionaryRef getPowerEvent(int type, CFDictionaryRef events);
+static void appendRepeatingEvents(CFDictionaryRef repeat, CFStringRef listKey, CFStringRef key, CFMutableArrayRef events);
 static int getRepeatingDictionaryMinutes(CFDictionaryRef event);
 static int getRepeatingDictionaryDayMask(CFDictionaryRef event);
 static CFStringRef getRepeatingDictionaryType(CFDictionaryRef event);
@@ -549,7 +560,7 @@ typedef struct {
 
 static CommandAndAction the_getters[] =
 	{ 
-		{kActionGetOnceNoArgs,  ARG_LIVE,           ^(char **arg){ show_system_power_settings(); show_live_pm_settings();}},
+		{kActionGetOnceNoArgs,  ARG_LIVE,           ^(char **arg){ show_system_power_settings(); show_live_pm_settings(); show_slow_pm_clients();}},
 		{kActionGetOnceNoArgs,  ARG_CUSTOM,         ^(char **arg){ show_custom_pm_settings(); }},
         {kActionGetOnceNoArgs,  ARG_CAP,            ^(char **arg){ show_supported_pm_features(); }},
         {kActionGetOnceNoArgs,  ARG_SCHED,          ^(char **arg){ show_scheduled_events(); }},
@@ -592,6 +603,9 @@ static CommandAndAction the_getters[] =
         {kActionGetOnceNoArgs,  ARG_RDSTATS,        ^(char **arg){show_rdStats(arg); }},
         {kActionGetOnceNoArgs,  ARG_SYSSTATE,       ^(char **arg){show_sysstate(arg); }},
         {kActionGetLog,         ARG_SLEEPBLOCKERS,  ^(char **arg){show_sleep_blockers(arg); }},
+        {kActionGetOnceNoArgs,  ARG_TRANSITIONPROFILE, ^(char **arg){show_transition_profile(arg); }},
+        {kActionGetOnceNoArgs,  ARG_WAKECANDIDATES, ^(char **arg){show_wake_candidates(); }},
+        {kActionGetOnceNoArgs,  ARG_LINGER,         ^(char **arg){show_darkwake_linger(); }},
         {kActionNotForEverything,   ARG_EVERYTHING, ^(char **arg){show_everything(arg); }}
 	};
 
@@ -1472,6 +1486,578 @@ exit:
     }
 }
 
+/*
+ * Lists sleep/wake clients that powerd has put on a reduced acknowledgement
+ * budget because they habitually time out. Prints nothing if there are none.
+ */
+static void show_slow_pm_clients(void)
+{
+    mach_port_t             pm_server = MACH_PORT_NULL;
+    vm_offset_t             outBuf = 0;
+    mach_msg_type_number_t  outBufCnt = 0;
+    CFDataRef               unfolder = NULL;
+    CFPropertyListRef       result = NULL;
+    CFIndex                 i;
+    int                     rc = kIOReturnError;
+    bool                    printedHeader = false;
+
+    if (kIOReturnSuccess != _pm_connect(&pm_server)) {
+        goto exit;
+    }
+
+    if ((KERN_SUCCESS != io_pm_assertion_copy_details(pm_server, 0, kIOPMConnectionMIGCopyAckHistory,
+                                                      0, 0, &outBuf, &outBufCnt, &rc)) ||
+        (kIOReturnSuccess != rc) || !outBuf)
+    {
+        goto exit;
+    }
+
+    unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)outBuf, outBufCnt, kCFAllocatorNull);
+    if (unfolder) {
+        result = CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+        CFRelease(unfolder);
+    }
+    if (!isA_CFArray(result)) {
+        goto exit;
+    }
+
+    for (i = 0; i < CFArrayGetCount(result); i++) {
+        CFDictionaryRef entry = isA_CFDictionary(CFArrayGetValueAtIndex(result, i));
+        char            name[64] = "";
+        int             timeouts = 0, samples = 0, p95 = 0, budget = 0;
+
+        if (!entry || (kCFBooleanTrue != CFDictionaryGetValue(entry, kIOPMAckHistoryOffenderKey))) {
+            continue;
+        }
+
+        CFStringGetCString(CFDictionaryGetValue(entry, kIOPMAckHistoryNameKey), name, sizeof(name), kCFStringEncodingUTF8);
+        CFNumberGetValue(CFDictionaryGetValue(entry, kIOPMAckHistoryTimeoutsKey), kCFNumberIntType, &timeouts);
+        CFNumberGetValue(CFDictionaryGetValue(entry, kIOPMAckHistorySamplesKey), kCFNumberIntType, &samples);
+        CFNumberGetValue(CFDictionaryGetValue(entry, kIOPMAckHistoryP95MsKey), kCFNumberIntType, &p95);
+        CFNumberGetValue(CFDictionaryGetValue(entry, kIOPMAckHistoryBudgetKey), kCFNumberIntType, &budget);
+
+        if (!printedHeader) {
+            printf("Sleep/wake clients on a reduced acknowledgement budget:\n");
+            printedHeader = true;
+        }
+        printf(" %-32s timed out %d of %d, p95 %d ms, budget %d secs\n",
+               name, timeouts, timeouts + samples, p95, budget);
+    }
+
+exit:
+    if (outBuf && outBufCnt) {
+        vm_deallocate(mach_task_self(), outBuf, outBufCnt);
+    }
+    if (MACH_PORT_NULL != pm_server) {
+        _pm_disconnect(pm_server);
+    }
+    if (result) CFRelease(result);
+}
+
+static long long transition_profile_num(CFDictionaryRef dict, CFStringRef key)
+{
+    long long   val = 0;
+    CFNumberRef num = isA_CFNumber(CFDictionaryGetValue(dict, key));
+
+    if (num) {
+        CFNumberGetValue(num, kCFNumberLongLongType, &val);
+    }
+    return val;
+}
+
+static void print_transition_phases_text(CFDictionaryRef phases)
+{
+    const char  *names[] = { kIOPMTransitionPhaseNotify, kIOPMTransitionPhaseClientAcks,
+                             kIOPMTransitionPhaseWakeEvents, kIOPMTransitionPhaseKernelAck };
+    CFStringRef str;
+    int         i;
+
+    for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        str = CFStringCreateWithCString(0, names[i], kCFStringEncodingUTF8);
+        if (!str) {
+            continue;
+        }
+        if (CFDictionaryContainsKey(phases, str)) {
+            printf(" %s %lld ms", names[i], transition_profile_num(phases, str));
+        }
+        CFRelease(str);
+    }
+}
+
+static void print_transition_profile_text(CFDictionaryRef profile)
+{
+    CFArrayRef      timelines = isA_CFArray(CFDictionaryGetValue(profile, kIOPMTransitionProfileTimelinesKey));
+    CFDictionaryRef histograms = isA_CFDictionary(CFDictionaryGetValue(profile, kIOPMTransitionProfileHistogramsKey));
+    CFDictionaryRef queue = isA_CFDictionary(CFDictionaryGetValue(profile, kIOPMTransitionProfileQueueKey));
+    CFDictionaryRef sends = isA_CFDictionary(CFDictionaryGetValue(profile, kIOPMTransitionProfileSendsKey));
+    const char      *names[] = { kIOPMTransitionPhaseNotify, kIOPMTransitionPhaseClientAcks,
+                                 kIOPMTransitionPhaseWakeEvents, kIOPMTransitionPhaseKernelAck };
+    CFIndex         i, j;
+    int             bucket;
+    char            label[16];
+    char            name[64];
+
+    printf("Sleep/wake transitions (ms since the capability change; oldest first):\n");
+    for (i = 0; timelines && (i < CFArrayGetCount(timelines)); i++) {
+        CFDictionaryRef tl = isA_CFDictionary(CFArrayGetValueAtIndex(timelines, i));
+        CFDictionaryRef phases = NULL;
+        CFArrayRef      acks = NULL;
+
+        if (!tl) {
+            continue;
+        }
+        printf("#%-5lld 0x%llx -> 0x%llx%s:", transition_profile_num(tl, kIOPMTransitionSeqKey),
+               transition_profile_num(tl, kIOPMTransitionFromCapsKey),
+               transition_profile_num(tl, kIOPMTransitionToCapsKey),
+               (kCFBooleanTrue == CFDictionaryGetValue(tl, kIOPMTransitionCompleteKey)) ? "" : " (in progress)");
+        if ((phases = isA_CFDictionary(CFDictionaryGetValue(tl, kIOPMTransitionPhasesKey)))) {
+            print_transition_phases_text(phases);
+        }
+        printf("\n");
+
+        acks = isA_CFArray(CFDictionaryGetValue(tl, kIOPMTransitionAcksKey));
+        for (j = 0; acks && (j < CFArrayGetCount(acks)); j++) {
+            CFDictionaryRef ack = isA_CFDictionary(CFArrayGetValueAtIndex(acks, j));
+            CFStringRef     ackName = NULL;
+
+            if (!ack) {
+                continue;
+            }
+            name[0] = 0;
+            if ((ackName = isA_CFString(CFDictionaryGetValue(ack, kIOPMTransitionAckNameKey)))) {
+                CFStringGetCString(ackName, name, sizeof(name), kCFStringEncodingUTF8);
+            }
+            printf("        %-32s (%lld) %s %lld ms\n", name,
+                   transition_profile_num(ack, kIOPMTransitionAckPIDKey),
+                   (kCFBooleanTrue == CFDictionaryGetValue(ack, kIOPMTransitionAckTimedOutKey)) ? "timed out at" : "acked at",
+                   transition_profile_num(ack, kIOPMTransitionAckMsKey));
+        }
+        if (acks && (transition_profile_num(tl, kIOPMTransitionAckCountKey) > CFArrayGetCount(acks))) {
+            printf("        ... %lld more\n",
+                   transition_profile_num(tl, kIOPMTransitionAckCountKey) - CFArrayGetCount(acks));
+        }
+    }
+
+    if (histograms) {
+        printf("\nPhase duration histograms (ms since the previous phase):\n%-12s", "");
+        for (bucket = 0; bucket < kIOPMTransitionHistBucketCnt; bucket++) {
+            if (bucket == kIOPMTransitionHistBucketCnt - 1) {
+                snprintf(label, sizeof(label), ">=%u", 1U << (bucket - 1));
+            } else {
+                snprintf(label, sizeof(label), "<%u", 1U << bucket);
+            }
+            printf("%7s", label);
+        }
+        printf("\n");
+
+        for (i = 0; i < (CFIndex)(sizeof(names) / sizeof(names[0])); i++) {
+            CFStringRef str = CFStringCreateWithCString(0, names[i], kCFStringEncodingUTF8);
+            CFArrayRef  counts = str ? isA_CFArray(CFDictionaryGetValue(histograms, str)) : NULL;
+
+            printf("%-12s", names[i]);
+            for (j = 0; counts && (j < CFArrayGetCount(counts)); j++) {
+                int count = 0;
+                CFNumberGetValue(CFArrayGetValueAtIndex(counts, j), kCFNumberIntType, &count);
+                printf("%7d", count);
+            }
+            printf("\n");
+            if (str) CFRelease(str);
+        }
+    }
+
+    if (queue) {
+        printf("\nTransition queue: %lld queued, %lld coalesced, %lld dropped, max depth %lld, max wait %lld ms\n",
+               transition_profile_num(queue, kIOPMTransitionQueuedKey),
+               transition_profile_num(queue, kIOPMTransitionCoalescedKey),
+               transition_profile_num(queue, kIOPMTransitionDroppedKey),
+               transition_profile_num(queue, kIOPMTransitionMaxDepthKey),
+               transition_profile_num(queue, kIOPMTransitionWaitMaxMsKey));
+    }
+    if (sends) {
+        printf("Notifications: %lld sent, %lld deferred on a full client queue, %lld not delivered\n",
+               transition_profile_num(sends, kIOPMTransitionSentKey),
+               transition_profile_num(sends, kIOPMTransitionDeferredKey),
+               transition_profile_num(sends, kIOPMTransitionSendFailedKey));
+    }
+}
+
+/* Prints 'str' as a quoted JSON string, escaping quotes, backslashes and control characters */
+static void print_json_string(const char *str)
+{
+    const unsigned char *c;
+
+    putchar('"');
+    for (c = (const unsigned char *)str; *c; c++) {
+        switch (*c) {
+            case '"':   printf("\\\""); break;
+            case '\\':  printf("\\\\"); break;
+            case '\n':  printf("\\n"); break;
+            case '\r':  printf("\\r"); break;
+            case '\t':  printf("\\t"); break;
+            default:
+                if (*c < 0x20) {
+                    printf("\\u%04x", *c);
+                } else {
+                    putchar(*c);
+                }
+                break;
+        }
+    }
+    putchar('"');
+}
+
+static void print_transition_profile_json(CFDictionaryRef profile)
+{
+    CFArrayRef      timelines = isA_CFArray(CFDictionaryGetValue(profile, kIOPMTransitionProfileTimelinesKey));
+    CFDictionaryRef histograms = isA_CFDictionary(CFDictionaryGetValue(profile, kIOPMTransitionProfileHistogramsKey));
+    CFDictionaryRef queue = isA_CFDictionary(CFDictionaryGetValue(profile, kIOPMTransitionProfileQueueKey));
+    CFDictionaryRef sends = isA_CFDictionary(CFDictionaryGetValue(profile, kIOPMTransitionProfileSendsKey));
+    const char      *names[] = { kIOPMTransitionPhaseNotify, kIOPMTransitionPhaseClientAcks,
+                                 kIOPMTransitionPhaseWakeEvents, kIOPMTransitionPhaseKernelAck };
+    CFIndex         i, j;
+    int             p;
+    char            name[64];
+    bool            anyTimeline = false;
+
+    printf("{\n\"Timelines\":[");
+    for (i = 0; timelines && (i < CFArrayGetCount(timelines)); i++) {
+        CFDictionaryRef tl = isA_CFDictionary(CFArrayGetValueAtIndex(timelines, i));
+        CFDictionaryRef phases = NULL;
+        CFArrayRef      acks = NULL;
+        bool            first = true;
+        bool            anyAck = false;
+
+        if (!tl) {
+            continue;
+        }
+        printf("%s\n{\"Seq\":%lld,\"From\":%lld,\"To\":%lld,\"Complete\":%s,\"AckCount\":%lld,\"Phases\":{",
+               anyTimeline ? "," : "",
+               transition_profile_num(tl, kIOPMTransitionSeqKey),
+               transition_profile_num(tl, kIOPMTransitionFromCapsKey),
+               transition_profile_num(tl, kIOPMTransitionToCapsKey),
+               (kCFBooleanTrue == CFDictionaryGetValue(tl, kIOPMTransitionCompleteKey)) ? "true" : "false",
+               transition_profile_num(tl, kIOPMTransitionAckCountKey));
+        anyTimeline = true;
+
+        phases = isA_CFDictionary(CFDictionaryGetValue(tl, kIOPMTransitionPhasesKey));
+        for (p = 0; phases && (p < (int)(sizeof(names) / sizeof(names[0]))); p++) {
+            CFStringRef str = CFStringCreateWithCString(0, names[p], kCFStringEncodingUTF8);
+            if (str && CFDictionaryContainsKey(phases, str)) {
+                printf("%s\"%s\":%lld", first ? "" : ",", names[p], transition_profile_num(phases, str));
+                first = false;
+            }
+            if (str) CFRelease(str);
+        }
+        printf("},\"Acks\":[");
+
+        acks = isA_CFArray(CFDictionaryGetValue(tl, kIOPMTransitionAcksKey));
+        for (j = 0; acks && (j < CFArrayGetCount(acks)); j++) {
+            CFDictionaryRef ack = isA_CFDictionary(CFArrayGetValueAtIndex(acks, j));
+            CFStringRef     ackName = NULL;
+
+            if (!ack) {
+                continue;
+            }
+            name[0] = 0;
+            if ((ackName = isA_CFString(CFDictionaryGetValue(ack, kIOPMTransitionAckNameKey)))) {
+                CFStringGetCString(ackName, name, sizeof(name), kCFStringEncodingUTF8);
+            }
+            printf("%s{\"Name\":", anyAck ? "," : "");
+            anyAck = true;
+            print_json_string(name);
+            printf(",\"PID\":%lld,\"Ms\":%lld,\"TimedOut\":%s}",
+                   transition_profile_num(ack, kIOPMTransitionAckPIDKey),
+                   transition_profile_num(ack, kIOPMTransitionAckMsKey),
+                   (kCFBooleanTrue == CFDictionaryGetValue(ack, kIOPMTransitionAckTimedOutKey)) ? "true" : "false");
+        }
+        printf("]}");
+    }
+    printf("\n],\n\"Histograms\":{");
+
+    for (p = 0; histograms && (p < (int)(sizeof(names) / sizeof(names[0]))); p++) {
+        CFStringRef str = CFStringCreateWithCString(0, names[p], kCFStringEncodingUTF8);
+        CFArrayRef  counts = str ? isA_CFArray(CFDictionaryGetValue(histograms, str)) : NULL;
+
+        printf("%s\n\"%s\":[", p ? "," : "", names[p]);
+        for (j = 0; counts && (j < CFArrayGetCount(counts)); j++) {
+            int count = 0;
+            CFNumberGetValue(CFArrayGetValueAtIndex(counts, j), kCFNumberIntType, &count);
+            printf("%s%d", j ? "," : "", count);
+        }
+        printf("]");
+        if (str) CFRelease(str);
+    }
+    printf("\n}");
+
+    if (queue) {
+        printf(",\n\"Queue\":{\"Queued\":%lld,\"Coalesced\":%lld,\"Dropped\":%lld,\"MaxDepth\":%lld,\"WaitMaxMs\":%lld,\"WaitTotalMs\":%lld}",
+               transition_profile_num(queue, kIOPMTransitionQueuedKey),
+               transition_profile_num(queue, kIOPMTransitionCoalescedKey),
+               transition_profile_num(queue, kIOPMTransitionDroppedKey),
+               transition_profile_num(queue, kIOPMTransitionMaxDepthKey),
+               transition_profile_num(queue, kIOPMTransitionWaitMaxMsKey),
+               transition_profile_num(queue, kIOPMTransitionWaitTotalMsKey));
+    }
+    if (sends) {
+        printf(",\n\"Sends\":{\"Sent\":%lld,\"Deferred\":%lld,\"Failed\":%lld}",
+               transition_profile_num(sends, kIOPMTransitionSentKey),
+               transition_profile_num(sends, kIOPMTransitionDeferredKey),
+               transition_profile_num(sends, kIOPMTransitionSendFailedKey));
+    }
+    printf("\n}\n");
+}
+
+/*
+ * Prints powerd's recent sleep/wake transition timelines and per-phase
+ * histograms. Pass -json for machine readable output.
+ */
+static void show_transition_profile(char **argv)
+{
+    mach_port_t             pm_server = MACH_PORT_NULL;
+    vm_offset_t             outBuf = 0;
+    mach_msg_type_number_t  outBufCnt = 0;
+    CFDataRef               unfolder = NULL;
+    CFPropertyListRef       result = NULL;
+    int                     rc = kIOReturnError;
+    bool                    json = false;
+
+    if (argv && argv[0] && !strcmp(argv[0], "-json")) {
+        json = true;
+    }
+
+    if (kIOReturnSuccess != _pm_connect(&pm_server)) {
+        printf("Error - unable to connect to powerd\n");
+        goto exit;
+    }
+
+    if ((KERN_SUCCESS != io_pm_assertion_copy_details(pm_server, 0, kIOPMConnectionMIGCopyTransitionProfile,
+                                                      0, 0, &outBuf, &outBufCnt, &rc)) ||
+        (kIOReturnSuccess != rc) || !outBuf)
+    {
+        printf("Error - no transition profile available\n");
+        goto exit;
+    }
+
+    unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)outBuf, outBufCnt, kCFAllocatorNull);
+    if (unfolder) {
+        result = CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+        CFRelease(unfolder);
+    }
+    if (!isA_CFDictionary(result)) {
+        printf("Error - malformed transition profile\n");
+        goto exit;
+    }
+
+    if (json) {
+        print_transition_profile_json(result);
+    } else {
+        print_transition_profile_text(result);
+    }
+
+exit:
+    if (outBuf && outBufCnt) {
+        vm_deallocate(mach_task_self(), outBuf, outBufCnt);
+    }
+    if (MACH_PORT_NULL != pm_server) {
+        _pm_disconnect(pm_server);
+    }
+    if (result) CFRelease(result);
+}
+
+/*
+ * Prints every wake request, and auto power off, that powerd weighed when it
+ * last went to sleep, and why each one that wasn't scheduled lost.
+ */
+static void show_wake_candidates(void)
+{
+    mach_port_t             pm_server = MACH_PORT_NULL;
+    vm_offset_t             outBuf = 0;
+    mach_msg_type_number_t  outBufCnt = 0;
+    CFDataRef               unfolder = NULL;
+    CFPropertyListRef       result = NULL;
+    CFIndex                 i;
+    int                     rc = kIOReturnError;
+
+    if (kIOReturnSuccess != _pm_connect(&pm_server)) {
+        printf("Error - unable to connect to powerd\n");
+        goto exit;
+    }
+
+    if ((KERN_SUCCESS != io_pm_assertion_copy_details(pm_server, 0, kIOPMConnectionMIGCopyWakeCandidates,
+                                                      0, 0, &outBuf, &outBufCnt, &rc)) ||
+        (kIOReturnSuccess != rc) || !outBuf)
+    {
+        printf("Error - no wake candidates available\n");
+        goto exit;
+    }
+
+    unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)outBuf, outBufCnt, kCFAllocatorNull);
+    if (unfolder) {
+        result = CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+        CFRelease(unfolder);
+    }
+    if (!isA_CFArray(result)) {
+        printf("Error - malformed wake candidates\n");
+        goto exit;
+    }
+    if (0 == CFArrayGetCount(result)) {
+        printf("No wake candidates at last sleep\n");
+        goto exit;
+    }
+
+    printf("Wake candidates at last sleep:\n");
+    for (i = 0; i < CFArrayGetCount(result); i++) {
+        CFDictionaryRef entry = isA_CFDictionary(CFArrayGetValueAtIndex(result, i));
+        CFStringRef     str = NULL;
+        CFStringRef     outcomeStr = NULL;
+        CFDateRef       requested = NULL;
+        CFDateRef       deadline = NULL;
+        CFDateRef       effective = NULL;
+        char            source[32] = "";
+        char            outcome[32] = "";
+        char            lostTo[32] = "";
+        char            info[128] = "";
+        char            reqStr[60] = "";
+        char            deadlineStr[60] = "";
+        char            effStr[60] = "";
+
+        if (!entry) {
+            continue;
+        }
+        if ((str = isA_CFString(CFDictionaryGetValue(entry, kIOPMWakeCandidateSourceKey)))) {
+            CFStringGetCString(str, source, sizeof(source), kCFStringEncodingUTF8);
+        }
+        if ((outcomeStr = isA_CFString(CFDictionaryGetValue(entry, kIOPMWakeCandidateOutcomeKey)))) {
+            CFStringGetCString(outcomeStr, outcome, sizeof(outcome), kCFStringEncodingUTF8);
+        }
+        if ((str = isA_CFString(CFDictionaryGetValue(entry, kIOPMWakeCandidateLostToKey)))) {
+            CFStringGetCString(str, lostTo, sizeof(lostTo), kCFStringEncodingUTF8);
+        }
+        if ((str = isA_CFString(CFDictionaryGetValue(entry, kIOPMWakeCandidateClientInfoKey)))) {
+            CFStringGetCString(str, info, sizeof(info), kCFStringEncodingUTF8);
+        }
+        if ((requested = isA_CFDate(CFDictionaryGetValue(entry, kIOPMWakeCandidateRequestedKey)))) {
+            return_pretty_date(CFDateGetAbsoluteTime(requested), reqStr);
+        }
+        if ((deadline = isA_CFDate(CFDictionaryGetValue(entry, kIOPMWakeCandidateDeadlineKey)))) {
+            return_pretty_date(CFDateGetAbsoluteTime(deadline), deadlineStr);
+        }
+        if ((effective = isA_CFDate(CFDictionaryGetValue(entry, kIOPMWakeCandidateEffectiveKey)))) {
+            return_pretty_date(CFDateGetAbsoluteTime(effective), effStr);
+        }
+
+        printf(" %-18s pid %-6lld ", source, transition_profile_num(entry, kIOPMWakeCandidatePIDKey));
+        printf("%s", reqStr);
+        if (deadline) {
+            printf(" to %s", deadlineStr);
+        } else {
+            deadline = requested;
+        }
+        if (deadline && effective && (CFDateGetAbsoluteTime(deadline) != CFDateGetAbsoluteTime(effective))) {
+            printf(" (effective %s)", effStr);
+        }
+        printf(" %s", outcome);
+        if (lostTo[0]) {
+            printf(" %s %s", (outcomeStr && CFEqual(outcomeStr, kIOPMWakeCandidateMerged)) ? "into" : "to", lostTo);
+        }
+        if (info[0]) {
+            printf(" [%s]", info);
+        }
+        printf("\n");
+    }
+
+exit:
+    if (outBuf && outBufCnt) {
+        vm_deallocate(mach_task_self(), outBuf, outBufCnt);
+    }
+    if (MACH_PORT_NULL != pm_server) {
+        _pm_disconnect(pm_server);
+    }
+    if (result) CFRelease(result);
+}
+
+static void show_darkwake_linger(void)
+{
+    mach_port_t             pm_server = MACH_PORT_NULL;
+    vm_offset_t             outBuf = 0;
+    mach_msg_type_number_t  outBufCnt = 0;
+    CFDataRef               unfolder = NULL;
+    CFPropertyListRef       result = NULL;
+    CFIndex                 i;
+    int                     rc = kIOReturnError;
+
+    if (kIOReturnSuccess != _pm_connect(&pm_server)) {
+        printf("Error - unable to connect to powerd\n");
+        goto exit;
+    }
+
+    if ((KERN_SUCCESS != io_pm_assertion_copy_details(pm_server, 0, kIOPMConnectionMIGCopyLingerPolicy,
+                                                      0, 0, &outBuf, &outBufCnt, &rc)) ||
+        (kIOReturnSuccess != rc) || !outBuf)
+    {
+        printf("Error - no dark wake linger policy available\n");
+        goto exit;
+    }
+
+    unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)outBuf, outBufCnt, kCFAllocatorNull);
+    if (unfolder) {
+        result = CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+        CFRelease(unfolder);
+    }
+    if (!isA_CFArray(result)) {
+        printf("Error - malformed dark wake linger policy\n");
+        goto exit;
+    }
+    if (0 == CFArrayGetCount(result)) {
+        printf("No dark wake lingers since powerd started\n");
+        goto exit;
+    }
+
+    printf("Dark wake linger by reason:\n");
+    printf(" %-8s %-32s %6s %7s %7s %5s %6s %5s %5s %9s %9s\n",
+           "Kind", "Reason", "Linger", "Default", "Lingers", "Samp", "During", "After", "None",
+           "Awake(s)", "AtDef(s)");
+    for (i = 0; i < CFArrayGetCount(result); i++) {
+        CFDictionaryRef entry = isA_CFDictionary(CFArrayGetValueAtIndex(result, i));
+        CFStringRef     str = NULL;
+        char            kind[16] = "";
+        char            reason[64] = "";
+
+        if (!entry) {
+            continue;
+        }
+        if ((str = isA_CFString(CFDictionaryGetValue(entry, kIOPMLingerKindKey)))) {
+            CFStringGetCString(str, kind, sizeof(kind), kCFStringEncodingUTF8);
+        }
+        if ((str = isA_CFString(CFDictionaryGetValue(entry, kIOPMLingerReasonKey)))) {
+            CFStringGetCString(str, reason, sizeof(reason), kCFStringEncodingUTF8);
+        }
+
+        printf(" %-8s %-32s %5llds%s %6llds %7lld %5lld %6lld %5lld %5lld %9lld %9lld\n",
+               kind, reason,
+               transition_profile_num(entry, kIOPMLingerDurationKey),
+               (kCFBooleanTrue == CFDictionaryGetValue(entry, kIOPMLingerLearnedKey)) ? "" : "*",
+               transition_profile_num(entry, kIOPMLingerDefaultKey),
+               transition_profile_num(entry, kIOPMLingerCountKey),
+               transition_profile_num(entry, kIOPMLingerSamplesKey),
+               transition_profile_num(entry, kIOPMLingerArrivedDuringKey),
+               transition_profile_num(entry, kIOPMLingerArrivedAfterKey),
+               transition_profile_num(entry, kIOPMLingerNoArrivalKey),
+               transition_profile_num(entry, kIOPMLingerAwakeKey),
+               transition_profile_num(entry, kIOPMLingerAwakeDefaultKey));
+    }
+    printf(" * too few samples yet; using the default\n");
+
+exit:
+    if (outBuf && outBufCnt) {
+        vm_deallocate(mach_task_self(), outBuf, outBufCnt);
+    }
+    if (MACH_PORT_NULL != pm_server) {
+        _pm_disconnect(pm_server);
+    }
+    if (result) CFRelease(result);
+}
+
 static void show_ups_settings(void)
 {
     CFDictionaryRef     thresholds;
@@ -1510,13 +2096,25 @@ static void show_ups_settings(void)
     CFRelease(thresholds);
 }
 
-static CFDictionaryRef
-getPowerEvent(int type, CFDictionaryRef     events)
+/*
+ * Appends the repeating events in 'repeat' to 'events': the list under
+ * 'listKey', or the single event under 'key' from an older powerd.
+ */
+static void
+appendRepeatingEvents(CFDictionaryRef repeat, CFStringRef listKey, CFStringRef key, CFMutableArrayRef events)
 {
-    if(type)
-        return (CFDictionaryRef)isA_CFDictionary(CFDictionaryGetValue(events, CFSTR(kIOPMRepeatingPowerOnKey)));
-    else
-        return (CFDictionaryRef)isA_CFDictionary(CFDictionaryGetValue(events, CFSTR(kIOPMRepeatingPowerOffKey)));
+    CFTypeRef   value;
+
+    if (!repeat)
+        return;
+    value = CFDictionaryGetValue(repeat, listKey);
+    if (!value)
+        value = CFDictionaryGetValue(repeat, key);
+    if (isA_CFDictionary(value)) {
+        CFArrayAppendValue(events, value);
+    } else if (isA_CFArray(value)) {
+        CFArrayAppendArray(events, value, CFRangeMake(0, CFArrayGetCount(value)));
+    }
 }
 static int
 getRepeatingDictionaryMinutes(CFDictionaryRef event)
@@ -1609,52 +2207,49 @@ print_days_to_buf(int d, char *buf, int buflen)
 }
 
 #define kMaxDaysOfWeekLength     20
-static void print_repeating_report(CFDictionaryRef repeat)
+static void print_repeating_event(CFDictionaryRef event)
 {
-    CFDictionaryRef     on, off;
     char                time_buf[kMaxDaysOfWeekLength];
     char                day_buf[kMaxDaysOfWeekLength];
     CFStringRef         type_str = NULL;
     char                type_buf[kMaxArgStringLength];
 
+    print_time_of_day_to_buf(getRepeatingDictionaryMinutes(event), time_buf, kMaxDaysOfWeekLength);
+    print_days_to_buf(getRepeatingDictionaryDayMask(event), day_buf, kMaxDaysOfWeekLength);
+
+    type_str = getRepeatingDictionaryType(event);
+    if (type_str) {
+        CFStringGetCString(type_str, type_buf, sizeof(type_buf),  kCFStringEncodingMacRoman);
+    } else {
+        snprintf(type_buf, sizeof(type_buf), "?type?");
+    }
+
+    printf("  %s at %s %s\n", type_buf, time_buf, day_buf);
+}
+
+static void print_repeating_report(CFDictionaryRef repeat)
+{
+    CFMutableArrayRef   events;
+    CFIndex             i;
+
+    events = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    if(!events)
+        return;
+
     // assumes validly formatted dictionary - doesn't do any error checking
-    on = getPowerEvent(1, repeat);
-    off = getPowerEvent(0, repeat);
+    appendRepeatingEvents(repeat, CFSTR(kIOPMRepeatingPowerOnListKey), CFSTR(kIOPMRepeatingPowerOnKey), events);
+    appendRepeatingEvents(repeat, CFSTR(kIOPMRepeatingPowerOffListKey), CFSTR(kIOPMRepeatingPowerOffKey), events);
 
-    if(on || off)
+    if(CFArrayGetCount(events))
     {
         printf("Repeating power events:\n");
-        if(on)
+        for(i = 0; i < CFArrayGetCount(events); i++)
         {
-            print_time_of_day_to_buf(getRepeatingDictionaryMinutes(on), time_buf, kMaxDaysOfWeekLength);
-            print_days_to_buf(getRepeatingDictionaryDayMask(on), day_buf, kMaxDaysOfWeekLength);
-        
-            type_str = getRepeatingDictionaryType(on);
-            if (type_str) {
-                CFStringGetCString(type_str, type_buf, sizeof(type_buf),  kCFStringEncodingMacRoman);
-            } else {
-                snprintf(type_buf, sizeof(type_buf), "?type?");
-            }
-            
-            printf("  %s at %s %s\n", type_buf, time_buf, day_buf);
-        }
-        
-        if(off)
-        {
-            print_time_of_day_to_buf(getRepeatingDictionaryMinutes(off), time_buf, kMaxDaysOfWeekLength);
-            print_days_to_buf(getRepeatingDictionaryDayMask(off), day_buf, kMaxDaysOfWeekLength);
-
-            type_str = getRepeatingDictionaryType(off);
-            if (type_str) {
-                CFStringGetCString(type_str, type_buf, sizeof(type_buf),  kCFStringEncodingMacRoman);
-            } else {
-                snprintf(type_buf, sizeof(type_buf), "?type?");
-            }
-            
-            printf("  %s at %s %s\n", type_buf, time_buf, day_buf);
+            print_repeating_event(CFArrayGetValueAtIndex(events, i));
         }
         fflush(stdout);
     }
+    CFRelease(events);
 }
 
 static void
@@ -3014,6 +3609,10 @@ static void show_assertions(char **argv, const char *decorate)
     CFDictionaryRef         assertions_info = NULL;
     IOReturn                ret;
 
+    if (show_assertions_filtered(argv)) {
+        return;
+    }
+
     print_pretty_date(CFAbsoluteTimeGetCurrent(), decorate?false:true);
     if (decorate) {
         printf(": %s\n", decorate);
@@ -3044,6 +3643,227 @@ static void show_assertions(char **argv, const char *decorate)
     return;
 }
 
+/*
+ * pmset -g assertions [--pid <pid>]... [--type <type>]... [--minage <secs>]
+ *                     [--name <prefix>] [--state active|inactive|any]
+ *                     [--fields <field>[,<field>]...]
+ *
+ * Asks powerd to filter the assertions and prints one row per match, with
+ * the requested fields as columns.
+ * Returns false if no filter arguments were given. A malformed filter is a
+ * usage error; it never falls back to the unfiltered listing.
+ */
+static bool isAssertionFilterOption(const char *arg)
+{
+    return (!strcmp(arg, "--pid") || !strcmp(arg, "--type") || !strcmp(arg, "--minage")
+            || !strcmp(arg, "--name") || !strcmp(arg, "--state") || !strcmp(arg, "--fields"));
+}
+
+static void __dead2 assertionFilterUsage(const char *option, const char *value)
+{
+    if (value) {
+        fprintf(stderr, "pmset: invalid value \'%s\' for %s\n", value, option);
+    } else {
+        fprintf(stderr, "pmset: %s requires a value\n", option);
+    }
+    usage();
+    exit(1);
+}
+
+static bool show_assertions_filtered(char **argv)
+{
+    CFMutableDictionaryRef  filter = NULL;
+    CFMutableArrayRef       pids = NULL;
+    CFMutableArrayRef       types = NULL;
+    CFMutableArrayRef       fieldNames = NULL;
+    CFDataRef               serializedFilter = NULL;
+    CFDataRef               unfolder = NULL;
+    CFDictionaryRef         result = NULL;
+    CFArrayRef              rows = NULL;
+    CFArrayRef              fields = NULL;
+    CFNumberRef             num = NULL;
+    CFStringRef             str = NULL;
+    mach_port_t             pm_server = MACH_PORT_NULL;
+    vm_offset_t             outBuf = 0;
+    mach_msg_type_number_t  outBufCnt = 0;
+    int                     rc = kIOReturnError;
+    char                    *endptr = NULL;
+    char                    *fieldList, *field, *next;
+    long                    lval;
+    int                     i, j, val;
+    bool                    handled = false;
+
+    if (!argv || !argv[0] || !isAssertionFilterOption(argv[0])) {
+        return false;
+    }
+
+    filter = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    pids = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    types = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    fieldNames = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    if (!filter || !pids || !types || !fieldNames) {
+        goto exit;
+    }
+    handled = true;
+
+    for (i = 0; argv[i]; i += 2) {
+        if (!isAssertionFilterOption(argv[i])) {
+            fprintf(stderr, "pmset: unknown assertion filter \'%s\'\n", argv[i]);
+            usage();
+            exit(1);
+        }
+        if (!argv[i+1]) {
+            assertionFilterUsage(argv[i], NULL);
+        }
+
+        if (!strcmp(argv[i], "--pid") || !strcmp(argv[i], "--minage")) {
+            lval = strtol(argv[i+1], &endptr, 10);
+            if ((endptr == argv[i+1]) || (0 != *endptr) || (lval < 0) || (lval > INT_MAX)) {
+                assertionFilterUsage(argv[i], argv[i+1]);
+            }
+            val = (int)lval;
+            num = CFNumberCreate(0, kCFNumberIntType, &val);
+            if (!strcmp(argv[i], "--pid")) {
+                CFArrayAppendValue(pids, num);
+            } else {
+                CFDictionarySetValue(filter, kIOPMAssertionQueryMinAgeKey, num);
+            }
+            CFRelease(num);
+        } else if (!strcmp(argv[i], "--type")) {
+            str = CFStringCreateWithCString(0, argv[i+1], kCFStringEncodingUTF8);
+            CFArrayAppendValue(types, str);
+            CFRelease(str);
+        } else if (!strcmp(argv[i], "--name")) {
+            str = CFStringCreateWithCString(0, argv[i+1], kCFStringEncodingUTF8);
+            CFDictionarySetValue(filter, kIOPMAssertionQueryNamePrefixKey, str);
+            CFRelease(str);
+        } else if (!strcmp(argv[i], "--fields")) {
+            fieldList = next = strdup(argv[i+1]);
+            while (next && (field = strsep(&next, ","))) {
+                if (!field[0]) continue;
+                str = CFStringCreateWithCString(0, field, kCFStringEncodingUTF8);
+                CFArrayAppendValue(fieldNames, str);
+                CFRelease(str);
+            }
+            free(fieldList);
+        } else {
+            if (!strcmp(argv[i+1], "active")) {
+                val = kIOPMAssertionQueryStateActive;
+            } else if (!strcmp(argv[i+1], "inactive")) {
+                val = kIOPMAssertionQueryStateInactive;
+            } else if (!strcmp(argv[i+1], "any")) {
+                val = kIOPMAssertionQueryStateAny;
+            } else {
+                assertionFilterUsage(argv[i], argv[i+1]);
+            }
+            num = CFNumberCreate(0, kCFNumberIntType, &val);
+            CFDictionarySetValue(filter, kIOPMAssertionQueryStateKey, num);
+            CFRelease(num);
+        }
+    }
+
+    if (CFArrayGetCount(pids)) {
+        CFDictionarySetValue(filter, kIOPMAssertionQueryPIDsKey, pids);
+    }
+    if (CFArrayGetCount(types)) {
+        CFDictionarySetValue(filter, kIOPMAssertionQueryTypesKey, types);
+    }
+    if (CFArrayGetCount(fieldNames)) {
+        CFDictionarySetValue(filter, kIOPMAssertionQueryFieldsKey, fieldNames);
+    }
+
+    serializedFilter = CFPropertyListCreateData(0, filter, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    if (!serializedFilter) {
+        goto exit;
+    }
+
+    if (kIOReturnSuccess != _pm_connect(&pm_server)) {
+        fprintf(stderr, "Failed to connect to powerd\n");
+        goto exit;
+    }
+
+    if (KERN_SUCCESS != io_pm_assertion_copy_details(pm_server, 0, kIOPMAssertionMIGCopyFiltered,
+                                                     (vm_offset_t)CFDataGetBytePtr(serializedFilter),
+                                                     (mach_msg_type_number_t)CFDataGetLength(serializedFilter),
+                                                     &outBuf, &outBufCnt, &rc))
+    {
+        fprintf(stderr, "Failed to query powerd for assertions\n");
+        goto exit;
+    }
+    if (kIOReturnBadArgument == rc) {
+        // pids are checked above, so powerd didn't recognize one of the types
+        fprintf(stderr, "pmset: unknown assertion type given to --type\n");
+        usage();
+        exit(1);
+    }
+    if ((kIOReturnSuccess != rc) || !outBuf) {
+        printf("No matching assertions.\n");
+        goto exit;
+    }
+
+    unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)outBuf, outBufCnt, kCFAllocatorNull);
+    if (unfolder) {
+        result = CFPropertyListCreateWithData(0, unfolder, 0, NULL, NULL);
+        CFRelease(unfolder);
+    }
+    if (!isA_CFDictionary(result)) {
+        printf("No matching assertions.\n");
+        goto exit;
+    }
+
+    fields = CFDictionaryGetValue(result, kIOPMAssertionQueryFieldsKey);
+    rows = CFDictionaryGetValue(result, kIOPMAssertionQueryRowsKey);
+    if (!isA_CFArray(fields) || !isA_CFArray(rows) || !CFArrayGetCount(rows)) {
+        printf("No matching assertions.\n");
+        goto exit;
+    }
+
+    for (j = 0; j < CFArrayGetCount(fields); j++) {
+        char buf[64];
+        CFStringGetCString(CFArrayGetValueAtIndex(fields, j), buf, sizeof(buf), kCFStringEncodingUTF8);
+        printf("%-12s", buf);
+    }
+    printf("\n");
+
+    for (i = 0; i < CFArrayGetCount(rows); i++) {
+        CFArrayRef row = CFArrayGetValueAtIndex(rows, i);
+        if (!isA_CFArray(row)) continue;
+
+        for (j = 0; j < CFArrayGetCount(row); j++) {
+            CFTypeRef   v = CFArrayGetValueAtIndex(row, j);
+            char        buf[128] = "-";
+            int64_t     n;
+
+            if (isA_CFNumber(v)) {
+                CFNumberGetValue(v, kCFNumberSInt64Type, &n);
+                snprintf(buf, sizeof(buf), "%lld", n);
+            } else if (isA_CFString(v)) {
+                CFStringGetCString(v, buf, sizeof(buf), kCFStringEncodingUTF8);
+            } else if (isA_CFBoolean(v)) {
+                snprintf(buf, sizeof(buf), "%s", CFBooleanGetValue(v) ? "yes" : "no");
+            }
+            printf("%-12s", buf);
+        }
+        printf("\n");
+    }
+
+exit:
+    if (outBuf && outBufCnt) {
+        vm_deallocate(mach_task_self(), outBuf, outBufCnt);
+    }
+    if (MACH_PORT_NULL != pm_server) {
+        _pm_disconnect(pm_server);
+    }
+    if (result) CFRelease(result);
+    if (serializedFilter) CFRelease(serializedFilter);
+    if (fieldNames) CFRelease(fieldNames);
+    if (types) CFRelease(types);
+    if (pids) CFRelease(pids);
+    if (filter) CFRelease(filter);
+
+    return handled;
+}
+
 static void log_assertions(void)
 {
     int                 token;
@@ -4314,8 +5134,39 @@ static int setUPSValue(char *valstr,
 }
 
 
+/*
+ * Stores 'events' under 'listKey', and the first of them under 'key', which
+ * is all that older versions of powerd understand.
+ */
+static void setRepeatingEvents(CFMutableDictionaryRef repeat, CFStringRef listKey, CFStringRef key, CFArrayRef events)
+{
+    if (CFArrayGetCount(events)) {
+        CFDictionarySetValue(repeat, key, CFArrayGetValueAtIndex(events, 0));
+        CFDictionarySetValue(repeat, listKey, events);
+    }
+}
+
+static CFIndex findRepeatingEvent(CFArrayRef events, CFDictionaryRef event)
+{
+    CFIndex i;
+
+    for (i = 0; i < CFArrayGetCount(events); i++) {
+        CFDictionaryRef one = CFArrayGetValueAtIndex(events, i);
+
+        if (isA_CFDictionary(one)
+            && getRepeatingDictionaryMinutes(one) == getRepeatingDictionaryMinutes(event)
+            && getRepeatingDictionaryDayMask(one) == getRepeatingDictionaryDayMask(event)
+            && CFEqual(getRepeatingDictionaryType(one), getRepeatingDictionaryType(event))) {
+            return i;
+        }
+    }
+    return kCFNotFound;
+}
+
 //  pmset repeat cancel
-//  pmset repeat <type> <days of week> <time> [<type> <days of week> <time>]\n");
+//  pmset repeat <type> <days of week> <time> [<type> <days of week> <time> ...]
+//  pmset repeat add <type> <days of week> <time> [<type> <days of week> <time> ...]
+//  pmset repeat remove <type> <days of week> <time> [<type> <days of week> <time> ...]
 static int parseRepeatingEvent(
     char                        **argv,
     int                         *num_args_parsed,
@@ -4338,6 +5189,20 @@ static int parseRepeatingEvent(
     int                         event_time = 0;
     CFNumberRef                 the_time = 0;       // in minutes from midnight
     CFMutableDictionaryRef      one_repeating_event = 0;
+    CFMutableArrayRef           on_events = 0;
+    CFMutableArrayRef           off_events = 0;
+    CFMutableArrayRef           the_events = 0;
+    CFDictionaryRef             current = 0;
+    CFIndex                     found = kCFNotFound;
+    bool                        adding = false;
+    bool                        removing = false;
+
+    on_events = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    off_events = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+    if(!on_events || !off_events) {
+        ret = kParseInternalError;
+        goto exit;
+    }
 
     formatter = CFDateFormatterCreate(kCFAllocatorDefault, CFLocaleGetSystem(),
         kCFDateFormatterShortStyle, kCFDateFormatterMediumStyle);
@@ -4363,9 +5228,29 @@ static int parseRepeatingEvent(
         ret = kParseSuccess;
         goto exit;
     }
+
+    // add to or remove from the current repeating events, rather than replace them
+    adding = (0 == strcmp(argv[i], ARG_ADD));
+    removing = (0 == strcmp(argv[i], ARG_REMOVE));
+    if(adding || removing)
+    {
+        i++;
+        if(!argv[i]) {
+            ret = kParseBadArgs;
+            goto bail;
+        }
+        current = IOPMCopyRepeatingPowerEvents();
+        appendRepeatingEvents(current, CFSTR(kIOPMRepeatingPowerOnListKey),
+                              CFSTR(kIOPMRepeatingPowerOnKey), on_events);
+        appendRepeatingEvents(current, CFSTR(kIOPMRepeatingPowerOffListKey),
+                              CFSTR(kIOPMRepeatingPowerOffKey), off_events);
+        if(current)
+            CFRelease(current);
+    }
     
     while(argv[i])
     {    
+        found = kCFNotFound;
         string_tolower(argv[i], argv[i]);
         
         // type
@@ -4475,10 +5360,19 @@ static int parseRepeatingEvent(
                 CFDictionarySetValue(one_repeating_event, CFSTR(kIOPMPowerEventTypeKey), the_type);
                 CFDictionarySetValue(one_repeating_event, CFSTR(kIOPMDaysOfWeekKey), the_days);
                 CFDictionarySetValue(one_repeating_event, CFSTR(kIOPMPowerEventTimeKey), the_time);
-                
-                CFDictionarySetValue(local_repeating_event,
-                     (on_off ? CFSTR(kIOPMRepeatingPowerOnKey):CFSTR(kIOPMRepeatingPowerOffKey)),
-                                    one_repeating_event);
+
+                the_events = on_off ? on_events : off_events;
+                found = findRepeatingEvent(the_events, one_repeating_event);
+                if(removing) {
+                    if(kCFNotFound != found) {
+                        CFArrayRemoveValueAtIndex(the_events, found);
+                    } else {
+                        fprintf(stderr, "Error: no such repeating power event: %s %s %s\n",
+                                argv[i-3], argv[i-2], argv[i-1]);
+                    }
+                } else if(kCFNotFound == found) {
+                    CFArrayAppendValue(the_events, one_repeating_event);
+                }
                 CFRelease(one_repeating_event);            
             }
         }
@@ -4488,8 +5382,32 @@ static int parseRepeatingEvent(
             CFRelease(the_time);
         if (cf_date)
             CFRelease(cf_date);
+
+        if(removing && (kCFNotFound == found)) {
+            ret = kParseBadArgs;
+            goto exit;
+        }
         
     } // while loop
+
+    if((CFArrayGetCount(on_events) > kIOPMMaxRepeatingEvents)
+        || (CFArrayGetCount(off_events) > kIOPMMaxRepeatingEvents))
+    {
+        fprintf(stderr, "Error: at most %d repeating power on and %d power off events\n",
+                kIOPMMaxRepeatingEvents, kIOPMMaxRepeatingEvents);
+        ret = kParseBadArgs;
+        goto exit;
+    }
+
+    setRepeatingEvents(local_repeating_event, CFSTR(kIOPMRepeatingPowerOnListKey),
+                       CFSTR(kIOPMRepeatingPowerOnKey), on_events);
+    setRepeatingEvents(local_repeating_event, CFSTR(kIOPMRepeatingPowerOffListKey),
+                       CFSTR(kIOPMRepeatingPowerOffKey), off_events);
+
+    // removing the last of them is the same as cancelling
+    if(0 == CFDictionaryGetCount(local_repeating_event)) {
+        *local_cancel_repeating = true;
+    }
     
     ret = kParseSuccess;
     goto exit;
@@ -4501,6 +5419,10 @@ bail:
 exit:
     if (the_type)
         CFRelease(the_type);
+    if (on_events)
+        CFRelease(on_events);
+    if (off_events)
+        CFRelease(off_events);
     if(num_args_parsed) 
         *num_args_parsed = i;
     if(tz) 